@@ -22,6 +22,7 @@ static struct sd_option cluster_options[] = {
 	{'c', "copies", true, "specify the default data redundancy (number of copies)"},
 	{'m', "mode", true, "mode (safe, quorum, unsafe)"},
 	{'f', "force", false, "do not prompt for confirmation"},
+	{'l', "placement", true, "specify the placement algorithm (ring, straw2)"},
 
 	{ 0, NULL, false, NULL },
 };
@@ -32,6 +33,7 @@ static struct cluster_cmd_data {
 	bool quorum;
 	bool force;
 	char name[STORE_LEN];
+	const struct placement_driver *placement;
 } cluster_cmd_data;
 
 #define DEFAULT_STORE	"plain"
@@ -101,6 +103,9 @@ static int cluster_format(int argc, char **argv)
 		hdr.flags |= SD_FLAG_NOHALT;
 	if (cluster_cmd_data.quorum)
 		hdr.flags |= SD_FLAG_QUORUM;
+	if (cluster_cmd_data.placement)
+		hdr.flags |= cluster_cmd_data.placement->id <<
+			SD_FLAG_PLACEMENT_SHIFT;
 
 	hdr.cluster.ctime = (uint64_t) tv.tv_sec << 32 | tv.tv_usec * 1000;
 
@@ -473,7 +478,7 @@ static int cluster_reweight(int argc, char **argv)
 static struct subcommand cluster_cmd[] = {
 	{"info", NULL, "aprh", "show cluster information",
 	 NULL, SUBCMD_FLAG_NEED_NODELIST, cluster_info, cluster_options},
-	{"format", NULL, "bcmaph", "create a Sheepdog store",
+	{"format", NULL, "bcmlaph", "create a Sheepdog store",
 	 NULL, 0, cluster_format, cluster_options},
 	{"shutdown", NULL, "aph", "stop Sheepdog",
 	 NULL, 0, cluster_shutdown, cluster_options},
@@ -526,6 +531,14 @@ static int cluster_parser(int ch, char *opt)
 			exit(EXIT_FAILURE);
 		}
 		break;
+	case 'l':
+		cluster_cmd_data.placement = find_placement_driver(opt);
+		if (!cluster_cmd_data.placement) {
+			fprintf(stderr, "Unknown placement algorithm '%s'\n",
+				opt);
+			exit(EXIT_FAILURE);
+		}
+		break;
 	case 'f':
 		cluster_cmd_data.force = true;
 		break;
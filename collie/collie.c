@@ -43,8 +43,8 @@ static void usage(const struct command *commands, int status);
 uint32_t sd_epoch;
 
 struct sd_node sd_nodes[SD_MAX_NODES];
-struct sd_vnode sd_vnodes[SD_MAX_VNODES];
-int sd_nodes_nr, sd_vnodes_nr;
+struct vnode_info sd_vinfo;
+int sd_nodes_nr;
 unsigned master_idx;
 
 int update_node_list(int max_nodes)
@@ -55,6 +55,7 @@ int update_node_list(int max_nodes)
 	struct sd_node *ent;
 	struct sd_req hdr;
 	struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
+	const struct placement_driver *pdrv;
 
 	size = sizeof(*ent) * max_nodes;
 	buf = xzalloc(size);
@@ -86,8 +87,19 @@ int update_node_list(int max_nodes)
 		goto out;
 	}
 
+	pdrv = get_placement_driver(cluster_placement_id(rsp->flags));
+	if (!pdrv) {
+		fprintf(stderr, "Unknown placement driver %d\n",
+			cluster_placement_id(rsp->flags));
+		ret = -1;
+		goto out;
+	}
+
 	memcpy(sd_nodes, buf, size);
-	sd_vnodes_nr = nodes_to_vnodes(sd_nodes, sd_nodes_nr, sd_vnodes);
+	placement_exit(&sd_vinfo);
+	sd_vinfo.nodes = sd_nodes;
+	sd_vinfo.nr_nodes = sd_nodes_nr;
+	placement_init(&sd_vinfo, pdrv);
 	sd_epoch = hdr.epoch;
 	master_idx = rsp->node.master_idx;
 out:
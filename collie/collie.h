@@ -54,8 +54,8 @@ extern bool raw_output;
 
 extern uint32_t sd_epoch;
 extern struct sd_node sd_nodes[SD_MAX_NODES];
-extern struct sd_vnode sd_vnodes[SD_MAX_VNODES];
-extern int sd_nodes_nr, sd_vnodes_nr;
+extern struct vnode_info sd_vinfo;
+extern int sd_nodes_nr;
 extern unsigned master_idx;
 
 bool is_current(const struct sd_inode *i);
@@ -69,6 +69,8 @@ int sd_read_object_sha1(uint64_t oid, uint32_t epoch, int nr_copies,
 			unsigned char *sha1);
 int sd_read_object(uint64_t oid, void *data, unsigned int datalen,
 		   uint64_t offset, bool direct);
+int sd_read_objects(const struct sd_obj_seg *segs, int nr_segs, void *data,
+		    unsigned int datalen);
 int sd_write_object(uint64_t oid, uint64_t cow_oid, void *data,
 		    unsigned int datalen, uint64_t offset, uint32_t flags,
 		    int copies, bool create, bool direct);
@@ -80,7 +82,7 @@ void confirm(const char *message);
 void work_queue_wait(struct work_queue *q);
 int do_vdi_create(const char *vdiname, int64_t vdi_size,
 		  uint32_t base_vid, uint32_t *vdi_id, bool snapshot,
-		  int nr_copies);
+		  int nr_copies, uint16_t copy_policy);
 
 
 extern struct command vdi_command;
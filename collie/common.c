@@ -43,7 +43,7 @@ int sd_read_object_sha1(uint64_t oid, uint32_t epoch, int nr_copies,
 {
 	struct sd_req req;
 	struct sd_rsp *rsp = (struct sd_rsp *)&req;
-	const struct sd_vnode *vnode = NULL;
+	const struct sd_node *node;
 	char host[HOST_NAME_MAX];
 	int port, ret = -1;
 
@@ -52,9 +52,9 @@ int sd_read_object_sha1(uint64_t oid, uint32_t epoch, int nr_copies,
 	req.obj.tgt_epoch = epoch;
 
 	for (int i = 0; i < nr_copies; i++) {
-		vnode = oid_to_vnode(sd_vnodes, sd_vnodes_nr, oid, i);
-		addr_to_str(host, sizeof(host), vnode->nid.addr, 0);
-		port = vnode->nid.port;
+		node = vinfo_oid_to_node(&sd_vinfo, oid, i);
+		addr_to_str(host, sizeof(host), node->nid.addr, 0);
+		port = node->nid.port;
 		if (collie_exec_req(host, port, &req, NULL) == 0) {
 			memcpy(sha1, rsp->hash.digest, SHA1_DIGEST_SIZE);
 			ret = 0;
@@ -97,6 +97,49 @@ int sd_read_object(uint64_t oid, void *data, unsigned int datalen,
 	return SD_RES_SUCCESS;
 }
 
+/* Read the segments with one request, 'datalen' is the sum of their length */
+int sd_read_objects(const struct sd_obj_seg *segs, int nr_segs, void *data,
+		    unsigned int datalen)
+{
+	struct sd_req hdr;
+	struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
+	int fd, ret;
+
+	sd_init_req(&hdr, SD_OP_READ_OBJS);
+	hdr.flags = SD_FLAG_CMD_WRITE;
+	hdr.data_length = sizeof(*segs) * nr_segs;
+	hdr.objs.nr_segs = nr_segs;
+
+	fd = connect_to(sdhost, sdport);
+	if (fd < 0) {
+		fprintf(stderr, "Failed to connect to %s:%d\n", sdhost, sdport);
+		return SD_RES_EIO;
+	}
+
+	ret = send_req(fd, &hdr, (void *)segs, hdr.data_length, NULL, 0);
+	if (!ret)
+		ret = recv_rsp(fd, rsp, data, datalen, NULL, 0);
+	close(fd);
+	if (ret) {
+		fprintf(stderr, "Failed to read objects\n");
+		return SD_RES_EIO;
+	}
+
+	if (rsp->result != SD_RES_SUCCESS) {
+		fprintf(stderr, "Failed to read objects %s\n",
+			sd_strerror(rsp->result));
+		return rsp->result;
+	}
+
+	if (rsp->data_length != datalen) {
+		fprintf(stderr, "Short read of objects, %"PRIu32"\n",
+			rsp->data_length);
+		return SD_RES_EIO;
+	}
+
+	return SD_RES_SUCCESS;
+}
+
 int sd_write_object(uint64_t oid, uint64_t cow_oid, void *data,
 		    unsigned int datalen, uint64_t offset, uint32_t flags,
 		    int copies, bool create, bool direct)
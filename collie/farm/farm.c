@@ -93,7 +93,7 @@ static int create_active_vdis(void)
 		if (do_vdi_create(vdi->name,
 				  vdi->vdi_size,
 				  vdi->vdi_id, &new_vid,
-				  false, vdi->nr_copies) < 0)
+				  false, vdi->nr_copies, 0) < 0)
 			return -1;
 	}
 	return 0;
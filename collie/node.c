@@ -10,6 +10,7 @@
  */
 
 #include "collie.h"
+#include "buffer.h"
 
 static struct node_cmd_data {
 	bool all_nodes;
@@ -246,6 +247,143 @@ static int md_info(int argc, char **argv)
 	return EXIT_SUCCESS;
 }
 
+static int node_buffer_info(struct node_id *nid)
+{
+	struct buf_class_stat stat[BUF_NR_CLASSES];
+	char held_str[UINT64_DECIMAL_SIZE];
+	struct sd_req hdr;
+	struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
+	int ret, i;
+	char host[HOST_NAME_MAX];
+
+	sd_init_req(&hdr, SD_OP_STAT_BUFFER);
+	hdr.data_length = sizeof(stat);
+
+	addr_to_str(host, sizeof(host), nid->addr, 0);
+	ret = collie_exec_req(host, nid->port, &hdr, stat);
+	if (ret < 0)
+		return EXIT_SYSFAIL;
+
+	if (rsp->result != SD_RES_SUCCESS) {
+		fprintf(stderr, "failed to get buffer pool information: %s\n",
+			sd_strerror(rsp->result));
+		return EXIT_FAILURE;
+	}
+
+	for (i = 0; i < BUF_NR_CLASSES; i++) {
+		size_to_str(stat[i].held, held_str, sizeof(held_str));
+		fprintf(stdout, "%"PRIu64" KB\t%"PRIu64"\t%"PRIu64"\t%s\n",
+			stat[i].size >> 10, stat[i].hits, stat[i].misses,
+			held_str);
+	}
+	return EXIT_SUCCESS;
+}
+
+static int node_buffer(int argc, char **argv)
+{
+	int i, ret;
+
+	fprintf(stdout, "Size\tHits\tMisses\tHeld\n");
+
+	if (!node_cmd_data.all_nodes) {
+		struct node_id nid = {.port = sdport};
+
+		if (!str_to_addr(sdhost, nid.addr)) {
+			fprintf(stderr, "Invalid address %s\n", sdhost);
+			return EXIT_FAILURE;
+		}
+
+		return node_buffer_info(&nid);
+	}
+
+	for (i = 0; i < sd_nodes_nr; i++) {
+		fprintf(stdout, "Node %d:\n", i);
+		ret = node_buffer_info(&sd_nodes[i].nid);
+		if (ret != EXIT_SUCCESS)
+			return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
+
+static const char * const latency_stages[] = {
+	[SD_LAT_QUEUE] = "queue",
+	[SD_LAT_WAIT] = "wait",
+	[SD_LAT_WORK] = "work",
+	[SD_LAT_TX] = "tx",
+	[SD_LAT_TOTAL] = "total",
+};
+
+static int node_latency_info(struct node_id *nid)
+{
+	int nr = 256 * SD_LAT_NR_STAGES, ret, i;
+	struct sd_latency_stat *stat = xmalloc(sizeof(*stat) * nr);
+	struct sd_req hdr;
+	struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
+	char host[HOST_NAME_MAX];
+
+	sd_init_req(&hdr, SD_OP_STAT_LATENCY);
+	hdr.data_length = sizeof(*stat) * nr;
+
+	addr_to_str(host, sizeof(host), nid->addr, 0);
+	ret = collie_exec_req(host, nid->port, &hdr, stat);
+	if (ret < 0) {
+		ret = EXIT_SYSFAIL;
+		goto out;
+	}
+
+	if (rsp->result != SD_RES_SUCCESS) {
+		fprintf(stderr, "failed to get latency information: %s\n",
+			sd_strerror(rsp->result));
+		ret = EXIT_FAILURE;
+		goto out;
+	}
+
+	nr = rsp->data_length / sizeof(*stat);
+	for (i = 0; i < nr; i++) {
+		struct sd_latency_stat *s = stat + i;
+
+		if (s->stage >= SD_LAT_NR_STAGES)
+			continue;
+		fprintf(stdout, "%-20s %-8s %-6s %10"PRIu64" %8"PRIu64
+			" %8"PRIu64" %8"PRIu64" %8"PRIu64" %8"PRIu64
+			" %8"PRIu64"\n", s->name, s->type,
+			latency_stages[s->stage], s->count, s->sum / s->count,
+			s->p50, s->p90, s->p99, s->p999, s->max);
+	}
+	ret = EXIT_SUCCESS;
+out:
+	free(stat);
+	return ret;
+}
+
+static int node_latency(int argc, char **argv)
+{
+	int i, ret;
+
+	fprintf(stdout, "%-20s %-8s %-6s %10s %8s %8s %8s %8s %8s %8s\n",
+		"Operation", "Type", "Stage", "Count", "Mean", "P50", "P90",
+		"P99", "P99.9", "Max");
+
+	if (!node_cmd_data.all_nodes) {
+		struct node_id nid = {.port = sdport};
+
+		if (!str_to_addr(sdhost, nid.addr)) {
+			fprintf(stderr, "Invalid address %s\n", sdhost);
+			return EXIT_FAILURE;
+		}
+
+		return node_latency_info(&nid);
+	}
+
+	for (i = 0; i < sd_nodes_nr; i++) {
+		fprintf(stdout, "Node %d:\n", i);
+		ret = node_latency_info(&sd_nodes[i].nid);
+		if (ret != EXIT_SUCCESS)
+			return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
+
 static int do_plug_unplug(char *disks, bool plug)
 {
 	struct sd_req hdr;
@@ -315,7 +453,7 @@ static int node_parser(int ch, char *opt)
 }
 
 static struct sd_option node_options[] = {
-	{'A', "all", false, "show md information of all the nodes"},
+	{'A', "all", false, "show information of all the nodes"},
 
 	{ 0, NULL, false, NULL },
 };
@@ -331,6 +469,11 @@ static struct subcommand node_cmd[] = {
 	 SUBCMD_FLAG_NEED_NODELIST, node_recovery},
 	{"md", "[disks]", "apAh", "See 'collie node md' for more information",
 	 node_md_cmd, SUBCMD_FLAG_NEED_ARG, node_md, node_options},
+	{"buffer", NULL, "apAh", "show the I/O buffer pool of the node", NULL,
+	 SUBCMD_FLAG_NEED_NODELIST, node_buffer, node_options},
+	{"latency", NULL, "apAh",
+	 "show the request latencies of the node in microseconds", NULL,
+	 SUBCMD_FLAG_NEED_NODELIST, node_latency, node_options},
 	{NULL,},
 };
 
@@ -20,6 +20,7 @@
 #include "collie.h"
 #include "treeview.h"
 #include "sha1.h"
+#include "fec.h"
 
 static struct sd_option vdi_options[] = {
 	{'P', "prealloc", false, "preallocate all the data objects"},
@@ -28,7 +29,8 @@ static struct sd_option vdi_options[] = {
 	{'x', "exclusive", false, "write in an exclusive mode"},
 	{'d', "delete", false, "delete a key"},
 	{'w', "writeback", false, "use writeback mode"},
-	{'c', "copies", true, "specify the data redundancy (number of copies)"},
+	{'c', "copies", true, "specify the data redundancy (number of copies "
+	 "or data:parity strips)"},
 	{'F', "from", true, "create a differential backup from the snapshot"},
 	{'f', "force", false, "do operation forcibly"},
 	{ 0, NULL, false, NULL },
@@ -42,6 +44,7 @@ static struct vdi_cmd_data {
 	bool delete;
 	bool prealloc;
 	int nr_copies;
+	uint16_t copy_policy;
 	bool writeback;
 	int from_snapshot_id;
 	char from_snapshot_tag[SD_MAX_VDI_TAG_LEN];
@@ -156,6 +159,7 @@ static void print_vdi_list(uint32_t vid, const char *name, const char *tag,
 	bool is_clone = false;
 	uint64_t my_objs, cow_objs;
 	char vdi_size_str[16], my_objs_str[16], cow_objs_str[16];
+	char copies_str[16];
 	time_t ti;
 	struct tm tm;
 	char dbuf[128];
@@ -191,6 +195,13 @@ static void print_vdi_list(uint32_t vid, const char *name, const char *tag,
 	if (i->snap_id == 1 && i->parent_vdi_id != 0)
 		is_clone = true;
 
+	if (i->copy_policy)
+		snprintf(copies_str, sizeof(copies_str), "%d:%d",
+			 ec_policy_data(i->copy_policy),
+			 ec_policy_parity(i->copy_policy));
+	else
+		snprintf(copies_str, sizeof(copies_str), "%d", i->nr_copies);
+
 	if (raw_output) {
 		printf("%c ", vdi_is_snapshot(i) ? 's' : (is_clone ? 'c' : '='));
 		while (*name) {
@@ -198,14 +209,14 @@ static void print_vdi_list(uint32_t vid, const char *name, const char *tag,
 				putchar('\\');
 			putchar(*name++);
 		}
-		printf(" %d %s %s %s %s %" PRIx32 " %d %s\n", snapid,
+		printf(" %d %s %s %s %s %" PRIx32 " %s %s\n", snapid,
 				vdi_size_str, my_objs_str, cow_objs_str, dbuf, vid,
-				i->nr_copies, i->tag);
+				copies_str, i->tag);
 	} else {
-		printf("%c %-8s %5d %7s %7s %7s %s  %7" PRIx32 " %5d %13s\n",
+		printf("%c %-8s %5d %7s %7s %7s %s  %7" PRIx32 " %5s %13s\n",
 				vdi_is_snapshot(i) ? 's' : (is_clone ? 'c' : ' '),
 				name, snapid, vdi_size_str, my_objs_str, cow_objs_str,
-				dbuf, vid, i->nr_copies, i->tag);
+				dbuf, vid, copies_str, i->tag);
 	}
 }
 
@@ -510,7 +521,7 @@ static int read_vdi_obj(const char *vdiname, int snapid, const char *tag,
 
 int do_vdi_create(const char *vdiname, int64_t vdi_size,
 			 uint32_t base_vid, uint32_t *vdi_id, bool snapshot,
-			 int nr_copies)
+			 int nr_copies, uint16_t copy_policy)
 {
 	struct sd_req hdr;
 	struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
@@ -528,6 +539,7 @@ int do_vdi_create(const char *vdiname, int64_t vdi_size,
 	hdr.vdi.snapid = snapshot ? 1 : 0;
 	hdr.vdi.vdi_size = vdi_size;
 	hdr.vdi.copies = nr_copies;
+	hdr.vdi.copy_policy = copy_policy;
 
 	ret = collie_exec_req(sdhost, sdport, &hdr, buf);
 	if (ret < 0)
@@ -552,6 +564,7 @@ static int vdi_create(int argc, char **argv)
 	uint32_t vid;
 	uint64_t oid;
 	int idx, max_idx, ret, nr_copies = vdi_cmd_data.nr_copies;
+	uint16_t policy = vdi_cmd_data.copy_policy;
 	struct sd_inode *inode = NULL;
 
 	if (!argv[optind]) {
@@ -571,9 +584,16 @@ static int vdi_create(int argc, char **argv)
 			"the copies(%d)\n", sd_nodes_nr, nr_copies);
 		return EXIT_USAGE;
 	}
+	if (policy && ec_policy_data(policy) + ec_policy_parity(policy) >
+	    sd_nodes_nr) {
+		fprintf(stderr, "There are not enough nodes(%d) to hold "
+			"the strips(%d)\n", sd_nodes_nr,
+			ec_policy_data(policy) + ec_policy_parity(policy));
+		return EXIT_USAGE;
+	}
 
 	ret = do_vdi_create(vdiname, size, 0, &vid, false,
-			    vdi_cmd_data.nr_copies);
+			    vdi_cmd_data.nr_copies, policy);
 	if (ret != EXIT_SUCCESS || !vdi_cmd_data.prealloc)
 		goto out;
 
@@ -640,7 +660,7 @@ static int vdi_snapshot(int argc, char **argv)
 	}
 
 	return do_vdi_create(vdiname, inode->vdi_size, vid, NULL, true,
-			     inode->nr_copies);
+			     inode->nr_copies, 0);
 }
 
 static int vdi_clone(int argc, char **argv)
@@ -675,7 +695,7 @@ static int vdi_clone(int argc, char **argv)
 		goto out;
 
 	ret = do_vdi_create(dst_vdi, inode->vdi_size, base_vid, &new_vid, false,
-			    vdi_cmd_data.nr_copies);
+			    vdi_cmd_data.nr_copies, 0);
 	if (ret != EXIT_SUCCESS || !vdi_cmd_data.prealloc)
 		goto out;
 
@@ -845,7 +865,7 @@ static int vdi_rollback(int argc, char **argv)
 	}
 
 	return do_vdi_create(vdiname, inode->vdi_size, base_vid, NULL,
-			     false, vdi_cmd_data.nr_copies);
+			     false, vdi_cmd_data.nr_copies, 0);
 }
 
 static int vdi_object(int argc, char **argv)
@@ -909,15 +929,14 @@ static int do_track_object(uint64_t oid, uint8_t nr_copies)
 	int i, j, ret;
 	struct sd_req hdr;
 	struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
-	struct sd_vnode *vnodes;
-	const struct sd_vnode *vnode_buf[SD_MAX_COPIES];
+	struct vnode_info vinfo = { .pdrv = NULL };
+	const struct sd_node *node_buf[SD_MAX_COPIES];
 	struct epoch_log *logs;
-	int vnodes_nr, nr_logs, log_length;
+	int nr_logs, log_length;
 	char host[128];
 
 	log_length = sd_epoch * sizeof(struct epoch_log);
 	logs = xmalloc(log_length);
-	vnodes = xmalloc(sizeof(*vnodes) * SD_MAX_VNODES);
 
 	sd_init_req(&hdr, SD_OP_STAT_CLUSTER);
 	hdr.data_length = log_length;
@@ -950,22 +969,22 @@ static int do_track_object(uint64_t oid, uint8_t nr_copies)
 			}
 			continue;
 		}
-		vnodes_nr = nodes_to_vnodes(logs[i].nodes,
-					    logs[i].nr_nodes, vnodes);
-		oid_to_vnodes(vnodes, vnodes_nr, oid, nr_copies, vnode_buf);
+		vinfo.nodes = logs[i].nodes;
+		vinfo.nr_nodes = logs[i].nr_nodes;
+		placement_init(&vinfo, sd_vinfo.pdrv);
+		vinfo_oid_to_nodes(&vinfo, oid, nr_copies, node_buf);
+		placement_exit(&vinfo);
 		for (j = 0; j < nr_copies; j++) {
-			addr_to_str(host, sizeof(host), vnode_buf[j]->nid.addr,
-				    vnode_buf[j]->nid.port);
+			addr_to_str(host, sizeof(host), node_buf[j]->nid.addr,
+				    node_buf[j]->nid.port);
 			printf("%s\n", host);
 		}
 	}
 
 	free(logs);
-	free(vnodes);
 	return EXIT_SUCCESS;
 error:
 	free(logs);
-	free(vnodes);
 	return EXIT_SYSFAIL;
 }
 
@@ -1178,13 +1197,133 @@ static int vdi_getattr(int argc, char **argv)
 	return EXIT_SUCCESS;
 }
 
+static int show_vdi_qos(const char *vdiname)
+{
+	int ret;
+	uint64_t attr_oid = 0;
+	uint32_t vid = 0, nr_copies = 0;
+	struct sheepdog_vdi_attr vattr;
+	struct sd_vdi_qos qos;
+	char size[UINT64_DECIMAL_SIZE], burst[UINT64_DECIMAL_SIZE];
+
+	ret = find_vdi_attr_oid(vdiname, "", 0, SD_VDI_QOS_KEY, NULL, 0, &vid,
+				&attr_oid, &nr_copies, false, false, false);
+	if (ret == SD_RES_NO_OBJ) {
+		memset(&qos, 0, sizeof(qos));
+		goto show;
+	} else if (ret == SD_RES_NO_VDI) {
+		fprintf(stderr, "VDI not found\n");
+		return EXIT_MISSING;
+	} else if (ret) {
+		fprintf(stderr, "Failed to find the I/O limits: %s\n",
+			sd_strerror(ret));
+		return EXIT_FAILURE;
+	}
+
+	ret = sd_read_object(attr_oid, &vattr, SD_ATTR_OBJ_SIZE, 0, true);
+	if (ret != SD_RES_SUCCESS) {
+		fprintf(stderr, "Failed to read the I/O limits: %s\n",
+			sd_strerror(ret));
+		return EXIT_SYSFAIL;
+	}
+	if (vattr.value_len != sizeof(qos)) {
+		fprintf(stderr, "Invalid I/O limits\n");
+		return EXIT_FAILURE;
+	}
+	memcpy(&qos, vattr.value, sizeof(qos));
+show:
+	if (qos.iops)
+		printf("IOPS: %" PRIu64 " (burst %" PRIu64 ")\n", qos.iops,
+		       qos.iops_burst ? qos.iops_burst : qos.iops);
+	else
+		printf("IOPS: unlimited\n");
+
+	if (qos.bps)
+		printf("Bandwidth: %s/s (burst %s)\n",
+		       size_to_str(qos.bps, size, sizeof(size)),
+		       size_to_str(qos.bps_burst ? qos.bps_burst : qos.bps,
+				   burst, sizeof(burst)));
+	else
+		printf("Bandwidth: unlimited\n");
+
+	return EXIT_SUCCESS;
+}
+
+static int vdi_qos(int argc, char **argv)
+{
+	const char *vdiname = argv[optind++];
+	uint64_t limits[4] = {};
+	struct sd_vdi_qos *qos;
+	struct sd_req hdr;
+	struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
+	char buf[SD_MAX_VDI_LEN + sizeof(*qos)];
+	int i, ret;
+
+	if (!argv[optind])
+		return show_vdi_qos(vdiname);
+
+	for (i = 0; i < ARRAY_SIZE(limits) && argv[optind]; i++) {
+		char *p;
+
+		/* The bandwidth can be given with a unit like 100M */
+		if (i % 2) {
+			if (parse_option_size(argv[optind++], &limits[i]) < 0)
+				return EXIT_USAGE;
+			continue;
+		}
+
+		limits[i] = strtoull(argv[optind], &p, 10);
+		if (argv[optind++] == p || *p) {
+			fprintf(stderr, "The IOPS must be an integer\n");
+			return EXIT_USAGE;
+		}
+	}
+	if (i == 1 || i == 3) {
+		fprintf(stderr, "Please specify both the IOPS and the "
+			"bandwidth, 0 means unlimited\n");
+		return EXIT_USAGE;
+	}
+
+	memset(buf, 0, sizeof(buf));
+	pstrcpy(buf, SD_MAX_VDI_LEN, vdiname);
+	qos = (struct sd_vdi_qos *)(buf + SD_MAX_VDI_LEN);
+	qos->iops = limits[0];
+	qos->bps = limits[1];
+	qos->iops_burst = limits[2];
+	qos->bps_burst = limits[3];
+
+	sd_init_req(&hdr, SD_OP_SET_VDI_QOS);
+	hdr.flags = SD_FLAG_CMD_WRITE;
+	hdr.data_length = sizeof(buf);
+
+	ret = collie_exec_req(sdhost, sdport, &hdr, buf);
+	if (ret < 0)
+		return EXIT_SYSFAIL;
+
+	switch (rsp->result) {
+	case SD_RES_SUCCESS:
+		return EXIT_SUCCESS;
+	case SD_RES_NO_VDI:
+		fprintf(stderr, "VDI not found\n");
+		return EXIT_MISSING;
+	default:
+		fprintf(stderr, "Failed to set the I/O limits: %s\n",
+			sd_strerror(rsp->result));
+		return EXIT_FAILURE;
+	}
+}
+
+/* How many objects 'vdi read' reads with one request */
+#define VDI_READ_NR_OBJS 8
+
 static int vdi_read(int argc, char **argv)
 {
 	const char *vdiname = argv[optind++];
-	int ret, idx;
+	int ret, idx, i, nr, nr_segs;
 	struct sd_inode *inode = NULL;
-	uint64_t offset = 0, oid, done = 0, total = (uint64_t) -1;
-	unsigned int len, remain;
+	uint64_t offset = 0, done = 0, total = (uint64_t) -1;
+	unsigned int len, remain, packed, pos, lens[VDI_READ_NR_OBJS];
+	struct sd_obj_seg segs[VDI_READ_NR_OBJS];
 	char *buf = NULL;
 
 	if (argv[optind]) {
@@ -1199,7 +1338,7 @@ static int vdi_read(int argc, char **argv)
 	}
 
 	inode = malloc(sizeof(*inode));
-	buf = xmalloc(SD_DATA_OBJ_SIZE);
+	buf = xmalloc(SD_DATA_OBJ_SIZE * VDI_READ_NR_OBJS);
 
 	ret = read_vdi_obj(vdiname, vdi_cmd_data.snapshot_id,
 			   vdi_cmd_data.snapshot_tag, NULL, inode,
@@ -1217,22 +1356,48 @@ static int vdi_read(int argc, char **argv)
 	idx = offset / SD_DATA_OBJ_SIZE;
 	offset %= SD_DATA_OBJ_SIZE;
 	while (done < total) {
-		len = min(total - done, SD_DATA_OBJ_SIZE - offset);
+		/* Read up to VDI_READ_NR_OBJS objects with one request */
+		nr = nr_segs = 0;
+		len = packed = 0;
+		while (nr < VDI_READ_NR_OBJS && done + len < total) {
+			lens[nr] = min(total - done - len,
+				       SD_DATA_OBJ_SIZE - offset);
+			if (inode->data_vdi_id[idx + nr]) {
+				segs[nr_segs].oid = vid_to_data_oid(
+					inode->data_vdi_id[idx + nr], idx + nr);
+				segs[nr_segs].offset = offset;
+				segs[nr_segs].length = lens[nr];
+				packed += lens[nr];
+				nr_segs++;
+			}
+			len += lens[nr];
+			offset = 0;
+			nr++;
+		}
 
-		if (inode->data_vdi_id[idx]) {
-			oid = vid_to_data_oid(inode->data_vdi_id[idx], idx);
-			ret = sd_read_object(oid, buf, len, offset, false);
+		if (nr_segs) {
+			ret = sd_read_objects(segs, nr_segs, buf, packed);
 			if (ret != SD_RES_SUCCESS) {
 				fprintf(stderr, "Failed to read VDI\n");
 				ret = EXIT_FAILURE;
 				goto out;
 			}
-		} else
-			memset(buf, 0, len);
+		}
+
+		/* Move the data to their place and zero the holes */
+		pos = len;
+		for (i = nr - 1; i >= 0; i--) {
+			pos -= lens[i];
+			if (inode->data_vdi_id[idx + i]) {
+				packed -= lens[i];
+				memmove(buf + pos, buf + packed, lens[i]);
+			} else
+				memset(buf + pos, 0, lens[i]);
+		}
 
 		remain = len;
 		while (remain) {
-			ret = write(STDOUT_FILENO, buf + (len - remain), len);
+			ret = write(STDOUT_FILENO, buf + (len - remain), remain);
 			if (ret < 0) {
 				fprintf(stderr, "Failed to write to stdout: %m\n");
 				ret = EXIT_SYSFAIL;
@@ -1241,8 +1406,7 @@ static int vdi_read(int argc, char **argv)
 			remain -= ret;
 		}
 
-		offset = 0;
-		idx++;
+		idx += nr;
 		done += len;
 	}
 	fsync(STDOUT_FILENO);
@@ -1363,7 +1527,7 @@ out:
 	return ret;
 }
 
-static void *read_object_from(const struct sd_vnode *vnode, uint64_t oid)
+static void *read_object_from(const struct sd_node *node, uint64_t oid)
 {
 	struct sd_req hdr;
 	struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
@@ -1381,8 +1545,8 @@ static void *read_object_from(const struct sd_vnode *vnode, uint64_t oid)
 
 	hdr.obj.oid = oid;
 
-	addr_to_str(name, sizeof(name), vnode->nid.addr, 0);
-	ret = collie_exec_req(name, vnode->nid.port, &hdr, buf);
+	addr_to_str(name, sizeof(name), node->nid.addr, 0);
+	ret = collie_exec_req(name, node->nid.port, &hdr, buf);
 
 	if (ret < 0)
 		exit(EXIT_SYSFAIL);
@@ -1403,7 +1567,7 @@ static void *read_object_from(const struct sd_vnode *vnode, uint64_t oid)
 	return buf;
 }
 
-static void write_object_to(const struct sd_vnode *vnode, uint64_t oid,
+static void write_object_to(const struct sd_node *node, uint64_t oid,
 			    void *buf, bool create)
 {
 	struct sd_req hdr;
@@ -1420,8 +1584,8 @@ static void write_object_to(const struct sd_vnode *vnode, uint64_t oid,
 	hdr.data_length = get_objsize(oid);
 	hdr.obj.oid = oid;
 
-	addr_to_str(name, sizeof(name), vnode->nid.addr, 0);
-	ret = collie_exec_req(name, vnode->nid.port, &hdr, buf);
+	addr_to_str(name, sizeof(name), node->nid.addr, 0);
+	ret = collie_exec_req(name, node->nid.port, &hdr, buf);
 
 	if (ret < 0)
 		exit(EXIT_SYSFAIL);
@@ -1435,7 +1599,7 @@ static void write_object_to(const struct sd_vnode *vnode, uint64_t oid,
 
 struct vdi_check_work {
 	struct vdi_check_info *info;
-	const struct sd_vnode *vnode;
+	const struct sd_node *node;
 	uint8_t hash[SHA1_DIGEST_SIZE];
 	bool object_found;
 	struct work work;
@@ -1468,8 +1632,8 @@ static void vdi_repair_work(struct work *work)
 	struct vdi_check_info *info = vcw->info;
 	void *buf;
 
-	buf = read_object_from(info->base->vnode, info->oid);
-	write_object_to(vcw->vnode, info->oid, buf, !vcw->object_found);
+	buf = read_object_from(info->base->node, info->oid);
+	write_object_to(vcw->node, info->oid, buf, !vcw->object_found);
 	free(buf);
 }
 
@@ -1503,8 +1667,8 @@ static void vdi_hash_check_work(struct work *work)
 	hdr.obj.oid = info->oid;
 	hdr.obj.tgt_epoch = sd_epoch;
 
-	addr_to_str(host, sizeof(host), vcw->vnode->nid.addr, 0);
-	ret = collie_exec_req(host, vcw->vnode->nid.port, &hdr, NULL);
+	addr_to_str(host, sizeof(host), vcw->node->nid.addr, 0);
+	ret = collie_exec_req(host, vcw->node->nid.port, &hdr, NULL);
 	if (ret < 0)
 		exit(EXIT_SYSFAIL);
 
@@ -1519,7 +1683,7 @@ static void vdi_hash_check_work(struct work *work)
 		break;
 	default:
 		fprintf(stderr, "failed to read %"PRIx64" from %s:%d, %s\n",
-			info->oid, host, vcw->vnode->nid.port,
+			info->oid, host, vcw->node->nid.port,
 			sd_strerror(ret));
 		exit(EXIT_FAILURE);
 	}
@@ -1562,7 +1726,7 @@ static void queue_vdi_check_work(struct sd_inode *inode, uint64_t oid,
 				 uint64_t *done, struct work_queue *wq)
 {
 	struct vdi_check_info *info;
-	const struct sd_vnode *tgt_vnodes[SD_MAX_COPIES];
+	const struct sd_node *tgt_nodes[SD_MAX_COPIES];
 	int nr_copies = inode->nr_copies;
 
 	info = xzalloc(sizeof(*info) + sizeof(info->vcw[0]) * nr_copies);
@@ -1572,10 +1736,10 @@ static void queue_vdi_check_work(struct sd_inode *inode, uint64_t oid,
 	info->done = done;
 	info->wq = wq;
 
-	oid_to_vnodes(sd_vnodes, sd_vnodes_nr, oid, nr_copies, tgt_vnodes);
+	vinfo_oid_to_nodes(&sd_vinfo, oid, nr_copies, tgt_nodes);
 	for (int i = 0; i < nr_copies; i++) {
 		info->vcw[i].info = info;
-		info->vcw[i].vnode = tgt_vnodes[i];
+		info->vcw[i].node = tgt_nodes[i];
 		info->vcw[i].work.fn = vdi_hash_check_work;
 		info->vcw[i].work.done = vdi_hash_check_main;
 		info->refcnt++;
@@ -1583,6 +1747,157 @@ static void queue_vdi_check_work(struct sd_inode *inode, uint64_t oid,
 	}
 }
 
+/*
+ * Check the strips of an erasure coded object.  The strips of the write most
+ * of them are of are taken as the object, and the parity is encoded again
+ * from their data.  Strips which are missing, of another write, or whose
+ * parity doesn't match the data are rewritten.
+ */
+struct vdi_ec_check_work {
+	uint64_t oid;
+	const struct fec *ctx;
+	int d, p;
+	uint32_t missing, fixed;
+	bool failed;
+	uint64_t total;
+	uint64_t *done;
+	struct work work;
+};
+
+static uint32_t ec_check_consistent_strips(char * const *bufs, int n,
+					   size_t len)
+{
+	uint32_t best = 0, set;
+	int i, j;
+
+	for (i = 0; i < n; i++) {
+		if (!bufs[i])
+			continue;
+		set = 0;
+		for (j = 0; j < n; j++)
+			if (bufs[j] && !memcmp(bufs[i] + len, bufs[j] + len,
+					       sizeof(struct sd_ec_trailer)))
+				set |= 1U << j;
+		if (__builtin_popcount(set) > __builtin_popcount(best))
+			best = set;
+	}
+
+	return best;
+}
+
+static void vdi_ec_check_work(struct work *work)
+{
+	struct vdi_ec_check_work *ecw = container_of(work,
+						     struct vdi_ec_check_work,
+						     work);
+	int d = ecw->d, n = ecw->d + ecw->p, i, ref;
+	uint32_t good, data_mask = (1U << d) - 1;
+	const struct sd_node *nodes[SD_EC_MAX_STRIPS];
+	uint64_t oids[SD_EC_MAX_STRIPS];
+	char *bufs[SD_EC_MAX_STRIPS];
+	uint8_t *strips[SD_EC_MAX_STRIPS], *parity[SD_EC_MAX_STRIPS];
+	size_t size, len;
+
+	for (i = 0; i < n; i++) {
+		oids[i] = ec_strip_oid(ecw->oid, d, i);
+		nodes[i] = vinfo_oid_to_node(&sd_vinfo, oids[i], 0);
+		bufs[i] = read_object_from(nodes[i], oids[i]);
+		if (!bufs[i])
+			ecw->missing |= 1U << i;
+	}
+	size = get_objsize(oids[0]);
+	len = size - SD_EC_TRAILER_SIZE;
+
+	good = ec_check_consistent_strips(bufs, n, len);
+	if (__builtin_popcount(good) < d) {
+		ecw->failed = true;
+		goto out;
+	}
+	ref = __builtin_ctz(good);
+
+	for (i = 0; i < n; i++) {
+		if (!bufs[i])
+			bufs[i] = xzalloc(size);
+		strips[i] = (uint8_t *)bufs[i];
+	}
+	if (fec_decode(ecw->ctx, strips, good, data_mask, len) < 0) {
+		ecw->failed = true;
+		goto out;
+	}
+
+	for (i = 0; i < ecw->p; i++)
+		parity[i] = xmalloc(len);
+	fec_encode(ecw->ctx, (const uint8_t * const *)strips, parity, len);
+	for (i = 0; i < n; i++) {
+		if (i >= d && memcmp(strips[i], parity[i - d], len)) {
+			memcpy(strips[i], parity[i - d], len);
+			ecw->fixed |= 1U << i;
+		}
+		if (!(good & (1U << i)))
+			ecw->fixed |= 1U << i;
+	}
+	for (i = 0; i < ecw->p; i++)
+		free(parity[i]);
+
+	for (i = 0; i < n; i++) {
+		if (!(ecw->fixed & (1U << i)))
+			continue;
+		memcpy(bufs[i] + len, bufs[ref] + len, SD_EC_TRAILER_SIZE);
+		write_object_to(nodes[i], oids[i], bufs[i],
+				ecw->missing & (1U << i));
+	}
+out:
+	for (i = 0; i < n; i++)
+		free(bufs[i]);
+}
+
+static void vdi_ec_check_main(struct work *work)
+{
+	struct vdi_ec_check_work *ecw = container_of(work,
+						     struct vdi_ec_check_work,
+						     work);
+	int i;
+
+	if (ecw->failed) {
+		fprintf(stderr, "less than %d strips of %"PRIx64" are of the"
+			" same write\n", ecw->d, ecw->oid);
+		exit(EXIT_FAILURE);
+	}
+
+	for (i = 0; i < ecw->d + ecw->p; i++) {
+		if (!(ecw->fixed & (1U << i)))
+			continue;
+		if (ecw->missing & (1U << i))
+			fprintf(stdout, "fixed missing strip %d of %"PRIx64"\n",
+				i, ecw->oid);
+		else
+			fprintf(stdout, "fixed strip %d of %"PRIx64"\n", i,
+				ecw->oid);
+	}
+
+	*ecw->done += SD_DATA_OBJ_SIZE;
+	show_progress(*ecw->done, ecw->total);
+	free(ecw);
+}
+
+static void queue_vdi_ec_check_work(struct sd_inode *inode, uint64_t oid,
+				    const struct fec *ctx, uint64_t *done,
+				    struct work_queue *wq)
+{
+	struct vdi_ec_check_work *ecw;
+
+	ecw = xzalloc(sizeof(*ecw));
+	ecw->oid = oid;
+	ecw->ctx = ctx;
+	ecw->d = ec_policy_data(inode->copy_policy);
+	ecw->p = ec_policy_parity(inode->copy_policy);
+	ecw->total = inode->vdi_size;
+	ecw->done = done;
+	ecw->work.fn = vdi_ec_check_work;
+	ecw->work.done = vdi_ec_check_main;
+	queue_work(wq, &ecw->work);
+}
+
 static int vdi_check(int argc, char **argv)
 {
 	const char *vdiname = argv[optind++];
@@ -1591,6 +1906,8 @@ static int vdi_check(int argc, char **argv)
 	uint32_t vid;
 	struct sd_inode *inode = xmalloc(sizeof(*inode));
 	struct work_queue *wq;
+	struct fec *ctx = NULL;
+	int nr_strips;
 
 	ret = read_vdi_obj(vdiname, vdi_cmd_data.snapshot_id,
 			   vdi_cmd_data.snapshot_tag, &vid, inode,
@@ -1605,6 +1922,18 @@ static int vdi_check(int argc, char **argv)
 		return EXIT_FAILURE;
 	}
 
+	if (inode->copy_policy) {
+		nr_strips = ec_policy_data(inode->copy_policy) +
+			ec_policy_parity(inode->copy_policy);
+		if (sd_nodes_nr < nr_strips) {
+			fprintf(stderr, "ABORT: Not enough active nodes for "
+				"consistency-check\n");
+			return EXIT_FAILURE;
+		}
+		ctx = fec_new(ec_policy_data(inode->copy_policy),
+			      ec_policy_parity(inode->copy_policy));
+	}
+
 	wq = create_work_queue("vdi check", WQ_DYNAMIC);
 
 	queue_vdi_check_work(inode, vid_to_vdi_oid(vid), NULL, wq);
@@ -1615,7 +1944,11 @@ static int vdi_check(int argc, char **argv)
 		vid = inode->data_vdi_id[idx];
 		if (vid) {
 			oid = vid_to_data_oid(vid, idx);
-			queue_vdi_check_work(inode, oid, &done, wq);
+			if (ctx)
+				queue_vdi_ec_check_work(inode, oid, ctx, &done,
+							wq);
+			else
+				queue_vdi_check_work(inode, oid, &done, wq);
 		} else {
 			done += SD_DATA_OBJ_SIZE;
 			show_progress(done, inode->vdi_size);
@@ -1624,6 +1957,9 @@ static int vdi_check(int argc, char **argv)
 
 	work_queue_wait(wq);
 
+	if (ctx)
+		fec_free(ctx);
+
 	fprintf(stdout, "finish check&repair %s\n", vdiname);
 	return EXIT_SUCCESS;
 out:
@@ -1847,7 +2183,7 @@ static uint32_t do_restore(const char *vdiname, int snapid, const char *tag)
 		goto out;
 
 	ret = do_vdi_create(vdiname, inode->vdi_size, inode->vdi_id, &vid,
-			    false, inode->nr_copies);
+			    false, inode->nr_copies, 0);
 	if (ret != EXIT_SUCCESS) {
 		fprintf(stderr, "Failed to read VDI\n");
 		goto out;
@@ -1944,7 +2280,7 @@ out:
 		/* recreate the current vdi object */
 		recovery_ret = do_vdi_create(vdiname, current_inode->vdi_size,
 					     current_inode->parent_vdi_id, NULL,
-					     true, current_inode->nr_copies);
+					     true, current_inode->nr_copies, 0);
 		if (recovery_ret != EXIT_SUCCESS) {
 			fprintf(stderr, "failed to resume the current vdi\n");
 			ret = recovery_ret;
@@ -2058,6 +2394,10 @@ static struct subcommand vdi_cmd[] = {
 	{"getattr", "<vdiname> <key>", "aph", "get a VDI attribute",
 	 NULL, SUBCMD_FLAG_NEED_ARG,
 	 vdi_getattr, vdi_options},
+	{"qos", "<vdiname> [<iops> <bandwidth> [<iops burst> <bandwidth burst>]]",
+	 "aph", "show or set the I/O limits of an image",
+	 NULL, SUBCMD_FLAG_NEED_ARG,
+	 vdi_qos, vdi_options},
 	{"resize", "<vdiname> <new size>", "aph", "resize an image",
 	 NULL, SUBCMD_FLAG_NEED_ARG,
 	 vdi_resize, vdi_options},
@@ -2118,6 +2458,23 @@ static int vdi_parser(int ch, char *opt)
 		break;
 	case 'c':
 		nr_copies = strtol(opt, &p, 10);
+		if (opt != p && *p == ':') {
+			char *q = p + 1;
+			int nr_parity = strtol(q, &p, 10);
+
+			if (q == p || *p || nr_copies < 0 || nr_parity < 0 ||
+			    !ec_policy_is_valid(nr_copies, nr_parity)) {
+				fprintf(stderr, "Invalid erasure coding "
+					"policy, must be data:parity with "
+					"2 or 4 data strips and up to %d "
+					"strips in total\n", SD_EC_MAX_STRIPS);
+				exit(EXIT_FAILURE);
+			}
+			vdi_cmd_data.copy_policy = ec_policy(nr_copies,
+							     nr_parity);
+			vdi_cmd_data.nr_copies = 0;
+			break;
+		}
 		if (opt == p || nr_copies < 0 || nr_copies > SD_MAX_COPIES) {
 			fprintf(stderr, "Invalid copies number, must be "
 				"an integer between 0 and %d\n", SD_MAX_COPIES);
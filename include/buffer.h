@@ -0,0 +1,40 @@
+/*
+ * Copyright (C) 2013 Taobao Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __BUFFER_H__
+#define __BUFFER_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Pool of page aligned I/O buffers
+ *
+ * Buffers from 4KB up to 4MB are kept in power of two size classes, and
+ * larger ones are allocated directly.  A buffer must be returned with the size
+ * it was got with.
+ */
+#define BUF_MIN_SHIFT 12
+#define BUF_MAX_SHIFT 22
+#define BUF_NR_CLASSES (BUF_MAX_SHIFT - BUF_MIN_SHIFT + 1)
+
+struct buf_class_stat {
+	uint64_t size;		/* size of the buffers of the class */
+	uint64_t hits;		/* buffers got from the pool */
+	uint64_t misses;	/* buffers allocated */
+	uint64_t held;		/* bytes of the free buffers in the pool */
+};
+
+void *buf_get(size_t size);
+void *xbuf_get(size_t size);
+void buf_put(void *buf, size_t size);
+void buf_pool_stat(struct buf_class_stat *stat);
+
+#endif
@@ -3,18 +3,27 @@
 
 #include "list.h"
 #include <limits.h>
+#include <stdbool.h>
+#include <sys/uio.h>
 
 struct event_info;
 
 typedef void (*event_handler_t)(int fd, int events, void *data);
+typedef void (*event_io_done_t)(int res, void *data);
 
 int init_event(int nr);
+int init_event_uring(int nr);
 int register_event_prio(int fd, event_handler_t h, void *data, int prio);
 void unregister_event(int fd);
 int modify_event(int fd, unsigned int events);
 void event_loop(int timeout);
 void event_loop_prio(int timeout);
 void event_force_refresh(void);
+bool event_async_io(void);
+int event_recv(int fd, void *buf, size_t len, event_io_done_t done,
+	       void *data);
+int event_sendmsg(int fd, struct iovec *iov, int iovcnt, event_io_done_t done,
+		  void *data);
 
 struct timer {
 	void (*callback)(void *);
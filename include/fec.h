@@ -0,0 +1,38 @@
+/*
+ * Copyright (C) 2013 Taobao Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __FEC_H__
+#define __FEC_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Systematic Reed-Solomon code over GF(2^8)
+ *
+ * 'd' data strips are encoded into 'p' parity strips, and any 'd' of the
+ * 'd + p' strips are enough to rebuild the others.  Strips are numbered data
+ * first, so a strip index below 'd' is a data strip.
+ */
+struct fec;
+
+struct fec *fec_new(int d, int p);
+void fec_free(struct fec *ctx);
+
+void fec_encode(const struct fec *ctx, const uint8_t * const *data,
+		uint8_t * const *parity, size_t len);
+void fec_update_parity(const struct fec *ctx, int idx, const uint8_t *data,
+		       uint8_t * const *parity, size_t len);
+int fec_decode(const struct fec *ctx, uint8_t * const *strips,
+	       uint32_t avail, uint32_t want, size_t len);
+
+const char *fec_kernel_name(void);
+
+#endif
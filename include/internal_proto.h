@@ -75,6 +75,13 @@
 #define SD_OP_GET_HASH       0xB4
 #define SD_OP_REWEIGHT       0xB5
 #define SD_OP_UPDATE_SIZE    0xB6
+#define SD_OP_CHAIN_WRITE_PEER 0xB7
+#define SD_OP_READ_OBJS_PEER 0xB8
+#define SD_OP_WRITE_OBJS_PEER 0xB9
+#define SD_OP_STAT_BUFFER    0xBA
+#define SD_OP_STAT_LATENCY   0xBB
+#define SD_OP_SET_VDI_QOS    0xBC
+#define SD_OP_EC_WRITE_PEER  0xBD
 
 /* internal flags for hdr.flags, must be above 0x80 */
 #define SD_FLAG_CMD_RECOVERY 0x0080
@@ -104,6 +111,8 @@
 
 #define SD_FLAG_NOHALT       0x0004 /* Serve the IO rquest even lack of nodes */
 #define SD_FLAG_QUORUM       0x0008 /* Serve the IO rquest as long we are quorate */
+#define SD_FLAG_PLACEMENT_MASK  0xf000 /* Id of the placement driver */
+#define SD_FLAG_PLACEMENT_SHIFT 12
 
 #define SD_STATUS_OK                0x00000001
 #define SD_STATUS_WAIT_FOR_FORMAT   0x00000002
@@ -183,6 +192,46 @@ struct sd_md_info {
 	int nr;
 };
 
+/* Stages of a request for SD_OP_STAT_LATENCY */
+enum sd_latency_stage {
+	SD_LAT_QUEUE,	/* received -> queued */
+	SD_LAT_WAIT,	/* queued -> started by a worker */
+	SD_LAT_WORK,	/* started -> done */
+	SD_LAT_TX,	/* done -> response sent */
+	SD_LAT_TOTAL,	/* received -> response sent */
+	SD_LAT_NR_STAGES,
+};
+
+/* Latencies of a stage of an operation in microseconds */
+struct sd_latency_stat {
+	char name[32];
+	char type[8];
+	uint8_t opcode;
+	uint8_t stage;
+	uint8_t __pad[6];
+	uint64_t count;
+	uint64_t sum;
+	uint64_t max;
+	uint64_t p50;
+	uint64_t p90;
+	uint64_t p99;
+	uint64_t p999;
+};
+
+/*
+ * I/O limits of a VDI, kept in its SD_VDI_QOS_KEY attribute.  The request
+ * data of SD_OP_SET_VDI_QOS is the VDI name (SD_MAX_VDI_LEN bytes) followed
+ * by the limits.
+ */
+#define SD_VDI_QOS_KEY "sheepdog.qos"
+
+struct sd_vdi_qos {
+	uint64_t iops;		/* 0 means unlimited */
+	uint64_t bps;		/* bytes per second, 0 means unlimited */
+	uint64_t iops_burst;	/* 0 means one second worth of I/Os */
+	uint64_t bps_burst;	/* 0 means one second worth of bytes */
+};
+
 enum cluster_join_result {
 	/* Success */
 	CJ_RES_SUCCESS,
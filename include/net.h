@@ -17,6 +17,22 @@
 #define POLL_TIMEOUT 5 /* seconds */
 #define MAX_RETRY_COUNT (MAX_POLLTIME / POLL_TIMEOUT)
 
+/*
+ * Pinning pages and reaping the completions cost more than copying small
+ * buffers, so MSG_ZEROCOPY is used only for the data larger than this.
+ */
+#define ZEROCOPY_MIN_LEN (16 * 1024)
+
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+#ifndef SO_EE_ORIGIN_ZEROCOPY
+#define SO_EE_ORIGIN_ZEROCOPY 5
+#endif
+
 enum conn_state {
 	C_IO_HEADER = 0,
 	C_IO_DATA_INIT,
@@ -55,6 +71,13 @@ int tx(struct connection *conn, enum conn_state next_state);
 int connect_to(const char *name, int port);
 int send_req(int sockfd, struct sd_req *hdr, void *data, unsigned int wlen,
 	     bool (*need_retry)(uint32_t), uint32_t);
+int send_reqv(int sockfd, struct sd_req *hdr, const struct iovec *data,
+	      int iovcnt, bool (*need_retry)(uint32_t), uint32_t);
+int send_req_zerocopy(int sockfd, struct sd_req *hdr, void *data,
+		      unsigned int wlen, bool (*need_retry)(uint32_t), uint32_t);
+int reap_zerocopy(int sockfd);
+int recv_rsp(int sockfd, struct sd_rsp *rsp, void *data, unsigned int rlen,
+	     bool (*need_retry)(uint32_t), uint32_t);
 int exec_req(int sockfd, struct sd_req *hdr, void *,
 	     bool (*need_retry)(uint32_t), uint32_t);
 int create_listen_ports(const char *bindaddr, int port,
@@ -69,6 +92,7 @@ int set_nonblocking(int fd);
 int set_nodelay(int fd);
 int set_keepalive(int fd);
 int set_snd_timeout(int fd);
+int set_zerocopy(int fd);
 int set_rcv_timeout(int fd);
 int get_local_addr(uint8_t *bytes);
 bool inetaddr_is_valid(char *addr);
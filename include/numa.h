@@ -0,0 +1,48 @@
+/*
+ * Copyright (C) 2013 Taobao Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __NUMA_H__
+#define __NUMA_H__
+
+#include <sched.h>
+#include <stddef.h>
+#include <pthread.h>
+
+/*
+ * NUMA topology and CPU placement of threads
+ *
+ * The topology is read from sysfs.  Without it, all the CPUs are on node 0.
+ */
+#define NUMA_MAX_NODES 64
+
+enum cpu_place_policy {
+	CPU_PLACE_NONE,		/* let the scheduler decide */
+	CPU_PLACE_PIN,		/* bind every thread to the given CPUs */
+	CPU_PLACE_SPREAD,	/* bind the threads to the nodes round robin */
+	CPU_PLACE_NIC,		/* bind to the nodes serving the NIC's IRQs */
+};
+
+struct cpu_placement {
+	enum cpu_place_policy policy;
+	cpu_set_t cpus;		/* for CPU_PLACE_PIN and CPU_PLACE_NIC */
+};
+
+int numa_nr_nodes(void);
+int numa_node_of_cpu(int cpu);
+int numa_current_node(void);
+int numa_bind_memory(void *addr, size_t len, int node);
+
+int parse_cpu_placement(const char *arg, struct cpu_placement *p);
+int place_thread(pthread_t thread, const struct cpu_placement *p, int idx);
+
+int set_thread_placement(const char *name, const struct cpu_placement *p);
+const struct cpu_placement *find_thread_placement(const char *name);
+
+#endif
@@ -18,20 +18,47 @@
 #include "net.h"
 #include "logger.h"
 
+/* The address of a vnode is the one of nodes[node_idx] */
 struct sd_vnode {
-	struct node_id  nid;
+	uint64_t        id;
 	uint16_t	node_idx;
 	uint32_t	zone;
-	uint64_t        id;
 };
 
-struct vnode_info {
-	struct sd_vnode vnodes[SD_MAX_VNODES];
-	int nr_vnodes;
+struct vnode_info;
+
+/*
+ * Placement driver
+ *
+ * A placement driver maps an object to the nodes of an epoch.  Every node of
+ * the cluster has to use the same one, so the driver is chosen when the
+ * cluster is formatted and its id is kept in the cluster flags.
+ */
+struct placement_driver {
+	const char *name;
+	int id;
+
+	/* Precompute the placement of vinfo->nodes, return the state of it */
+	void *(*init)(const struct vnode_info *vinfo);
+	void (*exit)(void *state);
+
+	/*
+	 * Store the indexes into vinfo->nodes of the first 'nr_copies' nodes
+	 * of 'oid', which are in distinct zones.  'nr_copies' must not exceed
+	 * the number of zones.
+	 */
+	void (*oid_to_nodes)(const struct vnode_info *vinfo, uint64_t oid,
+			     int nr_copies, int *idxs);
+};
 
-	struct sd_node nodes[SD_MAX_NODES];
+/* The nodes are sized to the epoch and 'placement' is the driver's state */
+struct vnode_info {
+	struct sd_node *nodes;
 	int nr_nodes;
 
+	const struct placement_driver *pdrv;
+	void *placement;
+
 	int nr_zones;
 	int refcnt;
 };
@@ -138,7 +165,15 @@ static inline const struct sd_vnode *oid_to_vnode(const struct sd_vnode *entries
 						  int nr_entries, uint64_t oid,
 						  int copy_idx)
 {
-	int idx = get_vnode_nth_idx(entries, nr_entries, oid, copy_idx);
+	int idx;
+
+	/* The strips of an object are placed like its copies */
+	if (is_ec_strip_obj(oid)) {
+		copy_idx += ec_strip_index(oid);
+		oid = ec_strip_base_oid(oid);
+	}
+
+	idx = get_vnode_nth_idx(entries, nr_entries, oid, copy_idx);
 
 	return &entries[idx];
 }
@@ -149,6 +184,14 @@ static inline void oid_to_vnodes(const struct sd_vnode *entries, int nr_entries,
 {
 	int idx, idxs[SD_MAX_COPIES], i;
 
+	/* A strip has no copies, see vinfo_oid_to_nodes() */
+	if (is_ec_strip_obj(oid)) {
+		assert(nr_copies <= 1);
+		if (nr_copies)
+			vnodes[0] = oid_to_vnode(entries, nr_entries, oid, 0);
+		return;
+	}
+
 	idx = get_vnode_first_idx(entries, nr_entries, oid);
 	idxs[0] = idx;
 	vnodes[0] = &entries[idx];
@@ -160,17 +203,56 @@ static inline void oid_to_vnodes(const struct sd_vnode *entries, int nr_entries,
 	}
 }
 
-static inline void oid_to_nodes(const struct sd_vnode *entries, int nr_entries,
-				uint64_t oid, int nr_copies,
-				const struct sd_node *all_nodes,
-				const struct sd_node **nodes)
+const struct placement_driver *find_placement_driver(const char *name);
+const struct placement_driver *get_placement_driver(int id);
+void placement_init(struct vnode_info *vinfo,
+		    const struct placement_driver *pdrv);
+void placement_exit(struct vnode_info *vinfo);
+
+static inline int cluster_placement_id(uint16_t cluster_flags)
+{
+	return (cluster_flags & SD_FLAG_PLACEMENT_MASK) >>
+		SD_FLAG_PLACEMENT_SHIFT;
+}
+
+/* Get the node of the 'copy_idx'th copy of 'oid' */
+static inline const struct sd_node *
+vinfo_oid_to_node(const struct vnode_info *vinfo, uint64_t oid, int copy_idx)
 {
-	int i;
-	const struct sd_vnode *vnodes[SD_MAX_COPIES];
+	int idxs[SD_MAX_COPIES];
+
+	/* The strips of an object are placed like its copies */
+	if (is_ec_strip_obj(oid)) {
+		copy_idx += ec_strip_index(oid);
+		oid = ec_strip_base_oid(oid);
+	}
+
+	vinfo->pdrv->oid_to_nodes(vinfo, oid, copy_idx + 1, idxs);
+	return &vinfo->nodes[idxs[copy_idx]];
+}
+
+/*
+ * Get the nodes of the first 'nr_copies' copies of 'oid'
+ *
+ * A strip has no copies, so 'nr_copies' must be 0 or 1 for a strip, as
+ * get_obj_copy_number() returns.
+ */
+static inline void vinfo_oid_to_nodes(const struct vnode_info *vinfo,
+				      uint64_t oid, int nr_copies,
+				      const struct sd_node **nodes)
+{
+	int i, idxs[SD_MAX_COPIES];
+
+	if (is_ec_strip_obj(oid)) {
+		assert(nr_copies <= 1);
+		if (nr_copies)
+			nodes[0] = vinfo_oid_to_node(vinfo, oid, 0);
+		return;
+	}
 
-	oid_to_vnodes(entries, nr_entries, oid, nr_copies, vnodes);
+	vinfo->pdrv->oid_to_nodes(vinfo, oid, nr_copies, idxs);
 	for (i = 0; i < nr_copies; i++)
-		nodes[i] = &all_nodes[vnodes[i]->node_idx];
+		nodes[i] = &vinfo->nodes[idxs[i]];
 }
 
 static inline const char *sd_strerror(int err)
@@ -285,8 +367,6 @@ static inline int nodes_to_vnodes(struct sd_node *nodes, int nr,
 					hval = fnv_64a_buf(&n->nid.addr[j], 1, hval);
 
 				vnodes[nr_vnodes].id = hval;
-				memcpy(vnodes[nr_vnodes].nid.addr, n->nid.addr, sizeof(n->nid.addr));
-				vnodes[nr_vnodes].nid.port = n->nid.port;
 				vnodes[nr_vnodes].node_idx = n - nodes;
 				vnodes[nr_vnodes].zone = n->zone;
 			}
@@ -29,6 +29,8 @@
 #define SD_OP_WRITE_OBJ      0x03
 #define SD_OP_REMOVE_OBJ     0x04
 #define SD_OP_DISCARD_OBJ    0x05
+#define SD_OP_READ_OBJS      0x06
+#define SD_OP_WRITE_OBJS     0x07
 
 #define SD_OP_NEW_VDI        0x11
 #define SD_OP_LOCK_VDI       0x12
@@ -82,6 +84,9 @@
  * 32 - 55 (24 bits): VDI object space
  * 56 - 59 ( 4 bits): reserved VDI object space
  * 60 - 63 ( 4 bits): object type indentifier space
+ *
+ * A strip of an erasure coded data object has EC_STRIP_BIT set, and keeps the
+ * strip index in bits 56 - 58 and the number of data strips in bit 59.
  */
 
 #define VDI_SPACE_SHIFT   32
@@ -89,6 +94,10 @@
 #define VDI_BIT (UINT64_C(1) << 63)
 #define VMSTATE_BIT (UINT64_C(1) << 62)
 #define VDI_ATTR_BIT (UINT64_C(1) << 61)
+#define EC_STRIP_BIT (UINT64_C(1) << 60)
+#define EC_DATA_BIT (UINT64_C(1) << 59)
+#define EC_INDEX_SHIFT 56
+#define EC_INDEX_MASK (UINT64_C(7) << EC_INDEX_SHIFT)
 #define MAX_DATA_OBJS (1ULL << 20)
 #define MAX_CHILDREN 1024U
 #define SD_MAX_VDI_LEN 256U
@@ -108,6 +117,41 @@
 
 #define STORE_LEN 16
 
+/*
+ * Erasure coding policy of a VDI, stored in sd_inode.copy_policy
+ *
+ * Zero means replication.  Otherwise the data objects are split into 2 or 4
+ * data strips which are encoded into 1 or more parity strips, and each strip
+ * is stored on a different zone.
+ */
+#define SD_EC_MAX_STRIPS 8
+#define ec_policy(d, p) ((d) << 4 | (p))
+#define ec_policy_data(policy) ((policy) >> 4)
+#define ec_policy_parity(policy) ((policy) & 0x0f)
+
+/*
+ * Every strip object ends with a trailer which identifies the write that
+ * stored it.  Each write of the object stamps all its strips with a new
+ * generation, so strips of different writes are never decoded together.
+ */
+#define SD_EC_TRAILER_SIZE 512
+
+struct sd_ec_trailer {
+	uint64_t gen;
+	uint32_t writer;	/* hash of the node id of the gateway */
+	uint32_t __pad;
+};
+
+/*
+ * Limits of the vectored requests SD_OP_READ_OBJS and SD_OP_WRITE_OBJS
+ *
+ * The request data starts with 'nr_segs' struct sd_obj_seg.  For a write, it
+ * is followed by the data of the segments in order, and a read returns the
+ * data of the segments in order.
+ */
+#define SD_MAX_OBJS_SEGS 1024
+#define SD_MAX_OBJS_DATA (SD_DATA_OBJ_SIZE * 16)
+
 #define SD_REQ_SIZE 48
 #define SD_RSP_SIZE 48
 
@@ -131,7 +175,14 @@ struct sd_req {
 			uint32_t	base_vdi_id;
 			uint32_t	copies;
 			uint32_t	snapid;
+			uint16_t	copy_policy;
 		} vdi;
+		struct {
+			uint64_t	__zero; /* obj.oid, must be zero */
+			uint32_t	nr_segs;
+			uint32_t	__pad;
+			uint32_t	copies;
+		} objs;
 
 		/* sheepdog-internal */
 		struct {
@@ -146,7 +197,19 @@ struct sd_req {
 			uint32_t	copies;
 			uint8_t		set_bitmap; /* 0 means false */
 						    /* others mean true */
+			uint8_t		__pad;
+			uint16_t	copy_policy;
 		} vdi_state;
+		struct {
+			/* same layout as 'obj' so that peer ops can use it */
+			uint64_t	oid;
+			uint64_t	cow_oid;
+			uint32_t	copies;
+			uint8_t		opcode;   /* peer op done at each hop */
+			uint8_t		done_map; /* targets written already */
+			uint16_t	__pad;
+			uint64_t	offset;
+		} chain;
 
 		uint32_t		__pad[8];
 	};
@@ -172,6 +235,7 @@ struct sd_rsp {
 			uint32_t	vdi_id;
 			uint32_t	attr_id;
 			uint32_t	copies;
+			uint16_t	copy_policy;
 		} vdi;
 
 		/* sheepdog-internal */
@@ -193,6 +257,12 @@ struct sd_rsp {
 	};
 };
 
+struct sd_obj_seg {
+	uint64_t	oid;
+	uint32_t	offset;
+	uint32_t	length;
+};
+
 struct sd_inode {
 	char name[SD_MAX_VDI_LEN];
 	char tag[SD_MAX_VDI_TAG_LEN];
@@ -271,8 +341,43 @@ static inline bool is_data_obj(uint64_t oid)
 		!is_vdi_attr_obj(oid);
 }
 
+static inline bool is_ec_strip_obj(uint64_t oid)
+{
+	return !!(oid & EC_STRIP_BIT);
+}
+
+static inline bool ec_policy_is_valid(int d, int p)
+{
+	return (d == 2 || d == 4) && p >= 1 && d + p <= SD_EC_MAX_STRIPS;
+}
+
+static inline uint64_t ec_strip_oid(uint64_t oid, int nr_data, int idx)
+{
+	return oid | EC_STRIP_BIT | (nr_data == 4 ? EC_DATA_BIT : 0) |
+		(uint64_t)idx << EC_INDEX_SHIFT;
+}
+
+static inline uint64_t ec_strip_base_oid(uint64_t oid)
+{
+	return oid & ~(EC_STRIP_BIT | EC_DATA_BIT | EC_INDEX_MASK);
+}
+
+static inline int ec_strip_index(uint64_t oid)
+{
+	return (oid & EC_INDEX_MASK) >> EC_INDEX_SHIFT;
+}
+
+static inline int ec_strip_nr_data(uint64_t oid)
+{
+	return oid & EC_DATA_BIT ? 4 : 2;
+}
+
 static inline size_t get_objsize(uint64_t oid)
 {
+	if (is_ec_strip_obj(oid))
+		return SD_DATA_OBJ_SIZE / ec_strip_nr_data(oid) +
+			SD_EC_TRAILER_SIZE;
+
 	if (is_vdi_obj(oid))
 		return SD_INODE_SIZE;
 
@@ -0,0 +1,57 @@
+/*
+ * Copyright (C) 2013 Taobao Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __URING_H__
+#define __URING_H__
+
+#include <stdbool.h>
+#include <linux/io_uring.h>
+
+/*
+ * A minimal io_uring, set up with the raw system calls
+ *
+ * A ring is not thread safe; every thread which submits I/O needs its own.
+ */
+struct uring {
+	int fd;
+
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	struct io_uring_sqe *sqes;
+	unsigned sqe_tail;	/* the next sqe to hand out */
+	unsigned sq_entries;
+
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	void *ring_mem;		/* both the rings share a mapping */
+	size_t ring_size;
+};
+
+int uring_init(struct uring *ring, unsigned entries);
+void uring_exit(struct uring *ring);
+struct io_uring_sqe *uring_get_sqe(struct uring *ring);
+int uring_submit(struct uring *ring, unsigned wait_nr, int timeout);
+struct io_uring_cqe *uring_peek_cqe(struct uring *ring);
+void uring_cqe_seen(struct uring *ring);
+bool uring_supported(void);
+
+static inline void uring_prep_rw(struct io_uring_sqe *sqe, int op, int fd,
+				 const void *addr, unsigned len, uint64_t off,
+				 void *data)
+{
+	sqe->opcode = op;
+	sqe->fd = fd;
+	sqe->addr = (unsigned long)addr;
+	sqe->len = len;
+	sqe->off = off;
+	sqe->user_data = (unsigned long)data;
+}
+
+#endif
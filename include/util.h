@@ -8,6 +8,7 @@
 #include <limits.h>
 #include <stdint.h>
 #include <unistd.h>
+#include <time.h>
 #include <urcu/uatomic.h>
 
 #include "bitops.h"
@@ -197,6 +198,15 @@ static inline bool is_stdout_console(void)
 	return isatty(STDOUT_FILENO);
 }
 
+/* Return the monotonic time in microseconds, for measuring latencies */
+static inline uint64_t clock_get_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
 extern mode_t sd_def_fmode;
 extern mode_t sd_def_dmode;
 
@@ -15,7 +15,6 @@ struct work {
 
 struct work_queue {
 	int wq_state;
-	struct list_head pending_list;
 };
 
 enum wq_thread_control {
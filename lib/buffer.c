@@ -0,0 +1,243 @@
+/*
+ * Copyright (C) 2013 Taobao Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The free buffers of a class are linked through their first word.  Every
+ * thread caches a few small buffers without locking, and gives them back to
+ * the shared pool when it exits.  Large buffers always go through the shared
+ * pool, which is locked per class and keeps a bounded number of them.
+ *
+ * There is a shared pool per NUMA node.  A thread gets buffers from the pool
+ * of the node it runs on, new buffers are placed on that node, and a buffer
+ * goes back to the pool of the node of the thread which puts it.
+ */
+#include <pthread.h>
+
+#include "buffer.h"
+#include "numa.h"
+#include "util.h"
+#include "logger.h"
+
+/* Classes up to 256KB are cached per thread */
+#define BUF_TCACHE_MAX_SHIFT 18
+#define BUF_TCACHE_NR_CLASSES (BUF_TCACHE_MAX_SHIFT - BUF_MIN_SHIFT + 1)
+#define BUF_TCACHE_DEPTH 4
+
+/* The shared pool keeps up to 64 buffers or 32MB per class */
+#define BUF_POOL_MAX_NR 64
+#define BUF_POOL_MAX_BYTES (32 << 20)
+
+struct buf_class {
+	pthread_mutex_t lock;
+	void *head;
+	int nr, max_nr;
+
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t held;
+};
+
+struct buf_tcache {
+	void *head;
+	int nr;
+};
+
+/* BUF_NR_CLASSES classes per node */
+static struct buf_class *buf_classes;
+static int buf_nr_nodes;
+static __thread struct buf_tcache buf_tcache[BUF_TCACHE_NR_CLASSES];
+static pthread_key_t buf_tcache_key;
+
+static inline void *buf_pop(void **head)
+{
+	void *buf = *head;
+
+	*head = *(void **)buf;
+	return buf;
+}
+
+static inline void buf_push(void **head, void *buf)
+{
+	*(void **)buf = *head;
+	*head = buf;
+}
+
+static inline int buf_class_idx(size_t size)
+{
+	int shift = BUF_MIN_SHIFT;
+
+	while (((size_t)1 << shift) < size)
+		shift++;
+
+	return shift <= BUF_MAX_SHIFT ? shift - BUF_MIN_SHIFT : -1;
+}
+
+static inline struct buf_class *buf_node_class(int idx)
+{
+	int node = numa_current_node();
+
+	if (node >= buf_nr_nodes)
+		node = 0;
+	return buf_classes + node * BUF_NR_CLASSES + idx;
+}
+
+static void buf_pool_put(int idx, void *buf)
+{
+	struct buf_class *c = buf_node_class(idx);
+
+	pthread_mutex_lock(&c->lock);
+	if (c->nr < c->max_nr) {
+		buf_push(&c->head, buf);
+		c->nr++;
+		buf = NULL;
+	}
+	pthread_mutex_unlock(&c->lock);
+
+	if (buf)
+		free(buf);
+	else
+		uatomic_add(&c->held, 1UL << (idx + BUF_MIN_SHIFT));
+}
+
+/* Give the buffers cached by an exiting thread back to the shared pool */
+static void buf_tcache_flush(void *arg)
+{
+	int i;
+
+	for (i = 0; i < BUF_TCACHE_NR_CLASSES; i++) {
+		struct buf_tcache *tc = buf_tcache + i;
+
+		while (tc->nr) {
+			uatomic_sub(&buf_node_class(i)->held,
+				    1UL << (i + BUF_MIN_SHIFT));
+			buf_pool_put(i, buf_pop(&tc->head));
+			tc->nr--;
+		}
+	}
+}
+
+static void __attribute__((constructor)) buf_pool_init(void)
+{
+	int i;
+
+	buf_nr_nodes = numa_nr_nodes();
+	buf_classes = xcalloc(buf_nr_nodes * BUF_NR_CLASSES,
+			      sizeof(*buf_classes));
+	for (i = 0; i < buf_nr_nodes * BUF_NR_CLASSES; i++) {
+		pthread_mutex_init(&buf_classes[i].lock, NULL);
+		buf_classes[i].max_nr = min(BUF_POOL_MAX_NR,
+					    BUF_POOL_MAX_BYTES >>
+					    (i % BUF_NR_CLASSES +
+					     BUF_MIN_SHIFT));
+	}
+
+	pthread_key_create(&buf_tcache_key, buf_tcache_flush);
+}
+
+/* Get a page aligned buffer of at least 'size' bytes, or NULL */
+void *buf_get(size_t size)
+{
+	int idx = buf_class_idx(size);
+	struct buf_class *c;
+	struct buf_tcache *tc;
+	void *buf = NULL;
+
+	if (idx < 0)
+		return valloc(size);
+
+	c = buf_node_class(idx);
+	if (idx < BUF_TCACHE_NR_CLASSES) {
+		tc = buf_tcache + idx;
+		if (tc->nr) {
+			tc->nr--;
+			buf = buf_pop(&tc->head);
+		}
+	}
+
+	if (!buf && uatomic_read(&c->nr)) {
+		pthread_mutex_lock(&c->lock);
+		if (c->nr) {
+			c->nr--;
+			buf = buf_pop(&c->head);
+		}
+		pthread_mutex_unlock(&c->lock);
+	}
+
+	if (buf) {
+		uatomic_inc(&c->hits);
+		uatomic_sub(&c->held, 1UL << (idx + BUF_MIN_SHIFT));
+		return buf;
+	}
+
+	uatomic_inc(&c->misses);
+	size = 1UL << (idx + BUF_MIN_SHIFT);
+	buf = valloc(size);
+	if (buf)
+		numa_bind_memory(buf, size, (c - buf_classes) / BUF_NR_CLASSES);
+	return buf;
+}
+
+void *xbuf_get(size_t size)
+{
+	void *buf = buf_get(size);
+
+	if (!buf)
+		panic("Out of memory");
+	return buf;
+}
+
+void buf_put(void *buf, size_t size)
+{
+	int idx = buf_class_idx(size);
+	struct buf_tcache *tc;
+
+	if (!buf)
+		return;
+
+	if (idx < 0) {
+		free(buf);
+		return;
+	}
+
+	if (idx < BUF_TCACHE_NR_CLASSES) {
+		tc = buf_tcache + idx;
+		if (tc->nr < BUF_TCACHE_DEPTH) {
+			/* Flush the cache when this thread exits */
+			if (!pthread_getspecific(buf_tcache_key))
+				pthread_setspecific(buf_tcache_key, buf_tcache);
+			buf_push(&tc->head, buf);
+			tc->nr++;
+			uatomic_add(&buf_node_class(idx)->held,
+				    1UL << (idx + BUF_MIN_SHIFT));
+			return;
+		}
+	}
+
+	buf_pool_put(idx, buf);
+}
+
+/* The sums of the classes of all the nodes */
+void buf_pool_stat(struct buf_class_stat *stat)
+{
+	struct buf_class *c;
+	int i, node;
+
+	for (i = 0; i < BUF_NR_CLASSES; i++) {
+		stat[i].size = 1ULL << (i + BUF_MIN_SHIFT);
+		stat[i].hits = stat[i].misses = stat[i].held = 0;
+		for (node = 0; node < buf_nr_nodes; node++) {
+			c = buf_classes + node * BUF_NR_CLASSES + i;
+			stat[i].hits += uatomic_read(&c->hits);
+			stat[i].misses += uatomic_read(&c->misses);
+			stat[i].held += uatomic_read(&c->held);
+		}
+	}
+}
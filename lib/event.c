@@ -14,15 +14,22 @@
 #include <string.h>
 #include <unistd.h>
 #include <sys/epoll.h>
+#include <sys/socket.h>
 #include <sys/timerfd.h>
 
 #include "list.h"
 #include "util.h"
 #include "event.h"
 #include "logger.h"
+#include "rbtree.h"
+#include "uring.h"
 
-static int efd;
-static LIST_HEAD(events_list);
+/*
+ * Every thread which calls init_event() runs its own event loop, and the
+ * events registered by a thread are delivered to its loop.
+ */
+static __thread int efd;
+static __thread struct rb_root events_tree = RB_ROOT;
 
 static void timer_handler(int fd, int events, void *data)
 {
@@ -66,17 +73,48 @@ struct event_info {
 	event_handler_t handler;
 	int fd;
 	void *data;
-	struct list_head ei_list;
+	struct rb_node rb;
 	int prio;
+	bool dead;		/* unregistered, but not freed yet */
+
+	/* epoll backend */
+	struct list_head dead_list;
+
+	/* io_uring backend */
+	unsigned int events;
+	bool armed;		/* the poll is queued in the kernel */
+	struct list_head pending_list;
 };
 
-static struct epoll_event *events;
-static int nr_events;
+/*
+ * An event loop backend.  del() takes the ownership of 'ei', which is already
+ * removed from the events tree.
+ */
+struct event_backend {
+	int (*init)(int nr);
+	int (*add)(struct event_info *ei);
+	void (*del)(struct event_info *ei);
+	int (*mod)(struct event_info *ei, unsigned int events);
+	void (*loop)(int timeout, bool sort_with_prio);
+};
 
-int init_event(int nr)
+static __thread const struct event_backend *backend;
+static __thread struct epoll_event *events;
+static __thread int nr_events;
+
+/*
+ * Events unregistered while epoll_loop() runs the handlers of a batch.  The
+ * rest of the batch may still refer to them, so they are freed after it.
+ */
+static __thread bool in_epoll_batch;
+static __thread struct list_head dead_events;
+
+static struct event_info *lookup_event(int fd);
+
+static int epoll_init(int nr)
 {
-	nr_events = nr;
-	events = xcalloc(nr_events, sizeof(struct epoll_event));
+	events = xcalloc(nr, sizeof(struct epoll_event));
+	INIT_LIST_HEAD(&dead_events);
 
 	efd = epoll_create(nr);
 	if (efd < 0) {
@@ -86,12 +124,90 @@ int init_event(int nr)
 	return 0;
 }
 
+static int epoll_add(struct event_info *ei)
+{
+	struct epoll_event ev;
+	int ret;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = ei;
+
+	ret = epoll_ctl(efd, EPOLL_CTL_ADD, ei->fd, &ev);
+	if (ret)
+		sd_eprintf("failed to add epoll event: %m");
+	return ret;
+}
+
+static void epoll_del(struct event_info *ei)
+{
+	if (epoll_ctl(efd, EPOLL_CTL_DEL, ei->fd, NULL))
+		sd_eprintf("failed to delete epoll event for fd %d: %m",
+			   ei->fd);
+	if (in_epoll_batch) {
+		ei->dead = true;
+		list_add_tail(&ei->dead_list, &dead_events);
+	} else
+		free(ei);
+}
+
+static int epoll_mod(struct event_info *ei, unsigned int new_events)
+{
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = new_events;
+	ev.data.ptr = ei;
+
+	if (epoll_ctl(efd, EPOLL_CTL_MOD, ei->fd, &ev)) {
+		sd_eprintf("failed to delete epoll event for fd %d: %m",
+			   ei->fd);
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * Events are indexed by fd in a rbtree because the gateway registers and
+ * unregisters replica sockets on every forwarded request, so the number of
+ * registered fds can grow up to the number of in-flight writes.
+ */
+static struct event_info *event_insert(struct event_info *new)
+{
+	struct rb_node **p = &events_tree.rb_node;
+	struct rb_node *parent = NULL;
+	struct event_info *ei;
+
+	while (*p) {
+		parent = *p;
+		ei = rb_entry(parent, struct event_info, rb);
+
+		if (new->fd < ei->fd)
+			p = &(*p)->rb_left;
+		else if (new->fd > ei->fd)
+			p = &(*p)->rb_right;
+		else
+			return ei;
+	}
+	rb_link_node(&new->rb, parent, p);
+	rb_insert_color(&new->rb, &events_tree);
+
+	return NULL; /* insert successfully */
+}
+
 static struct event_info *lookup_event(int fd)
 {
+	struct rb_node *n = events_tree.rb_node;
 	struct event_info *ei;
 
-	list_for_each_entry(ei, &events_list, ei_list) {
-		if (ei->fd == fd)
+	while (n) {
+		ei = rb_entry(n, struct event_info, rb);
+
+		if (fd < ei->fd)
+			n = n->rb_left;
+		else if (fd > ei->fd)
+			n = n->rb_right;
+		else
 			return ei;
 	}
 	return NULL;
@@ -100,7 +216,6 @@ static struct event_info *lookup_event(int fd)
 int register_event_prio(int fd, event_handler_t h, void *data, int prio)
 {
 	int ret;
-	struct epoll_event ev;
 	struct event_info *ei;
 
 	ei = xzalloc(sizeof(*ei));
@@ -109,41 +224,29 @@ int register_event_prio(int fd, event_handler_t h, void *data, int prio)
 	ei->data = data;
 	ei->prio = prio;
 
-	memset(&ev, 0, sizeof(ev));
-	ev.events = EPOLLIN;
-	ev.data.ptr = ei;
-
-	ret = epoll_ctl(efd, EPOLL_CTL_ADD, fd, &ev);
-	if (ret) {
-		sd_eprintf("failed to add epoll event: %m");
+	ret = backend->add(ei);
+	if (ret)
 		free(ei);
-	} else
-		list_add(&ei->ei_list, &events_list);
+	else
+		event_insert(ei);
 
 	return ret;
 }
 
 void unregister_event(int fd)
 {
-	int ret;
 	struct event_info *ei;
 
 	ei = lookup_event(fd);
 	if (!ei)
 		return;
 
-	ret = epoll_ctl(efd, EPOLL_CTL_DEL, fd, NULL);
-	if (ret)
-		sd_eprintf("failed to delete epoll event for fd %d: %m", fd);
-
-	list_del(&ei->ei_list);
-	free(ei);
+	rb_erase(&ei->rb, &events_tree);
+	backend->del(ei);
 }
 
 int modify_event(int fd, unsigned int new_events)
 {
-	int ret;
-	struct epoll_event ev;
 	struct event_info *ei;
 
 	ei = lookup_event(fd);
@@ -152,19 +255,10 @@ int modify_event(int fd, unsigned int new_events)
 		return 1;
 	}
 
-	memset(&ev, 0, sizeof(ev));
-	ev.events = new_events;
-	ev.data.ptr = ei;
-
-	ret = epoll_ctl(efd, EPOLL_CTL_MOD, fd, &ev);
-	if (ret) {
-		sd_eprintf("failed to delete epoll event for fd %d: %m", fd);
-		return 1;
-	}
-	return 0;
+	return backend->mod(ei, new_events);
 }
 
-static bool event_loop_refresh;
+static __thread bool event_loop_refresh;
 
 void event_force_refresh(void)
 {
@@ -187,7 +281,18 @@ static int epoll_event_cmp(const struct epoll_event *_a, struct epoll_event *_b)
 	return 0;
 }
 
-static void do_event_loop(int timeout, bool sort_with_prio)
+static void free_dead_events(void)
+{
+	struct event_info *ei, *t;
+
+	list_for_each_entry_safe(ei, t, &dead_events, dead_list) {
+		list_del(&ei->dead_list);
+		free(ei);
+	}
+	in_epoll_batch = false;
+}
+
+static void epoll_loop(int timeout, bool sort_with_prio)
 {
 	int i, nr;
 
@@ -202,26 +307,320 @@ refresh:
 		sd_eprintf("epoll_wait failed: %m");
 		exit(1);
 	} else if (nr) {
+		in_epoll_batch = true;
 		for (i = 0; i < nr; i++) {
 			struct event_info *ei;
 
 			ei = (struct event_info *)events[i].data.ptr;
+			if (ei->dead)
+				continue;
 			ei->handler(ei->fd, events[i].events, ei->data);
 
 			if (event_loop_refresh) {
 				event_loop_refresh = false;
+				free_dead_events();
 				goto refresh;
 			}
 		}
+		free_dead_events();
+	}
+}
+
+static const struct event_backend epoll_backend = {
+	.init = epoll_init,
+	.add = epoll_add,
+	.del = epoll_del,
+	.mod = epoll_mod,
+	.loop = epoll_loop,
+};
+
+/*
+ * io_uring backend
+ *
+ * Every registered fd has a one shot poll in the ring, which is queued again
+ * after its handler runs, so the events are level triggered like epoll.
+ * Queueing, modifying and removing the polls needs no system call of its own;
+ * they are submitted together with the wait for the next events.
+ *
+ * The ring also runs the asynchronous receives and sends of event_recv() and
+ * event_sendmsg().  Their user_data is tagged with the lowest bit to tell them
+ * from the polls.
+ */
+#define URING_IO_TAG 1UL
+
+struct uring_event {
+	struct event_info *ei;
+	int revents;
+};
+
+struct event_io {
+	event_io_done_t done;
+	void *data;
+	struct msghdr msg;
+};
+
+static __thread struct uring ring;
+static __thread struct uring_event *uring_events;
+static __thread struct list_head pending_events; /* polls to be queued */
+
+static int uring_backend_init(int nr)
+{
+	uring_events = xcalloc(nr, sizeof(*uring_events));
+	INIT_LIST_HEAD(&pending_events);
+
+	return uring_init(&ring, nr);
+}
+
+/* Get an sqe, and flush the submission queue to the kernel if it is full */
+static struct io_uring_sqe *uring_xget_sqe(void)
+{
+	struct io_uring_sqe *sqe;
+	int ret;
+
+	while (!(sqe = uring_get_sqe(&ring))) {
+		ret = uring_submit(&ring, 0, 0);
+		if (ret < 0 && ret != -EINTR && ret != -EAGAIN &&
+		    ret != -EBUSY)
+			panic("failed to submit to io_uring, %s",
+			      strerror(-ret));
+	}
+	return sqe;
+}
+
+static void uring_arm(struct event_info *ei)
+{
+	struct io_uring_sqe *sqe = uring_xget_sqe();
+
+	uring_prep_rw(sqe, IORING_OP_POLL_ADD, ei->fd, NULL, 0, 0, ei);
+	sqe->poll32_events = ei->events;
+	ei->armed = true;
+}
+
+static int uring_add(struct event_info *ei)
+{
+	ei->events = EPOLLIN;
+	uring_arm(ei);
+	return 0;
+}
+
+static void uring_del(struct event_info *ei)
+{
+	struct io_uring_sqe *sqe;
+
+	ei->dead = true;
+	if (!ei->armed)
+		/* Freed when the pending events are queued */
+		return;
+
+	sqe = uring_xget_sqe();
+	uring_prep_rw(sqe, IORING_OP_POLL_REMOVE, -1, ei, 0, 0, NULL);
+}
+
+static int uring_mod(struct event_info *ei, unsigned int new_events)
+{
+	struct io_uring_sqe *sqe;
+
+	ei->events = new_events;
+	if (!ei->armed)
+		return 0;
+
+	/* If the poll has already fired, it is queued again with the events */
+	sqe = uring_xget_sqe();
+	uring_prep_rw(sqe, IORING_OP_POLL_REMOVE, -1, ei,
+		      IORING_POLL_UPDATE_EVENTS, 0, NULL);
+	sqe->poll32_events = new_events;
+	return 0;
+}
+
+static void uring_queue_pending(void)
+{
+	struct event_info *ei, *t;
+
+	list_for_each_entry_safe(ei, t, &pending_events, pending_list) {
+		list_del(&ei->pending_list);
+		if (ei->dead)
+			free(ei);
+		else
+			uring_arm(ei);
+	}
+}
+
+static void uring_io_complete(unsigned long user_data, int res)
+{
+	struct event_io *io = (struct event_io *)(user_data & ~URING_IO_TAG);
+
+	io->done(res, io->data);
+	free(io);
+}
+
+static int uring_event_cmp(const struct uring_event *a,
+			   const struct uring_event *b)
+{
+	/* we need sort event_info array in reverse order */
+	if (a->ei->prio < b->ei->prio)
+		return 1;
+	else if (b->ei->prio < a->ei->prio)
+		return -1;
+
+	return 0;
+}
+
+/* Reap the completions, and return the number of the fired events */
+static int uring_reap(void)
+{
+	struct io_uring_cqe *cqe;
+	struct event_info *ei;
+	unsigned long user_data;
+	int nr = 0, res;
+
+	while (nr < nr_events && (cqe = uring_peek_cqe(&ring))) {
+		user_data = cqe->user_data;
+		res = cqe->res;
+		uring_cqe_seen(&ring);
+
+		if (!user_data)
+			/* The result of a poll removal or update */
+			continue;
+		if (user_data & URING_IO_TAG) {
+			uring_io_complete(user_data, res);
+			continue;
+		}
+
+		ei = (struct event_info *)user_data;
+		ei->armed = false;
+		if (ei->dead) {
+			free(ei);
+			continue;
+		}
+
+		list_add_tail(&ei->pending_list, &pending_events);
+		if (res < 0) {
+			sd_eprintf("poll of fd %d failed, %s", ei->fd,
+				   strerror(-res));
+			continue;
+		}
+		uring_events[nr].ei = ei;
+		uring_events[nr].revents = res;
+		nr++;
 	}
+
+	return nr;
+}
+
+static void uring_loop(int timeout, bool sort_with_prio)
+{
+	struct event_info *ei;
+	int i, nr, ret;
+
+refresh:
+	uring_queue_pending();
+	ret = uring_submit(&ring, uring_peek_cqe(&ring) ? 0 : 1, timeout);
+	if (ret < 0 && ret != -ETIME && ret != -EINTR && ret != -EBUSY) {
+		sd_eprintf("io_uring_enter failed, %s", strerror(-ret));
+		exit(1);
+	}
+
+	nr = uring_reap();
+	if (sort_with_prio)
+		xqsort(uring_events, nr, uring_event_cmp);
+
+	for (i = 0; i < nr; i++) {
+		ei = uring_events[i].ei;
+		/* Unregistered by a handler of this batch */
+		if (ei->dead)
+			continue;
+		ei->handler(ei->fd, uring_events[i].revents, ei->data);
+
+		/* The rest are polled again, as they are still pending */
+		if (event_loop_refresh) {
+			event_loop_refresh = false;
+			goto refresh;
+		}
+	}
+}
+
+static const struct event_backend uring_backend = {
+	.init = uring_backend_init,
+	.add = uring_add,
+	.del = uring_del,
+	.mod = uring_mod,
+	.loop = uring_loop,
+};
+
+static int uring_submit_io(int op, int fd, struct event_io *io,
+			   const void *addr, unsigned len, int flags)
+{
+	struct io_uring_sqe *sqe;
+
+	if (backend != &uring_backend) {
+		free(io);
+		return -1;
+	}
+
+	sqe = uring_xget_sqe();
+	uring_prep_rw(sqe, op, fd, addr, len, 0, io);
+	sqe->msg_flags = flags;
+	sqe->user_data |= URING_IO_TAG;
+	return 0;
+}
+
+/*
+ * Receive up to 'len' bytes asynchronously, and call 'done' with the result of
+ * recv(2) or a negative errno.  The buffer must be kept until then.
+ */
+int event_recv(int fd, void *buf, size_t len, event_io_done_t done,
+	       void *data)
+{
+	struct event_io *io = xmalloc(sizeof(*io));
+
+	io->done = done;
+	io->data = data;
+	return uring_submit_io(IORING_OP_RECV, fd, io, buf, len, 0);
+}
+
+/* Send the iovecs asynchronously like event_recv() */
+int event_sendmsg(int fd, struct iovec *iov, int iovcnt, event_io_done_t done,
+		  void *data)
+{
+	struct event_io *io = xzalloc(sizeof(*io));
+
+	io->done = done;
+	io->data = data;
+	io->msg.msg_iov = iov;
+	io->msg.msg_iovlen = iovcnt;
+	return uring_submit_io(IORING_OP_SENDMSG, fd, io, &io->msg, 1,
+			       MSG_NOSIGNAL);
+}
+
+/* Return true if the loop of this thread has event_recv() and friends */
+bool event_async_io(void)
+{
+	return backend == &uring_backend;
+}
+
+static int do_init_event(const struct event_backend *b, int nr)
+{
+	backend = b;
+	nr_events = nr;
+	return backend->init(nr);
+}
+
+int init_event(int nr)
+{
+	return do_init_event(&epoll_backend, nr);
+}
+
+int init_event_uring(int nr)
+{
+	return do_init_event(&uring_backend, nr);
 }
 
 void event_loop(int timeout)
 {
-	do_event_loop(timeout, false);
+	backend->loop(timeout, false);
 }
 
 void event_loop_prio(int timeout)
 {
-	do_event_loop(timeout, true);
+	backend->loop(timeout, true);
 }
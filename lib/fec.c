@@ -0,0 +1,336 @@
+/*
+ * Copyright (C) 2013 Taobao Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Reed-Solomon erasure code
+ *
+ * The encoding matrix is an identity matrix on top of a Cauchy matrix, so any
+ * 'd' rows of it are linearly independent.  Strips are multiplied by a
+ * constant with two 16-entry tables, one for each nibble of the source byte,
+ * which lets the SSSE3 and AVX2 kernels do the table lookups with PSHUFB.
+ */
+#include <string.h>
+
+#include "fec.h"
+#include "util.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define FEC_X86
+#endif
+
+#define GF_POLY 0x11d
+#define FEC_MAX_STRIPS 32
+
+struct fec {
+	int d, p;
+	uint8_t *matrix;	/* p x d parity rows of the encoding matrix */
+	uint8_t (*tbls)[32];	/* multiplication tables of 'matrix' */
+};
+
+typedef void (*gf_mul_add_fn)(const uint8_t *tbl, const uint8_t *src,
+			      uint8_t *dst, size_t len);
+
+static uint8_t gf_exp[512];
+static uint8_t gf_log[256];
+static gf_mul_add_fn gf_mul_add;
+static const char *gf_kernel;
+
+static inline uint8_t gf_mul(uint8_t a, uint8_t b)
+{
+	if (!a || !b)
+		return 0;
+	return gf_exp[gf_log[a] + gf_log[b]];
+}
+
+static inline uint8_t gf_inv(uint8_t a)
+{
+	return gf_exp[255 - gf_log[a]];
+}
+
+/* tbl[x] = c * x and tbl[16 + x] = c * (x << 4) */
+static void gf_init_tbl(uint8_t c, uint8_t *tbl)
+{
+	int i;
+
+	for (i = 0; i < 16; i++) {
+		tbl[i] = gf_mul(c, i);
+		tbl[16 + i] = gf_mul(c, i << 4);
+	}
+}
+
+/* dst ^= c * src */
+static void gf_mul_add_generic(const uint8_t *tbl, const uint8_t *src,
+			       uint8_t *dst, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		dst[i] ^= tbl[src[i] & 0x0f] ^ tbl[16 + (src[i] >> 4)];
+}
+
+#ifdef FEC_X86
+__attribute__((target("ssse3")))
+static void gf_mul_add_ssse3(const uint8_t *tbl, const uint8_t *src,
+			     uint8_t *dst, size_t len)
+{
+	__m128i lo = _mm_loadu_si128((const __m128i *)tbl);
+	__m128i hi = _mm_loadu_si128((const __m128i *)(tbl + 16));
+	__m128i mask = _mm_set1_epi8(0x0f);
+	size_t i;
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		__m128i s = _mm_loadu_si128((const __m128i *)(src + i));
+		__m128i d = _mm_loadu_si128((const __m128i *)(dst + i));
+		__m128i l, h;
+
+		l = _mm_shuffle_epi8(lo, _mm_and_si128(s, mask));
+		h = _mm_shuffle_epi8(hi, _mm_and_si128(_mm_srli_epi64(s, 4),
+						       mask));
+		d = _mm_xor_si128(d, _mm_xor_si128(l, h));
+		_mm_storeu_si128((__m128i *)(dst + i), d);
+	}
+
+	gf_mul_add_generic(tbl, src + i, dst + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static void gf_mul_add_avx2(const uint8_t *tbl, const uint8_t *src,
+			    uint8_t *dst, size_t len)
+{
+	__m256i lo, hi, mask = _mm256_set1_epi8(0x0f);
+	size_t i;
+
+	/* PSHUFB looks up within each 128 bit lane */
+	lo = _mm256_broadcastsi128_si256(
+		_mm_loadu_si128((const __m128i *)tbl));
+	hi = _mm256_broadcastsi128_si256(
+		_mm_loadu_si128((const __m128i *)(tbl + 16)));
+
+	for (i = 0; i + 32 <= len; i += 32) {
+		__m256i s = _mm256_loadu_si256((const __m256i *)(src + i));
+		__m256i d = _mm256_loadu_si256((const __m256i *)(dst + i));
+		__m256i l, h;
+
+		l = _mm256_shuffle_epi8(lo, _mm256_and_si256(s, mask));
+		h = _mm256_shuffle_epi8(hi,
+				_mm256_and_si256(_mm256_srli_epi64(s, 4),
+						 mask));
+		d = _mm256_xor_si256(d, _mm256_xor_si256(l, h));
+		_mm256_storeu_si256((__m256i *)(dst + i), d);
+	}
+
+	gf_mul_add_generic(tbl, src + i, dst + i, len - i);
+}
+#endif
+
+static void __attribute__((constructor)) gf_init(void)
+{
+	int i, x = 1;
+
+	for (i = 0; i < 255; i++) {
+		gf_exp[i] = x;
+		gf_exp[i + 255] = x;
+		gf_log[x] = i;
+		x <<= 1;
+		if (x & 0x100)
+			x ^= GF_POLY;
+	}
+
+	gf_mul_add = gf_mul_add_generic;
+	gf_kernel = "generic";
+#ifdef FEC_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		gf_mul_add = gf_mul_add_avx2;
+		gf_kernel = "avx2";
+	} else if (__builtin_cpu_supports("ssse3")) {
+		gf_mul_add = gf_mul_add_ssse3;
+		gf_kernel = "ssse3";
+	}
+#endif
+}
+
+const char *fec_kernel_name(void)
+{
+	return gf_kernel;
+}
+
+struct fec *fec_new(int d, int p)
+{
+	struct fec *ctx;
+	int i, j;
+
+	if (d < 1 || p < 0 || d + p > FEC_MAX_STRIPS)
+		return NULL;
+
+	ctx = xzalloc(sizeof(*ctx));
+	ctx->d = d;
+	ctx->p = p;
+	ctx->matrix = xmalloc(p * d);
+	ctx->tbls = xmalloc(p * d * sizeof(*ctx->tbls));
+
+	/* Cauchy matrix 1 / (x_i + y_j) with x_i = d + i and y_j = j */
+	for (i = 0; i < p; i++)
+		for (j = 0; j < d; j++) {
+			ctx->matrix[i * d + j] = gf_inv((d + i) ^ j);
+			gf_init_tbl(ctx->matrix[i * d + j],
+				    ctx->tbls[i * d + j]);
+		}
+
+	return ctx;
+}
+
+void fec_free(struct fec *ctx)
+{
+	if (!ctx)
+		return;
+
+	free(ctx->matrix);
+	free(ctx->tbls);
+	free(ctx);
+}
+
+void fec_encode(const struct fec *ctx, const uint8_t * const *data,
+		uint8_t * const *parity, size_t len)
+{
+	int i, j;
+
+	for (i = 0; i < ctx->p; i++) {
+		memset(parity[i], 0, len);
+		for (j = 0; j < ctx->d; j++)
+			gf_mul_add(ctx->tbls[i * ctx->d + j], data[j],
+				   parity[i], len);
+	}
+}
+
+/*
+ * Add 'data' of the data strip 'idx' to the same range of the parity strips.
+ * The code is linear, so doing it with the old and then with the new data of
+ * a range updates the parity for the change without the other data strips.
+ */
+void fec_update_parity(const struct fec *ctx, int idx, const uint8_t *data,
+		       uint8_t * const *parity, size_t len)
+{
+	int i;
+
+	for (i = 0; i < ctx->p; i++)
+		gf_mul_add(ctx->tbls[i * ctx->d + idx], data, parity[i], len);
+}
+
+/* Gauss-Jordan elimination, 'm' is overwritten */
+static int gf_invert_matrix(uint8_t *m, uint8_t *inv, int n)
+{
+	int i, j, k;
+	uint8_t c;
+
+	memset(inv, 0, n * n);
+	for (i = 0; i < n; i++)
+		inv[i * n + i] = 1;
+
+	for (i = 0; i < n; i++) {
+		for (k = i; k < n && !m[k * n + i]; k++)
+			;
+		if (k == n)
+			return -1;
+		if (k != i)
+			for (j = 0; j < n; j++) {
+				c = m[i * n + j];
+				m[i * n + j] = m[k * n + j];
+				m[k * n + j] = c;
+				c = inv[i * n + j];
+				inv[i * n + j] = inv[k * n + j];
+				inv[k * n + j] = c;
+			}
+
+		c = gf_inv(m[i * n + i]);
+		for (j = 0; j < n; j++) {
+			m[i * n + j] = gf_mul(m[i * n + j], c);
+			inv[i * n + j] = gf_mul(inv[i * n + j], c);
+		}
+
+		for (k = 0; k < n; k++) {
+			if (k == i || !m[k * n + i])
+				continue;
+			c = m[k * n + i];
+			for (j = 0; j < n; j++) {
+				m[k * n + j] ^= gf_mul(m[i * n + j], c);
+				inv[k * n + j] ^= gf_mul(inv[i * n + j], c);
+			}
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Rebuild the strips in 'want' which are not in 'avail'.  'strips' has all
+ * the 'd + p' strips, and the buffers of the missing ones are overwritten.
+ * Return -1 if less than 'd' strips are available.
+ */
+int fec_decode(const struct fec *ctx, uint8_t * const *strips,
+	       uint32_t avail, uint32_t want, size_t len)
+{
+	int d = ctx->d, n = ctx->d + ctx->p, i, j, t, rows[FEC_MAX_STRIPS];
+	uint32_t data_mask = (1U << d) - 1, missing = want & ~avail;
+	uint8_t m[FEC_MAX_STRIPS * FEC_MAX_STRIPS];
+	uint8_t inv[FEC_MAX_STRIPS * FEC_MAX_STRIPS], tbl[32];
+
+	if (!missing)
+		return 0;
+
+	/* The missing parity is encoded from the whole data */
+	if (missing & ~data_mask)
+		missing |= data_mask & ~avail;
+
+	for (i = 0, t = 0; i < n && t < d; i++)
+		if (avail & (1U << i))
+			rows[t++] = i;
+	if (t < d)
+		return -1;
+
+	if (missing & data_mask) {
+		for (t = 0; t < d; t++) {
+			if (rows[t] < d) {
+				memset(m + t * d, 0, d);
+				m[t * d + rows[t]] = 1;
+			} else
+				memcpy(m + t * d,
+				       ctx->matrix + (rows[t] - d) * d, d);
+		}
+		if (gf_invert_matrix(m, inv, d) < 0)
+			return -1;
+
+		for (j = 0; j < d; j++) {
+			if (!(missing & (1U << j)))
+				continue;
+			memset(strips[j], 0, len);
+			for (t = 0; t < d; t++) {
+				if (!inv[j * d + t])
+					continue;
+				gf_init_tbl(inv[j * d + t], tbl);
+				gf_mul_add(tbl, strips[rows[t]], strips[j],
+					   len);
+			}
+		}
+	}
+
+	for (i = 0; i < ctx->p; i++) {
+		if (!(missing & (1U << (d + i))))
+			continue;
+		memset(strips[d + i], 0, len);
+		for (j = 0; j < d; j++)
+			gf_mul_add(ctx->tbls[i * d + j], strips[j],
+				   strips[d + i], len);
+	}
+
+	return 0;
+}
@@ -26,6 +26,7 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/uio.h>
+#include <linux/errqueue.h>
 
 #include "sheepdog_proto.h"
 #include "sheep.h"
@@ -320,14 +321,23 @@ static void forward_iov(struct msghdr *msg, int len)
 
 
 static int do_write(int sockfd, struct msghdr *msg, int len,
-		    bool (*need_retry)(uint32_t), uint32_t epoch)
+		    bool (*need_retry)(uint32_t), uint32_t epoch, int flags)
 {
 	int ret, repeat = MAX_RETRY_COUNT;
+	size_t iovlen = msg->msg_iovlen;
 rewrite:
-	ret = sendmsg(sockfd, msg, 0);
+	/* sendmsg() takes at most IOV_MAX vectors at once */
+	msg->msg_iovlen = min(iovlen, (size_t)IOV_MAX);
+	ret = sendmsg(sockfd, msg, flags);
+	msg->msg_iovlen = iovlen;
 	if (ret < 0) {
 		if (errno == EINTR)
 			goto rewrite;
+		/* Out of the optmem for pinning pages, copy the data instead */
+		if (errno == ENOBUFS && (flags & MSG_ZEROCOPY)) {
+			flags &= ~MSG_ZEROCOPY;
+			goto rewrite;
+		}
 		/*
 		 * Since we set timeout for write, we'll get EAGAIN even for
 		 * blocking sockfd.
@@ -345,6 +355,7 @@ rewrite:
 	len -= ret;
 	if (len) {
 		forward_iov(msg, ret);
+		iovlen = msg->msg_iovlen;
 		goto rewrite;
 	}
 
@@ -372,7 +383,7 @@ int send_req(int sockfd, struct sd_req *hdr, void *data, unsigned int wlen,
 		iov[1].iov_len = wlen;
 	}
 
-	ret = do_write(sockfd, &msg, sizeof(*hdr) + wlen, need_retry, epoch);
+	ret = do_write(sockfd, &msg, sizeof(*hdr) + wlen, need_retry, epoch, 0);
 	if (ret) {
 		sd_eprintf("failed to send request %x, %d: %m", hdr->opcode,
 			   wlen);
@@ -382,23 +393,125 @@ int send_req(int sockfd, struct sd_req *hdr, void *data, unsigned int wlen,
 	return ret;
 }
 
-int exec_req(int sockfd, struct sd_req *hdr, void *data,
-	     bool (*need_retry)(uint32_t epoch), uint32_t epoch)
+#define SEND_REQV_MAX_IOV 8
+
+/* Send the request with the data gathered from 'data' */
+int send_reqv(int sockfd, struct sd_req *hdr, const struct iovec *data,
+	      int iovcnt, bool (*need_retry)(uint32_t epoch), uint32_t epoch)
 {
-	int ret;
-	struct sd_rsp *rsp = (struct sd_rsp *)hdr;
-	unsigned int wlen, rlen;
+	struct iovec iov_buf[SEND_REQV_MAX_IOV + 1], *iov = iov_buf;
+	struct msghdr msg;
+	int i, ret = 0, len = sizeof(*hdr);
 
-	if (hdr->flags & SD_FLAG_CMD_WRITE) {
-		wlen = hdr->data_length;
-		rlen = 0;
-	} else {
-		wlen = 0;
-		rlen = hdr->data_length;
+	if (iovcnt > SEND_REQV_MAX_IOV)
+		iov = xmalloc(sizeof(*iov) * (iovcnt + 1));
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = iovcnt + 1;
+
+	iov[0].iov_base = hdr;
+	iov[0].iov_len = sizeof(*hdr);
+	for (i = 0; i < iovcnt; i++) {
+		iov[i + 1] = data[i];
+		len += data[i].iov_len;
 	}
 
-	if (send_req(sockfd, hdr, data, wlen, need_retry, epoch))
-		return 1;
+	if (do_write(sockfd, &msg, len, need_retry, epoch, 0)) {
+		sd_eprintf("failed to send request %x, %d: %m", hdr->opcode,
+			   len);
+		ret = -1;
+	}
+
+	if (iov != iov_buf)
+		free(iov);
+	return ret;
+}
+
+/*
+ * Send the request data without copying it into the socket buffer, if the
+ * socket has SO_ZEROCOPY enabled.  The kernel sends the data straight from
+ * our pages, so the caller must not modify or free 'data' until the peer
+ * responds, and should reap the completions with reap_zerocopy().
+ *
+ * The header is sent with a normal copy, because it is usually on the stack.
+ */
+int send_req_zerocopy(int sockfd, struct sd_req *hdr, void *data,
+		      unsigned int wlen, bool (*need_retry)(uint32_t epoch),
+		      uint32_t epoch)
+{
+	struct msghdr msg;
+	struct iovec iov;
+
+	if (wlen < ZEROCOPY_MIN_LEN)
+		return send_req(sockfd, hdr, data, wlen, need_retry, epoch);
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+
+	iov.iov_base = hdr;
+	iov.iov_len = sizeof(*hdr);
+	if (do_write(sockfd, &msg, sizeof(*hdr), need_retry, epoch, MSG_MORE))
+		goto err;
+
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	iov.iov_base = data;
+	iov.iov_len = wlen;
+	if (do_write(sockfd, &msg, wlen, need_retry, epoch, MSG_ZEROCOPY))
+		goto err;
+
+	return 0;
+err:
+	sd_eprintf("failed to send request %x, %d: %m", hdr->opcode, wlen);
+	return -1;
+}
+
+/*
+ * Drain the zero-copy completion notifications from the socket error queue.
+ *
+ * Return the number of notifications, or -1 if the socket has a real error.
+ */
+int reap_zerocopy(int sockfd)
+{
+	char control[CMSG_SPACE(sizeof(struct sock_extended_err))];
+	struct sock_extended_err *serr;
+	struct msghdr msg;
+	struct cmsghdr *cm;
+	int nr = 0;
+
+	for (;;) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+
+		if (recvmsg(sockfd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return nr;
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+
+		cm = CMSG_FIRSTHDR(&msg);
+		if (!cm)
+			return -1;
+		serr = (struct sock_extended_err *)CMSG_DATA(cm);
+		if (serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY || serr->ee_errno)
+			return -1;
+		nr++;
+	}
+}
+
+/*
+ * Read the response of a request sent by send_req().  At most 'rlen' bytes of
+ * the response data are read into 'data'.
+ */
+int recv_rsp(int sockfd, struct sd_rsp *rsp, void *data, unsigned int rlen,
+	     bool (*need_retry)(uint32_t epoch), uint32_t epoch)
+{
+	int ret;
 
 	ret = do_read(sockfd, rsp, sizeof(*rsp), need_retry, epoch);
 	if (ret) {
@@ -420,6 +533,26 @@ int exec_req(int sockfd, struct sd_req *hdr, void *data,
 	return 0;
 }
 
+int exec_req(int sockfd, struct sd_req *hdr, void *data,
+	     bool (*need_retry)(uint32_t epoch), uint32_t epoch)
+{
+	struct sd_rsp *rsp = (struct sd_rsp *)hdr;
+	unsigned int wlen, rlen;
+
+	if (hdr->flags & SD_FLAG_CMD_WRITE) {
+		wlen = hdr->data_length;
+		rlen = 0;
+	} else {
+		wlen = 0;
+		rlen = hdr->data_length;
+	}
+
+	if (send_req(sockfd, hdr, data, wlen, need_retry, epoch))
+		return 1;
+
+	return recv_rsp(sockfd, rsp, data, rlen, need_retry, epoch);
+}
+
 char *addr_to_str(char *str, int size, const uint8_t *addr, uint16_t port)
 {
 	int af = AF_INET6;
@@ -497,6 +630,13 @@ int set_nonblocking(int fd)
 	return ret;
 }
 
+int set_zerocopy(int fd)
+{
+	int opt = 1;
+
+	return setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &opt, sizeof(opt));
+}
+
 int set_snd_timeout(int fd)
 {
 	struct timeval timeout;
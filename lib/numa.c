@@ -0,0 +1,301 @@
+/*
+ * Copyright (C) 2013 Taobao Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The node of every CPU is read once from /sys/devices/system/node.  Threads
+ * are placed by name: the work queues and the network threads look up their
+ * placement when they start a thread, and each thread binds itself.  With the
+ * spread policy the n-th thread of a group goes to node n % nr_nodes.  The
+ * NIC policy binds the threads to the nodes of the NIC, i.e. to its PCI node,
+ * or else to the nodes of the CPUs its MSI interrupts are routed to, so that
+ * the requests are processed next to the memory they were received into.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <limits.h>
+#include <syscall.h>
+#include <unistd.h>
+
+#include "numa.h"
+#include "util.h"
+#include "logger.h"
+
+#define MAX_PLACEMENTS 32
+
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED 1
+#endif
+
+static int nr_nodes = 1;
+static short cpu_node[CPU_SETSIZE];
+static cpu_set_t node_cpus[NUMA_MAX_NODES];
+static pthread_once_t numa_once = PTHREAD_ONCE_INIT;
+
+static struct thread_placement {
+	char name[32];
+	struct cpu_placement p;
+} placements[MAX_PLACEMENTS];
+static int nr_placements;
+
+/* Parse a CPU list like "0-3,8,10-11" */
+static int parse_cpulist(const char *list, cpu_set_t *set)
+{
+	long first, last;
+	char *p;
+
+	CPU_ZERO(set);
+	while (*list && *list != '\n') {
+		first = strtol(list, &p, 10);
+		if (p == list)
+			return -1;
+		last = first;
+		if (*p == '-') {
+			list = p + 1;
+			last = strtol(list, &p, 10);
+			if (p == list)
+				return -1;
+		}
+		if (first < 0 || last < first || last >= CPU_SETSIZE)
+			return -1;
+		for (; first <= last; first++)
+			CPU_SET(first, set);
+
+		if (*p == ',')
+			p++;
+		else if (*p && *p != '\n')
+			return -1;
+		list = p;
+	}
+
+	return CPU_COUNT(set) ? 0 : -1;
+}
+
+static int read_cpulist(const char *path, cpu_set_t *set)
+{
+	char buf[4096];
+	FILE *fp;
+	int ret = -1;
+
+	fp = fopen(path, "r");
+	if (!fp)
+		return -1;
+	if (fgets(buf, sizeof(buf), fp))
+		ret = parse_cpulist(buf, set);
+	fclose(fp);
+
+	return ret;
+}
+
+static void numa_init(void)
+{
+	char path[PATH_MAX];
+	int node, cpu;
+
+	for (node = 0; node < NUMA_MAX_NODES; node++) {
+		snprintf(path, sizeof(path),
+			 "/sys/devices/system/node/node%d/cpulist", node);
+		if (read_cpulist(path, node_cpus + node) < 0)
+			break;
+		for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+			if (CPU_ISSET(cpu, node_cpus + node))
+				cpu_node[cpu] = node;
+	}
+
+	if (node > 1)
+		nr_nodes = node;
+	else {
+		/* No NUMA, or no sysfs.  Everything is on node 0. */
+		CPU_ZERO(node_cpus);
+		for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+			CPU_SET(cpu, node_cpus);
+	}
+}
+
+int numa_nr_nodes(void)
+{
+	pthread_once(&numa_once, numa_init);
+	return nr_nodes;
+}
+
+int numa_node_of_cpu(int cpu)
+{
+	pthread_once(&numa_once, numa_init);
+	if (cpu < 0 || cpu >= CPU_SETSIZE)
+		return 0;
+	return cpu_node[cpu];
+}
+
+int numa_current_node(void)
+{
+	if (numa_nr_nodes() == 1)
+		return 0;
+	return numa_node_of_cpu(sched_getcpu());
+}
+
+/* Prefer 'node' for the pages of the range which are not touched yet */
+int numa_bind_memory(void *addr, size_t len, int node)
+{
+	unsigned long mask = 1UL << node;
+
+	if (numa_nr_nodes() == 1)
+		return 0;
+
+	return syscall(SYS_mbind, addr, len, MPOL_PREFERRED, &mask,
+		       NUMA_MAX_NODES + 1, 0);
+}
+
+/* Add the CPUs of the nodes the CPUs in 'set' belong to */
+static void expand_to_nodes(cpu_set_t *set)
+{
+	cpu_set_t nodes;
+	int cpu;
+
+	CPU_ZERO(&nodes);
+	for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+		if (CPU_ISSET(cpu, set))
+			CPU_OR(&nodes, &nodes, node_cpus + cpu_node[cpu]);
+	*set = nodes;
+}
+
+static int nic_cpus(const char *ifname, cpu_set_t *set)
+{
+	char path[PATH_MAX];
+	struct dirent *d;
+	cpu_set_t irq;
+	FILE *fp;
+	DIR *dir;
+	int node = -1;
+
+	pthread_once(&numa_once, numa_init);
+
+	snprintf(path, sizeof(path), "/sys/class/net/%s/device/numa_node",
+		 ifname);
+	fp = fopen(path, "r");
+	if (fp) {
+		if (fscanf(fp, "%d", &node) != 1)
+			node = -1;
+		fclose(fp);
+	}
+	if (0 <= node && node < nr_nodes) {
+		*set = node_cpus[node];
+		return 0;
+	}
+
+	/* Follow the CPUs which the interrupts of the NIC go to */
+	CPU_ZERO(set);
+	snprintf(path, sizeof(path), "/sys/class/net/%s/device/msi_irqs",
+		 ifname);
+	dir = opendir(path);
+	if (!dir)
+		return -1;
+	while ((d = readdir(dir))) {
+		if (!is_numeric(d->d_name))
+			continue;
+		snprintf(path, sizeof(path),
+			 "/proc/irq/%s/smp_affinity_list", d->d_name);
+		if (read_cpulist(path, &irq) == 0)
+			CPU_OR(set, set, &irq);
+	}
+	closedir(dir);
+
+	if (!CPU_COUNT(set))
+		return -1;
+
+	expand_to_nodes(set);
+	return 0;
+}
+
+/*
+ * Parse "none", "spread", "pin:<cpu list>" or "nic:<interface>".  Return -1
+ * if 'arg' is invalid.
+ */
+int parse_cpu_placement(const char *arg, struct cpu_placement *p)
+{
+	memset(p, 0, sizeof(*p));
+
+	if (!strcmp(arg, "none"))
+		p->policy = CPU_PLACE_NONE;
+	else if (!strcmp(arg, "spread"))
+		p->policy = CPU_PLACE_SPREAD;
+	else if (!strncmp(arg, "pin:", 4)) {
+		p->policy = CPU_PLACE_PIN;
+		if (parse_cpulist(arg + 4, &p->cpus) < 0)
+			return -1;
+	} else if (!strncmp(arg, "nic:", 4)) {
+		p->policy = CPU_PLACE_NIC;
+		if (nic_cpus(arg + 4, &p->cpus) < 0) {
+			sd_eprintf("cannot find the CPUs of %s", arg + 4);
+			return -1;
+		}
+	} else
+		return -1;
+
+	return 0;
+}
+
+/* Bind 'thread', the 'idx'-th thread of its group, as 'p' says */
+int place_thread(pthread_t thread, const struct cpu_placement *p, int idx)
+{
+	const cpu_set_t *set;
+	int ret;
+
+	switch (p->policy) {
+	case CPU_PLACE_NONE:
+		return 0;
+	case CPU_PLACE_SPREAD:
+		set = node_cpus + idx % numa_nr_nodes();
+		break;
+	default:
+		set = &p->cpus;
+		break;
+	}
+
+	ret = pthread_setaffinity_np(thread, sizeof(*set), set);
+	if (ret) {
+		sd_eprintf("failed to set the CPU affinity, %s",
+			   strerror(ret));
+		return -1;
+	}
+
+	return 0;
+}
+
+int set_thread_placement(const char *name, const struct cpu_placement *p)
+{
+	int i;
+
+	for (i = 0; i < nr_placements; i++)
+		if (!strcmp(placements[i].name, name))
+			break;
+
+	if (i == MAX_PLACEMENTS || strlen(name) >= sizeof(placements[i].name))
+		return -1;
+	if (i == nr_placements)
+		nr_placements++;
+
+	pstrcpy(placements[i].name, sizeof(placements[i].name), name);
+	placements[i].p = *p;
+	return 0;
+}
+
+/* Placements are set up before any thread starts, so no lock is needed */
+const struct cpu_placement *find_thread_placement(const char *name)
+{
+	int i;
+
+	for (i = 0; i < nr_placements; i++)
+		if (!strcmp(placements[i].name, name))
+			return &placements[i].p;
+
+	return NULL;
+}
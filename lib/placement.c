@@ -0,0 +1,204 @@
+/*
+ * Copyright (C) 2013 Taobao Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "sheepdog_proto.h"
+#include "sheep.h"
+
+/*
+ * Vnode ring
+ *
+ * Every node gets nr_vnodes points on a hash ring, and the copies of an object
+ * go to the zone distinct vnodes which follow the hash of its oid.
+ *
+ * The hash space is split into buckets, and buckets[b] is the first vnode
+ * whose id falls in bucket 'b' or after it, so the first vnode of an oid is
+ * found with a short scan instead of a binary search.  The copies of an
+ * object only depend on its first vnode, so 'tuples' keeps the nodes picked
+ * for every first vnode, 'nr_copies' entries each.
+ */
+struct vnode_ring {
+	struct sd_vnode *vnodes;
+	uint64_t *ids;		/* ids of 'vnodes' packed for the lookups */
+	int nr_vnodes;
+
+	int nr_copies;
+	int bucket_shift;
+	uint32_t *buckets;
+	uint16_t *tuples;
+};
+
+/* Count the zones of the ring, up to SD_MAX_COPIES */
+static int get_vnode_zones_nr(const struct sd_vnode *entries, int nr_entries)
+{
+	uint32_t zones[SD_MAX_COPIES];
+	int nr_zones = 0, i, j;
+
+	for (i = 0; i < nr_entries && nr_zones < SD_MAX_COPIES; i++) {
+		for (j = 0; j < nr_zones; j++)
+			if (zones[j] == entries[i].zone)
+				break;
+		if (j == nr_zones)
+			zones[nr_zones++] = entries[i].zone;
+	}
+
+	return nr_zones;
+}
+
+/*
+ * The nodes in the table are the same as what get_vnode_first_idx() and
+ * get_vnode_next_idx() pick.
+ */
+static void *ring_init(const struct vnode_info *vinfo)
+{
+	struct vnode_ring *ring;
+	int bits = 1, nr_buckets, nr, b, i, j, idxs[SD_MAX_COPIES];
+
+	nr = nodes_to_vnodes(vinfo->nodes, vinfo->nr_nodes, NULL);
+	if (!nr)
+		return NULL;
+
+	ring = xzalloc(sizeof(*ring));
+	ring->vnodes = xmalloc((sizeof(*ring->vnodes) + sizeof(*ring->ids)) *
+			       nr);
+	ring->ids = (uint64_t *)(ring->vnodes + nr);
+	ring->nr_vnodes = nodes_to_vnodes(vinfo->nodes, vinfo->nr_nodes,
+					  ring->vnodes);
+	for (i = 0; i < nr; i++)
+		ring->ids[i] = ring->vnodes[i].id;
+
+	while ((1 << bits) < nr)
+		bits++;
+	nr_buckets = 1 << bits;
+
+	ring->nr_copies = get_vnode_zones_nr(ring->vnodes, nr);
+	ring->bucket_shift = 64 - bits;
+	ring->buckets = xmalloc(sizeof(*ring->buckets) * nr_buckets);
+	ring->tuples = xmalloc(sizeof(*ring->tuples) * nr * ring->nr_copies);
+
+	for (b = 0, i = 0; b < nr_buckets; b++) {
+		uint64_t start = (uint64_t)b << ring->bucket_shift;
+
+		while (i < nr && ring->ids[i] < start)
+			i++;
+		ring->buckets[b] = i;
+	}
+
+	for (i = 0; i < nr; i++) {
+		idxs[0] = i;
+		for (j = 1; j < ring->nr_copies; j++)
+			idxs[j] = get_vnode_next_idx(ring->vnodes, nr, idxs, j);
+		for (j = 0; j < ring->nr_copies; j++)
+			ring->tuples[i * ring->nr_copies + j] =
+				ring->vnodes[idxs[j]].node_idx;
+	}
+
+	return ring;
+}
+
+static void ring_exit(void *state)
+{
+	struct vnode_ring *ring = state;
+
+	if (!ring)
+		return;
+
+	free(ring->vnodes);
+	free(ring->buckets);
+	free(ring->tuples);
+	free(ring);
+}
+
+static void ring_oid_to_nodes(const struct vnode_info *vinfo, uint64_t oid,
+			      int nr_copies, int *idxs)
+{
+	const struct vnode_ring *ring = vinfo->placement;
+	const struct sd_vnode *vnodes[SD_MAX_COPIES];
+	const uint16_t *tuple;
+	uint64_t id;
+	int i, idx;
+
+	if (!nr_copies)
+		return;
+
+	if (nr_copies > ring->nr_copies) {
+		oid_to_vnodes(ring->vnodes, ring->nr_vnodes, oid, nr_copies,
+			      vnodes);
+		for (i = 0; i < nr_copies; i++)
+			idxs[i] = vnodes[i]->node_idx;
+		return;
+	}
+
+	id = fnv_64a_buf(&oid, sizeof(oid), FNV1A_64_INIT);
+	idx = ring->buckets[id >> ring->bucket_shift];
+	while (idx < ring->nr_vnodes && ring->ids[idx] < id)
+		idx++;
+
+	tuple = ring->tuples + (idx % ring->nr_vnodes) * ring->nr_copies;
+	for (i = 0; i < nr_copies; i++)
+		idxs[i] = tuple[i];
+}
+
+static const struct placement_driver ring_placement = {
+	.name = "ring",
+	.id = 0,
+	.init = ring_init,
+	.exit = ring_exit,
+	.oid_to_nodes = ring_oid_to_nodes,
+};
+
+extern const struct placement_driver straw2_placement;
+
+/*
+ * The drivers are listed here rather than registered by constructors, which
+ * the linker would drop together with the unreferenced objects of the
+ * library.
+ */
+static const struct placement_driver *placement_drivers[] = {
+	&ring_placement,
+	&straw2_placement,
+};
+
+const struct placement_driver *find_placement_driver(const char *name)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(placement_drivers); i++)
+		if (strcmp(placement_drivers[i]->name, name) == 0)
+			return placement_drivers[i];
+
+	return NULL;
+}
+
+const struct placement_driver *get_placement_driver(int id)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(placement_drivers); i++)
+		if (placement_drivers[i]->id == id)
+			return placement_drivers[i];
+
+	return NULL;
+}
+
+/* Set up the placement of vinfo->nodes, which must be sorted */
+void placement_init(struct vnode_info *vinfo,
+		    const struct placement_driver *pdrv)
+{
+	vinfo->pdrv = pdrv;
+	vinfo->placement = pdrv->init(vinfo);
+}
+
+void placement_exit(struct vnode_info *vinfo)
+{
+	if (vinfo->pdrv)
+		vinfo->pdrv->exit(vinfo->placement);
+	vinfo->pdrv = NULL;
+	vinfo->placement = NULL;
+}
@@ -0,0 +1,185 @@
+/*
+ * Copyright (C) 2013 Taobao Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Weighted rendezvous hashing (straw2)
+ *
+ * Every node draws a straw ln(u) / weight for an object, where u is a hash of
+ * the object and the node in (0, 1] and the weight is the number of vnodes of
+ * the node.  The object goes to the nodes with the longest straws in distinct
+ * zones.  The straw of a node doesn't depend on the other nodes, so adding,
+ * removing or reweighting a node only moves the copies which it wins or
+ * loses, which is the minimum to keep the placement proportional to the
+ * weights.
+ *
+ * ln(u) is computed in fixed point with integers only, so that every sheep
+ * gets the same placement whatever its libm is.  A lookup costs a hash per
+ * node with vnodes.
+ */
+#include "sheepdog_proto.h"
+#include "sheep.h"
+
+#define LOG2_TBL_BITS 8
+
+struct straw2_node {
+	uint64_t seed;
+	uint32_t weight;
+	uint32_t zone;
+	int idx;
+};
+
+struct straw2 {
+	int nr_nodes;
+	struct straw2_node nodes[];
+};
+
+/* log2(1 + i / 256) in 16.16 fixed point */
+static uint32_t log2_tbl[(1 << LOG2_TBL_BITS) + 1];
+
+/* Compute the table bit by bit by squaring, in 2.30 fixed point */
+static void __attribute__((constructor)) straw2_init_tbl(void)
+{
+	int i, b;
+
+	for (i = 0; i < (1 << LOG2_TBL_BITS); i++) {
+		uint64_t y = (uint64_t)((1 << LOG2_TBL_BITS) + i) <<
+			(30 - LOG2_TBL_BITS);
+		uint32_t l = 0;
+
+		for (b = 15; b >= 0; b--) {
+			y = (y * y) >> 30;
+			if (y >= (2ULL << 30)) {
+				y >>= 1;
+				l |= 1U << b;
+			}
+		}
+		log2_tbl[i] = l;
+	}
+	log2_tbl[1 << LOG2_TBL_BITS] = 1 << 16;
+}
+
+/* log2(x) in 16.16 fixed point, x must not be zero */
+static inline uint32_t log2_fixed(uint64_t x)
+{
+	int n = 63 - __builtin_clzll(x);
+	uint32_t m, i, r;
+
+	/* The 15 bits below the leading one */
+	if (n >= 15)
+		m = (x >> (n - 15)) & 0x7fff;
+	else
+		m = (x << (15 - n)) & 0x7fff;
+	i = m >> (15 - LOG2_TBL_BITS);
+	r = m & ((1 << (15 - LOG2_TBL_BITS)) - 1);
+
+	return (n << 16) + log2_tbl[i] +
+		(((log2_tbl[i + 1] - log2_tbl[i]) * r) >> (15 - LOG2_TBL_BITS));
+}
+
+/* The finalizer of MurmurHash3 */
+static inline uint64_t mix64(uint64_t h)
+{
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+/* -ln(u) / weight, scaled; the longest straw has the smallest value */
+static inline uint64_t straw2_draw(uint64_t h, const struct straw2_node *n)
+{
+	uint64_t u = (mix64(h ^ n->seed) >> 16) + 1;	/* (0, 2^48] */
+	uint64_t l = (48ULL << 16) - log2_fixed(u);	/* -log2(u / 2^48) */
+
+	return (l << 32) / n->weight;
+}
+
+static void *straw2_init(const struct vnode_info *vinfo)
+{
+	struct straw2 *s;
+	int i;
+
+	s = xzalloc(sizeof(*s) + sizeof(s->nodes[0]) * vinfo->nr_nodes);
+	for (i = 0; i < vinfo->nr_nodes; i++) {
+		const struct sd_node *node = vinfo->nodes + i;
+		struct straw2_node *n = s->nodes + s->nr_nodes;
+
+		if (!node->nr_vnodes)
+			continue;
+
+		n->seed = fnv_64a_buf(&node->nid, sizeof(node->nid),
+				      FNV1A_64_INIT);
+		n->weight = node->nr_vnodes;
+		n->zone = node->zone;
+		n->idx = i;
+		s->nr_nodes++;
+	}
+
+	return s;
+}
+
+static void straw2_exit(void *state)
+{
+	free(state);
+}
+
+/*
+ * Keep the best draw of every zone among the 'nr_copies' best zones, sorted.
+ * A zone which drops out can come back later with a better draw of another
+ * node, so this is the same as walking all the nodes in the order of their
+ * draws and skipping the zones already picked.
+ */
+static void straw2_oid_to_nodes(const struct vnode_info *vinfo, uint64_t oid,
+				int nr_copies, int *idxs)
+{
+	const struct straw2 *s = vinfo->placement;
+	uint64_t draws[SD_MAX_COPIES], h = mix64(oid), d;
+	uint32_t zones[SD_MAX_COPIES];
+	int i, j, nr = 0;
+
+	for (i = 0; i < s->nr_nodes; i++) {
+		const struct straw2_node *n = s->nodes + i;
+
+		d = straw2_draw(h, n);
+
+		for (j = 0; j < nr; j++)
+			if (zones[j] == n->zone)
+				break;
+		if (j < nr) {
+			if (d >= draws[j])
+				continue;
+		} else if (nr < nr_copies)
+			j = nr++;
+		else if (nr && d < draws[nr - 1])
+			j = nr - 1;
+		else
+			continue;
+
+		for (; j > 0 && draws[j - 1] > d; j--) {
+			draws[j] = draws[j - 1];
+			zones[j] = zones[j - 1];
+			idxs[j] = idxs[j - 1];
+		}
+		draws[j] = d;
+		zones[j] = n->zone;
+		idxs[j] = n->idx;
+	}
+}
+
+const struct placement_driver straw2_placement = {
+	.name = "straw2",
+	.id = 1,
+	.init = straw2_init,
+	.exit = straw2_exit,
+	.oid_to_nodes = straw2_oid_to_nodes,
+};
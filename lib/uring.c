@@ -0,0 +1,189 @@
+/*
+ * Copyright (C) 2013 Taobao Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "util.h"
+#include "logger.h"
+#include "uring.h"
+
+static inline int io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static inline int io_uring_enter(int fd, unsigned to_submit,
+				 unsigned min_complete, unsigned flags,
+				 void *arg, size_t argsz)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+		       arg, argsz);
+}
+
+int uring_init(struct uring *ring, unsigned entries)
+{
+	struct io_uring_params p;
+	void *sqes;
+
+	memset(ring, 0, sizeof(*ring));
+	memset(&p, 0, sizeof(p));
+
+	ring->fd = io_uring_setup(entries, &p);
+	if (ring->fd < 0) {
+		sd_eprintf("failed to set up io_uring, %m");
+		return -1;
+	}
+
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP) ||
+	    !(p.features & IORING_FEAT_NODROP) ||
+	    !(p.features & IORING_FEAT_EXT_ARG)) {
+		sd_eprintf("io_uring of this kernel is too old");
+		goto err;
+	}
+
+	ring->ring_size = max(p.sq_off.array + p.sq_entries * sizeof(unsigned),
+			      p.cq_off.cqes +
+			      p.cq_entries * sizeof(struct io_uring_cqe));
+	ring->ring_mem = mmap(NULL, ring->ring_size, PROT_READ | PROT_WRITE,
+			      MAP_SHARED | MAP_POPULATE, ring->fd,
+			      IORING_OFF_SQ_RING);
+	if (ring->ring_mem == MAP_FAILED) {
+		sd_eprintf("failed to map io_uring, %m");
+		goto err;
+	}
+
+	sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+		    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		    ring->fd, IORING_OFF_SQES);
+	if (sqes == MAP_FAILED) {
+		sd_eprintf("failed to map io_uring sqes, %m");
+		munmap(ring->ring_mem, ring->ring_size);
+		goto err;
+	}
+
+	ring->sq_head = (unsigned *)((char *)ring->ring_mem + p.sq_off.head);
+	ring->sq_tail = (unsigned *)((char *)ring->ring_mem + p.sq_off.tail);
+	ring->sq_mask = (unsigned *)((char *)ring->ring_mem +
+				     p.sq_off.ring_mask);
+	ring->sq_array = (unsigned *)((char *)ring->ring_mem + p.sq_off.array);
+	ring->sqes = sqes;
+	ring->sq_entries = p.sq_entries;
+	ring->sqe_tail = *ring->sq_tail;
+
+	ring->cq_head = (unsigned *)((char *)ring->ring_mem + p.cq_off.head);
+	ring->cq_tail = (unsigned *)((char *)ring->ring_mem + p.cq_off.tail);
+	ring->cq_mask = (unsigned *)((char *)ring->ring_mem +
+				     p.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)((char *)ring->ring_mem +
+					     p.cq_off.cqes);
+
+	return 0;
+err:
+	close(ring->fd);
+	ring->fd = -1;
+	return -1;
+}
+
+void uring_exit(struct uring *ring)
+{
+	if (ring->fd < 0)
+		return;
+
+	munmap(ring->sqes, ring->sq_entries * sizeof(struct io_uring_sqe));
+	munmap(ring->ring_mem, ring->ring_size);
+	close(ring->fd);
+	ring->fd = -1;
+}
+
+/* Return a cleared sqe, or NULL if the submission queue is full */
+struct io_uring_sqe *uring_get_sqe(struct uring *ring)
+{
+	unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	struct io_uring_sqe *sqe;
+	unsigned idx;
+
+	if (ring->sqe_tail - head >= ring->sq_entries)
+		return NULL;
+
+	idx = ring->sqe_tail & *ring->sq_mask;
+	ring->sq_array[idx] = idx;
+	ring->sqe_tail++;
+
+	sqe = ring->sqes + idx;
+	memset(sqe, 0, sizeof(*sqe));
+	return sqe;
+}
+
+/*
+ * Submit the prepared sqes and wait for 'wait_nr' completions at most
+ * 'timeout' milliseconds, or forever if it is negative.  Return the number of
+ * the submitted sqes, or a negative errno.  -ETIME and -EINTR mean that the
+ * wait ended early.
+ */
+int uring_submit(struct uring *ring, unsigned wait_nr, int timeout)
+{
+	unsigned tail = *ring->sq_tail, to_submit = ring->sqe_tail - tail;
+	struct io_uring_getevents_arg arg;
+	struct __kernel_timespec ts;
+	unsigned flags = 0;
+	int ret;
+
+	__atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+
+	if (!wait_nr && !to_submit)
+		return 0;
+	if (wait_nr) {
+		flags |= IORING_ENTER_GETEVENTS;
+		if (timeout >= 0) {
+			ts.tv_sec = timeout / 1000;
+			ts.tv_nsec = (timeout % 1000) * 1000000LL;
+			memset(&arg, 0, sizeof(arg));
+			arg.ts = (unsigned long)&ts;
+			flags |= IORING_ENTER_EXT_ARG;
+		}
+	}
+
+	ret = io_uring_enter(ring->fd, to_submit, wait_nr, flags,
+			     (flags & IORING_ENTER_EXT_ARG) ? &arg : NULL,
+			     (flags & IORING_ENTER_EXT_ARG) ? sizeof(arg) : 0);
+	return ret < 0 ? -errno : ret;
+}
+
+struct io_uring_cqe *uring_peek_cqe(struct uring *ring)
+{
+	unsigned head = *ring->cq_head;
+
+	if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+		return NULL;
+
+	return ring->cqes + (head & *ring->cq_mask);
+}
+
+void uring_cqe_seen(struct uring *ring)
+{
+	__atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+/* Check if this kernel has an io_uring which we can use */
+bool uring_supported(void)
+{
+	struct uring ring;
+
+	if (uring_init(&ring, 2) < 0)
+		return false;
+
+	uring_exit(&ring);
+	return true;
+}
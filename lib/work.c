@@ -17,6 +17,7 @@
 #include <inttypes.h>
 #include <stdbool.h>
 #include <pthread.h>
+#include <semaphore.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <fcntl.h>
@@ -32,6 +33,7 @@
 #include "work.h"
 #include "logger.h"
 #include "event.h"
+#include "numa.h"
 
 /*
  * The protection period from shrinking work queue.  This is necessary
@@ -40,20 +42,90 @@
  */
 #define WQ_PROTECTION_PERIOD 1000 /* ms */
 
+#define WQ_INJECT_SIZE 4096	/* slots of the submission ring */
+#define WQ_DEQUE_SIZE 256	/* slots of the deque of a worker */
+#define WQ_MAX_DEQUES 256	/* the other workers go without a deque */
+#define WQ_BATCH 8		/* works taken from the ring at once */
+#define WQ_DONE_SIZE 256	/* slots of the completion ring of a worker */
+#define WQ_DONE_BUDGET 64	/* done() calls of a queue per event */
+
+/*
+ * Works are submitted to a bounded lock-free ring which any thread can push
+ * to and any worker can pop from, see Dmitry Vyukov's bounded MPMC queue.
+ * When the ring is full, works go to the overflow list until it drains, so
+ * the works of one submitter stay in order.
+ */
+struct inject_cell {
+	unsigned long seq;
+	struct work *work;
+};
+
+struct inject_ring {
+	unsigned long head __attribute__((aligned(64)));
+	unsigned long tail __attribute__((aligned(64)));
+	struct inject_cell cells[WQ_INJECT_SIZE];
+};
+
+/*
+ * Finished works are passed to the main thread in a single-producer,
+ * single-consumer ring per worker.
+ */
+struct done_ring {
+	unsigned long head __attribute__((aligned(64)));
+	unsigned long tail __attribute__((aligned(64)));
+	struct work *works[WQ_DONE_SIZE];
+};
+
+/*
+ * A worker takes a batch of works from the ring into its own deque.  Only
+ * the owner pushes to a deque, and the owner and the thieves take works from
+ * its head, so the works are run in the order they were queued.
+ */
+struct work_deque {
+	unsigned long head __attribute__((aligned(64)));
+	unsigned long tail;
+	bool in_use;
+	struct work *works[WQ_DEQUE_SIZE];
+	struct done_ring done;
+};
+
 struct worker_info {
 	const char *name;
 
+	/*
+	 * Each queue has its own event fd.  A worker writes to it only when
+	 * the main thread hasn't been notified since it last looked.
+	 */
+	int efd;
+	int notified;
+
+	/*
+	 * The workers without a deque, and those with a full completion ring,
+	 * put their works here.  The others follow while it is not empty.
+	 */
 	struct list_head finished_list;
-	struct list_head worker_info_siblings;
-
 	pthread_mutex_t finished_lock;
+	/* protected by uatomic primitives */
+	size_t nr_finished;
+
+	/* protects the number of threads and the protection period */
 	pthread_mutex_t startup_lock;
 
-	/* wokers sleep on this and signaled by tgtd */
-	pthread_cond_t pending_cond;
-	/* locked by tgtd and workers */
-	pthread_mutex_t pending_lock;
-	/* protected by pending_lock */
+	struct inject_ring *ring;
+
+	pthread_mutex_t overflow_lock;
+	struct list_head overflow_list;
+	/* protected by uatomic primitives */
+	size_t nr_overflow;
+
+	/* deques are never freed, the exiting workers leave them for reuse */
+	struct work_deque *deques[WQ_MAX_DEQUES];
+	int nr_deques;
+
+	/* idle workers sleep on this, see wq_wakeup() */
+	sem_t wakeup_sem;
+	int nr_sleepers;
+
 	struct work_queue q;
 	size_t nr_threads;
 
@@ -63,10 +135,12 @@ struct worker_info {
 	/* we cannot shrink work queue till this time */
 	uint64_t tm_end_of_protection;
 	enum wq_thread_control tc;
+
+	/* CPU placement of the workers, set up by set_thread_placement() */
+	const struct cpu_placement *placement;
+	int nr_placed;
 };
 
-static int efd;
-static LIST_HEAD(worker_info_list);
 static size_t nr_nodes = 1;
 static size_t (*wq_get_nr_nodes)(void);
 static void (*wq_create_cb)(pthread_t);
@@ -134,12 +208,10 @@ static int create_worker_threads(struct worker_info *wi, size_t nr_threads)
 	pthread_t thread;
 	int ret;
 
-	pthread_mutex_lock(&wi->startup_lock);
 	while (wi->nr_threads < nr_threads) {
 		ret = pthread_create(&thread, NULL, worker_routine, wi);
 		if (ret != 0) {
 			sd_eprintf("failed to create worker thread: %m");
-			pthread_mutex_unlock(&wi->startup_lock);
 			return -1;
 		}
 		if (wq_create_cb)
@@ -147,106 +219,446 @@ static int create_worker_threads(struct worker_info *wi, size_t nr_threads)
 		wi->nr_threads++;
 		sd_dprintf("create thread %s %zu", wi->name, wi->nr_threads);
 	}
-	pthread_mutex_unlock(&wi->startup_lock);
 
 	return 0;
 }
 
+static bool inject_push(struct inject_ring *r, struct work *work)
+{
+	unsigned long pos = __atomic_load_n(&r->tail, __ATOMIC_RELAXED), seq;
+	struct inject_cell *c;
+	long dif;
+
+	for (;;) {
+		c = &r->cells[pos & (WQ_INJECT_SIZE - 1)];
+		seq = __atomic_load_n(&c->seq, __ATOMIC_ACQUIRE);
+		dif = (long)seq - (long)pos;
+		if (dif == 0) {
+			if (__atomic_compare_exchange_n(&r->tail, &pos, pos + 1,
+							true, __ATOMIC_RELAXED,
+							__ATOMIC_RELAXED))
+				break;
+		} else if (dif < 0)
+			return false; /* full */
+		else
+			pos = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+	}
+
+	c->work = work;
+	__atomic_store_n(&c->seq, pos + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+static struct work *inject_pop(struct inject_ring *r)
+{
+	unsigned long pos = __atomic_load_n(&r->head, __ATOMIC_RELAXED), seq;
+	struct inject_cell *c;
+	struct work *work;
+	long dif;
+
+	for (;;) {
+		c = &r->cells[pos & (WQ_INJECT_SIZE - 1)];
+		seq = __atomic_load_n(&c->seq, __ATOMIC_ACQUIRE);
+		dif = (long)seq - (long)(pos + 1);
+		if (dif == 0) {
+			if (__atomic_compare_exchange_n(&r->head, &pos, pos + 1,
+							true, __ATOMIC_RELAXED,
+							__ATOMIC_RELAXED))
+				break;
+		} else if (dif < 0)
+			return NULL; /* empty */
+		else
+			pos = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+	}
+
+	work = c->work;
+	__atomic_store_n(&c->seq, pos + WQ_INJECT_SIZE, __ATOMIC_RELEASE);
+	return work;
+}
+
+static bool inject_empty(struct inject_ring *r)
+{
+	return __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) ==
+		__atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+}
+
+static bool deque_push(struct work_deque *dq, struct work *work)
+{
+	unsigned long t = dq->tail;
+
+	if (t - __atomic_load_n(&dq->head, __ATOMIC_ACQUIRE) >= WQ_DEQUE_SIZE)
+		return false;
+
+	__atomic_store_n(&dq->works[t & (WQ_DEQUE_SIZE - 1)], work,
+			 __ATOMIC_RELAXED);
+	__atomic_store_n(&dq->tail, t + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+/* Called by the owner and the thieves */
+static struct work *deque_pop(struct work_deque *dq)
+{
+	unsigned long h = __atomic_load_n(&dq->head, __ATOMIC_ACQUIRE);
+	struct work *work;
+
+	for (;;) {
+		if (h >= __atomic_load_n(&dq->tail, __ATOMIC_ACQUIRE))
+			return NULL;
+
+		/* the slot is reused only after the head moves on */
+		work = __atomic_load_n(&dq->works[h & (WQ_DEQUE_SIZE - 1)],
+				       __ATOMIC_RELAXED);
+		if (__atomic_compare_exchange_n(&dq->head, &h, h + 1, false,
+						__ATOMIC_ACQ_REL,
+						__ATOMIC_ACQUIRE))
+			return work;
+	}
+}
+
+static inline size_t deque_size(struct work_deque *dq)
+{
+	unsigned long h = __atomic_load_n(&dq->head, __ATOMIC_ACQUIRE);
+	unsigned long t = __atomic_load_n(&dq->tail, __ATOMIC_ACQUIRE);
+
+	return t > h ? t - h : 0;
+}
+
+static struct work_deque *get_deque(struct worker_info *wi)
+{
+	struct work_deque *dq;
+	int i, nr;
+
+	nr = __atomic_load_n(&wi->nr_deques, __ATOMIC_ACQUIRE);
+	for (i = 0; i < nr; i++) {
+		dq = wi->deques[i];
+		if (!__atomic_exchange_n(&dq->in_use, true, __ATOMIC_ACQ_REL))
+			return dq;
+	}
+
+	pthread_mutex_lock(&wi->startup_lock);
+	nr = wi->nr_deques;
+	if (nr == WQ_MAX_DEQUES) {
+		pthread_mutex_unlock(&wi->startup_lock);
+		return NULL;
+	}
+	dq = xzalloc(sizeof(*dq));
+	dq->in_use = true;
+	wi->deques[nr] = dq;
+	__atomic_store_n(&wi->nr_deques, nr + 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&wi->startup_lock);
+
+	return dq;
+}
+
+static inline void put_deque(struct work_deque *dq)
+{
+	if (dq)
+		__atomic_store_n(&dq->in_use, false, __ATOMIC_RELEASE);
+}
+
+/* Wake up a sleeping worker, if any */
+static void wq_wakeup(struct worker_info *wi)
+{
+	int n;
+
+	/* pairs with the barrier in worker_sleep() */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	n = uatomic_read(&wi->nr_sleepers);
+	while (n > 0) {
+		int old = uatomic_cmpxchg(&wi->nr_sleepers, n, n - 1);
+
+		if (old == n) {
+			sem_post(&wi->wakeup_sem);
+			return;
+		}
+		n = old;
+	}
+}
+
+static bool wq_has_work(struct worker_info *wi)
+{
+	int i, nr = __atomic_load_n(&wi->nr_deques, __ATOMIC_ACQUIRE);
+
+	if (!inject_empty(wi->ring) || uatomic_read(&wi->nr_overflow))
+		return true;
+
+	for (i = 0; i < nr; i++)
+		if (deque_size(wi->deques[i]))
+			return true;
+
+	return false;
+}
+
+static void worker_sleep(struct worker_info *wi)
+{
+	int n;
+
+	uatomic_inc(&wi->nr_sleepers);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	/* A work may have been queued before we were counted */
+	if (wq_has_work(wi)) {
+		n = uatomic_read(&wi->nr_sleepers);
+		while (n > 0) {
+			int old = uatomic_cmpxchg(&wi->nr_sleepers, n, n - 1);
+
+			if (old == n)
+				return;
+			n = old;
+		}
+		/* somebody is waking us up already, take the wakeup */
+	}
+
+	while (sem_wait(&wi->wakeup_sem) < 0 && errno == EINTR)
+		;
+}
+
 void queue_work(struct work_queue *q, struct work *work)
 {
 	struct worker_info *wi = container_of(q, struct worker_info, q);
 
 	uatomic_inc(&wi->nr_workers);
-	pthread_mutex_lock(&wi->pending_lock);
 
-	if (wq_need_grow(wi))
+	if (wq_need_grow(wi)) {
+		pthread_mutex_lock(&wi->startup_lock);
 		/* double the thread pool size */
-		create_worker_threads(wi, wi->nr_threads * 2);
+		if (wq_need_grow(wi))
+			create_worker_threads(wi, wi->nr_threads * 2);
+		pthread_mutex_unlock(&wi->startup_lock);
+	}
+
+	if (uatomic_read(&wi->nr_overflow) || !inject_push(wi->ring, work)) {
+		pthread_mutex_lock(&wi->overflow_lock);
+		list_add_tail(&work->w_list, &wi->overflow_list);
+		uatomic_inc(&wi->nr_overflow);
+		pthread_mutex_unlock(&wi->overflow_lock);
+	}
+
+	wq_wakeup(wi);
+}
+
+static bool done_push(struct done_ring *r, struct work *work)
+{
+	unsigned long t = r->tail;
+
+	if (t - __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) >= WQ_DONE_SIZE)
+		return false;
+
+	r->works[t & (WQ_DONE_SIZE - 1)] = work;
+	__atomic_store_n(&r->tail, t + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+static struct work *done_pop(struct done_ring *r)
+{
+	unsigned long h = r->head;
+	struct work *work;
+
+	if (h == __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE))
+		return NULL;
+
+	work = r->works[h & (WQ_DONE_SIZE - 1)];
+	__atomic_store_n(&r->head, h + 1, __ATOMIC_RELEASE);
+	return work;
+}
+
+static void work_done(struct worker_info *wi, struct work_deque *dq,
+		      struct work *work)
+{
+	eventfd_t value = 1;
 
-	list_add_tail(&work->w_list, &wi->q.pending_list);
-	pthread_mutex_unlock(&wi->pending_lock);
+	if (!dq || uatomic_read(&wi->nr_finished) ||
+	    !done_push(&dq->done, work)) {
+		pthread_mutex_lock(&wi->finished_lock);
+		list_add_tail(&work->w_list, &wi->finished_list);
+		uatomic_inc(&wi->nr_finished);
+		pthread_mutex_unlock(&wi->finished_lock);
+	}
 
-	pthread_cond_signal(&wi->pending_cond);
+	/* pairs with the exchange in worker_thread_request_done() */
+	if (!uatomic_xchg(&wi->notified, 1))
+		eventfd_write(wi->efd, value);
 }
 
+/*
+ * Call done() of the finished works of one queue, at most WQ_DONE_BUDGET of
+ * them so that a busy queue doesn't hold back the other events.
+ */
 static void worker_thread_request_done(int fd, int events, void *data)
 {
-	int ret;
-	struct worker_info *wi;
+	struct worker_info *wi = data;
 	struct work *work;
 	eventfd_t value;
 	LIST_HEAD(list);
+	int i, nr, budget = WQ_DONE_BUDGET;
 
 	if (wq_get_nr_nodes)
 		nr_nodes = wq_get_nr_nodes();
 
-	ret = eventfd_read(fd, &value);
-	if (ret < 0)
-		return;
+	eventfd_read(fd, &value);
+	/* the works finished from now on notify us again */
+	uatomic_xchg(&wi->notified, 0);
+
+	nr = __atomic_load_n(&wi->nr_deques, __ATOMIC_ACQUIRE);
+	for (i = 0; i < nr && budget; i++) {
+		while (budget && (work = done_pop(&wi->deques[i]->done))) {
+			work->done(work);
+			uatomic_dec(&wi->nr_workers);
+			budget--;
+		}
+	}
 
-	list_for_each_entry(wi, &worker_info_list, worker_info_siblings) {
+	if (budget && uatomic_read(&wi->nr_finished)) {
 		pthread_mutex_lock(&wi->finished_lock);
-		list_splice_init(&wi->finished_list, &list);
+		while (budget && !list_empty(&wi->finished_list)) {
+			work = list_first_entry(&wi->finished_list,
+						struct work, w_list);
+			list_move_tail(&work->w_list, &list);
+			budget--;
+		}
 		pthread_mutex_unlock(&wi->finished_lock);
 
 		while (!list_empty(&list)) {
 			work = list_first_entry(&list, struct work, w_list);
 			list_del(&work->w_list);
+			/* The rings take finished works again when drained */
+			uatomic_dec(&wi->nr_finished);
 
 			work->done(work);
 			uatomic_dec(&wi->nr_workers);
 		}
 	}
+
+	/* Come back after the other events if we ran out of the budget */
+	if (!budget)
+		eventfd_write(fd, 1);
+}
+
+static struct work *overflow_pop(struct worker_info *wi)
+{
+	struct work *work = NULL;
+
+	if (!uatomic_read(&wi->nr_overflow))
+		return NULL;
+
+	pthread_mutex_lock(&wi->overflow_lock);
+	if (!list_empty(&wi->overflow_list)) {
+		work = list_first_entry(&wi->overflow_list, struct work,
+					w_list);
+		list_del(&work->w_list);
+	}
+	pthread_mutex_unlock(&wi->overflow_lock);
+
+	/* The ring takes new works again once the list is drained */
+	if (work)
+		uatomic_dec(&wi->nr_overflow);
+
+	return work;
+}
+
+/*
+ * Take a batch of works from the ring, or steal half of the deque of another
+ * worker.  The first work is returned and the rest go to our deque.
+ */
+static struct work *fetch_works(struct worker_info *wi, struct work_deque *dq)
+{
+	struct work *first, *work;
+	int i, j, nr, nr_steal;
+
+	first = inject_pop(wi->ring);
+	if (first) {
+		for (i = 1; dq && i < WQ_BATCH; i++) {
+			work = inject_pop(wi->ring);
+			if (!work)
+				break;
+			if (!deque_push(dq, work)) {
+				/* can't happen, our deque was empty */
+				panic("work deque overflow");
+			}
+		}
+		return first;
+	}
+
+	first = overflow_pop(wi);
+	if (first)
+		return first;
+
+	nr = __atomic_load_n(&wi->nr_deques, __ATOMIC_ACQUIRE);
+	for (i = 0; i < nr; i++) {
+		struct work_deque *victim = wi->deques[i];
+
+		if (victim == dq)
+			continue;
+
+		first = deque_pop(victim);
+		if (!first)
+			continue;
+
+		nr_steal = deque_size(victim) / 2;
+		for (j = 0; dq && j < nr_steal; j++) {
+			work = deque_pop(victim);
+			if (!work)
+				break;
+			deque_push(dq, work);
+		}
+		return first;
+	}
+
+	return NULL;
 }
 
 static void *worker_routine(void *arg)
 {
 	struct worker_info *wi = arg;
+	struct work_deque *dq;
 	struct work *work;
-	eventfd_t value = 1;
 
 	set_thread_name(wi->name, (wi->tc != WQ_ORDERED));
 
+	if (wi->placement)
+		place_thread(pthread_self(), wi->placement,
+			     uatomic_add_return(&wi->nr_placed, 1) - 1);
+
 	pthread_mutex_lock(&wi->startup_lock);
 	/* started this thread */
 	pthread_mutex_unlock(&wi->startup_lock);
 
-	pthread_mutex_lock(&wi->pending_lock);
-	pthread_mutex_unlock(&wi->pending_lock);
+	/* An ordered queue has one worker and takes works in order anyway */
+	dq = get_deque(wi);
 
 	while (true) {
+		work = dq ? deque_pop(dq) : NULL;
+		if (!work)
+			work = fetch_works(wi, dq);
+
+		if (!work) {
+			pthread_mutex_lock(&wi->startup_lock);
+			if (wq_need_shrink(wi)) {
+				wi->nr_threads--;
+				if (wq_destroy_cb)
+					wq_destroy_cb(pthread_self());
+				pthread_mutex_unlock(&wi->startup_lock);
+				put_deque(dq);
+				pthread_detach(pthread_self());
+				sd_dprintf("destroy thread %s %d, %zu", wi->name,
+					   gettid(), wi->nr_threads);
+				break;
+			}
+			pthread_mutex_unlock(&wi->startup_lock);
 
-		pthread_mutex_lock(&wi->pending_lock);
-		if (wq_need_shrink(wi)) {
-			wi->nr_threads--;
-			if (wq_destroy_cb)
-				wq_destroy_cb(pthread_self());
-			pthread_mutex_unlock(&wi->pending_lock);
-			pthread_detach(pthread_self());
-			sd_dprintf("destroy thread %s %d, %zu", wi->name,
-				   gettid(), wi->nr_threads);
-			break;
-		}
-retest:
-		if (list_empty(&wi->q.pending_list)) {
-			pthread_cond_wait(&wi->pending_cond, &wi->pending_lock);
-			goto retest;
+			worker_sleep(wi);
+			continue;
 		}
 
-		work = list_first_entry(&wi->q.pending_list,
-				       struct work, w_list);
-
-		list_del(&work->w_list);
-		pthread_mutex_unlock(&wi->pending_lock);
+		/* Let an idle worker steal the rest of our batch */
+		if (dq && deque_size(dq))
+			wq_wakeup(wi);
 
 		if (work->fn)
 			work->fn(work);
 
-		pthread_mutex_lock(&wi->finished_lock);
-		list_add_tail(&work->w_list, &wi->finished_list);
-		pthread_mutex_unlock(&wi->finished_lock);
-
-		eventfd_write(efd, value);
+		work_done(wi, dq, work);
 	}
 
 	pthread_exit(NULL);
@@ -255,8 +667,6 @@ retest:
 int init_work_queue(size_t (*get_nr_nodes)(void), void (*create_cb)(pthread_t),
 		    void (*destroy_cb)(pthread_t))
 {
-	int ret;
-
 	wq_get_nr_nodes = get_nr_nodes;
 	wq_create_cb = create_cb;
 	wq_destroy_cb = destroy_cb;
@@ -264,19 +674,6 @@ int init_work_queue(size_t (*get_nr_nodes)(void), void (*create_cb)(pthread_t),
 	if (wq_get_nr_nodes)
 		nr_nodes = wq_get_nr_nodes();
 
-	efd = eventfd(0, EFD_NONBLOCK);
-	if (efd < 0) {
-		sd_eprintf("failed to create an event fd: %m");
-		return 1;
-	}
-
-	ret = register_event(efd, worker_thread_request_done, NULL);
-	if (ret) {
-		sd_eprintf("failed to register event fd %m");
-		close(efd);
-		return 1;
-	}
-
 	return 0;
 }
 
@@ -294,35 +691,58 @@ int init_work_queue(size_t (*get_nr_nodes)(void), void (*create_cb)(pthread_t),
 struct work_queue *create_work_queue(const char *name,
 				     enum wq_thread_control tc)
 {
-	int ret;
+	int ret, i;
 	struct worker_info *wi;
 
 	wi = xzalloc(sizeof(*wi));
 	wi->name = name;
 	wi->tc = tc;
+	wi->placement = find_thread_placement(name);
+
+	wi->ring = xvalloc(sizeof(*wi->ring));
+	memset(wi->ring, 0, sizeof(*wi->ring));
+	for (i = 0; i < WQ_INJECT_SIZE; i++)
+		wi->ring->cells[i].seq = i;
 
-	INIT_LIST_HEAD(&wi->q.pending_list);
+	INIT_LIST_HEAD(&wi->overflow_list);
 	INIT_LIST_HEAD(&wi->finished_list);
 
-	pthread_cond_init(&wi->pending_cond, NULL);
+	sem_init(&wi->wakeup_sem, 0, 0);
+
+	wi->efd = eventfd(0, EFD_NONBLOCK);
+	if (wi->efd < 0) {
+		sd_eprintf("failed to create an event fd: %m");
+		goto free_wi;
+	}
+
+	ret = register_event(wi->efd, worker_thread_request_done, wi);
+	if (ret) {
+		sd_eprintf("failed to register event fd %m");
+		goto close_efd;
+	}
 
 	pthread_mutex_init(&wi->finished_lock, NULL);
-	pthread_mutex_init(&wi->pending_lock, NULL);
+	pthread_mutex_init(&wi->overflow_lock, NULL);
 	pthread_mutex_init(&wi->startup_lock, NULL);
 
+	pthread_mutex_lock(&wi->startup_lock);
 	ret = create_worker_threads(wi, 1);
+	pthread_mutex_unlock(&wi->startup_lock);
 	if (ret < 0)
 		goto destroy_threads;
 
-	list_add(&wi->worker_info_siblings, &worker_info_list);
-
 	return &wi->q;
 destroy_threads:
-	pthread_mutex_unlock(&wi->startup_lock);
-	pthread_cond_destroy(&wi->pending_cond);
-	pthread_mutex_destroy(&wi->pending_lock);
+	pthread_mutex_destroy(&wi->overflow_lock);
 	pthread_mutex_destroy(&wi->startup_lock);
 	pthread_mutex_destroy(&wi->finished_lock);
+	unregister_event(wi->efd);
+close_efd:
+	close(wi->efd);
+free_wi:
+	sem_destroy(&wi->wakeup_sem);
+	free(wi->ring);
+	free(wi);
 
 	return NULL;
 }
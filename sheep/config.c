@@ -17,7 +17,7 @@
 
 #include "sheep_priv.h"
 
-#define SD_FORMAT_VERSION 0x0002
+#define SD_FORMAT_VERSION 0x0003
 #define SD_CONFIG_SIZE 40
 
 static struct sheepdog_config {
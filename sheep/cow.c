@@ -0,0 +1,299 @@
+/*
+ * Copyright (C) 2013 Taobao Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Block granular copy-on-write
+ *
+ * The first write to a cloned object doesn't copy the whole base object.  The
+ * new object only gets the blocks covered by the write, and its COW map
+ * records the base object and which blocks are written.  Reads of the other
+ * blocks are redirected to the base object, and the map is dropped once every
+ * block of the object is written.
+ */
+#include <pthread.h>
+
+#include "sheep_priv.h"
+
+#define COW_NR_LOCKS 64
+
+/* Serialize the updates of the COW map of the same object */
+static pthread_mutex_t cow_obj_lock[COW_NR_LOCKS] = {
+	[0 ... COW_NR_LOCKS - 1] = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static pthread_mutex_t *get_cow_lock(uint64_t oid)
+{
+	uint64_t h = fnv_64a_buf(&oid, sizeof(oid), FNV1A_64_INIT);
+
+	return cow_obj_lock + h % COW_NR_LOCKS;
+}
+
+static inline bool cow_map_supported(uint64_t oid)
+{
+	return sd_store->get_cow_map && is_data_obj(oid) &&
+		!is_ec_strip_obj(oid);
+}
+
+static inline uint32_t cow_block(uint64_t offset)
+{
+	return offset >> SD_COW_BLOCK_SHIFT;
+}
+
+/* Read [offset, offset + len) of the base object through the gateway */
+static int read_cow_base(uint64_t cow_oid, char *buf, uint32_t len,
+			 uint64_t offset, struct vnode_info *vinfo)
+{
+	struct request read_req = { };
+	struct sd_req *hdr = &read_req.rq;
+	struct sd_rsp *rsp = &read_req.rp;
+	int ret;
+
+	sd_init_req(hdr, SD_OP_READ_OBJ);
+	hdr->data_length = len;
+	hdr->epoch = sys_epoch();
+	hdr->obj.oid = cow_oid;
+	hdr->obj.offset = offset;
+
+	read_req.data = buf;
+	read_req.op = get_sd_op(hdr->opcode);
+	read_req.vinfo = vinfo;
+
+	ret = gateway_read_obj_sync(&read_req);
+	if (ret != SD_RES_SUCCESS) {
+		sd_eprintf("failed to read cow object %"PRIx64", %s", cow_oid,
+			   sd_strerror(ret));
+		return ret;
+	}
+
+	untrim_zero_sectors(buf, rsp->obj.offset, rsp->data_length, len);
+	return SD_RES_SUCCESS;
+}
+
+/*
+ * Copy the unwritten blocks in [offset, offset + len) from the base object to
+ * 'buf'.  The base object is read once from the first unwritten block to the
+ * last one.
+ */
+static int fill_from_base(const struct cow_map *map, char *buf, uint32_t len,
+			  uint64_t offset, struct vnode_info *vinfo)
+{
+	uint32_t first, last, i;
+	uint64_t start, end, s, e;
+	char *base;
+	int ret;
+
+	if (!len)
+		return SD_RES_SUCCESS;
+
+	last = cow_block(offset + len - 1);
+	first = find_next_zero_bit(map->bmap, last + 1, cow_block(offset));
+	if (first > last)
+		return SD_RES_SUCCESS;
+	while (test_bit(last, map->bmap))
+		last--;
+
+	start = max(offset, (uint64_t)first << SD_COW_BLOCK_SHIFT);
+	end = min(offset + len, (uint64_t)(last + 1) << SD_COW_BLOCK_SHIFT);
+	base = xbuf_get(end - start);
+	ret = read_cow_base(map->cow_oid, base, end - start, start, vinfo);
+	if (ret != SD_RES_SUCCESS)
+		goto out;
+
+	for (i = first; i <= last; i++) {
+		if (test_bit(i, map->bmap))
+			continue;
+		s = max(start, (uint64_t)i << SD_COW_BLOCK_SHIFT);
+		e = min(end, (uint64_t)(i + 1) << SD_COW_BLOCK_SHIFT);
+		memcpy(buf + (s - offset), base + (s - start), e - s);
+	}
+out:
+	buf_put(base, end - start);
+	return ret;
+}
+
+/*
+ * Extend the write in 'iocb' to the boundaries of the unwritten blocks it
+ * touches, and fill the extended parts from the base object.  The returned
+ * buffer must be put back by the caller with buf_put().
+ */
+static char *prepare_cow_write(const struct cow_map *map,
+			       const struct siocb *iocb, struct siocb *out,
+			       struct vnode_info *vinfo, int *ret)
+{
+	uint64_t start = iocb->offset, end = iocb->offset + iocb->length;
+	uint32_t first = cow_block(start), last = cow_block(end - 1);
+	char *buf;
+
+	if (!test_bit(first, map->bmap))
+		start = (uint64_t)first << SD_COW_BLOCK_SHIFT;
+	if (!test_bit(last, map->bmap))
+		end = min((uint64_t)(last + 1) << SD_COW_BLOCK_SHIFT,
+			  (uint64_t)SD_DATA_OBJ_SIZE);
+
+	buf = xbuf_get(end - start);
+	*ret = fill_from_base(map, buf, iocb->offset - start, start, vinfo);
+	if (*ret == SD_RES_SUCCESS)
+		*ret = fill_from_base(map, buf + (iocb->offset + iocb->length -
+						  start),
+				      end - iocb->offset - iocb->length,
+				      iocb->offset + iocb->length, vinfo);
+	if (*ret != SD_RES_SUCCESS) {
+		buf_put(buf, end - start);
+		return NULL;
+	}
+	memcpy(buf + (iocb->offset - start), iocb->buf, iocb->length);
+
+	*out = *iocb;
+	out->buf = buf;
+	out->offset = start;
+	out->length = end - start;
+	return buf;
+}
+
+/* Mark the blocks covered by 'iocb' as written */
+static void cow_map_set(struct cow_map *map, const struct siocb *iocb)
+{
+	uint32_t i, last = cow_block(iocb->offset + iocb->length - 1);
+
+	for (i = cow_block(iocb->offset); i <= last; i++)
+		set_bit(i, map->bmap);
+
+	if (find_next_zero_bit(map->bmap, SD_COW_NR_BLOCKS, 0) >=
+	    SD_COW_NR_BLOCKS)
+		map->cow_oid = 0;
+}
+
+int cow_read_obj(uint64_t oid, const struct siocb *iocb,
+		 struct vnode_info *vinfo)
+{
+	struct cow_map map;
+	int ret;
+
+	if (!cow_map_supported(oid) || !iocb->length)
+		return sd_store->read(oid, iocb);
+
+	/*
+	 * Get the map before the data.  A block written in between is then
+	 * read from the base object, which is fine for a racing read.
+	 */
+	ret = sd_store->get_cow_map(oid, iocb->epoch, &map);
+	if (ret != SD_RES_SUCCESS)
+		return ret;
+
+	ret = sd_store->read(oid, iocb);
+	if (ret != SD_RES_SUCCESS || !map.cow_oid)
+		return ret;
+
+	return fill_from_base(&map, iocb->buf, iocb->length, iocb->offset,
+			      vinfo);
+}
+
+/*
+ * Start the I/O of an object which needs no copy-on-write work, so that the
+ * worker doesn't wait for the disk.  SD_RES_NO_SUPPORT means that the caller
+ * has to do it with cow_read_obj() or cow_write_obj().
+ */
+int cow_submit_obj(uint64_t oid, const struct siocb *iocb, bool write,
+		   void (*done)(void *data, int result), void *data)
+{
+	struct cow_map map;
+
+	if (!sd_store->submit || !iocb->length)
+		return SD_RES_NO_SUPPORT;
+
+	if (cow_map_supported(oid) &&
+	    (sd_store->get_cow_map(oid, iocb->epoch, &map) != SD_RES_SUCCESS ||
+	     map.cow_oid))
+		return SD_RES_NO_SUPPORT;
+
+	return sd_store->submit(oid, iocb, write, done, data);
+}
+
+int cow_write_obj(uint64_t oid, const struct siocb *iocb,
+		  struct vnode_info *vinfo)
+{
+	pthread_mutex_t *lock = get_cow_lock(oid);
+	struct cow_map map;
+	struct siocb wiocb;
+	char *buf;
+	int ret;
+
+	if (!cow_map_supported(oid) || !iocb->length)
+		return sd_store->write(oid, iocb);
+
+	/* The map of an object is never added after creation */
+	ret = sd_store->get_cow_map(oid, iocb->epoch, &map);
+	if (ret != SD_RES_SUCCESS)
+		return ret;
+	if (!map.cow_oid)
+		return sd_store->write(oid, iocb);
+
+	pthread_mutex_lock(lock);
+	ret = sd_store->get_cow_map(oid, iocb->epoch, &map);
+	if (ret != SD_RES_SUCCESS)
+		goto out;
+	if (!map.cow_oid) {
+		ret = sd_store->write(oid, iocb);
+		goto out;
+	}
+
+	buf = prepare_cow_write(&map, iocb, &wiocb, vinfo, &ret);
+	if (!buf)
+		goto out;
+
+	/* The data must hit the disk before the blocks are marked */
+	ret = sd_store->write(oid, &wiocb);
+	if (ret == SD_RES_SUCCESS) {
+		cow_map_set(&map, &wiocb);
+		if (!map.cow_oid)
+			sd_dprintf("%"PRIx64" is fully written, drop its "
+				   "cow map", oid);
+		ret = sd_store->set_cow_map(oid, &map);
+	}
+	buf_put(buf, wiocb.length);
+out:
+	pthread_mutex_unlock(lock);
+	return ret;
+}
+
+/*
+ * Create the object with the blocks covered by 'iocb' and a COW map which
+ * points to 'cow_oid'.  Return SD_RES_NO_SUPPORT if the store cannot keep COW
+ * maps, then the caller has to copy the whole base object.
+ */
+int cow_create_and_write_obj(uint64_t oid, uint64_t cow_oid,
+			     const struct siocb *iocb, struct vnode_info *vinfo)
+{
+	pthread_mutex_t *lock;
+	struct cow_map map = { .cow_oid = cow_oid };
+	struct siocb wiocb;
+	char *buf;
+	int ret;
+
+	if (!cow_map_supported(oid) || !iocb->length)
+		return SD_RES_NO_SUPPORT;
+
+	buf = prepare_cow_write(&map, iocb, &wiocb, vinfo, &ret);
+	if (!buf)
+		return ret;
+
+	cow_map_set(&map, &wiocb);
+	if (map.cow_oid)
+		wiocb.cow = &map;
+
+	lock = get_cow_lock(oid);
+	pthread_mutex_lock(lock);
+	ret = sd_store->create_and_write(oid, &wiocb);
+	pthread_mutex_unlock(lock);
+
+	buf_put(buf, wiocb.length);
+	return ret;
+}
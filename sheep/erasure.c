@@ -0,0 +1,860 @@
+/*
+ * Copyright (C) 2013 Taobao Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Erasure coded data objects
+ *
+ * A data object of an erasure coded VDI is split into 'd' data strips and
+ * encoded into 'p' parity strips.  Strip 'i' is stored as its own object,
+ * ec_strip_oid(oid, d, i), on the i'th node that oid_to_vnodes() would pick
+ * for a copy of the object, so the strips are on different zones.  A strip
+ * object is the strip followed by a trailer with the generation of the write
+ * which stored it.
+ *
+ * The gateway reads the data strips that cover the request, and falls back to
+ * decoding the object from any 'd' strips of the same generation if some of
+ * them can't be read.
+ *
+ * A write which doesn't cover the whole object reads the old data of the
+ * range, the same ranges of the parity strips and the trailers of all the
+ * strips.  If all the strips are of the same generation, the parity is
+ * updated with the difference of the old and the new data, and only the
+ * range of the touched data strips, the parity ranges and the trailers are
+ * written with WRITE_OBJS_PEER.  Otherwise, e.g. after an interrupted write,
+ * the object is rebuilt from the strips which agree and every strip is
+ * replaced with a CREATE_AND_WRITE_PEER, which is atomic on the peers.  All
+ * the strip requests go through the network, also to this node, so that the
+ * peer side checks epochs and waits for recovery as usual.
+ *
+ * All the writes of an object are done by the node of its first strip, which
+ * serializes them with a lock of the object.  Other gateways forward them
+ * there with EC_WRITE_PEER, whose epoch has to be the one of that node, so
+ * the nodes agree on which of them does the writes.  The strip requests of a
+ * write carry its epoch too, and a peer which has moved on to a new epoch
+ * rejects the strips of the old one.  A write interrupted by an epoch change
+ * leaves strips of different generations, which the next write of the object
+ * detects and replaces with a full write.  So no partial write updates the
+ * parity from data which another write has changed in the meantime.
+ */
+#include <pthread.h>
+#include <sys/time.h>
+
+#include "sheep_priv.h"
+#include "fec.h"
+
+#define EC_NR_LOCKS 64
+#define EC_MAX_SEGS 3	/* two ranges of a parity strip and the trailer */
+
+struct strip_io {
+	uint64_t oid;
+	const struct node_id *nid;
+	struct sockfd *sfd;
+	struct sd_req hdr;
+	struct sd_obj_seg segs[EC_MAX_SEGS];
+	char *bufs[EC_MAX_SEGS];
+	int nr_segs;
+	int ret;
+};
+
+/* Layout of a partial write */
+struct ec_update {
+	uint64_t off, end;
+	int d, p, first, last;
+	size_t len;		/* of a strip, without the trailer */
+	struct sd_obj_seg psegs[EC_MAX_SEGS - 1];	/* parity ranges */
+	int nr_psegs;
+};
+
+static struct fec *fec_ctx[SD_EC_MAX_STRIPS + 1][SD_EC_MAX_STRIPS + 1];
+static pthread_mutex_t fec_ctx_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Serialize the writes of the objects whose first strip is on this node */
+static pthread_mutex_t ec_obj_lock[EC_NR_LOCKS] = {
+	[0 ... EC_NR_LOCKS - 1] = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static uint64_t ec_gen;
+
+/* Start the generations from the time, so a restart doesn't reuse them */
+static void __attribute__((constructor)) ec_init_gen(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	ec_gen = (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static struct fec *get_fec(int d, int p)
+{
+	struct fec *ctx;
+
+	pthread_mutex_lock(&fec_ctx_lock);
+	ctx = fec_ctx[d][p];
+	if (!ctx) {
+		ctx = fec_new(d, p);
+		fec_ctx[d][p] = ctx;
+		sd_dprintf("%d:%d, %s kernel", d, p, fec_kernel_name());
+	}
+	pthread_mutex_unlock(&fec_ctx_lock);
+
+	return ctx;
+}
+
+static pthread_mutex_t *get_obj_lock(uint64_t oid)
+{
+	uint64_t h = fnv_64a_buf(&oid, sizeof(oid), FNV1A_64_INIT);
+
+	return ec_obj_lock + h % EC_NR_LOCKS;
+}
+
+/* Stamp 'buf' with a trailer which no other write has */
+static void ec_new_trailer(char *buf)
+{
+	struct sd_ec_trailer *t = (struct sd_ec_trailer *)buf;
+
+	memset(buf, 0, SD_EC_TRAILER_SIZE);
+	t->gen = uatomic_add_return(&ec_gen, 1);
+	t->writer = fnv_64a_buf(&sys->this_node.nid, sizeof(struct node_id),
+				FNV1A_64_INIT);
+}
+
+static bool ec_same_trailer(const char *a, const char *b)
+{
+	return !memcmp(a, b, sizeof(struct sd_ec_trailer));
+}
+
+/*
+ * Return the strips in 'avail' whose trailer is the one most of them have, or
+ * 0 if less than 'd' of them agree.
+ */
+static uint32_t ec_consistent_strips(char * const *trailers, uint32_t avail,
+				     int n, int d)
+{
+	uint32_t best = 0, set;
+	int i, j;
+
+	for (i = 0; i < n; i++) {
+		if (!(avail & (1U << i)))
+			continue;
+		set = 0;
+		for (j = 0; j < n; j++)
+			if ((avail & (1U << j)) &&
+			    ec_same_trailer(trailers[i], trailers[j]))
+				set |= 1U << j;
+		if (__builtin_popcount(set) > __builtin_popcount(best))
+			best = set;
+	}
+
+	return __builtin_popcount(best) >= d ? best : 0;
+}
+
+static int ec_result_rank(int ret)
+{
+	switch (ret) {
+	case SD_RES_SUCCESS:
+		return 0;
+	case SD_RES_NO_OBJ:
+		return 1;
+	case SD_RES_NETWORK_ERROR:
+		return 3;
+	case SD_RES_OLD_NODE_VER:
+	case SD_RES_NEW_NODE_VER:
+		return 4;
+	default:
+		return 2;
+	}
+}
+
+/* Prefer the errors which make the gateway retry the request */
+static int ec_worse_result(int a, int b)
+{
+	return ec_result_rank(a) >= ec_result_rank(b) ? a : b;
+}
+
+static void strip_io_init(struct strip_io *io, uint64_t oid)
+{
+	io->oid = oid;
+	io->nr_segs = 0;
+}
+
+static void strip_io_add(struct strip_io *io, uint32_t offset, uint32_t len,
+			 char *buf)
+{
+	assert(io->nr_segs < EC_MAX_SEGS);
+
+	io->segs[io->nr_segs].oid = io->oid;
+	io->segs[io->nr_segs].offset = offset;
+	io->segs[io->nr_segs].length = len;
+	io->bufs[io->nr_segs] = buf;
+	io->nr_segs++;
+}
+
+/*
+ * The vectored opcodes carry all the segments of the strip.  The others
+ * address the first segment, or the whole object for SD_OP_REMOVE_PEER.
+ */
+static void strip_io_send(struct strip_io *io, const struct vnode_info *vinfo,
+			  uint8_t opcode, uint32_t epoch)
+{
+	struct iovec iov[EC_MAX_SEGS + 1];
+	const struct sd_node *n;
+	int i, iovcnt = 0;
+
+	n = vinfo_oid_to_node(vinfo, io->oid, 0);
+	io->nid = &n->nid;
+
+	sd_init_req(&io->hdr, opcode);
+	io->hdr.epoch = epoch;
+	switch (opcode) {
+	case SD_OP_READ_OBJS_PEER:
+	case SD_OP_WRITE_OBJS_PEER:
+		io->hdr.flags = SD_FLAG_CMD_WRITE;
+		io->hdr.objs.nr_segs = io->nr_segs;
+		iov[iovcnt].iov_base = io->segs;
+		iov[iovcnt++].iov_len = sizeof(io->segs[0]) * io->nr_segs;
+		for (i = 0; opcode == SD_OP_WRITE_OBJS_PEER &&
+			     i < io->nr_segs; i++) {
+			iov[iovcnt].iov_base = io->bufs[i];
+			iov[iovcnt++].iov_len = io->segs[i].length;
+		}
+		break;
+	default:
+		io->hdr.obj.oid = io->oid;
+		io->hdr.obj.copies = 1;
+		if (io->nr_segs) {
+			io->hdr.obj.offset = io->segs[0].offset;
+			io->hdr.data_length = io->segs[0].length;
+		}
+		if (opcode == SD_OP_CREATE_AND_WRITE_PEER) {
+			io->hdr.flags = SD_FLAG_CMD_WRITE;
+			iov[iovcnt].iov_base = io->bufs[0];
+			iov[iovcnt++].iov_len = io->segs[0].length;
+		}
+		break;
+	}
+	if (iovcnt)
+		io->hdr.data_length = 0;
+	for (i = 0; i < iovcnt; i++)
+		io->hdr.data_length += iov[i].iov_len;
+
+	io->sfd = sheep_get_sockfd(io->nid);
+	if (!io->sfd) {
+		io->ret = SD_RES_NETWORK_ERROR;
+		return;
+	}
+
+	if (send_reqv(io->sfd->fd, &io->hdr, iov, iovcnt, sheep_need_retry,
+		      epoch)) {
+		sheep_del_sockfd(io->nid, io->sfd);
+		io->ret = SD_RES_NETWORK_ERROR;
+		return;
+	}
+
+	io->ret = SD_RES_SUCCESS;
+}
+
+static uint32_t strip_io_len(const struct strip_io *io)
+{
+	uint32_t len = 0;
+	int i;
+
+	for (i = 0; i < io->nr_segs; i++)
+		len += io->segs[i].length;
+
+	return len;
+}
+
+static void strip_io_recv(struct strip_io *io)
+{
+	struct sd_rsp rsp;
+	uint8_t opcode = io->hdr.opcode;
+	uint32_t epoch = io->hdr.epoch;
+	int i, ret;
+
+	if (io->ret != SD_RES_SUCCESS)
+		return;
+
+	if (opcode == SD_OP_READ_PEER)
+		ret = recv_rsp(io->sfd->fd, &rsp, io->bufs[0],
+			       io->segs[0].length, sheep_need_retry, epoch);
+	else {
+		ret = do_read(io->sfd->fd, &rsp, sizeof(rsp), sheep_need_retry,
+			      epoch);
+		if (!ret && opcode == SD_OP_READ_OBJS_PEER &&
+		    rsp.result == SD_RES_SUCCESS) {
+			if (rsp.data_length != strip_io_len(io)) {
+				sd_eprintf("bad response length %"PRIu32,
+					   rsp.data_length);
+				ret = -1;
+			}
+			for (i = 0; !ret && i < io->nr_segs; i++)
+				ret = do_read(io->sfd->fd, io->bufs[i],
+					      io->segs[i].length,
+					      sheep_need_retry, epoch);
+		}
+	}
+	if (ret) {
+		sd_dprintf("remote node might have gone away");
+		sheep_del_sockfd(io->nid, io->sfd);
+		io->ret = SD_RES_NETWORK_ERROR;
+		return;
+	}
+	sheep_put_sockfd(io->nid, io->sfd);
+
+	io->ret = rsp.result;
+	if (io->ret != SD_RES_SUCCESS) {
+		sd_dprintf("%"PRIx64", %s", io->oid, sd_strerror(io->ret));
+		return;
+	}
+
+	if (opcode == SD_OP_READ_PEER)
+		untrim_zero_sectors(io->bufs[0], rsp.obj.offset,
+				    rsp.data_length, io->segs[0].length);
+}
+
+/*
+ * Read the whole erasure coded object into 'buf', which has room for all the
+ * strip objects.  The parity strips are read only if some data strips are
+ * missing or not of the same write.
+ */
+static int ec_read_object(struct request *req, uint64_t oid, int d, int p,
+			  char *buf)
+{
+	struct strip_io io[SD_EC_MAX_STRIPS];
+	uint8_t *strips[SD_EC_MAX_STRIPS];
+	char *trailers[SD_EC_MAX_STRIPS];
+	size_t len = SD_DATA_OBJ_SIZE / d, size = len + SD_EC_TRAILER_SIZE;
+	uint32_t avail = 0, good, data_mask = (1U << d) - 1;
+	int i, from = 0, to = d, nr_avail = 0, ret = SD_RES_SUCCESS;
+
+	for (i = 0; i < d + p; i++) {
+		strips[i] = (uint8_t *)buf + i * size;
+		trailers[i] = buf + i * size + len;
+	}
+again:
+	for (i = from; i < to; i++) {
+		if (i >= req->vinfo->nr_zones) {
+			io[i].ret = SD_RES_HALT;
+			continue;
+		}
+		strip_io_init(io + i, ec_strip_oid(oid, d, i));
+		strip_io_add(io + i, 0, size, (char *)strips[i]);
+		strip_io_send(io + i, req->vinfo, SD_OP_READ_PEER,
+			      req->rq.epoch);
+	}
+	for (i = from; i < to; i++) {
+		strip_io_recv(io + i);
+		if (io[i].ret == SD_RES_SUCCESS) {
+			avail |= 1U << i;
+			nr_avail++;
+		} else
+			ret = ec_worse_result(ret, io[i].ret);
+	}
+
+	good = ec_consistent_strips(trailers, avail, d + p, d);
+	if (good != data_mask && to == d) {
+		from = d;
+		to = d + p;
+		goto again;
+	}
+	if (nr_avail < d) {
+		sd_eprintf("%"PRIx64" has only %d strips, %s", oid, nr_avail,
+			   sd_strerror(ret));
+		return ret;
+	}
+	if (!good) {
+		sd_eprintf("%"PRIx64" has no %d strips of the same write", oid,
+			   d);
+		return SD_RES_EIO;
+	}
+
+	if ((good & data_mask) != data_mask) {
+		sd_dprintf("decode %"PRIx64" from %x", oid, good);
+		if (fec_decode(get_fec(d, p), strips, good, data_mask, len) < 0)
+			return SD_RES_EIO;
+	}
+
+	return SD_RES_SUCCESS;
+}
+
+/* Copy between the range of the object and the strips in 'buf' */
+static void ec_copy_range(char *data, char *buf, uint64_t off, uint64_t end,
+			  size_t len, bool to_strips)
+{
+	size_t size = len + SD_EC_TRAILER_SIZE;
+	uint64_t s, e;
+	char *strip;
+
+	for (s = off; s < end; s = e) {
+		e = min(end, (s / len + 1) * len);
+		strip = buf + (s / len) * size + s % len;
+		if (to_strips)
+			memcpy(strip, data + (s - off), e - s);
+		else
+			memcpy(data + (s - off), strip, e - s);
+	}
+}
+
+int gateway_ec_read_obj(struct request *req)
+{
+	struct sd_req *hdr = &req->rq;
+	uint64_t oid = hdr->obj.oid, off = hdr->obj.offset;
+	uint64_t end = off + hdr->data_length, s, e;
+	uint16_t policy = get_vdi_copy_policy(oid_to_vid(oid));
+	int d = ec_policy_data(policy), p = ec_policy_parity(policy);
+	struct strip_io io[SD_EC_MAX_STRIPS];
+	size_t len = SD_DATA_OBJ_SIZE / d, size = len + SD_EC_TRAILER_SIZE;
+	int i, first, last, ret = SD_RES_SUCCESS;
+	char *buf;
+
+	if (end > SD_DATA_OBJ_SIZE)
+		return SD_RES_INVALID_PARMS;
+	if (!hdr->data_length)
+		goto out;
+
+	/* Read the range from the data strips straight into place */
+	first = off / len;
+	last = (end - 1) / len;
+	for (i = first; i <= last; i++) {
+		s = max(off, (uint64_t)i * len);
+		e = min(end, (uint64_t)(i + 1) * len);
+		if (i >= req->vinfo->nr_zones) {
+			io[i].ret = SD_RES_HALT;
+			continue;
+		}
+		strip_io_init(io + i, ec_strip_oid(oid, d, i));
+		strip_io_add(io + i, s - i * len, e - s,
+			     (char *)req->data + (s - off));
+		strip_io_send(io + i, req->vinfo, SD_OP_READ_PEER, hdr->epoch);
+	}
+	for (i = first; i <= last; i++) {
+		strip_io_recv(io + i);
+		ret = ec_worse_result(ret, io[i].ret);
+	}
+
+	switch (ret) {
+	case SD_RES_SUCCESS:
+	case SD_RES_OLD_NODE_VER:
+	case SD_RES_NEW_NODE_VER:
+		break;
+	default:
+		/* degraded read */
+		buf = xbuf_get(size * (d + p));
+		ret = ec_read_object(req, oid, d, p, buf);
+		if (ret == SD_RES_SUCCESS)
+			ec_copy_range(req->data, buf, off, end, len, false);
+		buf_put(buf, size * (d + p));
+		break;
+	}
+out:
+	if (ret == SD_RES_SUCCESS) {
+		req->rp.data_length = hdr->data_length;
+		req->rp.obj.offset = 0;
+	}
+	return ret;
+}
+
+/* Replace all the strips of the object, reading the rest of it if needed */
+static int ec_write_full(struct request *req, uint64_t oid, int d, int p,
+			 bool create)
+{
+	struct sd_req *hdr = &req->rq;
+	uint64_t off = hdr->obj.offset;
+	uint16_t policy = get_vdi_copy_policy(oid_to_vid(oid));
+	struct strip_io io[SD_EC_MAX_STRIPS];
+	uint8_t *strips[SD_EC_MAX_STRIPS];
+	size_t len = SD_DATA_OBJ_SIZE / d, size = len + SD_EC_TRAILER_SIZE;
+	int i, ret = SD_RES_SUCCESS;
+	char *buf;
+
+	buf = xbuf_get(size * (d + p));
+	for (i = 0; i < d + p; i++)
+		strips[i] = (uint8_t *)buf + i * size;
+
+	if (off != 0 || hdr->data_length != SD_DATA_OBJ_SIZE) {
+		if (!create)
+			ret = ec_read_object(req, oid, d, p, buf);
+		else if (!(hdr->flags & SD_FLAG_CMD_COW))
+			for (i = 0; i < d; i++)
+				memset(strips[i], 0, len);
+		else if (get_vdi_copy_policy(oid_to_vid(hdr->obj.cow_oid)) ==
+			 policy)
+			ret = ec_read_object(req, hdr->obj.cow_oid, d, p, buf);
+		else {
+			/* Clones inherit the policy of their base */
+			sd_eprintf("bad cow object %"PRIx64, hdr->obj.cow_oid);
+			ret = SD_RES_INVALID_PARMS;
+		}
+		if (ret != SD_RES_SUCCESS)
+			goto out;
+	}
+
+	ec_copy_range(req->data, buf, off, off + hdr->data_length, len, true);
+	fec_encode(get_fec(d, p), (const uint8_t * const *)strips, strips + d,
+		   len);
+	ec_new_trailer((char *)strips[0] + len);
+	for (i = 1; i < d + p; i++)
+		memcpy(strips[i] + len, strips[0] + len, SD_EC_TRAILER_SIZE);
+
+	for (i = 0; i < d + p; i++) {
+		strip_io_init(io + i, ec_strip_oid(oid, d, i));
+		strip_io_add(io + i, 0, size, (char *)strips[i]);
+		strip_io_send(io + i, req->vinfo, SD_OP_CREATE_AND_WRITE_PEER,
+			      hdr->epoch);
+	}
+	for (i = 0; i < d + p; i++) {
+		strip_io_recv(io + i);
+		ret = ec_worse_result(ret, io[i].ret);
+	}
+out:
+	buf_put(buf, size * (d + p));
+	return ret;
+}
+
+/* The range of the data strip 'i' which the write covers */
+static void ec_strip_range(const struct ec_update *u, int i, uint32_t *s,
+			   uint32_t *e)
+{
+	*s = max(u->off, (uint64_t)i * u->len) - i * u->len;
+	*e = min(u->end, (uint64_t)(i + 1) * u->len) - i * u->len;
+}
+
+static void ec_init_update(struct ec_update *u, const struct sd_req *hdr,
+			   int d, int p)
+{
+	uint32_t s, e, s2, e2;
+
+	u->d = d;
+	u->p = p;
+	u->len = SD_DATA_OBJ_SIZE / d;
+	u->off = hdr->obj.offset;
+	u->end = u->off + hdr->data_length;
+	u->first = u->off / u->len;
+	u->last = (u->end - 1) / u->len;
+
+	/* The parity ranges are the union of the ranges of the data strips */
+	ec_strip_range(u, u->first, &s, &e);
+	ec_strip_range(u, u->last, &s2, &e2);
+	u->nr_psegs = 1;
+	if (u->first == u->last) {
+		u->psegs[0].offset = s;
+		u->psegs[0].length = e - s;
+	} else if (u->last == u->first + 1 && e2 < s) {
+		u->psegs[0].offset = 0;
+		u->psegs[0].length = e2;
+		u->psegs[1].offset = s;
+		u->psegs[1].length = u->len - s;
+		u->nr_psegs = 2;
+	} else {
+		u->psegs[0].offset = 0;
+		u->psegs[0].length = u->len;
+	}
+}
+
+/*
+ * Add the segments of the strip 'i' for a partial write to 'io': the range of
+ * a touched data strip, or the parity ranges, and the trailer.
+ */
+static void ec_add_update_segs(const struct ec_update *u, struct strip_io *io,
+			       int i, char *buf, char *trailer)
+{
+	size_t size = u->len + SD_EC_TRAILER_SIZE;
+	char *strip = buf + i * size;
+	uint32_t s, e;
+	int j;
+
+	if (i >= u->d)
+		for (j = 0; j < u->nr_psegs; j++)
+			strip_io_add(io, u->psegs[j].offset,
+				     u->psegs[j].length,
+				     strip + u->psegs[j].offset);
+	else if (u->first <= i && i <= u->last) {
+		ec_strip_range(u, i, &s, &e);
+		strip_io_add(io, s, e - s, strip + s);
+	}
+	strip_io_add(io, u->len, SD_EC_TRAILER_SIZE, trailer);
+}
+
+/*
+ * Write the range by updating the parity with the difference of the old and
+ * the new data.  Return SD_RES_EIO before writing anything if the strips
+ * can't be read or are not of the same write.
+ */
+static int ec_write_partial(struct request *req, uint64_t oid, int d, int p)
+{
+	struct sd_req *hdr = &req->rq;
+	struct strip_io io[SD_EC_MAX_STRIPS];
+	struct ec_update u;
+	uint8_t *parity[SD_EC_MAX_STRIPS];
+	char *trailers[SD_EC_MAX_STRIPS], *buf, *tbuf, *new;
+	const struct fec *ctx = get_fec(d, p);
+	size_t size = SD_DATA_OBJ_SIZE / d + SD_EC_TRAILER_SIZE;
+	uint32_t avail = 0, s, e;
+	int i, j, ret = SD_RES_SUCCESS;
+
+	ec_init_update(&u, hdr, d, p);
+	buf = xbuf_get(size * (d + p));
+	tbuf = xbuf_get(SD_EC_TRAILER_SIZE * (d + p + 1));
+
+	for (i = 0; i < d + p; i++) {
+		trailers[i] = tbuf + i * SD_EC_TRAILER_SIZE;
+		strip_io_init(io + i, ec_strip_oid(oid, d, i));
+		ec_add_update_segs(&u, io + i, i, buf, trailers[i]);
+		strip_io_send(io + i, req->vinfo, SD_OP_READ_OBJS_PEER,
+			      hdr->epoch);
+	}
+	for (i = 0; i < d + p; i++) {
+		strip_io_recv(io + i);
+		if (io[i].ret == SD_RES_SUCCESS)
+			avail |= 1U << i;
+		else
+			ret = ec_worse_result(ret, io[i].ret);
+	}
+	if (ret != SD_RES_SUCCESS ||
+	    ec_consistent_strips(trailers, avail, d + p, d + p) != avail) {
+		sd_dprintf("%"PRIx64" is not consistent, %s", oid,
+			   sd_strerror(ret));
+		ret = SD_RES_EIO;
+		goto out;
+	}
+
+	/* Take the old data out of the parity and put the new data in */
+	for (i = u.first; i <= u.last; i++) {
+		ec_strip_range(&u, i, &s, &e);
+		for (j = 0; j < p; j++)
+			parity[j] = (uint8_t *)buf + (d + j) * size + s;
+		new = (char *)req->data + (i * u.len + s - u.off);
+		fec_update_parity(ctx, i, (uint8_t *)buf + i * size + s,
+				  parity, e - s);
+		fec_update_parity(ctx, i, (uint8_t *)new, parity, e - s);
+		memcpy(buf + i * size + s, new, e - s);
+	}
+
+	ec_new_trailer(tbuf + (d + p) * SD_EC_TRAILER_SIZE);
+	for (i = 0; i < d + p; i++) {
+		strip_io_init(io + i, ec_strip_oid(oid, d, i));
+		ec_add_update_segs(&u, io + i, i, buf,
+				   tbuf + (d + p) * SD_EC_TRAILER_SIZE);
+		strip_io_send(io + i, req->vinfo, SD_OP_WRITE_OBJS_PEER,
+			      hdr->epoch);
+	}
+	for (i = 0; i < d + p; i++) {
+		strip_io_recv(io + i);
+		ret = ec_worse_result(ret, io[i].ret);
+	}
+out:
+	buf_put(tbuf, SD_EC_TRAILER_SIZE * (d + p + 1));
+	buf_put(buf, size * (d + p));
+	return ret;
+}
+
+/* Write the object on the node of its first strip */
+static int ec_write_obj(struct request *req, bool create)
+{
+	struct sd_req *hdr = &req->rq;
+	uint64_t oid = hdr->obj.oid;
+	uint16_t policy = get_vdi_copy_policy(oid_to_vid(oid));
+	int d = ec_policy_data(policy), p = ec_policy_parity(policy);
+	pthread_mutex_t *lock = get_obj_lock(oid);
+	int ret;
+
+	if (hdr->obj.offset + hdr->data_length > SD_DATA_OBJ_SIZE)
+		return SD_RES_INVALID_PARMS;
+	if (req->vinfo->nr_zones < d + p)
+		return SD_RES_HALT;
+
+	pthread_mutex_lock(lock);
+	if (create || hdr->data_length == SD_DATA_OBJ_SIZE)
+		ret = SD_RES_EIO;
+	else
+		ret = ec_write_partial(req, oid, d, p);
+	if (ret == SD_RES_EIO)
+		ret = ec_write_full(req, oid, d, p, create);
+	pthread_mutex_unlock(lock);
+
+	return ret;
+}
+
+static const struct sd_node *ec_write_owner(const struct request *req)
+{
+	uint64_t oid = req->rq.obj.oid;
+	int d = ec_policy_data(get_vdi_copy_policy(oid_to_vid(oid)));
+
+	return vinfo_oid_to_node(req->vinfo, ec_strip_oid(oid, d, 0), 0);
+}
+
+int gateway_ec_write_obj(struct request *req)
+{
+	const struct sd_node *owner = ec_write_owner(req);
+	struct sd_req hdr;
+
+	if (node_is_local(owner))
+		return ec_write_obj(req,
+				    req->rq.opcode == SD_OP_CREATE_AND_WRITE_OBJ);
+
+	/* The gateway opcode goes in chain.opcode, like for chain writes */
+	sd_init_req(&hdr, SD_OP_EC_WRITE_PEER);
+	hdr.flags = SD_FLAG_CMD_WRITE | (req->rq.flags & SD_FLAG_CMD_COW);
+	hdr.epoch = req->rq.epoch;
+	hdr.data_length = req->rq.data_length;
+	hdr.chain.oid = req->rq.obj.oid;
+	hdr.chain.cow_oid = req->rq.obj.cow_oid;
+	hdr.chain.opcode = req->rq.opcode;
+	hdr.chain.offset = req->rq.obj.offset;
+
+	return sheep_exec_req(&owner->nid, &hdr, req->data);
+}
+
+int peer_ec_write_obj(struct request *req)
+{
+	/* The epoch is checked already, so we agree with the gateway */
+	if (!node_is_local(ec_write_owner(req))) {
+		sd_eprintf("%"PRIx64" is not written by this node",
+			   req->rq.obj.oid);
+		return SD_RES_INVALID_PARMS;
+	}
+
+	return ec_write_obj(req,
+			    req->rq.chain.opcode == SD_OP_CREATE_AND_WRITE_OBJ);
+}
+
+int gateway_ec_remove_obj(struct request *req)
+{
+	uint64_t oid = req->rq.obj.oid;
+	int d = ec_policy_data(get_vdi_copy_policy(oid_to_vid(oid)));
+	int i, n = min(get_ec_nr_strips(oid), (int)req->vinfo->nr_zones);
+	struct strip_io io[SD_EC_MAX_STRIPS];
+	int ret = SD_RES_SUCCESS;
+
+	for (i = 0; i < n; i++) {
+		strip_io_init(io + i, ec_strip_oid(oid, d, i));
+		strip_io_send(io + i, req->vinfo, SD_OP_REMOVE_PEER,
+			      req->rq.epoch);
+	}
+	for (i = 0; i < n; i++) {
+		strip_io_recv(io + i);
+		/* the strip may have been lost */
+		if (io[i].ret != SD_RES_NO_OBJ)
+			ret = ec_worse_result(ret, io[i].ret);
+	}
+
+	return ret;
+}
+
+static int read_sibling_strip(const struct sd_node *n, uint64_t oid,
+			      uint32_t epoch, uint32_t tgt_epoch, char *buf)
+{
+	struct sd_req hdr;
+	struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
+	struct siocb iocb = { 0 };
+	uint32_t len = get_objsize(oid);
+	int ret;
+
+	if (node_is_local(n)) {
+		iocb.epoch = tgt_epoch;
+		iocb.buf = buf;
+		iocb.length = len;
+		return sd_store->read(oid, &iocb);
+	}
+
+	sd_init_req(&hdr, SD_OP_READ_PEER);
+	hdr.epoch = epoch;
+	hdr.flags = SD_FLAG_CMD_RECOVERY;
+	hdr.data_length = len;
+	hdr.obj.oid = oid;
+	hdr.obj.tgt_epoch = tgt_epoch;
+
+	ret = sheep_exec_req(&n->nid, &hdr, buf);
+	if (ret == SD_RES_SUCCESS)
+		untrim_zero_sectors(buf, rsp->obj.offset, rsp->data_length,
+				    len);
+
+	return ret;
+}
+
+/*
+ * Rebuild the strip 'oid' from the sibling strips which were stored on the
+ * nodes of 'vinfo' at 'tgt_epoch', and store it locally.  All the siblings
+ * are read, so that the strip is rebuilt from the write most of them agree
+ * on.
+ */
+int ec_rebuild_strip(uint64_t oid, struct vnode_info *vinfo, uint32_t epoch,
+		     uint32_t tgt_epoch)
+{
+	uint64_t base = ec_strip_base_oid(oid), sibling;
+	int d = ec_strip_nr_data(oid), n = get_ec_nr_strips(oid);
+	int idx = ec_strip_index(oid), i, nr_avail = 0, ret = SD_RES_NO_OBJ;
+	size_t size = get_objsize(oid), len = size - SD_EC_TRAILER_SIZE;
+	uint8_t *strips[SD_EC_MAX_STRIPS];
+	char *trailers[SD_EC_MAX_STRIPS];
+	struct siocb iocb = { 0 };
+	uint32_t avail = 0, good;
+	char *buf;
+
+	if (n <= d) {
+		sd_eprintf("no erasure coding policy for %"PRIx64, oid);
+		return SD_RES_NO_OBJ;
+	}
+
+	buf = xbuf_get(size * n);
+	for (i = 0; i < n; i++) {
+		strips[i] = (uint8_t *)buf + i * size;
+		trailers[i] = buf + i * size + len;
+	}
+
+	for (i = 0; i < n; i++) {
+		const struct sd_node *node;
+
+		if (i == idx || i >= vinfo->nr_zones)
+			continue;
+
+		sibling = ec_strip_oid(base, d, i);
+		node = vinfo_oid_to_node(vinfo, sibling, 0);
+		ret = read_sibling_strip(node, sibling, epoch, tgt_epoch,
+					 (char *)strips[i]);
+		if (ret == SD_RES_OLD_NODE_VER)
+			goto out;
+		if (ret == SD_RES_SUCCESS) {
+			avail |= 1U << i;
+			nr_avail++;
+		}
+	}
+
+	good = ec_consistent_strips(trailers, avail, n, d);
+	if (!good) {
+		sd_dprintf("%"PRIx64" has %d strips at epoch %"PRIu32", but"
+			   " not %d of the same write", oid, nr_avail,
+			   tgt_epoch, d);
+		ret = SD_RES_NO_OBJ;
+		goto out;
+	}
+
+	if (fec_decode(get_fec(d, n - d), strips, good, 1U << idx, len) < 0) {
+		ret = SD_RES_EIO;
+		goto out;
+	}
+	memcpy(trailers[idx], trailers[__builtin_ctz(good)],
+	       SD_EC_TRAILER_SIZE);
+
+	/* A gateway has written a newer strip in the meantime */
+	if (sd_store->exist(oid)) {
+		ret = SD_RES_SUCCESS;
+		goto out;
+	}
+
+	iocb.epoch = epoch;
+	iocb.buf = strips[idx];
+	iocb.length = size;
+	ret = sd_store->create_and_write(oid, &iocb);
+out:
+	buf_put(buf, size * n);
+	return ret;
+}
@@ -0,0 +1,219 @@
+/*
+ * Copyright (C) 2013 Taobao Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Cache of open object files
+ *
+ * A file is cached per oid and open flags, so a buffered and a direct
+ * descriptor of the same object can be cached side by side.  The cache is
+ * split into shards by oid, each with its own lock, hash table and LRU list.
+ *
+ * Whoever replaces or removes the file of an object in the working directory
+ * must call fd_cache_invalidate() afterwards, and moving objects between
+ * disks needs fd_cache_purge().  A descriptor still in use when it is
+ * dropped is closed by its last user.  A lookup that misses opens the file
+ * without the lock and caches it only if the shard was not invalidated in
+ * the meantime, so a file opened just before its replacement never gets in.
+ */
+#include <fcntl.h>
+#include <pthread.h>
+
+#include "sheep_priv.h"
+
+#define FD_CACHE_SHARD_BITS 4
+#define FD_CACHE_NR_SHARDS (1 << FD_CACHE_SHARD_BITS)
+#define FD_CACHE_HASH_BITS 8
+#define FD_CACHE_SIZE 2048	/* descriptors in all the shards */
+
+#define FD_CACHE_FLAGS (O_DIRECT | O_DSYNC | O_ACCMODE)
+
+struct fd_cache_entry {
+	uint64_t oid;
+	int flags;
+	int fd;
+	int refcnt;		/* protected by the lock of the shard */
+	bool cached;
+	struct hlist_node hash;
+	struct list_head lru;
+};
+
+struct fd_cache_shard {
+	pthread_mutex_t lock;
+	uint64_t gen;
+	int nr;
+	struct list_head lru;
+	struct hlist_head hash[1 << FD_CACHE_HASH_BITS];
+} __attribute__((aligned(64)));
+
+static struct fd_cache_shard shards[FD_CACHE_NR_SHARDS];
+
+static inline struct fd_cache_shard *oid_to_shard(uint64_t oid)
+{
+	return shards + (hash_64(oid, 64) & (FD_CACHE_NR_SHARDS - 1));
+}
+
+static inline struct hlist_head *oid_to_bucket(struct fd_cache_shard *s,
+					       uint64_t oid)
+{
+	return s->hash + (hash_64(oid, 64) >> (64 - FD_CACHE_HASH_BITS));
+}
+
+/* Drop 'e' from the cache.  Return true if nobody uses it any more */
+static bool unlink_entry(struct fd_cache_shard *s, struct fd_cache_entry *e)
+{
+	hlist_del(&e->hash);
+	list_del(&e->lru);
+	e->cached = false;
+	s->nr--;
+
+	return e->refcnt == 0;
+}
+
+static void free_entry(struct fd_cache_entry *e)
+{
+	close(e->fd);
+	free(e);
+}
+
+/*
+ * Return the cached file of 'oid' opened with 'flags', or open it with
+ * 'open_fn'.  Return NULL with errno set if it can't be opened.  The entry
+ * must be released with fd_cache_put().
+ */
+struct fd_cache_entry *fd_cache_get(uint64_t oid, int flags,
+				    int (*open_fn)(uint64_t oid, int flags))
+{
+	struct fd_cache_shard *s = oid_to_shard(oid);
+	struct hlist_head *head = oid_to_bucket(s, oid);
+	struct fd_cache_entry *e, *new, *evict = NULL;
+	struct hlist_node *node;
+	uint64_t gen;
+	int fd;
+
+	flags &= FD_CACHE_FLAGS;
+
+	pthread_mutex_lock(&s->lock);
+	hlist_for_each_entry(e, node, head, hash) {
+		if (e->oid == oid && e->flags == flags) {
+			e->refcnt++;
+			list_move(&e->lru, &s->lru);
+			pthread_mutex_unlock(&s->lock);
+			return e;
+		}
+	}
+	gen = s->gen;
+	pthread_mutex_unlock(&s->lock);
+
+	fd = open_fn(oid, flags);
+	if (fd < 0)
+		return NULL;
+
+	new = xzalloc(sizeof(*new));
+	new->oid = oid;
+	new->flags = flags;
+	new->fd = fd;
+	new->refcnt = 1;
+
+	pthread_mutex_lock(&s->lock);
+	if (gen != s->gen)
+		goto out;
+	hlist_for_each_entry(e, node, head, hash) {
+		/* Somebody else has opened it too */
+		if (e->oid == oid && e->flags == flags)
+			goto out;
+	}
+
+	new->cached = true;
+	hlist_add_head(&new->hash, head);
+	list_add(&new->lru, &s->lru);
+	if (++s->nr > FD_CACHE_SIZE / FD_CACHE_NR_SHARDS) {
+		e = list_entry(s->lru.prev, struct fd_cache_entry, lru);
+		if (unlink_entry(s, e))
+			evict = e;
+	}
+out:
+	pthread_mutex_unlock(&s->lock);
+
+	if (evict)
+		free_entry(evict);
+
+	return new;
+}
+
+void fd_cache_put(struct fd_cache_entry *e)
+{
+	struct fd_cache_shard *s = oid_to_shard(e->oid);
+	bool last;
+
+	pthread_mutex_lock(&s->lock);
+	last = --e->refcnt == 0 && !e->cached;
+	pthread_mutex_unlock(&s->lock);
+
+	if (last)
+		free_entry(e);
+}
+
+int fd_cache_fd(const struct fd_cache_entry *e)
+{
+	return e->fd;
+}
+
+/* Drop the files of 'oid' with any flags */
+void fd_cache_invalidate(uint64_t oid)
+{
+	struct fd_cache_shard *s = oid_to_shard(oid);
+	struct hlist_head *head = oid_to_bucket(s, oid);
+	struct fd_cache_entry *e, *t;
+	struct hlist_node *node, *n;
+	LIST_HEAD(list);
+
+	pthread_mutex_lock(&s->lock);
+	s->gen++;
+	hlist_for_each_entry_safe(e, node, n, head, hash) {
+		if (e->oid == oid && unlink_entry(s, e))
+			list_add(&e->lru, &list);
+	}
+	pthread_mutex_unlock(&s->lock);
+
+	list_for_each_entry_safe(e, t, &list, lru)
+		free_entry(e);
+}
+
+/* Drop all the cached files */
+void fd_cache_purge(void)
+{
+	struct fd_cache_entry *e, *t;
+	struct fd_cache_shard *s;
+	LIST_HEAD(list);
+
+	for (s = shards; s < shards + FD_CACHE_NR_SHARDS; s++) {
+		pthread_mutex_lock(&s->lock);
+		s->gen++;
+		list_for_each_entry_safe(e, t, &s->lru, lru) {
+			if (unlink_entry(s, e))
+				list_add(&e->lru, &list);
+		}
+		pthread_mutex_unlock(&s->lock);
+	}
+
+	list_for_each_entry_safe(e, t, &list, lru)
+		free_entry(e);
+}
+
+static void __attribute__((constructor)) fd_cache_init(void)
+{
+	struct fd_cache_shard *s;
+
+	for (s = shards; s < shards + FD_CACHE_NR_SHARDS; s++) {
+		pthread_mutex_init(&s->lock, NULL);
+		INIT_LIST_HEAD(&s->lru);
+	}
+}
@@ -13,6 +13,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <poll.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
 
 #include "sheep_priv.h"
 
@@ -23,21 +25,88 @@ static inline void gateway_init_fwd_hdr(struct sd_req *fwd, struct sd_req *hdr)
 	fwd->proto_ver = SD_SHEEP_PROTO_VER;
 }
 
+/* Read the object from the remote node and account the latency */
+static int gateway_read_remote(struct request *req, const struct node_id *nid)
+{
+	struct sd_req fwd_hdr;
+	struct sd_rsp *rsp = (struct sd_rsp *)&fwd_hdr;
+	uint64_t start = clock_get_usec();
+	int ret;
+
+	gateway_init_fwd_hdr(&fwd_hdr, &req->rq);
+	sheep_node_read_start(nid);
+	ret = sheep_exec_req(nid, &fwd_hdr, req->data);
+	sheep_node_read_done(nid, clock_get_usec() - start);
+	if (ret == SD_RES_SUCCESS)
+		memcpy(&req->rp, rsp, sizeof(*rsp));
+
+	return ret;
+}
+
+/*
+ * Sort the remote replicas by the expected read cost.  We start from a random
+ * replica so that the replicas of the same cost share the load, which is
+ * useful for reading base VM's COW objects.
+ */
+static int sort_read_targets(const struct sd_node **obj_nodes, int nr_copies,
+			     const struct node_id **nids)
+{
+	uint64_t cost[SD_MAX_COPIES];
+	int i, j, nr = 0, start = random();
+
+	for (i = 0; i < nr_copies; i++) {
+		const struct sd_node *n = obj_nodes[(i + start) % nr_copies];
+		uint64_t c;
+
+		if (node_is_local(n))
+			continue;
+
+		c = sheep_node_read_cost(&n->nid);
+		for (j = nr; j > 0 && cost[j - 1] > c; j--) {
+			cost[j] = cost[j - 1];
+			nids[j] = nids[j - 1];
+		}
+		cost[j] = c;
+		nids[j] = &n->nid;
+		nr++;
+	}
+
+	return nr;
+}
+
+static int gateway_hedged_read(struct request *req,
+			       const struct node_id **nids, int nr,
+			       uint64_t hedge);
+
+static void untrim_read_rsp(struct request *req)
+{
+	if (req->rq.proto_ver >= SD_PROTO_VER_TRIM_ZERO_SECTORS)
+		return;
+
+	/* the client doesn't support trimming zero bytes */
+	untrim_zero_sectors(req->data, req->rp.obj.offset, req->rp.data_length,
+			    req->rq.data_length);
+	req->rp.data_length = req->rq.data_length;
+	req->rp.obj.offset = 0;
+}
+
 /*
  * Try our best to read one copy and read local first.
  *
+ * Remote replicas are tried in the order of the expected read latency.
  * Return success if any read succeed. We don't call gateway_forward_request()
  * because we only read once.
+ *
+ * A hedged read is left to the main thread with req->fwd, so only the
+ * requests which are done by gateway_op_done() can be hedged.
  */
-int gateway_read_obj(struct request *req)
+static int do_gateway_read_obj(struct request *req, bool can_hedge)
 {
 	int i, ret = SD_RES_SUCCESS;
-	struct sd_req fwd_hdr;
-	struct sd_rsp *rsp = (struct sd_rsp *)&fwd_hdr;
-	const struct sd_vnode *v;
-	const struct sd_vnode *obj_vnodes[SD_MAX_COPIES];
-	uint64_t oid = req->rq.obj.oid;
-	int nr_copies, j;
+	const struct sd_node *obj_nodes[SD_MAX_COPIES];
+	const struct node_id *nids[SD_MAX_COPIES];
+	uint64_t oid = req->rq.obj.oid, hedge = 0;
+	int nr_copies, nr;
 
 	if (sys->enable_object_cache && !req->local &&
 	    !bypass_object_cache(req)) {
@@ -45,12 +114,15 @@ int gateway_read_obj(struct request *req)
 		goto out;
 	}
 
+	if (is_ec_obj(oid)) {
+		ret = gateway_ec_read_obj(req);
+		goto out;
+	}
+
 	nr_copies = get_req_copy_number(req);
-	oid_to_vnodes(req->vinfo->vnodes, req->vinfo->nr_vnodes, oid,
-		      nr_copies, obj_vnodes);
+	vinfo_oid_to_nodes(req->vinfo, oid, nr_copies, obj_nodes);
 	for (i = 0; i < nr_copies; i++) {
-		v = obj_vnodes[i];
-		if (!vnode_is_local(v))
+		if (!node_is_local(obj_nodes[i]))
 			continue;
 		ret = peer_read_obj(req);
 		if (ret == SD_RES_SUCCESS)
@@ -61,182 +133,661 @@ int gateway_read_obj(struct request *req)
 		break;
 	}
 
-	/*
-	 * Read random copy from cluster for better load balance, useful for
-	 * reading base VM's COW objects
-	 */
-	j = random();
-	for (i = 0; i < nr_copies; i++) {
-		int idx = (i + j) % nr_copies;
-
-		v = obj_vnodes[idx];
-		if (vnode_is_local(v))
-			continue;
-		/*
-		 * We need to re-init it because rsp and req share the same
-		 * structure.
-		 */
-		gateway_init_fwd_hdr(&fwd_hdr, &req->rq);
-		ret = sheep_exec_req(&v->nid, &fwd_hdr, req->data);
-		if (ret != SD_RES_SUCCESS)
-			continue;
+	nr = sort_read_targets(obj_nodes, nr_copies, nids);
+	if (can_hedge && sys->hedge_read_pct && nr > 1)
+		hedge = sheep_read_latency_percentile(sys->hedge_read_pct);
+	if (hedge && hedge < POLL_TIMEOUT * 1000000ULL)
+		/* The response is received by gateway_wait_forward_request() */
+		return gateway_hedged_read(req, nids, nr, hedge);
 
-		/* Read success */
-		memcpy(&req->rp, rsp, sizeof(*rsp));
-		break;
+	for (i = 0; i < nr; i++) {
+		ret = gateway_read_remote(req, nids[i]);
+		if (ret == SD_RES_SUCCESS)
+			break;
 	}
 out:
-	if (ret == SD_RES_SUCCESS &&
-	    req->rq.proto_ver < SD_PROTO_VER_TRIM_ZERO_SECTORS) {
-		/* the client doesn't support trimming zero bytes */
-		untrim_zero_sectors(req->data, req->rp.obj.offset,
-				    req->rp.data_length, req->rq.data_length);
-		req->rp.data_length = req->rq.data_length;
-		req->rp.obj.offset = 0;
-	}
+	if (ret == SD_RES_SUCCESS)
+		untrim_read_rsp(req);
 	return ret;
 }
 
-struct write_info_entry {
-	struct pollfd pfd;
-	const struct node_id *nid;
+int gateway_read_obj(struct request *req)
+{
+	return do_gateway_read_obj(req, true);
+}
+
+/* Read an object for a request which is made up in the worker thread */
+int gateway_read_obj_sync(struct request *req)
+{
+	return do_gateway_read_obj(req, false);
+}
+
+/*
+ * Forwarded requests are completion driven: the gateway worker sends the
+ * request to all the replicas and returns, and then the sockets are watched by
+ * the main event loop.  The request is done when the last ack arrives, so an
+ * in-flight write doesn't hold a worker thread while waiting for the peers.
+ *
+ * A hedged read is sent to one replica at first, and the main thread sends it
+ * to the next one when the hedge deadline passes or the read fails.  The
+ * first replica which responds successfully gets the data, and the other
+ * reads are abandoned.
+ */
+struct forward_info_entry {
+	struct node_id nid;
 	struct sockfd *sfd;
+	struct sd_rsp rsp;
+	size_t rsp_len; /* bytes of rsp received so far */
+	bool done;
+	bool abandoned; /* the response is out of sync with the connection */
+	uint64_t start; /* when the read is sent, in microseconds */
+	struct forward_info *fi;
 };
 
-struct write_info {
-	struct write_info_entry ent[SD_MAX_NODES];
+struct forward_info {
 	int nr_sent;
+	int nr_pending;
+	int repeat;
+	int err_ret;
+	uint64_t deadline;		/* in microseconds */
+	struct list_head wait_list;
+	struct request *req;
+
+	/* hedged reads */
+	bool read;
+	uint64_t hedge;			/* in microseconds */
+	int nr_targets;			/* entries which have a sockfd */
+	uint32_t data_len;		/* bytes of the data received so far */
+	struct forward_info_entry *reader; /* the entry receiving the data */
+
+	struct forward_info_entry ent[];
 };
 
-static inline void write_info_update(struct write_info *wi, int pos)
+#define NR_HEDGED_READS 2
+
+/*
+ * The forwarded requests waiting for acks, in the order of their deadlines.
+ * Any progress pushes the deadline of a request back to POLL_TIMEOUT from
+ * then, which is usually the tail, and the earlier hedge deadlines of the
+ * reads are sorted in.  The timer is armed for the head of the list.  Only the
+ * main thread touches them.
+ */
+static LIST_HEAD(forward_wait_list);
+static int forward_timer_fd = -1;
+static uint64_t forward_timer_expire; /* 0 if the timer isn't armed */
+
+static struct forward_info *alloc_forward_info(int nr_ent)
 {
-	sd_dprintf("%d, %d", wi->nr_sent, pos);
-	wi->nr_sent--;
-	memmove(wi->ent + pos, wi->ent + pos + 1,
-		sizeof(struct write_info_entry) * (wi->nr_sent - pos));
+	return xzalloc(sizeof(struct forward_info) +
+		       sizeof(struct forward_info_entry) * nr_ent);
 }
 
-static inline void finish_one_write(struct write_info *wi, int i)
+/*
+ * Send a request whose data is kept until all the replicas ack, so it can be
+ * sent without being copied into the socket buffers
+ */
+static int forward_send_req(struct sockfd *sfd, struct sd_req *hdr,
+			    void *data, unsigned int wlen, uint32_t epoch)
 {
-	sheep_put_sockfd(wi->ent[i].nid, wi->ent[i].sfd);
-	write_info_update(wi, i);
+	if (sys->zerocopy)
+		return send_req_zerocopy(sfd->fd, hdr, data, wlen,
+					 sheep_need_retry, epoch);
+
+	return send_req(sfd->fd, hdr, data, wlen, sheep_need_retry, epoch);
 }
 
-static inline void finish_one_write_err(struct write_info *wi, int i)
+static inline void forward_info_advance(struct forward_info *fi,
+					const struct node_id *nid,
+					struct sockfd *sfd)
 {
-	sheep_del_sockfd(wi->ent[i].nid, wi->ent[i].sfd);
-	write_info_update(wi, i);
+	struct forward_info_entry *e = fi->ent + fi->nr_sent;
+
+	e->nid = *nid;
+	e->sfd = sfd;
+	e->fi = fi;
+	fi->nr_sent++;
 }
 
-struct pfd_info {
-	struct pollfd pfds[SD_MAX_NODES];
-	int nr;
-};
+static void forward_read_finish(struct forward_info *fi)
+{
+	struct request *req = fi->req;
+	int i;
+
+	/* Release the sockfds of the replicas which we didn't have to ask */
+	for (i = fi->nr_sent; i < fi->nr_targets; i++)
+		sheep_put_sockfd(&fi->ent[i].nid, fi->ent[i].sfd);
+
+	if (!fi->reader)
+		return;
+
+	memcpy(&req->rp, &fi->reader->rsp, sizeof(req->rp));
+	fi->err_ret = SD_RES_SUCCESS;
+	untrim_read_rsp(req);
+}
+
+static void forward_finish(struct forward_info *fi)
+{
+	struct request *req = fi->req;
+
+	list_del(&fi->wait_list);
+	if (fi->read)
+		forward_read_finish(fi);
+
+	req->rp.result = fi->err_ret;
+	req->fwd = NULL;
+	free(fi);
+
+	/* We are done with the replicas, let the done handler go on */
+	req->work.done(&req->work);
+}
+
+static void forward_timer_arm(uint64_t deadline)
+{
+	struct itimerspec it;
+
+	if (forward_timer_expire && forward_timer_expire <= deadline)
+		return;
+
+	memset(&it, 0, sizeof(it));
+	it.it_value.tv_sec = deadline / 1000000;
+	it.it_value.tv_nsec = deadline % 1000000 * 1000;
+	if (timerfd_settime(forward_timer_fd, TFD_TIMER_ABSTIME, &it, NULL) < 0)
+		panic("failed to arm forward timer, %m");
+	forward_timer_expire = deadline;
+}
+
+static void forward_timer_set(struct forward_info *fi, uint64_t deadline)
+{
+	struct list_head *p;
+
+	fi->deadline = deadline;
+	list_del_init(&fi->wait_list);
+	for (p = forward_wait_list.prev; p != &forward_wait_list; p = p->prev)
+		if (list_entry(p, struct forward_info, wait_list)->deadline <=
+		    deadline)
+			break;
+	list_add(&fi->wait_list, p);
+
+	forward_timer_arm(deadline);
+}
+
+/* Like the poll-based path, any progress restarts the timeout */
+static void forward_timer_restart(struct forward_info *fi)
+{
+	forward_timer_set(fi, clock_get_usec() + POLL_TIMEOUT * 1000000ULL);
+}
+
+static bool forward_read_can_hedge(const struct forward_info *fi)
+{
+	return fi->read && !fi->reader && fi->nr_pending < NR_HEDGED_READS &&
+		fi->nr_sent < fi->nr_targets;
+}
+
+static void forward_read_restart(struct forward_info *fi)
+{
+	if (forward_read_can_hedge(fi))
+		forward_timer_set(fi, fi->ent[fi->nr_sent - 1].start +
+				  fi->hedge);
+	else
+		forward_timer_restart(fi);
+}
+
+/* Send the read to the next replica, and return its entry */
+static struct forward_info_entry *forward_read_send(struct forward_info *fi)
+{
+	struct request *req = fi->req;
+	struct forward_info_entry *e;
+	struct sd_req hdr;
+
+	gateway_init_fwd_hdr(&hdr, &req->rq);
+	while (fi->nr_sent < fi->nr_targets) {
+		e = fi->ent + fi->nr_sent++;
+		e->start = clock_get_usec();
+		sheep_node_read_start(&e->nid);
+		if (!send_req(e->sfd->fd, &hdr, NULL, 0, sheep_need_retry,
+			      req->rq.epoch))
+			return e;
+
+		sheep_node_read_done(&e->nid, clock_get_usec() - e->start);
+		sheep_del_sockfd(&e->nid, e->sfd);
+		e->done = true;
+		fi->err_ret = SD_RES_NETWORK_ERROR;
+	}
+
+	return NULL;
+}
 
-static inline void pfd_info_init(struct write_info *wi, struct pfd_info *pi)
+static void forward_entry_done(struct forward_info_entry *e, bool broken);
+static int forward_recv_start(struct forward_info_entry *e);
+
+/* Called in the main thread to ask one more replica */
+static void forward_read_next(struct forward_info *fi)
+{
+	struct forward_info_entry *e;
+
+	while ((e = forward_read_send(fi))) {
+		fi->nr_pending++;
+		if (forward_recv_start(e) == 0)
+			return;
+
+		fi->err_ret = SD_RES_NETWORK_ERROR;
+		forward_entry_done(e, true);
+	}
+}
+
+static void forward_read_entry_done(struct forward_info *fi)
+{
+	/*
+	 * Don't wait for the hedge timeout to ask the next replica.  The extra
+	 * count keeps 'fi' while the new reads fail one after another.
+	 */
+	if (forward_read_can_hedge(fi)) {
+		fi->nr_pending++;
+		forward_read_next(fi);
+		fi->nr_pending--;
+	}
+
+	if (fi->nr_pending == 0)
+		forward_finish(fi);
+	else
+		forward_read_restart(fi);
+}
+
+static void forward_entry_done(struct forward_info_entry *e, bool broken)
+{
+	struct forward_info *fi = e->fi;
+
+	unregister_event(e->sfd->fd);
+	if (e->abandoned)
+		sheep_close_sockfd(&e->nid, e->sfd);
+	else if (broken)
+		sheep_del_sockfd(&e->nid, e->sfd);
+	else {
+		if (sys->zerocopy)
+			reap_zerocopy(e->sfd->fd);
+		sheep_put_sockfd(&e->nid, e->sfd);
+	}
+	e->done = true;
+
+	sd_dprintf("%d, %d", fi->nr_pending, fi->nr_sent);
+	fi->nr_pending--;
+	if (fi->read) {
+		sheep_node_read_done(&e->nid, clock_get_usec() - e->start);
+		if (fi->reader == e && broken)
+			fi->reader = NULL;
+		forward_read_entry_done(fi);
+		return;
+	}
+
+	if (fi->nr_pending == 0)
+		forward_finish(fi);
+}
+
+static void forward_rsp_received(struct forward_info_entry *e)
+{
+	struct forward_info *fi = e->fi;
+	struct request *req = fi->req;
+
+	forward_timer_restart(fi);
+
+	memcpy(&req->rp, &e->rsp, sizeof(e->rsp));
+	if (e->rsp.result != SD_RES_SUCCESS) {
+		sd_eprintf("fail %"PRIx64", %s", req->rq.obj.oid,
+			   sd_strerror(e->rsp.result));
+		fi->err_ret = e->rsp.result;
+	}
+	forward_entry_done(e, false);
+}
+
+/* The late response is still on the way, so the connection can't be reused */
+static void forward_read_abandon(struct forward_info_entry *e)
 {
+	e->abandoned = true;
+	if (event_async_io())
+		/* The receive in flight fails, and then closes it */
+		shutdown(e->sfd->fd, SHUT_RDWR);
+	else
+		forward_entry_done(e, false);
+}
+
+/*
+ * The first successful response wins and abandons the other reads.  Return
+ * true if the data of 'e' follows.
+ */
+static bool forward_read_rsp_received(struct forward_info_entry *e)
+{
+	struct forward_info *fi = e->fi;
+	struct request *req = fi->req;
 	int i;
-	for (i = 0; i < wi->nr_sent; i++)
-		pi->pfds[i] = wi->ent[i].pfd;
-	pi->nr = wi->nr_sent;
+
+	if (e->rsp.result != SD_RES_SUCCESS) {
+		sd_eprintf("failed %s", sd_strerror(e->rsp.result));
+		fi->err_ret = e->rsp.result;
+		forward_entry_done(e, false);
+		return false;
+	}
+	if (e->rsp.data_length > req->rq.data_length) {
+		sd_eprintf("too long data %"PRIu32, e->rsp.data_length);
+		fi->err_ret = SD_RES_NETWORK_ERROR;
+		forward_entry_done(e, true);
+		return false;
+	}
+
+	fi->reader = e;
+	for (i = 0; i < fi->nr_sent; i++)
+		if (fi->ent + i != e && !fi->ent[i].done &&
+		    !fi->ent[i].abandoned)
+			forward_read_abandon(fi->ent + i);
+
+	if (e->rsp.data_length == 0) {
+		forward_entry_done(e, false);
+		return false;
+	}
+	forward_timer_restart(fi);
+	return true;
+}
+
+/* Return the buffer for the rest of the response */
+static void *forward_recv_buf(struct forward_info_entry *e, size_t *len)
+{
+	struct forward_info *fi = e->fi;
+
+	if (e->rsp_len < sizeof(e->rsp)) {
+		*len = sizeof(e->rsp) - e->rsp_len;
+		return (char *)&e->rsp + e->rsp_len;
+	}
+
+	*len = e->rsp.data_length - fi->data_len;
+	return (char *)fi->req->data + fi->data_len;
 }
 
 /*
- * Wait for all forward requests completion.
- *
- * Even if something goes wrong, we have to wait forward requests completion to
- * avoid interleaved requests.
- *
- * Return error code if any one request fails.
+ * Account 'len' bytes received by 'e', and return true if more of the
+ * response is expected
  */
-static int wait_forward_request(struct write_info *wi, struct request *req)
-{
-	int nr_sent, err_ret = SD_RES_SUCCESS, ret, pollret, i,
-	    repeat = MAX_RETRY_COUNT;
-	struct pfd_info pi;
-	struct sd_rsp *rsp = &req->rp;
-again:
-	pfd_info_init(wi, &pi);
-	pollret = poll(pi.pfds, pi.nr, 1000 * POLL_TIMEOUT);
-	if (pollret < 0) {
-		if (errno == EINTR)
-			goto again;
-
-		panic("%m");
-	} else if (pollret == 0) {
-		/*
-		 * If IO NIC is down, epoch isn't incremented, so we can't retry
-		 * for ever.
-		 */
-		if (sheep_need_retry(req->rq.epoch) && repeat) {
-			repeat--;
-			sd_printf(SDOG_WARNING,
-				  "poll timeout %d, disks of some nodes or"
-				   " network is busy. Going to poll-wait again",
-				   wi->nr_sent);
-			goto again;
-		}
+static bool forward_recv_progress(struct forward_info_entry *e, size_t len)
+{
+	struct forward_info *fi = e->fi;
 
-		nr_sent = wi->nr_sent;
-		/* XXX Blinedly close all the connections */
-		for (i = 0; i < nr_sent; i++)
-			sheep_del_sockfd(wi->ent[i].nid, wi->ent[i].sfd);
+	if (e->rsp_len < sizeof(e->rsp)) {
+		e->rsp_len += len;
+		if (e->rsp_len < sizeof(e->rsp))
+			/* Short read, wait for the rest of the header */
+			return true;
+		if (fi->read)
+			return forward_read_rsp_received(e);
+		forward_rsp_received(e);
+		return false;
+	}
 
-		return SD_RES_NETWORK_ERROR;
+	fi->data_len += len;
+	if (fi->data_len < e->rsp.data_length) {
+		forward_timer_restart(fi);
+		return true;
 	}
+	forward_entry_done(e, false);
+	return false;
+}
 
-	nr_sent = wi->nr_sent;
-	for (i = 0; i < nr_sent; i++)
-		if (pi.pfds[i].revents & POLLIN)
+static void forward_rsp_handler(int fd, int events, void *data)
+{
+	struct forward_info_entry *e = data;
+	struct forward_info *fi = e->fi;
+	size_t len;
+	void *buf;
+	ssize_t ret;
+
+	/* Zero-copy completions are reported as socket errors */
+	if ((events & EPOLLERR) && sys->zerocopy && reap_zerocopy(fd) > 0) {
+		events &= ~EPOLLERR;
+		if (!(events & (EPOLLIN | EPOLLHUP)))
+			return;
+	}
+
+	if (events & (EPOLLERR | EPOLLHUP)) {
+		sd_dprintf("%d, revents %x", fd, events);
+		fi->err_ret = SD_RES_NETWORK_ERROR;
+		forward_entry_done(e, true);
+		return;
+	}
+
+	buf = forward_recv_buf(e, &len);
+	ret = recv(fd, buf, len, MSG_DONTWAIT);
+	if (ret <= 0) {
+		if (ret < 0 && (errno == EAGAIN || errno == EINTR))
+			return;
+		sd_eprintf("remote node might have gone away");
+		fi->err_ret = SD_RES_NETWORK_ERROR;
+		forward_entry_done(e, true);
+		return;
+	}
+
+	forward_recv_progress(e, ret);
+}
+
+static void forward_rsp_done(int res, void *data);
+
+/* Receive the rest of the response asynchronously */
+static int forward_async_recv(struct forward_info_entry *e)
+{
+	size_t len;
+	void *buf = forward_recv_buf(e, &len);
+
+	return event_recv(e->sfd->fd, buf, len, forward_rsp_done, e);
+}
+
+static void forward_rsp_done(int res, void *data)
+{
+	struct forward_info_entry *e = data;
+	struct forward_info *fi = e->fi;
+
+	if (e->abandoned) {
+		forward_entry_done(e, true);
+		return;
+	}
+
+	if (res <= 0) {
+		sd_eprintf("remote node might have gone away");
+		fi->err_ret = SD_RES_NETWORK_ERROR;
+		forward_entry_done(e, true);
+		return;
+	}
+
+	if (forward_recv_progress(e, res) && forward_async_recv(e) < 0) {
+		fi->err_ret = SD_RES_NETWORK_ERROR;
+		forward_entry_done(e, true);
+	}
+}
+
+static int forward_recv_start(struct forward_info_entry *e)
+{
+	if (event_async_io())
+		return forward_async_recv(e);
+
+	return register_event(e->sfd->fd, forward_rsp_handler, e);
+}
+
+static void forward_timeout(struct forward_info *fi)
+{
+	struct request *req = fi->req;
+	int i;
+
+	if (forward_read_can_hedge(fi)) {
+		sd_dprintf("hedge read %"PRIx64" after %"PRIu64" usec",
+			   req->rq.obj.oid, fi->hedge);
+		forward_read_next(fi);
+		forward_read_restart(fi);
+		return;
+	}
+
+	/*
+	 * If IO NIC is down, epoch isn't incremented, so we can't retry for
+	 * ever.
+	 */
+	if (sheep_need_retry(req->rq.epoch) && fi->repeat) {
+		fi->repeat--;
+		sd_printf(SDOG_WARNING,
+			  "poll timeout %d, disks of some nodes or"
+			  " network is busy. Going to poll-wait again",
+			  fi->nr_pending);
+		forward_timer_restart(fi);
+		return;
+	}
+
+	fi->err_ret = SD_RES_NETWORK_ERROR;
+	/* Don't ask the other replicas of a read any more */
+	fi->nr_targets = fi->nr_sent;
+
+	/* The receives in flight fail, and then finish the request */
+	if (event_async_io()) {
+		for (i = 0; i < fi->nr_sent; i++)
+			if (!fi->ent[i].done)
+				shutdown(fi->ent[i].sfd->fd, SHUT_RDWR);
+		forward_timer_restart(fi);
+		return;
+	}
+
+	/* XXX Blinedly close all the connections */
+	for (i = 0; i < fi->nr_sent; i++) {
+		struct forward_info_entry *e = fi->ent + i;
+
+		if (e->done)
+			continue;
+		unregister_event(e->sfd->fd);
+		sheep_del_sockfd(&e->nid, e->sfd);
+		if (fi->read)
+			sheep_node_read_done(&e->nid,
+					     clock_get_usec() - e->start);
+		e->done = true;
+	}
+	fi->nr_pending = 0;
+	fi->reader = NULL;
+	forward_finish(fi);
+}
+
+static void forward_timer_handler(int fd, int events, void *data)
+{
+	struct forward_info *fi;
+	uint64_t val, now;
+
+	if (read(fd, &val, sizeof(val)) < 0)
+		return;
+
+	forward_timer_expire = 0;
+	now = clock_get_usec();
+	while (!list_empty(&forward_wait_list)) {
+		fi = list_first_entry(&forward_wait_list, struct forward_info,
+				      wait_list);
+		if (fi->deadline > now) {
+			forward_timer_arm(fi->deadline);
 			break;
-	if (i < nr_sent) {
-		int re = pi.pfds[i].revents;
-		sd_dprintf("%d, revents %x", i, re);
-		if (re & (POLLERR | POLLHUP | POLLNVAL)) {
-			err_ret = SD_RES_NETWORK_ERROR;
-			finish_one_write_err(wi, i);
-			goto finish_write;
-		}
-		if (do_read(pi.pfds[i].fd, rsp, sizeof(*rsp), sheep_need_retry,
-			    req->rq.epoch)) {
-			sd_eprintf("remote node might have gone away");
-			err_ret = SD_RES_NETWORK_ERROR;
-			finish_one_write_err(wi, i);
-			goto finish_write;
 		}
+		/* Either finishes 'fi' or moves it back */
+		forward_timeout(fi);
+	}
+}
 
-		ret = rsp->result;
-		if (ret != SD_RES_SUCCESS) {
-			sd_eprintf("fail %"PRIx64", %s", req->rq.obj.oid,
-				   sd_strerror(ret));
-			err_ret = ret;
+static void forward_timer_init(void)
+{
+	forward_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+	if (forward_timer_fd < 0)
+		panic("timerfd_create: %m");
+
+	if (register_event(forward_timer_fd, forward_timer_handler, NULL) < 0)
+		panic("failed to set up forward timer, %m");
+}
+
+/*
+ * Start waiting for the forwarded requests of 'req' in the main thread.
+ *
+ * Even if something goes wrong, we have to wait forward requests completion to
+ * avoid interleaved requests.  When the last ack arrives, req->rp.result is
+ * set to the error code if any one request fails, and req->work.done() is
+ * called again.
+ */
+void gateway_wait_forward_request(struct request *req)
+{
+	struct forward_info *fi = req->fwd;
+	int i, ret;
+
+	assert(is_main_thread());
+
+	fi->req = req;
+	fi->err_ret = req->rp.result;
+	fi->repeat = MAX_RETRY_COUNT;
+	fi->nr_pending = fi->nr_sent;
+
+	if (forward_timer_fd < 0)
+		forward_timer_init();
+	INIT_LIST_HEAD(&fi->wait_list);
+
+	if (fi->read) {
+		/* The worker has sent the read to the first replica */
+		if (forward_recv_start(fi->ent) < 0) {
+			fi->err_ret = SD_RES_NETWORK_ERROR;
+			forward_entry_done(fi->ent, true);
+		} else
+			forward_read_restart(fi);
+		return;
+	}
+	forward_timer_restart(fi);
+
+	for (i = 0; i < fi->nr_sent; i++) {
+		struct forward_info_entry *e = fi->ent + i;
+
+		ret = forward_recv_start(e);
+		if (ret < 0) {
+			sheep_del_sockfd(&e->nid, e->sfd);
+			e->done = true;
+			fi->err_ret = SD_RES_NETWORK_ERROR;
+			fi->nr_pending--;
 		}
-		finish_one_write(wi, i);
 	}
-finish_write:
-	if (wi->nr_sent > 0)
-		goto again;
 
-	return err_ret;
+	if (fi->nr_pending == 0)
+		forward_finish(fi);
 }
 
-static inline void write_info_init(struct write_info *wi, size_t nr_to_send)
+/*
+ * Read from the cheapest replica, and if it doesn't respond within the
+ * 'hedge' latency, send the same read to the next replica and take whichever
+ * response comes first.  A failed read also makes us try the next replica.
+ * Only the first read is sent here, and the rest is done in the main thread
+ * by gateway_wait_forward_request(), so the worker doesn't wait for a slow
+ * replica.
+ */
+static int gateway_hedged_read(struct request *req,
+			       const struct node_id **nids, int nr,
+			       uint64_t hedge)
 {
+	struct forward_info *fi = alloc_forward_info(nr);
+	struct sockfd *sfd;
 	int i;
-	for (i = 0; i < nr_to_send; i++)
-		wi->ent[i].pfd.fd = -1;
-	wi->nr_sent = 0;
-}
 
-static inline void
-write_info_advance(struct write_info *wi, const struct node_id *nid,
-		   struct sockfd *sfd)
-{
-	wi->ent[wi->nr_sent].nid = nid;
-	wi->ent[wi->nr_sent].pfd.fd = sfd->fd;
-	wi->ent[wi->nr_sent].pfd.events = POLLIN;
-	wi->ent[wi->nr_sent].sfd = sfd;
-	wi->nr_sent++;
+	fi->req = req;
+	fi->read = true;
+	fi->hedge = hedge;
+
+	/* Connect in the worker, so the main thread only has to send */
+	for (i = 0; i < nr; i++) {
+		struct forward_info_entry *e = fi->ent + fi->nr_targets;
+
+		sfd = sheep_get_sockfd(nids[i]);
+		if (!sfd)
+			continue;
+		e->nid = *nids[i];
+		e->sfd = sfd;
+		e->fi = fi;
+		fi->nr_targets++;
+	}
+
+	if (!forward_read_send(fi)) {
+		free(fi);
+		return SD_RES_NETWORK_ERROR;
+	}
+
+	req->fwd = fi;
+	return SD_RES_SUCCESS;
 }
 
 static int init_target_nodes(struct request *req, uint64_t oid,
@@ -246,8 +797,7 @@ static int init_target_nodes(struct request *req, uint64_t oid,
 	const struct vnode_info *vinfo = req->vinfo;
 
 	nr_to_send = get_req_copy_number(req);
-	oid_to_nodes(vinfo->vnodes, vinfo->nr_vnodes, oid, nr_to_send,
-		     vinfo->nodes, target_nodes);
+	vinfo_oid_to_nodes(vinfo, oid, nr_to_send, target_nodes);
 
 	return nr_to_send;
 }
@@ -258,7 +808,7 @@ static int gateway_forward_request(struct request *req)
 	unsigned wlen;
 	uint64_t oid = req->rq.obj.oid;
 	int nr_to_send;
-	struct write_info wi;
+	struct forward_info *fi;
 	const struct sd_op_template *op;
 	struct sd_req hdr;
 	const struct sd_node *target_nodes[SD_MAX_NODES];
@@ -270,7 +820,7 @@ static int gateway_forward_request(struct request *req)
 
 	wlen = hdr.data_length;
 	nr_to_send = init_target_nodes(req, oid, target_nodes);
-	write_info_init(&wi, nr_to_send);
+	fi = alloc_forward_info(nr_to_send);
 
 	for (i = 0; i < nr_to_send; i++) {
 		struct sockfd *sfd;
@@ -288,15 +838,15 @@ static int gateway_forward_request(struct request *req)
 			break;
 		}
 
-		ret = send_req(sfd->fd, &hdr, req->data, wlen,
-			       sheep_need_retry, req->rq.epoch);
+		ret = forward_send_req(sfd, &hdr, req->data, wlen,
+				       req->rq.epoch);
 		if (ret) {
 			sheep_del_sockfd(nid, sfd);
 			err_ret = SD_RES_NETWORK_ERROR;
 			sd_dprintf("fail %d", ret);
 			break;
 		}
-		write_info_advance(&wi, nid, sfd);
+		forward_info_advance(fi, nid, sfd);
 	}
 
 	if (local != -1 && err_ret == SD_RES_SUCCESS) {
@@ -310,16 +860,105 @@ static int gateway_forward_request(struct request *req)
 		}
 	}
 
-	sd_dprintf("nr_sent %d, err %x", wi.nr_sent, err_ret);
-	if (wi.nr_sent > 0) {
-		ret = wait_forward_request(&wi, req);
-		if (ret != SD_RES_SUCCESS)
+	sd_dprintf("nr_sent %d, err %x", fi->nr_sent, err_ret);
+	if (fi->nr_sent > 0)
+		/* Acks are collected by gateway_wait_forward_request() */
+		req->fwd = fi;
+	else
+		free(fi);
+
+	return err_ret;
+}
+
+/*
+ * Chain replication: the data leaves the gateway only once.  It is sent to the
+ * first target which doesn't have it yet, and every hop writes it locally and
+ * passes it on to the next target, so an ack from the next hop means that all
+ * the following replicas are done.  'done_map' is the bitmap of the target
+ * nodes, in oid_to_nodes() order, which have already written the object.
+ */
+static int forward_chain_request(struct request *req, uint8_t opcode,
+				 uint8_t done_map)
+{
+	int i, err_ret = SD_RES_SUCCESS, ret, local = -1, next = -1;
+	uint64_t oid = req->rq.obj.oid;
+	int nr_copies;
+	struct forward_info *fi;
+	const struct sd_op_template *op = get_sd_op(opcode);
+	struct sd_req hdr;
+	const struct sd_node *target_nodes[SD_MAX_NODES];
+
+	nr_copies = init_target_nodes(req, oid, target_nodes);
+	for (i = 0; i < nr_copies; i++) {
+		if (node_is_local(target_nodes[i])) {
+			local = i;
+			done_map |= 1 << i;
+		}
+	}
+	for (i = 0; i < nr_copies; i++) {
+		if (!(done_map & (1 << i))) {
+			next = i;
+			break;
+		}
+	}
+
+	sd_dprintf("%"PRIx64", local %d, next %d", oid, local, next);
+
+	fi = alloc_forward_info(1);
+	if (next != -1) {
+		const struct node_id *nid = &target_nodes[next]->nid;
+		struct sockfd *sfd;
+
+		memcpy(&hdr, &req->rq, sizeof(hdr));
+		hdr.opcode = SD_OP_CHAIN_WRITE_PEER;
+		hdr.proto_ver = SD_SHEEP_PROTO_VER;
+		hdr.chain.opcode = opcode;
+		hdr.chain.copies = nr_copies;
+		hdr.chain.done_map = done_map;
+
+		sfd = sheep_get_sockfd(nid);
+		if (!sfd)
+			err_ret = SD_RES_NETWORK_ERROR;
+		else {
+			ret = forward_send_req(sfd, &hdr, req->data,
+					       hdr.data_length, req->rq.epoch);
+			if (ret) {
+				sheep_del_sockfd(nid, sfd);
+				err_ret = SD_RES_NETWORK_ERROR;
+				sd_dprintf("fail %d", ret);
+			} else
+				forward_info_advance(fi, nid, sfd);
+		}
+	}
+
+	if (local != -1 && err_ret == SD_RES_SUCCESS) {
+		assert(op);
+		ret = sheep_do_op_work(op, req);
+		if (ret != SD_RES_SUCCESS) {
+			sd_eprintf("fail to write local %"PRIx64", %s", oid,
+				   sd_strerror(ret));
 			err_ret = ret;
+		}
 	}
 
+	if (fi->nr_sent > 0)
+		/* The ack of the next hop is collected in the main thread */
+		req->fwd = fi;
+	else
+		free(fi);
+
 	return err_ret;
 }
 
+static int gateway_forward_write(struct request *req)
+{
+	if (sys->chain_replication)
+		return forward_chain_request(req,
+				gateway_to_peer_opcode(req->rq.opcode), 0);
+
+	return gateway_forward_request(req);
+}
+
 int gateway_write_obj(struct request *req)
 {
 	uint64_t oid = req->rq.obj.oid;
@@ -330,7 +969,10 @@ int gateway_write_obj(struct request *req)
 	if (!bypass_object_cache(req))
 		return object_cache_handle_request(req);
 
-	return gateway_forward_request(req);
+	if (is_ec_obj(oid))
+		return gateway_ec_write_obj(req);
+
+	return gateway_forward_write(req);
 }
 
 int gateway_create_and_write_obj(struct request *req)
@@ -343,10 +985,432 @@ int gateway_create_and_write_obj(struct request *req)
 	if (!bypass_object_cache(req))
 		return object_cache_handle_request(req);
 
-	return gateway_forward_request(req);
+	if (is_ec_obj(oid))
+		return gateway_ec_write_obj(req);
+
+	return gateway_forward_write(req);
 }
 
 int gateway_remove_obj(struct request *req)
 {
+	if (is_ec_obj(req->rq.obj.oid))
+		return gateway_ec_remove_obj(req);
+
 	return gateway_forward_request(req);
 }
+
+/*
+ * Vectored requests
+ *
+ * The segments are grouped by the node which serves them, and each node gets
+ * one peer request with all its segments.  The peer requests are sent before
+ * we wait for any of them, so the nodes work in parallel.
+ */
+struct objs_group {
+	int nr_segs;
+	struct sd_obj_seg *segs;
+	uint32_t *idx; /* index of the segments in the request */
+	uint64_t len; /* length of the segment data */
+	struct sockfd *sfd;
+	int ret;
+};
+
+static void objs_group_add(struct objs_group *g, const struct sd_obj_seg *seg,
+			   uint32_t idx, uint32_t max_segs)
+{
+	if (!g->segs) {
+		g->segs = xmalloc(sizeof(*g->segs) * max_segs);
+		g->idx = xmalloc(sizeof(*g->idx) * max_segs);
+	}
+	g->segs[g->nr_segs] = *seg;
+	g->idx[g->nr_segs++] = idx;
+	g->len += seg->length;
+}
+
+static void free_objs_groups(struct objs_group *groups, int nr)
+{
+	int i;
+
+	for (i = 0; i < nr; i++) {
+		free(groups[i].segs);
+		free(groups[i].idx);
+	}
+	free(groups);
+}
+
+/* Return the offsets of the segment data in the data of the request */
+static uint64_t *objs_data_offsets(const struct sd_obj_seg *segs,
+				   uint32_t nr_segs)
+{
+	uint64_t *off = xmalloc(sizeof(*off) * nr_segs), o = 0;
+	uint32_t i;
+
+	for (i = 0; i < nr_segs; i++) {
+		off[i] = o;
+		o += segs[i].length;
+	}
+
+	return off;
+}
+
+/* Make a single object request out of a segment of the vectored request */
+static void init_seg_request(struct request *sub, const struct request *req,
+			     const struct sd_obj_seg *seg, uint8_t opcode,
+			     void *data)
+{
+	memset(sub, 0, sizeof(*sub));
+	sub->rq = req->rq;
+	sub->rq.opcode = opcode;
+	if (opcode == SD_OP_READ_OBJ)
+		sub->rq.flags &= ~SD_FLAG_CMD_WRITE;
+	/* Ask for the untrimmed data */
+	sub->rq.proto_ver = 0;
+	sub->rq.data_length = seg->length;
+	sub->rq.obj.oid = seg->oid;
+	sub->rq.obj.cow_oid = 0;
+	sub->rq.obj.tgt_epoch = 0;
+	sub->rq.obj.offset = seg->offset;
+	sub->data = data;
+	sub->data_length = seg->length;
+	sub->vinfo = req->vinfo;
+	sub->local = req->local;
+}
+
+/* Serve the segments one by one with the object cache */
+static int objs_cache_rw(struct request *req, const struct sd_obj_seg *segs,
+			 char *buf, const uint64_t *off, uint8_t opcode)
+{
+	struct request sub;
+	uint32_t i;
+	int ret;
+
+	for (i = 0; i < req->rq.objs.nr_segs; i++) {
+		init_seg_request(&sub, req, segs + i, opcode, buf + off[i]);
+		ret = object_cache_handle_request(&sub);
+		if (ret != SD_RES_SUCCESS)
+			return ret;
+	}
+
+	return SD_RES_SUCCESS;
+}
+
+static int objs_group_send(struct request *req, struct objs_group *g,
+			   const struct node_id *nid, uint8_t opcode,
+			   const struct iovec *iov, int iovcnt)
+{
+	struct sd_req hdr;
+	int i;
+
+	memcpy(&hdr, &req->rq, sizeof(hdr));
+	hdr.opcode = opcode;
+	hdr.proto_ver = SD_SHEEP_PROTO_VER;
+	hdr.data_length = 0;
+	for (i = 0; i < iovcnt; i++)
+		hdr.data_length += iov[i].iov_len;
+	hdr.objs.nr_segs = g->nr_segs;
+
+	g->sfd = sheep_get_sockfd(nid);
+	if (!g->sfd)
+		return SD_RES_NETWORK_ERROR;
+
+	if (send_reqv(g->sfd->fd, &hdr, iov, iovcnt, sheep_need_retry,
+		      req->rq.epoch)) {
+		sheep_del_sockfd(nid, g->sfd);
+		return SD_RES_NETWORK_ERROR;
+	}
+
+	return SD_RES_SUCCESS;
+}
+
+/* Receive the data of the segments straight into their place in 'buf' */
+static int objs_group_recv(struct request *req, struct objs_group *g,
+			   const struct node_id *nid, char *buf,
+			   const uint64_t *off)
+{
+	struct sd_rsp rsp;
+	int i;
+
+	if (do_read(g->sfd->fd, &rsp, sizeof(rsp), sheep_need_retry,
+		    req->rq.epoch))
+		goto err;
+
+	if (rsp.result != SD_RES_SUCCESS) {
+		sd_eprintf("failed %s", sd_strerror(rsp.result));
+		sheep_put_sockfd(nid, g->sfd);
+		return rsp.result;
+	}
+
+	if (rsp.data_length != g->len) {
+		sd_eprintf("bad response length %"PRIu32", %"PRIu64,
+			   rsp.data_length, g->len);
+		goto err;
+	}
+
+	for (i = 0; i < g->nr_segs; i++)
+		if (do_read(g->sfd->fd, buf + off[g->idx[i]],
+			    g->segs[i].length, sheep_need_retry,
+			    req->rq.epoch))
+			goto err;
+
+	sheep_put_sockfd(nid, g->sfd);
+	return SD_RES_SUCCESS;
+err:
+	sheep_del_sockfd(nid, g->sfd);
+	return SD_RES_NETWORK_ERROR;
+}
+
+/* Read from the local replica if any, else from the fastest one */
+static const struct sd_node *objs_read_target(struct request *req,
+					      uint64_t oid)
+{
+	const struct vnode_info *vinfo = req->vinfo;
+	const struct sd_node *target_nodes[SD_MAX_COPIES], *n, *best = NULL;
+	uint64_t cost, best_cost = UINT64_MAX;
+	int i, nr_copies, start = random();
+
+	nr_copies = get_req_obj_copy_number(req, oid);
+	vinfo_oid_to_nodes(vinfo, oid, nr_copies, target_nodes);
+	for (i = 0; i < nr_copies; i++) {
+		n = target_nodes[(i + start) % nr_copies];
+		if (node_is_local(n))
+			return n;
+		cost = sheep_node_read_cost(&n->nid);
+		if (cost < best_cost) {
+			best = n;
+			best_cost = cost;
+		}
+	}
+
+	return best;
+}
+
+/*
+ * Read the segments from their replicas.  If a group fails, its segments are
+ * read one by one with gateway_read_obj_sync(), which tries all the replicas.
+ */
+int gateway_read_objs(struct request *req)
+{
+	const struct vnode_info *vinfo = req->vinfo;
+	struct sd_obj_seg *segs = req->data;
+	uint32_t i, nr_segs = req->rq.objs.nr_segs;
+	uint64_t len = objs_data_length(segs, nr_segs), *off;
+	struct objs_group *groups = NULL, *g;
+	struct request sub;
+	struct iovec iov;
+	char *buf;
+	int j, ret = SD_RES_SUCCESS;
+
+	buf = xbuf_get(len);
+	off = objs_data_offsets(segs, nr_segs);
+
+	if (!bypass_object_cache(req)) {
+		ret = objs_cache_rw(req, segs, buf, off, SD_OP_READ_OBJ);
+		goto out;
+	}
+
+	groups = xcalloc(vinfo->nr_nodes, sizeof(*groups));
+	for (i = 0; i < nr_segs; i++) {
+		const struct sd_node *n;
+
+		if (is_ec_obj(segs[i].oid))
+			continue;
+		n = objs_read_target(req, segs[i].oid);
+
+		objs_group_add(groups + (n - vinfo->nodes), segs + i, i,
+			       nr_segs);
+	}
+
+	for (j = 0; j < vinfo->nr_nodes; j++) {
+		g = groups + j;
+		if (!g->nr_segs || node_is_local(vinfo->nodes + j))
+			continue;
+		iov.iov_base = g->segs;
+		iov.iov_len = sizeof(*g->segs) * g->nr_segs;
+		g->ret = objs_group_send(req, g, &vinfo->nodes[j].nid,
+					 SD_OP_READ_OBJS_PEER, &iov, 1);
+	}
+
+	for (j = 0; j < vinfo->nr_nodes; j++) {
+		g = groups + j;
+		if (!g->nr_segs)
+			continue;
+		if (!node_is_local(vinfo->nodes + j)) {
+			if (g->ret == SD_RES_SUCCESS)
+				g->ret = objs_group_recv(req, g,
+							 &vinfo->nodes[j].nid,
+							 buf, off);
+			continue;
+		}
+		for (i = 0; i < g->nr_segs && g->ret == SD_RES_SUCCESS; i++)
+			g->ret = store_rw_segs(g->segs + i, 1,
+					       buf + off[g->idx[i]],
+					       req->rq.epoch, false,
+					       req->vinfo);
+	}
+
+	for (j = 0; j < vinfo->nr_nodes; j++) {
+		g = groups + j;
+		if (g->ret == SD_RES_SUCCESS)
+			continue;
+		for (i = 0; i < g->nr_segs; i++) {
+			init_seg_request(&sub, req, g->segs + i,
+					 SD_OP_READ_OBJ, buf + off[g->idx[i]]);
+			ret = gateway_read_obj_sync(&sub);
+			if (ret != SD_RES_SUCCESS) {
+				memcpy(&req->rp, &sub.rp, sizeof(req->rp));
+				goto out;
+			}
+		}
+	}
+
+	/* Erasure coded objects are read one by one from their strips */
+	for (i = 0; i < nr_segs; i++) {
+		if (!is_ec_obj(segs[i].oid))
+			continue;
+		init_seg_request(&sub, req, segs + i, SD_OP_READ_OBJ,
+				 buf + off[i]);
+		ret = gateway_ec_read_obj(&sub);
+		if (ret != SD_RES_SUCCESS)
+			goto out;
+	}
+out:
+	if (ret == SD_RES_SUCCESS) {
+		/* The segment list is replaced with the data we read */
+		buf_put(req->data, req->data_length);
+		req->data = buf;
+		req->data_length = len;
+		req->rp.data_length = len;
+	} else
+		buf_put(buf, len);
+	if (groups)
+		free_objs_groups(groups, vinfo->nr_nodes);
+	free(off);
+
+	return ret;
+}
+
+/*
+ * Write the segments to all their replicas.  Like gateway_forward_request(),
+ * the acks are collected in the main thread, and the whole request is retried
+ * if any write fails.
+ */
+int gateway_write_objs(struct request *req)
+{
+	const struct vnode_info *vinfo = req->vinfo;
+	struct sd_obj_seg *segs = req->data;
+	uint32_t i, nr_segs = req->rq.objs.nr_segs;
+	char *data = (char *)(segs + nr_segs), *slice;
+	uint64_t *off;
+	struct objs_group *groups = NULL, *g;
+	struct request sub;
+	struct forward_info *fi;
+	struct iovec *iov = NULL;
+	const struct sd_node *target_nodes[SD_MAX_COPIES];
+	int j, k, nr_copies, iovcnt, ret, err_ret = SD_RES_SUCCESS;
+
+	for (i = 0; i < nr_segs; i++)
+		if (oid_is_readonly(segs[i].oid))
+			return SD_RES_READONLY;
+
+	off = objs_data_offsets(segs, nr_segs);
+
+	if (!bypass_object_cache(req)) {
+		err_ret = objs_cache_rw(req, segs, data, off, SD_OP_WRITE_OBJ);
+		goto out;
+	}
+
+	groups = xcalloc(vinfo->nr_nodes, sizeof(*groups));
+	for (i = 0; i < nr_segs; i++) {
+		if (is_ec_obj(segs[i].oid))
+			continue;
+		nr_copies = get_req_obj_copy_number(req, segs[i].oid);
+		vinfo_oid_to_nodes(vinfo, segs[i].oid, nr_copies,
+				   target_nodes);
+		for (k = 0; k < nr_copies; k++)
+			objs_group_add(groups + (target_nodes[k] - vinfo->nodes),
+				       segs + i, i, nr_segs);
+	}
+
+	fi = alloc_forward_info(vinfo->nr_nodes);
+	iov = xmalloc(sizeof(*iov) * (nr_segs + 1));
+	for (j = 0; j < vinfo->nr_nodes; j++) {
+		const struct node_id *nid = &vinfo->nodes[j].nid;
+
+		g = groups + j;
+		if (!g->nr_segs || node_is_local(vinfo->nodes + j))
+			continue;
+
+		/*
+		 * Send the segment list and the data of this node straight
+		 * from the request, merging the slices which are contiguous
+		 */
+		iov[0].iov_base = g->segs;
+		iov[0].iov_len = sizeof(*g->segs) * g->nr_segs;
+		iovcnt = 1;
+		for (i = 0; i < g->nr_segs; i++) {
+			slice = data + off[g->idx[i]];
+			if (iovcnt > 1 &&
+			    (char *)iov[iovcnt - 1].iov_base +
+			    iov[iovcnt - 1].iov_len == slice) {
+				iov[iovcnt - 1].iov_len += g->segs[i].length;
+				continue;
+			}
+			iov[iovcnt].iov_base = slice;
+			iov[iovcnt++].iov_len = g->segs[i].length;
+		}
+
+		ret = objs_group_send(req, g, nid, SD_OP_WRITE_OBJS_PEER, iov,
+				      iovcnt);
+		if (ret != SD_RES_SUCCESS) {
+			err_ret = ret;
+			break;
+		}
+		forward_info_advance(fi, nid, g->sfd);
+	}
+
+	for (j = 0; j < vinfo->nr_nodes && err_ret == SD_RES_SUCCESS; j++) {
+		g = groups + j;
+		if (!g->nr_segs || !node_is_local(vinfo->nodes + j))
+			continue;
+		for (i = 0; i < g->nr_segs && err_ret == SD_RES_SUCCESS; i++)
+			err_ret = store_rw_segs(g->segs + i, 1,
+						data + off[g->idx[i]],
+						req->rq.epoch, true,
+						req->vinfo);
+	}
+
+	for (i = 0; i < nr_segs && err_ret == SD_RES_SUCCESS; i++) {
+		if (!is_ec_obj(segs[i].oid))
+			continue;
+		init_seg_request(&sub, req, segs + i, SD_OP_WRITE_OBJ,
+				 data + off[i]);
+		err_ret = gateway_ec_write_obj(&sub);
+	}
+
+	sd_dprintf("nr_sent %d, err %x", fi->nr_sent, err_ret);
+	if (fi->nr_sent > 0)
+		/* Acks are collected by gateway_wait_forward_request() */
+		req->fwd = fi;
+	else
+		free(fi);
+out:
+	if (groups)
+		free_objs_groups(groups, vinfo->nr_nodes);
+	free(iov);
+	free(off);
+
+	return err_ret;
+}
+
+int peer_chain_write_obj(struct request *req)
+{
+	uint8_t opcode = req->rq.chain.opcode;
+
+	if (opcode != SD_OP_WRITE_PEER &&
+	    opcode != SD_OP_CREATE_AND_WRITE_PEER) {
+		sd_eprintf("invalid opcode %x", opcode);
+		return SD_RES_INVALID_PARMS;
+	}
+
+	return forward_chain_request(req, opcode, req->rq.chain.done_map);
+}
@@ -173,17 +173,33 @@ void put_vnode_info(struct vnode_info *vnode_info)
 	if (vnode_info) {
 		assert(uatomic_read(&vnode_info->refcnt) > 0);
 
-		if (uatomic_sub_return(&vnode_info->refcnt, 1) == 0)
+		if (uatomic_sub_return(&vnode_info->refcnt, 1) == 0) {
+			placement_exit(vnode_info);
 			free(vnode_info);
+		}
 	}
 }
 
+static const struct placement_driver *get_cluster_placement(void)
+{
+	const struct placement_driver *pdrv;
+	int id = cluster_placement_id(sys->flags);
+
+	pdrv = get_placement_driver(id);
+	if (!pdrv)
+		panic("unknown placement driver %d", id);
+
+	return pdrv;
+}
+
 struct vnode_info *alloc_vnode_info(const struct sd_node *nodes,
 				    size_t nr_nodes)
 {
 	struct vnode_info *vnode_info;
 
-	vnode_info = xzalloc(sizeof(*vnode_info));
+	/* The nodes follow the structure */
+	vnode_info = xzalloc(sizeof(*vnode_info) + sizeof(*nodes) * nr_nodes);
+	vnode_info->nodes = (struct sd_node *)(vnode_info + 1);
 
 	vnode_info->nr_nodes = nr_nodes;
 	memcpy(vnode_info->nodes, nodes, sizeof(*nodes) * nr_nodes);
@@ -191,9 +207,8 @@ struct vnode_info *alloc_vnode_info(const struct sd_node *nodes,
 
 	recalculate_vnodes(vnode_info->nodes, nr_nodes);
 
-	vnode_info->nr_vnodes = nodes_to_vnodes(vnode_info->nodes, nr_nodes,
-						vnode_info->vnodes);
 	vnode_info->nr_zones = get_zones_nr_from(nodes, nr_nodes);
+	placement_init(vnode_info, get_cluster_placement());
 	uatomic_set(&vnode_info->refcnt, 1);
 	return vnode_info;
 }
@@ -234,6 +249,8 @@ int local_get_node_list(const struct sd_req *req, struct sd_rsp *rsp,
 	}
 
 	rsp->node.master_idx = -1;
+	/* Collie needs the placement driver in the cluster flags */
+	rsp->flags = sys->flags;
 	return SD_RES_SUCCESS;
 }
 
@@ -671,7 +688,8 @@ static int get_vdis_from(struct sd_node *node)
 	count = rsp->data_length / sizeof(*vs);
 	for (i = 0; i < count; i++) {
 		set_bit(vs[i].vid, sys->vdi_inuse);
-		add_vdi_state(vs[i].vid, vs[i].nr_copies, vs[i].snapshot);
+		add_vdi_state(vs[i].vid, vs[i].nr_copies, vs[i].snapshot,
+			      vs[i].copy_policy);
 	}
 out:
 	free(vs);
@@ -894,6 +912,7 @@ static void update_cluster_info(const struct join_message *msg,
 			set_cluster_copies(sys->nr_copies);
 			set_cluster_flags(sys->flags);
 			set_cluster_ctime(msg->ctime);
+			refresh_vnode_info();
 			/*FALLTHROUGH*/
 		case SD_STATUS_WAIT_FOR_JOIN:
 			sys->disable_recovery = msg->disable_recovery;
@@ -1245,6 +1264,19 @@ void update_node_size(struct sd_node *node)
 	sys->cdrv->update_node(node);
 }
 
+/* Rebuild the current vnode info after the placement driver is changed */
+void refresh_vnode_info(void)
+{
+	struct vnode_info *old = main_thread_get(current_vnode_info);
+
+	if (!old)
+		return;
+
+	main_thread_set(current_vnode_info,
+			alloc_vnode_info(old->nodes, old->nr_nodes));
+	put_vnode_info(old);
+}
+
 void kick_node_recover(void)
 {
 	struct vnode_info *old = main_thread_get(current_vnode_info);
@@ -1303,7 +1335,11 @@ int create_cluster(int port, int64_t zone, int nr_vnodes,
 		sys->status = SD_STATUS_WAIT_FOR_JOIN;
 		get_cluster_copies(&sys->nr_copies);
 		get_cluster_flags(&sys->flags);
-
+		if (!get_placement_driver(cluster_placement_id(sys->flags))) {
+			sd_eprintf("unknown placement driver %d",
+				   cluster_placement_id(sys->flags));
+			return -1;
+		}
 	} else {
 		sys->status = SD_STATUS_WAIT_FOR_FORMAT;
 	}
@@ -0,0 +1,251 @@
+/*
+ * Copyright (C) 2013 Taobao Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * I/O scheduler between client I/O and background work
+ *
+ * Client requests are never held back.  Recovery, object cache pushes and
+ * deletion take a token before each object I/O with iosched_acquire().  The
+ * tokens are shared by start-time fair queueing: the waiting class with the
+ * smallest virtual time goes next, and its virtual time advances by the
+ * inverse of its weight.
+ *
+ * The token rate follows the client latency.  Every IOSCHED_INTERVAL the
+ * main thread checks whether more than 1% of the client requests took longer
+ * than the target, i.e. whether their p99 is above it.  If so the rate is
+ * halved, otherwise it grows, and it doubles when there is no client I/O at
+ * all.  It never goes below the share of the client throughput which the
+ * weights give to the busy background classes, so recovery keeps going under
+ * a heavy client load.
+ */
+#include <pthread.h>
+
+#include "sheep_priv.h"
+
+#define IOSCHED_INTERVAL 100		/* ms */
+#define IOSCHED_BURST 100		/* ms worth of tokens */
+#define IOSCHED_MIN_RATE 10		/* I/Os per second */
+#define IOSCHED_MAX_RATE 1000000
+#define IOSCHED_SCALE 1000000		/* tokens are counted in millionths */
+#define IOSCHED_VTIME_SCALE 1000000
+#define IOSCHED_DEFAULT_TARGET 20	/* ms */
+
+struct io_class_info {
+	const char *name;
+	int weight;
+	int nr_waiting;
+	uint64_t vtime;
+	uint64_t nr_done;	/* in this interval */
+};
+
+static struct io_class_info io_classes[IO_NR_CLASSES] = {
+	[IO_CLASS_CLIENT] = { "client", 8 },
+	[IO_CLASS_RECOVERY] = { "recovery", 2 },
+	[IO_CLASS_PUSH] = { "push", 4 },
+	[IO_CLASS_DELETION] = { "deletion", 1 },
+};
+
+static pthread_mutex_t iosched_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t iosched_cond;
+
+static uint64_t iosched_rate = IOSCHED_MAX_RATE;	/* tokens per second */
+static int64_t iosched_tokens;
+static uint64_t iosched_last_refill;
+static uint64_t iosched_vtime;
+
+static uint64_t target_usec = IOSCHED_DEFAULT_TARGET * 1000;
+
+/* Client requests completed in this interval, and those over the target */
+static uint64_t nr_client_reqs;
+static uint64_t nr_slow_client_reqs;
+
+static inline int64_t iosched_depth(uint64_t rate)
+{
+	return max(rate * IOSCHED_BURST / 1000, (uint64_t)1) * IOSCHED_SCALE;
+}
+
+static void iosched_refill(uint64_t now)
+{
+	uint64_t room, elapsed = now - iosched_last_refill;
+	int64_t depth = iosched_depth(iosched_rate);
+
+	iosched_last_refill = now;
+	if (iosched_tokens >= depth)
+		return;
+
+	room = depth - iosched_tokens;
+	if (elapsed >= room / iosched_rate)
+		iosched_tokens = depth;
+	else
+		iosched_tokens += elapsed * iosched_rate;
+}
+
+/* The waiting class which goes next */
+static int next_class(void)
+{
+	int i, next = -1;
+
+	for (i = 0; i < IO_NR_CLASSES; i++) {
+		if (!io_classes[i].nr_waiting)
+			continue;
+		if (next < 0 || io_classes[i].vtime < io_classes[next].vtime)
+			next = i;
+	}
+
+	return next;
+}
+
+static void wait_usec(uint64_t usec)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	ts.tv_sec += usec / 1000000;
+	ts.tv_nsec += (usec % 1000000) * 1000;
+	if (ts.tv_nsec >= 1000000000) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000;
+	}
+
+	pthread_cond_timedwait(&iosched_cond, &iosched_lock, &ts);
+}
+
+/* Wait for the turn of a background I/O of 'class', called by workers */
+void iosched_acquire(enum io_class class)
+{
+	struct io_class_info *c = io_classes + class;
+
+	assert(class != IO_CLASS_CLIENT);
+
+	pthread_mutex_lock(&iosched_lock);
+
+	/* An idle class doesn't save up its share */
+	if (c->nr_waiting++ == 0)
+		c->vtime = max(c->vtime, iosched_vtime);
+
+	for (;;) {
+		iosched_refill(clock_get_usec());
+		if (iosched_tokens < IOSCHED_SCALE)
+			wait_usec((IOSCHED_SCALE - iosched_tokens) /
+				  iosched_rate + 1);
+		else if (next_class() != class)
+			pthread_cond_wait(&iosched_cond, &iosched_lock);
+		else
+			break;
+	}
+
+	iosched_tokens -= IOSCHED_SCALE;
+	iosched_vtime = c->vtime;
+	c->vtime += IOSCHED_VTIME_SCALE / c->weight;
+	c->nr_waiting--;
+	c->nr_done++;
+
+	/* Let the class which goes next know */
+	pthread_cond_broadcast(&iosched_cond);
+	pthread_mutex_unlock(&iosched_lock);
+}
+
+/* Record the service time of a client request */
+void iosched_client_done(uint64_t usec)
+{
+	uatomic_inc(&nr_client_reqs);
+	if (usec > uatomic_read(&target_usec))
+		uatomic_inc(&nr_slow_client_reqs);
+}
+
+static void iosched_adjust(void *arg)
+{
+	static struct timer t = {
+		.callback = iosched_adjust,
+	};
+	uint64_t nr_reqs, nr_slow, floor, rate, bg_weight = 0;
+	int i;
+
+	nr_reqs = uatomic_xchg(&nr_client_reqs, 0);
+	nr_slow = uatomic_xchg(&nr_slow_client_reqs, 0);
+
+	pthread_mutex_lock(&iosched_lock);
+
+	for (i = 0; i < IO_NR_CLASSES; i++) {
+		if (i == IO_CLASS_CLIENT)
+			continue;
+		if (io_classes[i].nr_waiting || io_classes[i].nr_done)
+			bg_weight += io_classes[i].weight;
+		io_classes[i].nr_done = 0;
+	}
+
+	/* The share of the busy background classes by the weights */
+	floor = nr_reqs * 1000 / IOSCHED_INTERVAL * bg_weight /
+		io_classes[IO_CLASS_CLIENT].weight;
+	floor = max(floor, (uint64_t)IOSCHED_MIN_RATE);
+
+	rate = iosched_rate;
+	if (!nr_reqs)
+		rate *= 2;
+	else if (nr_slow * 100 > nr_reqs)
+		rate /= 2;
+	else
+		rate += rate / 8 + IOSCHED_MIN_RATE;
+	rate = max(rate, floor);
+	rate = min(rate, (uint64_t)IOSCHED_MAX_RATE);
+
+	if (rate != iosched_rate)
+		sd_dprintf("%" PRIu64 " I/Os per second, client %" PRIu64
+			   " reqs, %" PRIu64 " slow", rate, nr_reqs, nr_slow);
+
+	iosched_refill(clock_get_usec());
+	iosched_rate = rate;
+	iosched_tokens = min(iosched_tokens, iosched_depth(rate));
+	pthread_cond_broadcast(&iosched_cond);
+
+	pthread_mutex_unlock(&iosched_lock);
+
+	add_timer(&t, IOSCHED_INTERVAL);
+}
+
+int iosched_set_weight(const char *name, int weight)
+{
+	int i;
+
+	if (weight < 1 || weight > IOSCHED_VTIME_SCALE)
+		return -1;
+
+	for (i = 0; i < IO_NR_CLASSES; i++) {
+		if (strcmp(io_classes[i].name, name) == 0) {
+			io_classes[i].weight = weight;
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+void iosched_set_target(uint64_t msec)
+{
+	target_usec = msec * 1000;
+}
+
+int iosched_init(void)
+{
+	pthread_condattr_t attr;
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&iosched_cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	iosched_last_refill = clock_get_usec();
+	iosched_tokens = iosched_depth(iosched_rate);
+
+	iosched_adjust(NULL);
+
+	return 0;
+}
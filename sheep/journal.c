@@ -140,8 +140,9 @@ static void journal_get_path(struct journal_descriptor *jd, char *path)
 	switch (jd->flag) {
 	case JF_STORE:
 	case JF_REMOVE_OBJ:
-		snprintf(path, PATH_MAX, "%s/%016"PRIx64,
-			 md_get_object_path(jd->oid), jd->oid);
+		snprintf(path, PATH_MAX, "%s/%02x/%016"PRIx64,
+			 md_get_object_path(jd->oid), obj_dir(jd->oid),
+			 jd->oid);
 		if (jd->flag == JF_STORE)
 			sd_iprintf("%s, size %"PRIu64", off %"PRIu64", %d",
 				path, jd->size, jd->offset, jd->create);
@@ -389,7 +390,7 @@ static int journal_file_write(struct journal_descriptor *jd, const char *buf)
 	jfile.pos += wsize;
 	pthread_spin_unlock(&jfile_lock);
 
-	p = wbuffer = xvalloc(wsize);
+	p = wbuffer = xbuf_get(wsize);
 	memcpy(p, jd, JOURNAL_DESC_SIZE);
 	p += JOURNAL_DESC_SIZE;
 	memcpy(p, buf, size);
@@ -414,7 +415,7 @@ static int journal_file_write(struct journal_descriptor *jd, const char *buf)
 		goto out;
 	}
 out:
-	free(wbuffer);
+	buf_put(wbuffer, wsize);
 	return ret;
 }
 
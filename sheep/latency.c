@@ -0,0 +1,197 @@
+/*
+ * Copyright (C) 2013 Taobao Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Request latency histograms
+ *
+ * Every opcode has a histogram per stage of its requests.  The buckets are
+ * log2 ranges of microseconds split into LAT_SUB_BUCKETS linear ones, so a
+ * latency is recorded within 1/8 of its value whatever its magnitude.  The
+ * histograms are updated with atomic operations only, because the requests
+ * are completed by the main thread, the worker threads and the network
+ * threads.
+ */
+#include "sheep_priv.h"
+
+#define LAT_SUB_BITS 3
+#define LAT_SUB_BUCKETS (1 << LAT_SUB_BITS)
+#define LAT_MAX_BITS 40		/* about 12 days */
+#define LAT_NR_BUCKETS ((LAT_MAX_BITS - LAT_SUB_BITS + 1) << LAT_SUB_BITS)
+
+struct lat_hist {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t max;
+	uint64_t buckets[LAT_NR_BUCKETS];
+};
+
+/* Allocated when the opcode completes its first request */
+static struct lat_hist *op_lat[256];
+
+static inline int lat_to_bucket(uint64_t v)
+{
+	int e;
+
+	if (v >= (1ULL << LAT_MAX_BITS))
+		v = (1ULL << LAT_MAX_BITS) - 1;
+	if (v < LAT_SUB_BUCKETS)
+		return v;
+
+	e = 63 - __builtin_clzll(v);
+	return ((e - LAT_SUB_BITS + 1) << LAT_SUB_BITS) +
+		((v >> (e - LAT_SUB_BITS)) & (LAT_SUB_BUCKETS - 1));
+}
+
+/* The largest latency which falls in the bucket */
+static inline uint64_t bucket_to_lat(int idx)
+{
+	int e, sub;
+
+	if (idx < LAT_SUB_BUCKETS)
+		return idx;
+
+	e = (idx >> LAT_SUB_BITS) + LAT_SUB_BITS - 1;
+	sub = idx & (LAT_SUB_BUCKETS - 1);
+	return ((uint64_t)(LAT_SUB_BUCKETS + sub + 1) << (e - LAT_SUB_BITS)) - 1;
+}
+
+static struct lat_hist *get_op_lat(uint8_t opcode)
+{
+	struct lat_hist *h = uatomic_read(&op_lat[opcode]), *old;
+
+	if (h)
+		return h;
+
+	h = xzalloc(sizeof(*h) * SD_LAT_NR_STAGES);
+	old = uatomic_cmpxchg(&op_lat[opcode], NULL, h);
+	if (old) {
+		free(h);
+		return old;
+	}
+
+	return h;
+}
+
+static void lat_add(struct lat_hist *h, uint64_t v)
+{
+	uint64_t max;
+
+	uatomic_inc(&h->count);
+	uatomic_add(&h->sum, v);
+	uatomic_inc(&h->buckets[lat_to_bucket(v)]);
+
+	max = uatomic_read(&h->max);
+	while (v > max) {
+		uint64_t old = uatomic_cmpxchg(&h->max, max, v);
+
+		if (old == max)
+			break;
+		max = old;
+	}
+}
+
+/*
+ * Record the stages of a completed request.  A stage which the request has
+ * skipped, e.g. the work of a request failed in queue_request(), takes no
+ * time.
+ */
+void account_request_latency(struct request *req)
+{
+	uint64_t *t = req->stamp;
+	struct lat_hist *h;
+	int i;
+
+	if (!req->op || !t[REQ_STAMP_RX])
+		return;
+
+	for (i = REQ_STAMP_RX + 1; i < REQ_NR_STAMPS; i++)
+		if (t[i] < t[i - 1])
+			t[i] = t[i - 1];
+
+	h = get_op_lat(req->rq.opcode);
+	lat_add(h + SD_LAT_QUEUE, t[REQ_STAMP_QUEUE] - t[REQ_STAMP_RX]);
+	lat_add(h + SD_LAT_WAIT, t[REQ_STAMP_WORK] - t[REQ_STAMP_QUEUE]);
+	lat_add(h + SD_LAT_WORK, t[REQ_STAMP_DONE] - t[REQ_STAMP_WORK]);
+	lat_add(h + SD_LAT_TX, t[REQ_STAMP_TX] - t[REQ_STAMP_DONE]);
+	lat_add(h + SD_LAT_TOTAL, t[REQ_STAMP_TX] - t[REQ_STAMP_RX]);
+
+	/* The time in the workers is what background I/O competes with */
+	if (is_gateway_op(req->op) && !req->local)
+		iosched_client_done(t[REQ_STAMP_DONE] - t[REQ_STAMP_WORK]);
+}
+
+static const char *op_type_name(const struct sd_op_template *op)
+{
+	if (is_gateway_op(op))
+		return "gateway";
+	if (is_peer_op(op))
+		return "peer";
+	if (is_local_op(op))
+		return "local";
+	return "cluster";
+}
+
+static void fill_latency_stat(struct sd_latency_stat *stat,
+			      const struct lat_hist *h)
+{
+	uint64_t buckets[LAT_NR_BUCKETS], count = 0, n = 0;
+	uint64_t *pcts[] = { &stat->p50, &stat->p90, &stat->p99, &stat->p999 };
+	const int permille[] = { 500, 900, 990, 999 };
+	int i, j = 0;
+
+	/* The histogram may change under us, so sum up our own copy */
+	for (i = 0; i < LAT_NR_BUCKETS; i++) {
+		buckets[i] = uatomic_read(&h->buckets[i]);
+		count += buckets[i];
+	}
+	stat->count = count;
+	stat->sum = uatomic_read(&h->sum);
+	stat->max = uatomic_read(&h->max);
+
+	for (i = 0; i < LAT_NR_BUCKETS && j < ARRAY_SIZE(pcts); i++) {
+		n += buckets[i];
+		while (j < ARRAY_SIZE(pcts) && n * 1000 >= count * permille[j])
+			*pcts[j++] = min(bucket_to_lat(i), stat->max);
+	}
+}
+
+/* Fill 'stat' with up to 'nr' stages which have latencies, and return them */
+int get_latency_stat(struct sd_latency_stat *stat, int nr)
+{
+	const struct sd_op_template *op;
+	struct lat_hist *h;
+	int opcode, stage, n = 0;
+
+	for (opcode = 0; opcode < ARRAY_SIZE(op_lat); opcode++) {
+		h = uatomic_read(&op_lat[opcode]);
+		if (!h)
+			continue;
+
+		op = get_sd_op(opcode);
+		for (stage = 0; stage < SD_LAT_NR_STAGES; stage++) {
+			if (!uatomic_read(&h[stage].count))
+				continue;
+			if (n == nr)
+				return n;
+
+			memset(stat + n, 0, sizeof(stat[n]));
+			pstrcpy(stat[n].name, sizeof(stat[n].name), op_name(op));
+			pstrcpy(stat[n].type, sizeof(stat[n].type),
+				op_type_name(op));
+			stat[n].opcode = opcode;
+			stat[n].stage = stage;
+			fill_latency_stat(stat + n, h + stage);
+			n++;
+		}
+	}
+
+	return n;
+}
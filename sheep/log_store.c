@@ -0,0 +1,1698 @@
+/*
+ * Copyright (C) 2013 Taobao Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Log-structured store driver
+ *
+ * Objects are not files.  Every update is a record appended to the log of the
+ * disk of the object, which is a sequence of segment files in <disk>/.log, so
+ * the disk only sees sequential writes however random the object I/O is.  An
+ * in-memory index maps every object, the live one and the stale copies of
+ * older epochs, to the extents of the segments which hold its data.
+ *
+ * The index of a disk is checkpointed into <disk>/.log/checkpoint, together
+ * with the position in the log it is up to date with.  At startup the
+ * checkpoint is loaded and the records after that position are replayed; the
+ * first record with a bad checksum is the end of the log.
+ *
+ * A background thread compacts the log.  It copies the live extents of the
+ * sealed segment with the most dead bytes to the head of the log, writes a
+ * checkpoint and deletes the segment.  It also writes a checkpoint when a lot
+ * has been appended since the last one, to bound the replay at startup.
+ *
+ * All the entries of an object stay on one disk, so the records of an object
+ * are ordered by its log.  Every record has a sequence number, unique across
+ * the disks, which decides between the entries of two disks at replay when
+ * an object was removed from one disk and created on another.
+ *
+ * Appends to a disk are serialized by the lock of the disk, and log_lock is
+ * only taken to look up or update the index.  The checksum of the data of a
+ * record is computed before any lock is taken, and only the header, which
+ * has the sequence number, is folded into it under the lock of the disk.
+ */
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "sheep_priv.h"
+#include "sha1.h"
+
+#define LOG_DIR "/.log"
+#define LOG_CHECKPOINT "checkpoint"
+#define LOG_MAGIC 0x736c6f67		/* "slog" */
+#define LOG_SEGMENT_SIZE (64ULL << 20)
+#define LOG_CHECKPOINT_BYTES (256ULL << 20)
+#define LOG_COMPACT_RATIO 50		/* % of dead bytes in a segment */
+#define LOG_COMPACT_INTERVAL 1		/* seconds */
+
+enum log_rec_type {
+	LOG_PUT = 1,	/* data at 'offset' of the object */
+	LOG_DELETE,	/* remove the object */
+	LOG_STALE,	/* move the live object to the stale one of 'epoch' */
+	LOG_LINK,	/* copy the stale object of 'epoch' to the live one */
+	LOG_COW,	/* set the cow map, which is the data, or clear it */
+	LOG_CLEANUP,	/* remove all the stale objects of the disk */
+};
+
+#define LOG_REC_CREATE	0x1	/* PUT: drop the old content first */
+#define LOG_REC_COW	0x2	/* PUT: the data starts with a cow map */
+
+struct log_rec {
+	uint32_t magic;
+	uint16_t type;
+	uint16_t flags;
+	uint64_t lsn;
+	uint64_t oid;
+	uint32_t epoch;		/* of the stale object, 0 for the live one */
+	uint32_t length;	/* of the data following the header */
+	uint64_t offset;
+	uint64_t csum;		/* of the data, and the header with csum 0 */
+};
+
+struct log_ckpt {
+	uint32_t magic;
+	uint32_t seq;		/* replay from 'offset' of segment 'seq' */
+	uint64_t offset;
+	uint64_t lsn;		/* the next sequence number */
+	uint64_t nr_objs;
+	uint64_t csum;		/* of the objects */
+};
+
+/* Followed by the cow map if has_cow, and by the extents */
+struct log_ckpt_obj {
+	uint64_t oid;
+	uint64_t lsn;
+	uint32_t epoch;
+	uint32_t nr_extents;
+	uint32_t has_cow;
+	uint32_t __pad;
+};
+
+struct log_ckpt_extent {
+	uint32_t offset;
+	uint32_t length;
+	uint32_t seq;
+	uint32_t __pad;
+	uint64_t seg_offset;
+};
+
+struct log_segment {
+	struct list_head list;
+	uint32_t seq;
+	int fd;
+	uint64_t size;		/* bytes appended */
+	uint64_t live;		/* bytes referenced by the index */
+	int refcnt;		/* I/O done without the lock */
+};
+
+struct log_disk {
+	char path[PATH_MAX];		/* the log directory */
+	int dirfd;
+	/* Serializes the appends, and protects the segments and their size */
+	pthread_mutex_t lock;
+	struct list_head segments;	/* in the order of seq */
+	struct log_segment *active;
+	uint64_t nr_appended;		/* since the last checkpoint */
+};
+
+struct log_extent {
+	uint32_t offset;		/* in the object */
+	uint32_t length;
+	struct log_segment *seg;
+	uint64_t seg_offset;
+};
+
+struct log_obj {
+	struct rb_node node;
+	uint64_t oid;
+	uint32_t epoch;			/* 0 for the live object */
+	uint64_t lsn;			/* of the record which created it */
+	struct log_disk *disk;
+	struct cow_map *cow;
+	int nr_extents;
+	struct log_extent *extents;	/* sorted, not overlapping */
+};
+
+/*
+ * The index, the table of the disks and the live bytes of the segments are
+ * protected by log_lock.  The entries of a disk only change with the lock of
+ * the disk held, which is taken before log_lock.
+ */
+static pthread_rwlock_t log_lock = PTHREAD_RWLOCK_INITIALIZER;
+static struct rb_root log_index = RB_ROOT;
+static struct log_disk *log_disks[MD_MAX_DISK];
+static int nr_log_disks;
+static uint64_t next_lsn = 1;
+
+/* Taken by the compactor while it works on the disks */
+static pthread_mutex_t compact_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int obj_cmp(uint64_t oid, uint32_t epoch, const struct log_obj *o)
+{
+	if (oid != o->oid)
+		return oid < o->oid ? -1 : 1;
+	if (epoch != o->epoch)
+		return epoch < o->epoch ? -1 : 1;
+	return 0;
+}
+
+static struct log_obj *lookup_obj(uint64_t oid, uint32_t epoch)
+{
+	struct rb_node *n = log_index.rb_node;
+	struct log_obj *o;
+	int cmp;
+
+	while (n) {
+		o = rb_entry(n, struct log_obj, node);
+		cmp = obj_cmp(oid, epoch, o);
+		if (cmp < 0)
+			n = n->rb_left;
+		else if (cmp > 0)
+			n = n->rb_right;
+		else
+			return o;
+	}
+
+	return NULL;
+}
+
+/* Return any entry of 'oid', live or stale */
+static struct log_obj *lookup_any_obj(uint64_t oid)
+{
+	struct rb_node *n = log_index.rb_node;
+	struct log_obj *o;
+
+	while (n) {
+		o = rb_entry(n, struct log_obj, node);
+		if (oid < o->oid)
+			n = n->rb_left;
+		else if (oid > o->oid)
+			n = n->rb_right;
+		else
+			return o;
+	}
+
+	return NULL;
+}
+
+static void insert_obj(struct log_obj *new)
+{
+	struct rb_node **p = &log_index.rb_node;
+	struct rb_node *parent = NULL;
+
+	while (*p) {
+		parent = *p;
+		if (obj_cmp(new->oid, new->epoch,
+			    rb_entry(parent, struct log_obj, node)) < 0)
+			p = &(*p)->rb_left;
+		else
+			p = &(*p)->rb_right;
+	}
+	rb_link_node(&new->node, parent, p);
+	rb_insert_color(&new->node, &log_index);
+}
+
+static void set_cow(struct log_obj *o, const struct cow_map *cow)
+{
+	if (cow && cow->cow_oid) {
+		if (!o->cow)
+			o->cow = xmalloc(sizeof(*cow));
+		*o->cow = *cow;
+	} else {
+		free(o->cow);
+		o->cow = NULL;
+	}
+}
+
+static void drop_extents(struct log_obj *o)
+{
+	int i;
+
+	for (i = 0; i < o->nr_extents; i++)
+		o->extents[i].seg->live -= o->extents[i].length;
+	free(o->extents);
+	o->extents = NULL;
+	o->nr_extents = 0;
+}
+
+static void free_obj(struct log_obj *o)
+{
+	drop_extents(o);
+	rb_erase(&o->node, &log_index);
+	free(o->cow);
+	free(o);
+}
+
+static struct log_obj *new_obj(uint64_t oid, uint32_t epoch, uint64_t lsn,
+			       struct log_disk *d)
+{
+	struct log_obj *o = xzalloc(sizeof(*o));
+
+	o->oid = oid;
+	o->epoch = epoch;
+	o->lsn = lsn;
+	o->disk = d;
+	insert_obj(o);
+
+	return o;
+}
+
+/* Map [offset, offset + length) of 'o' to the segment, over the old data */
+static void add_extent(struct log_obj *o, uint32_t offset, uint32_t length,
+		       struct log_segment *seg, uint64_t seg_offset)
+{
+	struct log_extent *new, x, ext = {
+		.offset = offset,
+		.length = length,
+		.seg = seg,
+		.seg_offset = seg_offset,
+	};
+	uint32_t end = offset + length, x_end;
+	bool added = false;
+	int i, n = 0;
+
+	if (!length)
+		return;
+
+	new = xmalloc(sizeof(*new) * (o->nr_extents + 2));
+	for (i = 0; i < o->nr_extents; i++) {
+		x = o->extents[i];
+		x_end = x.offset + x.length;
+
+		if (x_end <= offset || end <= x.offset) {
+			if (!added && end <= x.offset) {
+				new[n++] = ext;
+				added = true;
+			}
+			new[n++] = x;
+			continue;
+		}
+
+		x.seg->live -= min(x_end, end) - max(x.offset, offset);
+		if (x.offset < offset) {
+			new[n] = x;
+			new[n++].length = offset - x.offset;
+		}
+		if (!added) {
+			new[n++] = ext;
+			added = true;
+		}
+		if (end < x_end) {
+			new[n] = x;
+			new[n].offset = end;
+			new[n].length = x_end - end;
+			new[n++].seg_offset += end - x.offset;
+		}
+	}
+	if (!added)
+		new[n++] = ext;
+
+	seg->live += length;
+	free(o->extents);
+	o->extents = new;
+	o->nr_extents = n;
+}
+
+static void copy_extents(struct log_obj *dst, const struct log_obj *src)
+{
+	int i;
+
+	drop_extents(dst);
+	dst->extents = xmalloc(sizeof(*dst->extents) * src->nr_extents);
+	dst->nr_extents = src->nr_extents;
+	for (i = 0; i < src->nr_extents; i++) {
+		dst->extents[i] = src->extents[i];
+		dst->extents[i].seg->live += src->extents[i].length;
+	}
+}
+
+/*
+ * Return the entry of the key of 'rec' which the record creates, or NULL if a
+ * newer entry of another disk has it already.
+ */
+static struct log_obj *create_obj(struct log_disk *d, const struct log_rec *rec,
+				  uint32_t epoch)
+{
+	struct log_obj *o = lookup_obj(rec->oid, epoch);
+
+	if (o && o->disk != d) {
+		if (o->lsn > rec->lsn)
+			return NULL;
+		free_obj(o);
+		o = NULL;
+	}
+	if (!o)
+		o = new_obj(rec->oid, epoch, rec->lsn, d);
+
+	return o;
+}
+
+/* Return the entry of the key of 'rec' if it is the one of this disk */
+static struct log_obj *find_obj(struct log_disk *d, uint64_t oid,
+				uint32_t epoch)
+{
+	struct log_obj *o = lookup_obj(oid, epoch);
+
+	return o && o->disk == d ? o : NULL;
+}
+
+/*
+ * Apply 'rec' of 'd' to the index.  The data of the record is at 'data_offset'
+ * of 'seg', and 'cow' is the cow map in it if any.
+ */
+static void apply_rec(struct log_disk *d, const struct log_rec *rec,
+		      struct log_segment *seg, uint64_t data_offset,
+		      const struct cow_map *cow)
+{
+	struct log_obj *o, *src;
+	struct rb_node *n, *next;
+	uint32_t length = rec->length;
+
+	switch (rec->type) {
+	case LOG_PUT:
+		if (rec->flags & LOG_REC_CREATE)
+			o = create_obj(d, rec, rec->epoch);
+		else if (!(o = find_obj(d, rec->oid, rec->epoch)) &&
+			 !lookup_obj(rec->oid, rec->epoch))
+			o = new_obj(rec->oid, rec->epoch, rec->lsn, d);
+		if (!o)
+			break;
+		if (rec->flags & LOG_REC_CREATE) {
+			drop_extents(o);
+			set_cow(o, NULL);
+			o->lsn = rec->lsn;
+		}
+		if (rec->flags & LOG_REC_COW) {
+			set_cow(o, cow);
+			data_offset += sizeof(*cow);
+			length -= sizeof(*cow);
+		}
+		add_extent(o, rec->offset, length, seg, data_offset);
+		break;
+	case LOG_DELETE:
+		o = find_obj(d, rec->oid, rec->epoch);
+		if (o)
+			free_obj(o);
+		break;
+	case LOG_STALE:
+		src = find_obj(d, rec->oid, 0);
+		if (!src)
+			break;
+		o = lookup_obj(rec->oid, rec->epoch);
+		if (o)
+			free_obj(o);
+		rb_erase(&src->node, &log_index);
+		src->epoch = rec->epoch;
+		src->lsn = rec->lsn;
+		insert_obj(src);
+		break;
+	case LOG_LINK:
+		src = find_obj(d, rec->oid, rec->epoch);
+		if (!src)
+			break;
+		o = create_obj(d, rec, 0);
+		if (!o)
+			break;
+		copy_extents(o, src);
+		set_cow(o, src->cow);
+		o->lsn = rec->lsn;
+		break;
+	case LOG_COW:
+		o = find_obj(d, rec->oid, rec->epoch);
+		if (o)
+			set_cow(o, rec->length ? cow : NULL);
+		break;
+	case LOG_CLEANUP:
+		for (n = rb_first(&log_index); n; n = next) {
+			next = rb_next(n);
+			o = rb_entry(n, struct log_obj, node);
+			if (o->disk == d && o->epoch)
+				free_obj(o);
+		}
+		break;
+	default:
+		sd_eprintf("unknown record type %d", rec->type);
+		break;
+	}
+}
+
+/* The checksum of the data of a record, which is computed without the locks */
+static uint64_t data_csum(const struct cow_map *cow, const void *buf,
+			  uint32_t len)
+{
+	uint64_t csum = FNV1A_64_INIT;
+
+	if (cow)
+		csum = fnv_64a_buf(cow, sizeof(*cow), csum);
+	if (len)
+		csum = fnv_64a_buf(buf, len, csum);
+
+	return csum;
+}
+
+/* Fold the header of 'rec', with csum 0, into the checksum of its data */
+static uint64_t rec_csum(struct log_rec *rec, uint64_t csum)
+{
+	uint64_t saved = rec->csum;
+
+	rec->csum = 0;
+	csum = fnv_64a_buf(rec, sizeof(*rec), csum);
+	rec->csum = saved;
+
+	return csum;
+}
+
+static void seg_get(struct log_segment *seg)
+{
+	uatomic_inc(&seg->refcnt);
+}
+
+static void seg_put(struct log_segment *seg)
+{
+	uatomic_dec(&seg->refcnt);
+}
+
+static int sync_segment(struct log_segment *seg)
+{
+	if (sys->nosync)
+		return 0;
+
+	if (fdatasync(seg->fd) < 0) {
+		sd_eprintf("failed to sync segment %08"PRIx32", %m", seg->seq);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int sync_dir(struct log_disk *d)
+{
+	if (!sys->nosync && fsync(d->dirfd) < 0) {
+		sd_eprintf("failed to sync %s, %m", d->path);
+		return -1;
+	}
+
+	return 0;
+}
+
+static struct log_segment *open_segment(struct log_disk *d, uint32_t seq,
+					bool create)
+{
+	struct log_segment *seg;
+	char path[PATH_MAX];
+	struct stat st;
+	int fd;
+
+	if (snprintf(path, sizeof(path), "%s/%08"PRIx32, d->path, seq) >=
+	    sizeof(path)) {
+		sd_eprintf("too long path %s", d->path);
+		return NULL;
+	}
+	fd = open(path, O_RDWR | (create ? O_CREAT | O_EXCL : 0),
+		  sd_def_fmode);
+	if (fd < 0) {
+		sd_eprintf("failed to open %s, %m", path);
+		return NULL;
+	}
+	if (fstat(fd, &st) < 0) {
+		sd_eprintf("failed to stat %s, %m", path);
+		close(fd);
+		return NULL;
+	}
+	if (create && sync_dir(d) < 0) {
+		close(fd);
+		unlink(path);
+		return NULL;
+	}
+
+	seg = xzalloc(sizeof(*seg));
+	seg->seq = seq;
+	seg->fd = fd;
+	seg->size = st.st_size;
+	list_add_tail(&seg->list, &d->segments);
+	d->active = seg;
+
+	return seg;
+}
+
+static void close_segment(struct log_segment *seg)
+{
+	list_del(&seg->list);
+	close(seg->fd);
+	free(seg);
+}
+
+/*
+ * Append 'rec' and its data, of which 'csum' is the checksum, to the log of
+ * 'd' and apply it to the index.  Called with the lock of 'd' held.  The
+ * segment is returned in 'segp' with a reference, which the caller drops
+ * with end_commit() after the lock.
+ */
+static int commit_rec(struct log_disk *d, struct log_rec *rec,
+		      const struct cow_map *cow, void *buf, uint32_t len,
+		      uint64_t csum, struct log_segment **segp)
+{
+	struct log_segment *seg = d->active;
+	struct iovec iov[2];
+	int iovcnt = 0;
+	uint64_t total;
+	ssize_t ret;
+
+	if (cow) {
+		iov[iovcnt].iov_base = (void *)cow;
+		iov[iovcnt++].iov_len = sizeof(*cow);
+	}
+	if (len) {
+		iov[iovcnt].iov_base = buf;
+		iov[iovcnt++].iov_len = len;
+	}
+
+	rec->magic = LOG_MAGIC;
+	rec->lsn = uatomic_add_return(&next_lsn, 1) - 1;
+	rec->length = (cow ? sizeof(*cow) : 0) + len;
+	rec->csum = rec_csum(rec, csum);
+	total = sizeof(*rec) + rec->length;
+
+	if (seg->size && seg->size + total > LOG_SEGMENT_SIZE) {
+		if (sync_segment(seg) < 0)
+			return SD_RES_EIO;
+		seg = open_segment(d, seg->seq + 1, true);
+		if (!seg)
+			return SD_RES_EIO;
+	}
+
+	memmove(iov + 1, iov, sizeof(*iov) * iovcnt);
+	iov[0].iov_base = rec;
+	iov[0].iov_len = sizeof(*rec);
+	ret = pwritev(seg->fd, iov, iovcnt + 1, seg->size);
+	if (ret != total) {
+		/* The next record overwrites whatever was written */
+		sd_eprintf("failed to append to segment %08"PRIx32" of %s, %m",
+			   seg->seq, d->path);
+		return SD_RES_EIO;
+	}
+
+	pthread_rwlock_wrlock(&log_lock);
+	apply_rec(d, rec, seg, seg->size + sizeof(*rec), cow);
+	pthread_rwlock_unlock(&log_lock);
+	seg->size += total;
+	uatomic_add(&d->nr_appended, total);
+
+	seg_get(seg);
+	*segp = seg;
+	return SD_RES_SUCCESS;
+}
+
+/* The record is only acknowledged once it is on the disk */
+static int end_commit(struct log_segment *seg)
+{
+	int ret = sync_segment(seg);
+
+	seg_put(seg);
+	return ret < 0 ? SD_RES_EIO : SD_RES_SUCCESS;
+}
+
+static struct log_disk *find_disk(const char *path)
+{
+	char log_path[PATH_MAX];
+	int i;
+
+	if (snprintf(log_path, sizeof(log_path), "%s"LOG_DIR, path) >=
+	    sizeof(log_path))
+		return NULL;
+	for (i = 0; i < nr_log_disks; i++)
+		if (!strcmp(log_disks[i]->path, log_path))
+			return log_disks[i];
+
+	return NULL;
+}
+
+static int seg_seq_cmp(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Open the log of the disk at 'path' and all its segments */
+static struct log_disk *open_disk(const char *path)
+{
+	struct log_disk *d;
+	uint32_t *seqs = NULL;
+	int i, nr = 0;
+	struct dirent *de;
+	char *end;
+	DIR *dir;
+
+	if (nr_log_disks == MD_MAX_DISK)
+		return NULL;
+
+	d = xzalloc(sizeof(*d));
+	INIT_LIST_HEAD(&d->segments);
+	if (snprintf(d->path, sizeof(d->path), "%s"LOG_DIR, path) >=
+	    sizeof(d->path)) {
+		sd_eprintf("too long path %s", path);
+		goto err;
+	}
+	if (xmkdir(d->path, sd_def_dmode) < 0) {
+		sd_eprintf("failed to create %s, %m", d->path);
+		goto err;
+	}
+	d->dirfd = open(d->path, O_RDONLY | O_DIRECTORY);
+	if (d->dirfd < 0) {
+		sd_eprintf("failed to open %s, %m", d->path);
+		goto err;
+	}
+
+	dir = opendir(d->path);
+	if (!dir) {
+		sd_eprintf("failed to open %s, %m", d->path);
+		goto close_dirfd;
+	}
+	while ((de = readdir(dir))) {
+		if (strlen(de->d_name) != 8)
+			continue;
+		seqs = xrealloc(seqs, sizeof(*seqs) * (nr + 1));
+		seqs[nr] = strtoul(de->d_name, &end, 16);
+		if (*end == '\0')
+			nr++;
+	}
+	closedir(dir);
+
+	qsort(seqs, nr, sizeof(*seqs), seg_seq_cmp);
+	for (i = 0; i < nr; i++)
+		if (!open_segment(d, seqs[i], false))
+			goto close_segments;
+	if (!nr && !open_segment(d, 1, true))
+		goto close_segments;
+	free(seqs);
+
+	pthread_mutex_init(&d->lock, NULL);
+	log_disks[nr_log_disks++] = d;
+	sd_dprintf("%s, %d segments", d->path, nr);
+	return d;
+close_segments:
+	while (!list_empty(&d->segments))
+		close_segment(list_first_entry(&d->segments,
+					       struct log_segment, list));
+	free(seqs);
+close_dirfd:
+	close(d->dirfd);
+err:
+	free(d);
+	return NULL;
+}
+
+/*
+ * The disk of the entry (oid, epoch), or the disk for a new entry of 'oid' if
+ * 'create'.  All the entries of an object go to the disk which has the
+ * others.  The disk of a new object is opened if 'open' is true, which needs
+ * the write lock, and otherwise the read lock is enough.
+ */
+static struct log_disk *obj_to_disk(uint64_t oid, uint32_t epoch, bool create,
+				    bool open)
+{
+	char path[PATH_MAX];
+	struct log_disk *d;
+	struct log_obj *o;
+
+	if (!create) {
+		o = lookup_obj(oid, epoch);
+		return o ? o->disk : NULL;
+	}
+
+	o = lookup_any_obj(oid);
+	if (o)
+		return o->disk;
+
+	pstrcpy(path, sizeof(path), md_get_object_path(oid));
+	d = find_disk(path);
+	if (!d && open)
+		d = open_disk(path);
+
+	return d;
+}
+
+/*
+ * Find the disk as obj_to_disk() does and take its lock.  The entries of the
+ * disk only change with the lock held, so the disk is still the one of the
+ * entry until the caller releases the lock.
+ */
+static int lock_obj_disk(uint64_t oid, uint32_t epoch, bool create,
+			 struct log_disk **dp)
+{
+	struct log_disk *d, *cur;
+
+	for (;;) {
+		pthread_rwlock_rdlock(&log_lock);
+		d = obj_to_disk(oid, epoch, create, false);
+		pthread_rwlock_unlock(&log_lock);
+		if (!d && create) {
+			pthread_rwlock_wrlock(&log_lock);
+			d = obj_to_disk(oid, epoch, create, true);
+			pthread_rwlock_unlock(&log_lock);
+		}
+		if (!d)
+			return create ? SD_RES_EIO : SD_RES_NO_OBJ;
+
+		pthread_mutex_lock(&d->lock);
+		pthread_rwlock_rdlock(&log_lock);
+		cur = obj_to_disk(oid, epoch, create, false);
+		pthread_rwlock_unlock(&log_lock);
+		if (cur == d) {
+			*dp = d;
+			return SD_RES_SUCCESS;
+		}
+		/* The object was removed, or created on another disk */
+		pthread_mutex_unlock(&d->lock);
+	}
+}
+
+static struct log_segment *find_segment(struct log_disk *d, uint32_t seq)
+{
+	struct log_segment *seg;
+
+	list_for_each_entry(seg, &d->segments, list)
+		if (seg->seq == seq)
+			return seg;
+
+	return NULL;
+}
+
+static int load_checkpoint(struct log_disk *d, uint32_t *seq, uint64_t *offset)
+{
+	struct log_ckpt *ckpt;
+	struct log_ckpt_obj *co;
+	struct log_ckpt_extent *ce;
+	struct log_segment *seg;
+	struct log_obj *o;
+	char path[PATH_MAX], *buf, *p, *end;
+	struct stat st;
+	uint64_t i, j;
+	int fd, ret = SD_RES_EIO;
+
+	if (snprintf(path, sizeof(path), "%s/"LOG_CHECKPOINT, d->path) >=
+	    sizeof(path)) {
+		sd_eprintf("too long path %s", d->path);
+		return SD_RES_EIO;
+	}
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		if (errno != ENOENT) {
+			sd_eprintf("failed to open %s, %m", path);
+			return SD_RES_EIO;
+		}
+		/* Replay the whole log */
+		seg = list_first_entry(&d->segments, struct log_segment, list);
+		*seq = seg->seq;
+		*offset = 0;
+		return SD_RES_SUCCESS;
+	}
+	if (fstat(fd, &st) < 0 || st.st_size < sizeof(*ckpt)) {
+		sd_eprintf("invalid checkpoint %s", path);
+		close(fd);
+		return SD_RES_EIO;
+	}
+
+	buf = xmalloc(st.st_size);
+	if (xpread(fd, buf, st.st_size, 0) != st.st_size) {
+		sd_eprintf("failed to read %s, %m", path);
+		goto out;
+	}
+	ckpt = (struct log_ckpt *)buf;
+	p = buf + sizeof(*ckpt);
+	end = buf + st.st_size;
+	if (ckpt->magic != LOG_MAGIC ||
+	    ckpt->csum != fnv_64a_buf(p, end - p, FNV1A_64_INIT)) {
+		sd_eprintf("corrupted checkpoint %s", path);
+		goto out;
+	}
+
+	for (i = 0; i < ckpt->nr_objs; i++) {
+		co = (struct log_ckpt_obj *)p;
+		p += sizeof(*co);
+		if (p > end)
+			goto corrupted;
+
+		o = new_obj(co->oid, co->epoch, co->lsn, d);
+		if (co->has_cow) {
+			if (p + sizeof(struct cow_map) > end)
+				goto corrupted;
+			set_cow(o, (struct cow_map *)p);
+			p += sizeof(struct cow_map);
+		}
+		for (j = 0; j < co->nr_extents; j++) {
+			ce = (struct log_ckpt_extent *)p;
+			p += sizeof(*ce);
+			if (p > end)
+				goto corrupted;
+			seg = find_segment(d, ce->seq);
+			if (!seg) {
+				sd_eprintf("segment %08"PRIx32" of %s is lost",
+					   ce->seq, d->path);
+				goto out;
+			}
+			add_extent(o, ce->offset, ce->length, seg,
+				   ce->seg_offset);
+		}
+	}
+
+	*seq = ckpt->seq;
+	*offset = ckpt->offset;
+	next_lsn = max(next_lsn, ckpt->lsn);
+	ret = SD_RES_SUCCESS;
+	goto out;
+corrupted:
+	sd_eprintf("truncated checkpoint %s", path);
+out:
+	close(fd);
+	free(buf);
+	return ret;
+}
+
+/*
+ * Replay the records of 'seg' from 'offset'.  A bad record ends the log, and
+ * the head of the log is moved back to it.
+ */
+static void replay_segment(struct log_disk *d, struct log_segment *seg,
+			   uint64_t offset)
+{
+	struct log_rec rec;
+	void *data = NULL;
+	uint32_t data_size = 0;
+	int nr = 0;
+
+	while (offset + sizeof(rec) <= seg->size) {
+		if (xpread(seg->fd, &rec, sizeof(rec), offset) != sizeof(rec) ||
+		    rec.magic != LOG_MAGIC || rec.length > LOG_SEGMENT_SIZE ||
+		    offset + sizeof(rec) + rec.length > seg->size)
+			break;
+
+		if (rec.length > data_size) {
+			data = xrealloc(data, rec.length);
+			data_size = rec.length;
+		}
+		if (xpread(seg->fd, data, rec.length, offset + sizeof(rec)) !=
+		    rec.length)
+			break;
+		if (rec.csum != rec_csum(&rec, data_csum(NULL, data,
+							 rec.length)))
+			break;
+		if ((rec.flags & LOG_REC_COW || rec.type == LOG_COW) &&
+		    rec.length && rec.length < sizeof(struct cow_map))
+			break;
+
+		apply_rec(d, &rec, seg, offset + sizeof(rec), data);
+		next_lsn = max(next_lsn, rec.lsn + 1);
+		offset += sizeof(rec) + rec.length;
+		nr++;
+	}
+
+	if (offset < seg->size) {
+		if (seg == d->active) {
+			/* Drop the torn tail, nothing after it was acked */
+			sd_iprintf("log of %s ends at %08"PRIx32":%"PRIu64,
+				   d->path, seg->seq, offset);
+			if (ftruncate(seg->fd, offset) < 0)
+				sd_eprintf("failed to truncate segment %08"
+					   PRIx32", %m", seg->seq);
+		} else
+			sd_eprintf("segment %08"PRIx32" of %s is corrupted at %"
+				   PRIu64, seg->seq, d->path, offset);
+		seg->size = offset;
+	}
+	free(data);
+	sd_dprintf("%d records of %08"PRIx32" are replayed", nr, seg->seq);
+}
+
+static int init_log_disk(char *path)
+{
+	struct log_segment *seg;
+	struct log_disk *d;
+	uint64_t offset;
+	uint32_t seq;
+	int ret;
+
+	if (find_disk(path))
+		return SD_RES_SUCCESS;
+
+	d = open_disk(path);
+	if (!d)
+		return SD_RES_EIO;
+
+	ret = load_checkpoint(d, &seq, &offset);
+	if (ret != SD_RES_SUCCESS)
+		return ret;
+
+	list_for_each_entry(seg, &d->segments, list) {
+		if (seg->seq > seq)
+			replay_segment(d, seg, 0);
+		else if (seg->seq == seq)
+			replay_segment(d, seg, offset);
+	}
+
+	return SD_RES_SUCCESS;
+}
+
+/*
+ * Copy the extents of 'o' which overlap [offset, offset + length) and take a
+ * reference to their segments, so that they can be read without the lock.
+ */
+static int pin_extents(const struct log_obj *o, uint64_t offset,
+		       uint32_t length, struct log_extent **extents)
+{
+	struct log_extent *e;
+	int i, nr = 0;
+
+	*extents = xmalloc(sizeof(**extents) * (o->nr_extents ?: 1));
+	for (i = 0; i < o->nr_extents; i++) {
+		e = o->extents + i;
+		if (e->offset + e->length <= offset ||
+		    offset + length <= e->offset)
+			continue;
+		seg_get(e->seg);
+		(*extents)[nr++] = *e;
+	}
+
+	return nr;
+}
+
+static int read_extents(uint64_t oid, struct log_extent *extents, int nr,
+			void *buf, uint64_t offset, uint32_t length)
+{
+	struct log_extent *e;
+	uint64_t start, end;
+	int i, ret = SD_RES_SUCCESS;
+
+	memset(buf, 0, length);
+	for (i = 0; i < nr; i++) {
+		e = extents + i;
+		start = max((uint64_t)e->offset, offset);
+		end = min((uint64_t)e->offset + e->length, offset + length);
+		if (ret == SD_RES_SUCCESS &&
+		    xpread(e->seg->fd, (char *)buf + start - offset,
+			   end - start, e->seg_offset + start - e->offset)
+		    != end - start) {
+			sd_eprintf("failed to read object %"PRIx64" from "
+				   "segment %08"PRIx32", %m", oid, e->seg->seq);
+			ret = SD_RES_EIO;
+		}
+		seg_put(e->seg);
+	}
+
+	return ret;
+}
+
+/* Read the live object, or the stale one of 'epoch' if there is none */
+static int read_obj(uint64_t oid, uint32_t epoch, void *buf, uint64_t offset,
+		    uint32_t length)
+{
+	struct log_extent *extents;
+	struct log_obj *o;
+	int nr, ret;
+
+	pthread_rwlock_rdlock(&log_lock);
+	o = lookup_obj(oid, 0);
+	if (!o && epoch)
+		o = lookup_obj(oid, epoch);
+	if (!o) {
+		pthread_rwlock_unlock(&log_lock);
+		return SD_RES_NO_OBJ;
+	}
+	nr = pin_extents(o, offset, length, &extents);
+	pthread_rwlock_unlock(&log_lock);
+
+	ret = read_extents(oid, extents, nr, buf, offset, length);
+	free(extents);
+
+	return ret;
+}
+
+static int log_store_read(uint64_t oid, const struct siocb *iocb)
+{
+	uint32_t epoch = 0;
+
+	/* An object of an older epoch may be one of the stale objects */
+	if (iocb->epoch > 0 && iocb->epoch < sys_epoch())
+		epoch = iocb->epoch;
+
+	return read_obj(oid, epoch, iocb->buf, iocb->offset, iocb->length);
+}
+
+static int put_obj(uint64_t oid, const struct siocb *iocb, bool create)
+{
+	struct log_rec rec = {
+		.type = LOG_PUT,
+		.oid = oid,
+		.offset = iocb->offset,
+	};
+	const struct cow_map *cow = NULL;
+	struct log_segment *seg;
+	struct log_disk *d;
+	uint64_t csum;
+	int ret;
+
+	if (create) {
+		rec.flags = LOG_REC_CREATE;
+		if (iocb->cow && iocb->cow->cow_oid) {
+			rec.flags |= LOG_REC_COW;
+			cow = iocb->cow;
+		}
+	}
+	csum = data_csum(cow, iocb->buf, iocb->length);
+
+	ret = lock_obj_disk(oid, 0, create, &d);
+	if (ret != SD_RES_SUCCESS)
+		return ret;
+	ret = commit_rec(d, &rec, cow, iocb->buf, iocb->length, csum, &seg);
+	pthread_mutex_unlock(&d->lock);
+
+	if (ret == SD_RES_SUCCESS)
+		ret = end_commit(seg);
+	return ret;
+}
+
+static int log_store_write(uint64_t oid, const struct siocb *iocb)
+{
+	if (iocb->epoch < sys_epoch()) {
+		sd_dprintf("%"PRIu32" sys %"PRIu32, iocb->epoch, sys_epoch());
+		return SD_RES_OLD_NODE_VER;
+	}
+
+	return put_obj(oid, iocb, false);
+}
+
+static int log_store_create_and_write(uint64_t oid, const struct siocb *iocb)
+{
+	return put_obj(oid, iocb, true);
+}
+
+static bool log_store_exist(uint64_t oid)
+{
+	bool ret;
+
+	pthread_rwlock_rdlock(&log_lock);
+	ret = !!lookup_obj(oid, 0);
+	pthread_rwlock_unlock(&log_lock);
+
+	return ret;
+}
+
+/* Commit a record without data to the entry (oid, epoch) */
+static int commit_op(int type, uint64_t oid, uint32_t epoch,
+		     const struct cow_map *cow)
+{
+	struct log_rec rec = {
+		.type = type,
+		.oid = oid,
+		.epoch = epoch,
+	};
+	uint64_t csum = data_csum(cow, NULL, 0);
+	struct log_segment *seg;
+	struct log_disk *d;
+	int ret;
+
+	ret = lock_obj_disk(oid, type == LOG_STALE ? 0 : epoch, false, &d);
+	if (ret != SD_RES_SUCCESS)
+		return ret;
+	ret = commit_rec(d, &rec, cow, NULL, 0, csum, &seg);
+	pthread_mutex_unlock(&d->lock);
+
+	if (ret == SD_RES_SUCCESS)
+		ret = end_commit(seg);
+	return ret;
+}
+
+static int log_store_remove_object(uint64_t oid)
+{
+	return commit_op(LOG_DELETE, oid, 0, NULL);
+}
+
+static int log_store_link(uint64_t oid, uint32_t tgt_epoch)
+{
+	sd_dprintf("try link %"PRIx64" from snapshot with epoch %d", oid,
+		   tgt_epoch);
+
+	return commit_op(LOG_LINK, oid, tgt_epoch, NULL);
+}
+
+static int log_store_set_cow_map(uint64_t oid, const struct cow_map *map)
+{
+	return commit_op(LOG_COW, oid, 0, map->cow_oid ? map : NULL);
+}
+
+static int log_store_get_cow_map(uint64_t oid, uint32_t epoch,
+				 struct cow_map *map)
+{
+	struct log_obj *o;
+	int ret = SD_RES_SUCCESS;
+
+	pthread_rwlock_rdlock(&log_lock);
+	o = lookup_obj(oid, 0);
+	if (!o && epoch > 0 && epoch < sys_epoch())
+		o = lookup_obj(oid, epoch);
+	if (!o)
+		ret = SD_RES_NO_OBJ;
+	else if (o->cow)
+		*map = *o->cow;
+	else
+		map->cow_oid = 0;
+	pthread_rwlock_unlock(&log_lock);
+
+	return ret;
+}
+
+/* Return the live objects for which 'fn' is true */
+static uint64_t *collect_live_objs(bool (*fn)(uint64_t oid), int *nr)
+{
+	uint64_t *oids = NULL;
+	struct log_obj *o;
+	struct rb_node *n;
+
+	*nr = 0;
+	pthread_rwlock_rdlock(&log_lock);
+	for (n = rb_first(&log_index); n; n = rb_next(n)) {
+		o = rb_entry(n, struct log_obj, node);
+		if (o->epoch || (fn && !fn(o->oid)))
+			continue;
+		oids = xrealloc(oids, sizeof(*oids) * (*nr + 1));
+		oids[(*nr)++] = o->oid;
+	}
+	pthread_rwlock_unlock(&log_lock);
+
+	return oids;
+}
+
+static int stale_objs(bool (*fn)(uint64_t oid), uint32_t epoch)
+{
+	uint64_t *oids;
+	int i, nr, ret = SD_RES_SUCCESS;
+
+	oids = collect_live_objs(fn, &nr);
+	for (i = 0; i < nr; i++) {
+		ret = commit_op(LOG_STALE, oids[i], epoch, NULL);
+		if (ret == SD_RES_NO_OBJ)
+			ret = SD_RES_SUCCESS;
+		if (ret != SD_RES_SUCCESS)
+			break;
+		sd_dprintf("moved object %"PRIx64" to stale, epoch %"PRIu32,
+			   oids[i], epoch);
+	}
+	free(oids);
+
+	return ret;
+}
+
+static int log_store_update_epoch(uint32_t epoch)
+{
+	assert(epoch);
+	return stale_objs(default_oid_stale, epoch);
+}
+
+static int log_store_purge_obj(void)
+{
+	return stale_objs(NULL, get_latest_epoch());
+}
+
+static int log_store_cleanup(void)
+{
+	struct log_rec rec = { .type = LOG_CLEANUP };
+	uint64_t csum = data_csum(NULL, NULL, 0);
+	struct log_segment *seg;
+	struct log_disk *d;
+	int i, nr, ret = SD_RES_SUCCESS;
+
+	pthread_rwlock_rdlock(&log_lock);
+	nr = nr_log_disks;
+	pthread_rwlock_unlock(&log_lock);
+
+	/* Disks are only added while the store is in use */
+	for (i = 0; i < nr; i++) {
+		d = log_disks[i];
+		pthread_mutex_lock(&d->lock);
+		ret = commit_rec(d, &rec, NULL, NULL, 0, csum, &seg);
+		pthread_mutex_unlock(&d->lock);
+		if (ret == SD_RES_SUCCESS)
+			ret = end_commit(seg);
+		if (ret != SD_RES_SUCCESS)
+			break;
+	}
+
+	return ret;
+}
+
+static int log_store_get_hash(uint64_t oid, uint32_t epoch, uint8_t *sha1)
+{
+	int ret;
+	void *buf;
+	struct sha1_ctx c;
+	uint64_t offset = 0;
+	uint32_t length = get_objsize(oid);
+
+	buf = buf_get(length);
+	if (buf == NULL)
+		return SD_RES_NO_MEM;
+
+	ret = read_obj(oid, epoch, buf, 0, length);
+	if (ret != SD_RES_SUCCESS) {
+		buf_put(buf, get_objsize(oid));
+		return ret;
+	}
+
+	trim_zero_sectors(buf, &offset, &length);
+
+	sha1_init(&c);
+	sha1_update(&c, (uint8_t *)&offset, sizeof(offset));
+	sha1_update(&c, (uint8_t *)&length, sizeof(length));
+	sha1_update(&c, buf, length);
+	sha1_final(&c, sha1);
+	buf_put(buf, get_objsize(oid));
+
+	sd_dprintf("the message digest of %"PRIx64" at epoch %d is %s", oid,
+		   epoch, sha1_to_hex(sha1));
+
+	return SD_RES_SUCCESS;
+}
+
+static int checkpoint_disk(struct log_disk *d)
+{
+	struct log_ckpt ckpt = { .magic = LOG_MAGIC };
+	struct log_ckpt_extent *ce;
+	struct log_ckpt_obj *co;
+	struct log_segment *active;
+	struct log_obj *o;
+	struct rb_node *n;
+	uint64_t appended;
+	size_t size = sizeof(ckpt);
+	char path[PATH_MAX], *buf, *p;
+	int i, ret;
+
+	if (snprintf(path, sizeof(path), "%s/"LOG_CHECKPOINT, d->path) >=
+	    sizeof(path)) {
+		sd_eprintf("too long path %s", d->path);
+		return SD_RES_EIO;
+	}
+
+	/* The index is up to date with the head of the log under the lock */
+	pthread_mutex_lock(&d->lock);
+	pthread_rwlock_rdlock(&log_lock);
+	for (n = rb_first(&log_index); n; n = rb_next(n)) {
+		o = rb_entry(n, struct log_obj, node);
+		if (o->disk != d)
+			continue;
+		size += sizeof(*co) + sizeof(*ce) * o->nr_extents +
+			(o->cow ? sizeof(*o->cow) : 0);
+	}
+
+	buf = xmalloc(size);
+	p = buf + sizeof(ckpt);
+	for (n = rb_first(&log_index); n; n = rb_next(n)) {
+		o = rb_entry(n, struct log_obj, node);
+		if (o->disk != d)
+			continue;
+		co = (struct log_ckpt_obj *)p;
+		memset(co, 0, sizeof(*co));
+		co->oid = o->oid;
+		co->lsn = o->lsn;
+		co->epoch = o->epoch;
+		co->nr_extents = o->nr_extents;
+		co->has_cow = !!o->cow;
+		p += sizeof(*co);
+		if (o->cow) {
+			memcpy(p, o->cow, sizeof(*o->cow));
+			p += sizeof(*o->cow);
+		}
+		for (i = 0; i < o->nr_extents; i++) {
+			ce = (struct log_ckpt_extent *)p;
+			memset(ce, 0, sizeof(*ce));
+			ce->offset = o->extents[i].offset;
+			ce->length = o->extents[i].length;
+			ce->seq = o->extents[i].seg->seq;
+			ce->seg_offset = o->extents[i].seg_offset;
+			p += sizeof(*ce);
+		}
+		ckpt.nr_objs++;
+	}
+
+	active = d->active;
+	ckpt.seq = active->seq;
+	ckpt.offset = active->size;
+	ckpt.lsn = uatomic_read(&next_lsn);
+	appended = uatomic_read(&d->nr_appended);
+	seg_get(active);
+	pthread_rwlock_unlock(&log_lock);
+	pthread_mutex_unlock(&d->lock);
+
+	/* Everything the checkpoint refers to must be on the disk first */
+	ret = sync_segment(active);
+	seg_put(active);
+	if (ret < 0) {
+		free(buf);
+		return SD_RES_EIO;
+	}
+
+	ckpt.csum = fnv_64a_buf(buf + sizeof(ckpt), size - sizeof(ckpt),
+				FNV1A_64_INIT);
+	memcpy(buf, &ckpt, sizeof(ckpt));
+
+	ret = atomic_create_and_write(path, buf, size);
+	free(buf);
+	if (ret < 0) {
+		sd_eprintf("failed to write checkpoint of %s", d->path);
+		return SD_RES_EIO;
+	}
+	if (sync_dir(d) < 0)
+		return SD_RES_EIO;
+	uatomic_sub(&d->nr_appended, appended);
+
+	sd_dprintf("%s, %"PRIu64" objects, up to %08"PRIx32":%"PRIu64, d->path,
+		   ckpt.nr_objs, ckpt.seq, ckpt.offset);
+	return SD_RES_SUCCESS;
+}
+
+struct log_reloc {
+	uint64_t oid;
+	uint32_t epoch;
+	uint32_t length;
+	uint64_t seg_offset;
+};
+
+/*
+ * Find an extent of the entry of 'r' which is still in the part of 'seg' that
+ * 'r' covers.  Called with the lock of 'd' held.
+ */
+static bool find_reloc_extent(struct log_disk *d, struct log_segment *seg,
+			      const struct log_reloc *r, struct log_extent *ext)
+{
+	struct log_extent *e;
+	struct log_obj *o;
+	bool found = false;
+	int i;
+
+	pthread_rwlock_rdlock(&log_lock);
+	o = find_obj(d, r->oid, r->epoch);
+	for (i = 0; o && i < o->nr_extents; i++) {
+		e = o->extents + i;
+		if (e->seg == seg && r->seg_offset <= e->seg_offset &&
+		    e->seg_offset < r->seg_offset + r->length) {
+			*ext = *e;
+			found = true;
+			break;
+		}
+	}
+	pthread_rwlock_unlock(&log_lock);
+
+	return found;
+}
+
+static bool same_extent(const struct log_extent *a, const struct log_extent *b)
+{
+	return a->offset == b->offset && a->length == b->length &&
+		a->seg == b->seg && a->seg_offset == b->seg_offset;
+}
+
+/* Copy an extent of 'seg', which 'data' holds, to the head of the log */
+static int relocate_extent(struct log_disk *d, struct log_segment *seg,
+			   const struct log_reloc *r, char *data)
+{
+	struct log_segment *head;
+	struct log_extent ext, cur;
+	uint64_t csum;
+	char *p;
+	int ret = SD_RES_SUCCESS;
+
+	/* The extent may have been split by writes since it was collected */
+	for (;;) {
+		struct log_rec rec = {
+			.type = LOG_PUT,
+			.oid = r->oid,
+			.epoch = r->epoch,
+		};
+
+		pthread_mutex_lock(&d->lock);
+		if (!find_reloc_extent(d, seg, r, &ext)) {
+			pthread_mutex_unlock(&d->lock);
+			break;
+		}
+		pthread_mutex_unlock(&d->lock);
+
+		/* The data of the sealed segment never changes */
+		p = data + ext.seg_offset - r->seg_offset;
+		csum = data_csum(NULL, p, ext.length);
+
+		pthread_mutex_lock(&d->lock);
+		if (!find_reloc_extent(d, seg, r, &cur) ||
+		    !same_extent(&ext, &cur)) {
+			/* Overwritten meanwhile, look again */
+			pthread_mutex_unlock(&d->lock);
+			continue;
+		}
+		rec.offset = ext.offset;
+		ret = commit_rec(d, &rec, NULL, p, ext.length, csum, &head);
+		pthread_mutex_unlock(&d->lock);
+		if (ret != SD_RES_SUCCESS)
+			break;
+		seg_put(head);
+	}
+
+	return ret;
+}
+
+static int relocate_segment(struct log_disk *d, struct log_segment *seg)
+{
+	struct log_reloc *relocs = NULL;
+	struct log_obj *o;
+	struct rb_node *n;
+	char *data = NULL;
+	uint32_t data_size = 0;
+	int i, nr = 0, ret = SD_RES_SUCCESS;
+
+	pthread_rwlock_rdlock(&log_lock);
+	for (n = rb_first(&log_index); n; n = rb_next(n)) {
+		o = rb_entry(n, struct log_obj, node);
+		for (i = 0; i < o->nr_extents; i++) {
+			if (o->extents[i].seg != seg)
+				continue;
+			relocs = xrealloc(relocs, sizeof(*relocs) * (nr + 1));
+			relocs[nr].oid = o->oid;
+			relocs[nr].epoch = o->epoch;
+			relocs[nr].length = o->extents[i].length;
+			relocs[nr].seg_offset = o->extents[i].seg_offset;
+			nr++;
+		}
+	}
+	pthread_rwlock_unlock(&log_lock);
+
+	/* Nobody else deletes the segment, and its data never changes */
+	for (i = 0; i < nr; i++) {
+		if (relocs[i].length > data_size) {
+			data = xrealloc(data, relocs[i].length);
+			data_size = relocs[i].length;
+		}
+		if (xpread(seg->fd, data, relocs[i].length,
+			   relocs[i].seg_offset) != relocs[i].length) {
+			sd_eprintf("failed to read segment %08"PRIx32" of %s, "
+				   "%m", seg->seq, d->path);
+			ret = SD_RES_EIO;
+			break;
+		}
+		ret = relocate_extent(d, seg, relocs + i, data);
+		if (ret != SD_RES_SUCCESS)
+			break;
+	}
+	free(data);
+	free(relocs);
+
+	sd_dprintf("relocated %d extents of %08"PRIx32, nr, seg->seq);
+	return ret;
+}
+
+static void delete_segment(struct log_disk *d, struct log_segment *seg)
+{
+	char path[PATH_MAX];
+
+	/* open_segment() checked the length of the path */
+	if (snprintf(path, sizeof(path), "%s/%08"PRIx32, d->path, seg->seq) >=
+	    sizeof(path))
+		return;
+
+	pthread_mutex_lock(&d->lock);
+	pthread_rwlock_wrlock(&log_lock);
+	if (seg->live || uatomic_read(&seg->refcnt)) {
+		/* Retry next time */
+		pthread_rwlock_unlock(&log_lock);
+		pthread_mutex_unlock(&d->lock);
+		return;
+	}
+	close_segment(seg);
+	pthread_rwlock_unlock(&log_lock);
+	pthread_mutex_unlock(&d->lock);
+
+	if (unlink(path) < 0)
+		sd_eprintf("failed to remove %s, %m", path);
+	sync_dir(d);
+	sd_dprintf("%s", path);
+}
+
+static void compact_disk(struct log_disk *d)
+{
+	struct log_segment *seg, *victim = NULL;
+	uint64_t dead, max_dead = 0;
+
+	pthread_mutex_lock(&d->lock);
+	pthread_rwlock_rdlock(&log_lock);
+	list_for_each_entry(seg, &d->segments, list) {
+		if (seg == d->active)
+			continue;
+		dead = seg->size - seg->live;
+		if (dead * 100 >= seg->size * LOG_COMPACT_RATIO &&
+		    dead >= max_dead) {
+			victim = seg;
+			max_dead = dead;
+		}
+	}
+	pthread_rwlock_unlock(&log_lock);
+	pthread_mutex_unlock(&d->lock);
+
+	if (victim) {
+		if (relocate_segment(d, victim) != SD_RES_SUCCESS ||
+		    checkpoint_disk(d) != SD_RES_SUCCESS)
+			return;
+		delete_segment(d, victim);
+	} else if (uatomic_read(&d->nr_appended) >= LOG_CHECKPOINT_BYTES)
+		checkpoint_disk(d);
+}
+
+static void *log_compactor(void *arg)
+{
+	int i, nr;
+
+	for (;;) {
+		sleep(LOG_COMPACT_INTERVAL);
+
+		pthread_mutex_lock(&compact_lock);
+		pthread_rwlock_rdlock(&log_lock);
+		nr = nr_log_disks;
+		pthread_rwlock_unlock(&log_lock);
+
+		/* Disks are only added, or all removed with compact_lock */
+		for (i = 0; i < nr; i++)
+			compact_disk(log_disks[i]);
+		pthread_mutex_unlock(&compact_lock);
+	}
+
+	return NULL;
+}
+
+static int init_objlist_and_vdi_bitmap(struct log_obj *o)
+{
+	struct sd_inode *inode;
+	int ret;
+
+	objlist_cache_insert(o->oid);
+	if (!is_vdi_obj(o->oid))
+		return SD_RES_SUCCESS;
+
+	sd_dprintf("found the VDI object %" PRIx64, o->oid);
+	set_bit(oid_to_vid(o->oid), sys->vdi_inuse);
+
+	inode = xzalloc(SD_INODE_HEADER_SIZE);
+	ret = read_obj(o->oid, o->epoch, inode, 0, SD_INODE_HEADER_SIZE);
+	if (ret == SD_RES_SUCCESS)
+		add_vdi_state(oid_to_vid(o->oid), inode->nr_copies,
+			      vdi_is_snapshot(inode), inode->copy_policy);
+	else
+		sd_eprintf("failed to read inode header %" PRIx64 " %" PRId32,
+			   o->oid, o->epoch);
+	free(inode);
+
+	return SD_RES_SUCCESS;
+}
+
+static int log_store_init(void)
+{
+	static pthread_t compactor;
+	struct rb_node *n;
+	int ret;
+
+	sd_dprintf("use log store driver");
+
+	pthread_mutex_lock(&compact_lock);
+	pthread_rwlock_wrlock(&log_lock);
+	ret = for_each_obj_path(init_log_disk);
+	pthread_rwlock_unlock(&log_lock);
+	pthread_mutex_unlock(&compact_lock);
+	if (ret != SD_RES_SUCCESS)
+		return ret;
+
+	/* Nothing else runs yet, so the index can be walked without the lock */
+	for (n = rb_first(&log_index); n; n = rb_next(n))
+		init_objlist_and_vdi_bitmap(rb_entry(n, struct log_obj, node));
+
+	if (!compactor) {
+		ret = pthread_create(&compactor, NULL, log_compactor, NULL);
+		if (ret) {
+			sd_eprintf("failed to create the compactor, %s",
+				   strerror(ret));
+			compactor = 0;
+			return SD_RES_EIO;
+		}
+	}
+
+	return SD_RES_SUCCESS;
+}
+
+static int log_store_format(void)
+{
+	struct log_segment *seg, *t;
+	struct rb_node *n;
+	int i;
+
+	pthread_mutex_lock(&compact_lock);
+	pthread_rwlock_wrlock(&log_lock);
+	while ((n = rb_first(&log_index)))
+		free_obj(rb_entry(n, struct log_obj, node));
+	for (i = 0; i < nr_log_disks; i++) {
+		list_for_each_entry_safe(seg, t, &log_disks[i]->segments, list)
+			close_segment(seg);
+		close(log_disks[i]->dirfd);
+		pthread_mutex_destroy(&log_disks[i]->lock);
+		free(log_disks[i]);
+	}
+	nr_log_disks = 0;
+	pthread_rwlock_unlock(&log_lock);
+	pthread_mutex_unlock(&compact_lock);
+
+	return default_format();
+}
+
+static struct store_driver log_store = {
+	.name = "log",
+	.init = log_store_init,
+	.exist = log_store_exist,
+	.create_and_write = log_store_create_and_write,
+	.write = log_store_write,
+	.read = log_store_read,
+	.link = log_store_link,
+	.update_epoch = log_store_update_epoch,
+	.cleanup = log_store_cleanup,
+	.format = log_store_format,
+	.remove_object = log_store_remove_object,
+	.get_hash = log_store_get_hash,
+	.get_cow_map = log_store_get_cow_map,
+	.set_cow_map = log_store_set_cow_map,
+	.purge_obj = log_store_purge_obj,
+};
+
+add_store_driver(log_store);
@@ -188,7 +188,7 @@ static int get_total_object_size(uint64_t oid, char *wd, uint32_t epoch,
 	struct stat s;
 	char path[PATH_MAX];
 
-	snprintf(path, PATH_MAX, "%s/%016" PRIx64, wd, oid);
+	snprintf(path, PATH_MAX, "%s/%02x/%016" PRIx64, wd, obj_dir(oid), oid);
 	if (stat(path, &s) == 0)
 		*t += s.st_blocks * SECTOR_SIZE;
 	else
@@ -197,21 +197,27 @@ static int get_total_object_size(uint64_t oid, char *wd, uint32_t epoch,
 	return SD_RES_SUCCESS;
 }
 
-/* If cleanup is true, temporary objects will be removed */
-static int for_each_object_in_path(char *path,
-				   int (*func)(uint64_t, char *, uint32_t,
-					       void *),
-				   bool cleanup, void *arg)
+/*
+ * Call 'func' against the objects in the subdirectory 'idx' of 'path'.  If
+ * cleanup is true, temporary objects will be removed.
+ */
+static int for_each_object_in_dir(char *path, int idx,
+				  int (*func)(uint64_t, char *, uint32_t,
+					      void *),
+				  bool cleanup, void *arg)
 {
 	DIR *dir;
 	struct dirent *d;
 	uint64_t oid;
 	int ret = SD_RES_SUCCESS;
-	char p[PATH_MAX];
+	char p[PATH_MAX], subdir[PATH_MAX];
 
-	dir = opendir(path);
+	snprintf(subdir, sizeof(subdir), "%s/%02x", path, idx);
+	dir = opendir(subdir);
 	if (!dir) {
-		sd_eprintf("failed to open %s, %m", path);
+		if (errno == ENOENT)
+			return SD_RES_SUCCESS;
+		sd_eprintf("failed to open %s, %m", subdir);
 		return SD_RES_EIO;
 	}
 
@@ -229,8 +235,11 @@ static int for_each_object_in_path(char *path,
 		if (strlen(d->d_name) == 20 &&
 		    strcmp(d->d_name + 16, ".tmp") == 0) {
 			if (cleanup) {
-				snprintf(p, PATH_MAX, "%s/%016"PRIx64".tmp",
-					 path, oid);
+				if (snprintf(p, sizeof(p), "%s/%s", subdir,
+					     d->d_name) >= sizeof(p)) {
+					sd_eprintf("too long path %s", subdir);
+					continue;
+				}
 				sd_dprintf("remove tmp object %s", p);
 				unlink(p);
 			}
@@ -248,6 +257,56 @@ static int for_each_object_in_path(char *path,
 	return ret;
 }
 
+/* 'func' is called with 'path', not with the subdirectory of the object */
+static int for_each_object_in_path(char *path,
+				   int (*func)(uint64_t, char *, uint32_t,
+					       void *),
+				   bool cleanup, void *arg)
+{
+	int i, ret = SD_RES_SUCCESS;
+
+	for (i = 0; i < NR_OBJ_DIRS; i++) {
+		ret = for_each_object_in_dir(path, i, func, cleanup, arg);
+		if (ret != SD_RES_SUCCESS)
+			break;
+	}
+
+	return ret;
+}
+
+static int make_subdirs(const char *path)
+{
+	char p[PATH_MAX];
+	int i;
+
+	for (i = 0; i < NR_OBJ_DIRS; i++) {
+		snprintf(p, sizeof(p), "%s/%02x", path, i);
+		if (xmkdir(p, sd_def_dmode) < 0) {
+			sd_eprintf("can't mkdir for %s, %m", p);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/* Create the stale directory and the subdirectories of the objects */
+int md_make_obj_dirs(const char *path)
+{
+	char stale[PATH_MAX];
+
+	snprintf(stale, sizeof(stale), "%s/.stale", path);
+	if (xmkdir(stale, sd_def_dmode) < 0) {
+		sd_eprintf("can't mkdir for %s, %m", stale);
+		return -1;
+	}
+
+	if (make_subdirs(path) < 0 || make_subdirs(stale) < 0)
+		return -1;
+
+	return 0;
+}
+
 static uint64_t get_path_free_size(char *path, uint64_t *used)
 {
 	struct statvfs fs;
@@ -276,18 +335,14 @@ out:
 static uint64_t init_path_space(char *path)
 {
 	uint64_t size;
-	char stale[PATH_MAX];
 
 	if (!is_xattr_enabled(path)) {
 		sd_iprintf("multi-disk support need xattr feature");
 		goto broken_path;
 	}
 
-	snprintf(stale, PATH_MAX, "%s/.stale", path);
-	if (xmkdir(stale, sd_def_dmode) < 0) {
-		sd_eprintf("can't mkdir for %s, %m", stale);
+	if (md_make_obj_dirs(path) < 0)
 		goto broken_path;
-	}
 
 	if (getxattr(path, MDNAME, &size, MDSIZE) < 0) {
 		if (errno == ENODATA) {
@@ -409,6 +464,92 @@ int for_each_object_in_stale(int (*func)(uint64_t oid, char *path,
 	return ret;
 }
 
+struct scan_arg {
+	char path[PATH_MAX];
+	int (*func)(uint64_t oid, char *path, uint32_t epoch, void *arg);
+	bool cleanup;
+	const unsigned long *dirs;
+	void *arg;
+	pthread_t thread;
+	int ret;
+};
+
+/* Scan the subdirectories set in 'dirs', all of them if it is NULL */
+static int scan_dirs(struct scan_arg *s, char *path, bool cleanup)
+{
+	int i, ret = SD_RES_SUCCESS;
+
+	for (i = 0; i < NR_OBJ_DIRS; i++) {
+		if (s->dirs && !test_bit(i, s->dirs))
+			continue;
+		ret = for_each_object_in_dir(path, i, s->func, cleanup,
+					     s->arg);
+		if (ret != SD_RES_SUCCESS)
+			break;
+	}
+
+	return ret;
+}
+
+static void *scan_disk(void *p)
+{
+	struct scan_arg *s = p;
+	char stale[PATH_MAX];
+
+	if (snprintf(stale, sizeof(stale), "%s/.stale", s->path) >=
+	    sizeof(stale)) {
+		sd_eprintf("too long path %s", s->path);
+		s->ret = SD_RES_EIO;
+		return NULL;
+	}
+	s->ret = scan_dirs(s, stale, false);
+	if (s->ret == SD_RES_SUCCESS)
+		s->ret = scan_dirs(s, s->path, s->cleanup);
+
+	return NULL;
+}
+
+/*
+ * Call 'func' against all the objects in the working and the stale
+ * directories, with a thread for each disk.  'func' must be thread safe.
+ * If 'dirs' is not NULL, only the subdirectories set in it are scanned.
+ */
+int for_each_object_parallel(int (*func)(uint64_t oid, char *path,
+					 uint32_t epoch, void *arg),
+			     bool cleanup, const unsigned long *dirs,
+			     void *arg)
+{
+	struct scan_arg *scans;
+	int i, nr, err, ret = SD_RES_SUCCESS;
+
+	pthread_rwlock_rdlock(&md_lock);
+	scans = xzalloc(sizeof(*scans) * md_nr_disks);
+	for (nr = 0; nr < md_nr_disks; nr++) {
+		pstrcpy(scans[nr].path, sizeof(scans[nr].path),
+			md_disks[nr].path);
+		scans[nr].func = func;
+		scans[nr].cleanup = cleanup;
+		scans[nr].dirs = dirs;
+		scans[nr].arg = arg;
+		err = pthread_create(&scans[nr].thread, NULL, scan_disk,
+				     scans + nr);
+		if (err) {
+			sd_eprintf("failed to create a thread, %s",
+				   strerror(err));
+			ret = SD_RES_EIO;
+			break;
+		}
+	}
+	for (i = 0; i < nr; i++) {
+		pthread_join(scans[i].thread, NULL);
+		if (ret == SD_RES_SUCCESS)
+			ret = scans[i].ret;
+	}
+	pthread_rwlock_unlock(&md_lock);
+	free(scans);
+
+	return ret;
+}
 
 int for_each_obj_path(int (*func)(char *path))
 {
@@ -453,6 +594,10 @@ static void md_do_recover(struct work *work)
 out:
 	pthread_rwlock_unlock(&md_lock);
 
+	/* The files of the objects on the broken disk are useless now */
+	if (idx >= 0)
+		fd_cache_purge();
+
 	if (nr > 0)
 		kick_recover();
 
@@ -490,14 +635,16 @@ static int get_old_new_path(uint64_t oid, uint32_t epoch, char *path,
 			    char *old, char *new)
 {
 	if (!epoch) {
-		snprintf(old, PATH_MAX, "%s/%016" PRIx64, path, oid);
-		snprintf(new, PATH_MAX, "%s/%016" PRIx64,
-			 md_get_object_path_nolock(oid), oid);
+		snprintf(old, PATH_MAX, "%s/%02x/%016" PRIx64, path,
+			 obj_dir(oid), oid);
+		snprintf(new, PATH_MAX, "%s/%02x/%016" PRIx64,
+			 md_get_object_path_nolock(oid), obj_dir(oid), oid);
 	} else {
-		snprintf(old, PATH_MAX, "%s/.stale/%016"PRIx64".%"PRIu32, path,
-			 oid, epoch);
-		snprintf(new, PATH_MAX, "%s/.stale/%016"PRIx64".%"PRIu32,
-			 md_get_object_path_nolock(oid), oid, epoch);
+		snprintf(old, PATH_MAX, "%s/.stale/%02x/%016"PRIx64".%"PRIu32,
+			 path, obj_dir(oid), oid, epoch);
+		snprintf(new, PATH_MAX, "%s/.stale/%02x/%016"PRIx64".%"PRIu32,
+			 md_get_object_path_nolock(oid), obj_dir(oid), oid,
+			 epoch);
 	}
 
 	if (!md_access(old))
@@ -559,6 +706,8 @@ static int check_and_move(uint64_t oid, uint32_t epoch, char *path)
 		sd_eprintf("move old %s to new %s failed", old, new);
 		return SD_RES_EIO;
 	}
+	if (!epoch)
+		fd_cache_invalidate(oid);
 
 	sd_dprintf("from %s to %s", old, new);
 	return SD_RES_SUCCESS;
@@ -582,8 +731,8 @@ bool md_exist(uint64_t oid)
 {
 	char path[PATH_MAX];
 
-	snprintf(path, PATH_MAX, "%s/%016" PRIx64, md_get_object_path(oid),
-		 oid);
+	snprintf(path, PATH_MAX, "%s/%02x/%016" PRIx64,
+		 md_get_object_path(oid), obj_dir(oid), oid);
 	if (md_access(path))
 		return true;
 	/*
@@ -599,8 +748,8 @@ bool md_exist(uint64_t oid)
 
 int md_get_stale_path(uint64_t oid, uint32_t epoch, char *path)
 {
-	snprintf(path, PATH_MAX, "%s/.stale/%016"PRIx64".%"PRIu32,
-		 md_get_object_path(oid), oid, epoch);
+	snprintf(path, PATH_MAX, "%s/.stale/%02x/%016"PRIx64".%"PRIu32,
+		 md_get_object_path(oid), obj_dir(oid), oid, epoch);
 	if (md_access(path))
 		return SD_RES_SUCCESS;
 
@@ -669,6 +818,10 @@ static int do_plug_unplug(char *disks, bool plug)
 out:
 	pthread_rwlock_unlock(&md_lock);
 
+	/* Objects are looked up on the new set of disks from now on */
+	if (ret == SD_RES_SUCCESS)
+		fd_cache_purge();
+
 	/*
 	 * We have to kick recover aggressively because there is possibility
 	 * that nr of disks are removed during md_init_space() happens to equal
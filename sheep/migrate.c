@@ -80,6 +80,9 @@ struct sd_node_v2 {
 /* sheepdog_config_v2 is the same as v1 */
 #define sheepdog_config_v2 sheepdog_config_v1
 
+/* v3 changes only the layout of the object directories */
+#define sheepdog_config_v3 sheepdog_config_v1
+
 static size_t get_file_size(const char *path)
 {
 	struct stat stbuf;
@@ -430,9 +433,93 @@ static int migrate_from_v1_to_v2(void)
 	return ret;
 }
 
+/*
+ * Move the objects in 'path' to their hashed subdirectories.  The names are
+ * kept, so this can be done again if we crash before the version is updated.
+ */
+static int move_objects_to_subdirs(const char *path)
+{
+	char old[PATH_MAX], new[PATH_MAX];
+	struct dirent *d;
+	uint64_t oid;
+	DIR *dir;
+	char *p;
+	int ret = 0;
+
+	dir = opendir(path);
+	if (!dir) {
+		sd_eprintf("failed to open %s, %m", path);
+		return -1;
+	}
+
+	while ((d = readdir(dir))) {
+		/* <oid>, <oid>.tmp or <oid>.<epoch> */
+		oid = strtoull(d->d_name, &p, 16);
+		if (oid == 0 || p != d->d_name + 16 || (*p && *p != '.'))
+			continue;
+
+		snprintf(old, sizeof(old), "%s/%s", path, d->d_name);
+		snprintf(new, sizeof(new), "%s/%02x/%s", path, obj_dir(oid),
+			 d->d_name);
+		if (rename(old, new) < 0) {
+			sd_eprintf("failed to move %s to %s, %m", old, new);
+			ret = -1;
+			break;
+		}
+	}
+	closedir(dir);
+
+	return ret;
+}
+
+static int update_obj_path_from_v2_to_v3(char *path)
+{
+	char stale[PATH_MAX];
+
+	if (md_make_obj_dirs(path) < 0)
+		return SD_RES_EIO;
+
+	snprintf(stale, sizeof(stale), "%s/.stale", path);
+	if (move_objects_to_subdirs(path) < 0 ||
+	    move_objects_to_subdirs(stale) < 0)
+		return SD_RES_EIO;
+
+	sd_iprintf("moved the objects in %s", path);
+	return SD_RES_SUCCESS;
+}
+
+static int migrate_from_v2_to_v3(void)
+{
+	int fd, ret;
+	uint16_t version = 3;
+
+	/* upgrade the object directories of all the disks */
+	if (for_each_obj_path(update_obj_path_from_v2_to_v3) != SD_RES_SUCCESS)
+		return -1;
+
+	fd = open(config_path, O_WRONLY | O_DSYNC);
+	if (fd < 0) {
+		sd_eprintf("failed to open config file, %m");
+		return -1;
+	}
+
+	ret = xpwrite(fd, &version, sizeof(version),
+		      offsetof(struct sheepdog_config_v3, version));
+	if (ret != sizeof(version)) {
+		sd_eprintf("failed to write config data, %m");
+		close(fd);
+		return -1;
+	}
+
+	close(fd);
+
+	return 0;
+}
+
 static int (*migrate[])(void) = {
 	migrate_from_v0_to_v1, /* from 0.4.0 or 0.5.0 to 0.5.1 */
 	migrate_from_v1_to_v2, /* from 0.5.x to 0.6.0 */
+	migrate_from_v2_to_v3, /* hashed subdirectories of the objects */
 };
 
 int sd_migrate_store(int from, int to)
@@ -0,0 +1,738 @@
+/*
+ * Copyright (C) 2013 Taobao Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Persistent index of the local objects
+ *
+ * The plain store rebuilds the object list cache and the vdi states at
+ * startup, which means a readdir of every object directory and a read of
+ * every inode.  Instead, every change of the object list cache and of the
+ * vdi states is appended to <dir>/obj_index while sheep runs, and at startup
+ * the index is replayed if it can be trusted.
+ *
+ * The appends are buffered, and every few seconds a checkpoint syncs the
+ * records and then writes the number and the checksum of the synced ones
+ * to the header, with the time of the checkpoint.  A clean shutdown seals
+ * the index, i.e. checkpoints it and marks it clean together with a
+ * signature of the object directories.
+ *
+ * At startup, a sealed index of unchanged directories is used as is.
+ * Otherwise, e.g. after a crash, the checkpointed records are replayed and
+ * only the subdirectories modified since shortly before the checkpoint are
+ * scanned again, since creating or removing an object changes the mtime of
+ * its subdirectory.  The vdi states are read again from the inodes, which
+ * are updated in place.  If the records are corrupted or the disks changed,
+ * the stores fall back to a scan of all the disks.  Either way, the index is
+ * rewritten from the result.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "sheep_priv.h"
+
+#define OBJ_INDEX_PATH "/obj_index"
+#define OBJ_INDEX_MAGIC 0x6f626a69	/* "obji" */
+#define OBJ_INDEX_VERSION 2
+#define OBJ_INDEX_HDR_SIZE 512		/* updated with a single sector write */
+#define OBJ_INDEX_BUF_RECS 256
+#define OBJ_INDEX_COMPACT_MIN 65536	/* records */
+#define OBJ_INDEX_CKPT_INTERVAL 5000	/* msec */
+/* An object is added to the index a bit after its directory is changed */
+#define OBJ_INDEX_CKPT_SLACK 5		/* sec */
+
+enum obj_index_rec_type {
+	OBJ_INDEX_ADD = 1,	/* oid is added to the object list */
+	OBJ_INDEX_DEL,		/* oid is removed from the object list */
+	OBJ_INDEX_VDI,		/* vdi state is set */
+	OBJ_INDEX_CLEAR_VDI,	/* all the vdi states are dropped */
+};
+
+struct obj_index_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t clean;
+	uint32_t __pad;
+	uint64_t dirs;		/* signature of the object directories */
+	uint64_t nr_recs;	/* synced ones */
+	uint64_t csum;		/* of the synced records */
+	uint64_t disks;		/* signature of the disks */
+	uint64_t time;		/* of the checkpoint */
+};
+
+struct obj_index_rec {
+	uint32_t type;
+	uint32_t __pad;
+	union {
+		uint64_t oid;
+		struct vdi_state vs;
+	};
+};
+
+static char *obj_index_path;
+
+static struct obj_index {
+	pthread_mutex_t lock;
+	int fd;				/* -1 if the index is not in use */
+	bool clean;
+	uint64_t nr_recs;		/* flushed ones */
+	uint64_t csum;
+	int nr_buf;
+	struct obj_index_rec buf[OBJ_INDEX_BUF_RECS];
+
+	/* The last checkpoint */
+	uint64_t ckpt_recs;
+	uint64_t ckpt_csum;
+	uint64_t ckpt_time;
+} idx = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.fd = -1,
+};
+
+/* Serializes the checkpoints, taken before idx.lock */
+static pthread_mutex_t ckpt_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct work_queue *ckpt_wqueue;
+
+void init_obj_index_path(const char *base_path)
+{
+	int len = strlen(base_path) + strlen(OBJ_INDEX_PATH) + 1;
+
+	obj_index_path = xzalloc(len);
+	snprintf(obj_index_path, len, "%s" OBJ_INDEX_PATH, base_path);
+}
+
+/* The signatures are computed with a single accumulator */
+static pthread_mutex_t sig_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t dirs_sig;
+
+static void add_dir_sig(const char *path)
+{
+	struct stat st;
+
+	dirs_sig = fnv_64a_buf(path, strlen(path), dirs_sig);
+	if (stat(path, &st) < 0)
+		return;
+	dirs_sig = fnv_64a_buf(&st.st_ino, sizeof(st.st_ino), dirs_sig);
+	dirs_sig = fnv_64a_buf(&st.st_mtim, sizeof(st.st_mtim), dirs_sig);
+}
+
+static int dir_sig(char *path)
+{
+	char p[PATH_MAX];
+	int i;
+
+	add_dir_sig(path);
+	snprintf(p, sizeof(p), "%s/.stale", path);
+	add_dir_sig(p);
+	for (i = 0; i < NR_OBJ_DIRS; i++) {
+		snprintf(p, sizeof(p), "%s/%02x", path, i);
+		add_dir_sig(p);
+		snprintf(p, sizeof(p), "%s/.stale/%02x", path, i);
+		add_dir_sig(p);
+	}
+
+	return SD_RES_SUCCESS;
+}
+
+/*
+ * Any object created, renamed or removed while sheep is down changes the
+ * mtime of its subdirectory.
+ */
+static uint64_t get_dirs_sig(void)
+{
+	uint64_t sig;
+
+	pthread_mutex_lock(&sig_lock);
+	dirs_sig = FNV1A_64_INIT;
+	for_each_obj_path(dir_sig);
+	sig = dirs_sig;
+	pthread_mutex_unlock(&sig_lock);
+
+	return sig;
+}
+
+static int disk_sig(char *path)
+{
+	struct stat st;
+
+	dirs_sig = fnv_64a_buf(path, strlen(path), dirs_sig);
+	if (stat(path, &st) == 0)
+		dirs_sig = fnv_64a_buf(&st.st_ino, sizeof(st.st_ino),
+				       dirs_sig);
+
+	return SD_RES_SUCCESS;
+}
+
+/* The records are of the objects on these disks */
+static uint64_t get_disks_sig(void)
+{
+	uint64_t sig;
+
+	pthread_mutex_lock(&sig_lock);
+	dirs_sig = FNV1A_64_INIT;
+	for_each_obj_path(disk_sig);
+	sig = dirs_sig;
+	pthread_mutex_unlock(&sig_lock);
+
+	return sig;
+}
+
+/* Say that the first 'nr_recs' records are synced */
+static int write_header(int fd, bool clean, uint64_t nr_recs, uint64_t csum,
+			uint64_t ckpt_time)
+{
+	char buf[OBJ_INDEX_HDR_SIZE] = {};
+	struct obj_index_header *hdr = (struct obj_index_header *)buf;
+
+	hdr->magic = OBJ_INDEX_MAGIC;
+	hdr->version = OBJ_INDEX_VERSION;
+	hdr->clean = clean;
+	hdr->nr_recs = nr_recs;
+	hdr->csum = csum;
+	hdr->disks = get_disks_sig();
+	hdr->time = ckpt_time;
+	if (clean)
+		hdr->dirs = get_dirs_sig();
+
+	if (xpwrite(fd, buf, sizeof(buf), 0) != sizeof(buf) ||
+	    fdatasync(fd) < 0) {
+		sd_eprintf("failed to write %s, %m", obj_index_path);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Called with idx.lock held */
+static int mark_dirty(void)
+{
+	return write_header(idx.fd, false, idx.ckpt_recs, idx.ckpt_csum,
+			    idx.ckpt_time);
+}
+
+/* Stop using the index, the next startup scans the disks */
+static void drop_index(void)
+{
+	close(idx.fd);
+	idx.fd = -1;
+	idx.nr_buf = 0;
+	unlink(obj_index_path);
+}
+
+static int flush_index(void)
+{
+	size_t len = sizeof(idx.buf[0]) * idx.nr_buf;
+
+	if (!idx.nr_buf)
+		return 0;
+
+	if (xpwrite(idx.fd, idx.buf, len, OBJ_INDEX_HDR_SIZE +
+		    idx.nr_recs * sizeof(idx.buf[0])) != len) {
+		sd_eprintf("failed to write %s, %m", obj_index_path);
+		return -1;
+	}
+	idx.nr_recs += idx.nr_buf;
+	idx.nr_buf = 0;
+
+	return 0;
+}
+
+static void append_rec(const struct obj_index_rec *rec)
+{
+	pthread_mutex_lock(&idx.lock);
+	if (idx.fd < 0)
+		goto out;
+
+	/* Something changed after the index was sealed */
+	if (idx.clean) {
+		if (mark_dirty() < 0) {
+			drop_index();
+			goto out;
+		}
+		idx.clean = false;
+	}
+
+	idx.buf[idx.nr_buf++] = *rec;
+	idx.csum = fnv_64a_buf(rec, sizeof(*rec), idx.csum);
+	if (idx.nr_buf == OBJ_INDEX_BUF_RECS && flush_index() < 0)
+		drop_index();
+out:
+	pthread_mutex_unlock(&idx.lock);
+}
+
+void obj_index_add(uint64_t oid)
+{
+	struct obj_index_rec rec = { .type = OBJ_INDEX_ADD, .oid = oid };
+
+	append_rec(&rec);
+}
+
+void obj_index_del(uint64_t oid)
+{
+	struct obj_index_rec rec = { .type = OBJ_INDEX_DEL, .oid = oid };
+
+	append_rec(&rec);
+}
+
+void obj_index_set_vdi(uint32_t vid, int nr_copies, bool snapshot,
+		       uint16_t copy_policy)
+{
+	struct obj_index_rec rec = { .type = OBJ_INDEX_VDI };
+
+	rec.vs.vid = vid;
+	rec.vs.nr_copies = nr_copies;
+	rec.vs.snapshot = snapshot;
+	rec.vs.copy_policy = copy_policy;
+	append_rec(&rec);
+}
+
+void obj_index_clear_vdi(void)
+{
+	struct obj_index_rec rec = { .type = OBJ_INDEX_CLEAR_VDI };
+
+	append_rec(&rec);
+}
+
+/*
+ * Sync the records appended so far, and then say so in the header.  Appends
+ * go on meanwhile behind the records being synced.
+ */
+static void checkpoint_index(void)
+{
+	uint64_t nr_recs, csum, now;
+	int fd;
+
+	pthread_mutex_lock(&ckpt_lock);
+	pthread_mutex_lock(&idx.lock);
+	if (idx.fd < 0 || idx.clean ||
+	    idx.nr_recs + idx.nr_buf == idx.ckpt_recs) {
+		pthread_mutex_unlock(&idx.lock);
+		goto out;
+	}
+	now = time(NULL);
+	if (flush_index() < 0) {
+		drop_index();
+		pthread_mutex_unlock(&idx.lock);
+		goto out;
+	}
+	nr_recs = idx.nr_recs;
+	csum = idx.csum;
+	/* The index may be dropped on an append error meanwhile */
+	fd = dup(idx.fd);
+	pthread_mutex_unlock(&idx.lock);
+	if (fd < 0) {
+		sd_eprintf("failed to dup %s, %m", obj_index_path);
+		goto out;
+	}
+
+	if (fdatasync(fd) < 0) {
+		sd_eprintf("failed to sync %s, %m", obj_index_path);
+		goto drop;
+	}
+	if (write_header(fd, false, nr_recs, csum, now) < 0)
+		goto drop;
+
+	pthread_mutex_lock(&idx.lock);
+	idx.ckpt_recs = nr_recs;
+	idx.ckpt_csum = csum;
+	idx.ckpt_time = now;
+	pthread_mutex_unlock(&idx.lock);
+	sd_dprintf("%"PRIu64" records", nr_recs);
+	goto close;
+drop:
+	pthread_mutex_lock(&idx.lock);
+	if (idx.fd >= 0)
+		drop_index();
+	pthread_mutex_unlock(&idx.lock);
+close:
+	close(fd);
+out:
+	pthread_mutex_unlock(&ckpt_lock);
+}
+
+static void checkpoint_work(struct work *work)
+{
+	checkpoint_index();
+}
+
+static void checkpoint_timer(void *arg);
+
+static struct timer ckpt_timer = {
+	.callback = checkpoint_timer,
+};
+
+static void checkpoint_done(struct work *work)
+{
+	add_timer(&ckpt_timer, OBJ_INDEX_CKPT_INTERVAL);
+}
+
+static struct work ckpt_work = {
+	.fn = checkpoint_work,
+	.done = checkpoint_done,
+};
+
+static void checkpoint_timer(void *arg)
+{
+	queue_work(ckpt_wqueue, &ckpt_work);
+}
+
+/* Called in the main thread when the index is put in use */
+static void start_checkpoint(void)
+{
+	if (ckpt_wqueue)
+		return;
+
+	ckpt_wqueue = create_ordered_work_queue("obj_index");
+	if (!ckpt_wqueue) {
+		sd_eprintf("failed to create the checkpoint queue");
+		return;
+	}
+	add_timer(&ckpt_timer, OBJ_INDEX_CKPT_INTERVAL);
+}
+
+static void apply_rec(const struct obj_index_rec *rec)
+{
+	switch (rec->type) {
+	case OBJ_INDEX_ADD:
+		objlist_cache_insert(rec->oid);
+		if (is_vdi_obj(rec->oid))
+			set_bit(oid_to_vid(rec->oid), sys->vdi_inuse);
+		break;
+	case OBJ_INDEX_DEL:
+		objlist_cache_remove(rec->oid);
+		break;
+	case OBJ_INDEX_VDI:
+		add_vdi_state(rec->vs.vid, rec->vs.nr_copies,
+			      rec->vs.snapshot, rec->vs.copy_policy);
+		break;
+	case OBJ_INDEX_CLEAR_VDI:
+		clean_vdi_state();
+		break;
+	default:
+		sd_eprintf("unknown record type %"PRIu32, rec->type);
+		break;
+	}
+}
+
+static void count_oid(uint64_t oid, void *arg)
+{
+	(*(uint64_t *)arg)++;
+}
+
+/*
+ * The subdirectories modified since shortly before the checkpoint, their
+ * objects may be missing in the synced records.  Only used at startup.
+ */
+static DECLARE_BITMAP(changed_dirs, NR_OBJ_DIRS);
+static time_t changed_since;
+
+static void find_changed_dir(const char *path, int i)
+{
+	struct stat st;
+
+	if (stat(path, &st) < 0 || st.st_mtime >= changed_since)
+		set_bit(i, changed_dirs);
+}
+
+static int find_changed_dirs(char *path)
+{
+	char p[PATH_MAX];
+	int i;
+
+	for (i = 0; i < NR_OBJ_DIRS; i++) {
+		snprintf(p, sizeof(p), "%s/%02x", path, i);
+		find_changed_dir(p, i);
+		snprintf(p, sizeof(p), "%s/.stale/%02x", path, i);
+		find_changed_dir(p, i);
+	}
+
+	return SD_RES_SUCCESS;
+}
+
+struct oid_list {
+	uint64_t *oids;
+	uint64_t nr, size;
+};
+
+static void oid_list_add(struct oid_list *l, uint64_t oid)
+{
+	if (l->nr == l->size) {
+		l->size = l->size ? l->size * 2 : 1024;
+		l->oids = xrealloc(l->oids, sizeof(oid) * l->size);
+	}
+	l->oids[l->nr++] = oid;
+}
+
+static void add_changed_oid(uint64_t oid, void *arg)
+{
+	if (test_bit(obj_dir(oid), changed_dirs))
+		oid_list_add(arg, oid);
+}
+
+static void add_vdi_oid(uint64_t oid, void *arg)
+{
+	if (is_vdi_obj(oid))
+		oid_list_add(arg, oid);
+}
+
+/*
+ * Bring the replayed records up to date with the disks.  The objects of the
+ * changed subdirectories are dropped and scanned again, in all the disks and
+ * in both the working and the stale directories.
+ */
+static int rescan_changed_dirs(uint64_t ckpt_time,
+			       int (*scan)(uint64_t oid, char *path,
+					   uint32_t epoch, void *arg))
+{
+	struct oid_list l = {};
+	uint64_t i;
+	int nr, ret;
+
+	memset(changed_dirs, 0, sizeof(changed_dirs));
+	changed_since = ckpt_time - OBJ_INDEX_CKPT_SLACK;
+	for_each_obj_path(find_changed_dirs);
+
+	nr = 0;
+	for (i = 0; i < NR_OBJ_DIRS; i++)
+		nr += !!test_bit(i, changed_dirs);
+	sd_iprintf("scan %d of %d object directories", nr, NR_OBJ_DIRS);
+
+	objlist_cache_for_each(add_changed_oid, &l);
+	for (i = 0; i < l.nr; i++)
+		objlist_cache_remove(l.oids[i]);
+	l.nr = 0;
+
+	ret = for_each_object_parallel(scan, true, changed_dirs, NULL);
+	if (ret != SD_RES_SUCCESS)
+		goto out;
+
+	/* The inodes are updated in place, e.g. when a snapshot is taken */
+	objlist_cache_for_each(add_vdi_oid, &l);
+	for (i = 0; i < l.nr; i++) {
+		ret = scan(l.oids[i], md_get_object_path(l.oids[i]), 0, NULL);
+		if (ret != SD_RES_SUCCESS)
+			goto out;
+	}
+out:
+	free(l.oids);
+	return ret;
+}
+
+/*
+ * Load the object list cache and the vdi states from the index, 'scan' is
+ * called against the objects found in the disks if some of them have to be
+ * scanned again.  Return SD_RES_NO_OBJ if there is no usable index and the
+ * caller has to scan the disks and call obj_index_rebuild().
+ */
+int obj_index_load(int (*scan)(uint64_t oid, char *path, uint32_t epoch,
+				void *arg))
+{
+	struct obj_index_header hdr;
+	struct obj_index_rec *recs;
+	uint64_t i, len, nr_live = 0;
+	int fd, ret;
+
+	fd = open(obj_index_path, O_RDWR);
+	if (fd < 0) {
+		if (errno != ENOENT)
+			sd_eprintf("failed to open %s, %m", obj_index_path);
+		return SD_RES_NO_OBJ;
+	}
+
+	if (xpread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+	    hdr.magic != OBJ_INDEX_MAGIC || hdr.version != OBJ_INDEX_VERSION) {
+		sd_eprintf("invalid object index");
+		goto err;
+	}
+	if (hdr.disks != get_disks_sig()) {
+		sd_iprintf("disks are changed, scan the disks");
+		goto err;
+	}
+
+	len = hdr.nr_recs * sizeof(*recs);
+	recs = xmalloc(len ?: sizeof(*recs));
+	if (xpread(fd, recs, len, OBJ_INDEX_HDR_SIZE) != len ||
+	    fnv_64a_buf(recs, len, FNV1A_64_INIT) != hdr.csum) {
+		sd_eprintf("corrupted object index");
+		free(recs);
+		goto err;
+	}
+
+	/* The index is not in use yet, so nothing is appended to it */
+	for (i = 0; i < hdr.nr_recs; i++)
+		apply_rec(recs + i);
+	free(recs);
+	sd_iprintf("loaded %"PRIu64" records of the object index",
+		   hdr.nr_recs);
+
+	if (!hdr.clean || hdr.dirs != get_dirs_sig()) {
+		sd_iprintf("object index is not sealed or the directories are "
+			   "changed");
+		close(fd);
+		ret = rescan_changed_dirs(hdr.time, scan);
+		if (ret != SD_RES_SUCCESS)
+			return ret;
+		obj_index_rebuild();
+		return SD_RES_SUCCESS;
+	}
+
+	objlist_cache_for_each(count_oid, &nr_live);
+	if (hdr.nr_recs > OBJ_INDEX_COMPACT_MIN &&
+	    hdr.nr_recs > nr_live * 2) {
+		close(fd);
+		obj_index_rebuild();
+		return SD_RES_SUCCESS;
+	}
+
+	pthread_mutex_lock(&idx.lock);
+	idx.fd = fd;
+	idx.nr_recs = hdr.nr_recs;
+	idx.csum = hdr.csum;
+	idx.nr_buf = 0;
+	idx.ckpt_recs = hdr.nr_recs;
+	idx.ckpt_csum = hdr.csum;
+	idx.ckpt_time = hdr.time;
+	idx.clean = false;
+	/* What is loaded is right even if the index can't be kept */
+	if (mark_dirty() < 0)
+		drop_index();
+	pthread_mutex_unlock(&idx.lock);
+	start_checkpoint();
+
+	return SD_RES_SUCCESS;
+err:
+	close(fd);
+	return SD_RES_NO_OBJ;
+}
+
+struct snapshot {
+	struct obj_index_rec *recs;
+	uint64_t nr, size;
+};
+
+static void snapshot_add(struct snapshot *s, const struct obj_index_rec *rec)
+{
+	if (s->nr == s->size) {
+		s->size = s->size ? s->size * 2 : 1024;
+		s->recs = xrealloc(s->recs, sizeof(*rec) * s->size);
+	}
+	s->recs[s->nr++] = *rec;
+}
+
+static void snapshot_add_oid(uint64_t oid, void *arg)
+{
+	struct obj_index_rec rec = { .type = OBJ_INDEX_ADD, .oid = oid };
+
+	snapshot_add(arg, &rec);
+}
+
+/*
+ * Rewrite the index from the object list cache and the vdi states, and start
+ * using it.  Called at startup when nothing else changes them.
+ */
+void obj_index_rebuild(void)
+{
+	struct obj_index_rec rec = { .type = OBJ_INDEX_VDI };
+	struct obj_index_header *hdr;
+	struct snapshot s = {};
+	struct vdi_state *vs;
+	char *buf;
+	size_t len;
+	int i, nr;
+
+	vs = xzalloc(SD_DATA_OBJ_SIZE);
+	nr = fill_vdi_state_list(vs) / sizeof(*vs);
+	for (i = 0; i < nr; i++) {
+		rec.vs = vs[i];
+		snapshot_add(&s, &rec);
+	}
+	free(vs);
+	objlist_cache_for_each(snapshot_add_oid, &s);
+
+	len = OBJ_INDEX_HDR_SIZE + sizeof(*s.recs) * s.nr;
+	buf = xzalloc(len);
+	hdr = (struct obj_index_header *)buf;
+	hdr->magic = OBJ_INDEX_MAGIC;
+	hdr->version = OBJ_INDEX_VERSION;
+	hdr->nr_recs = s.nr;
+	hdr->csum = fnv_64a_buf(s.recs, sizeof(*s.recs) * s.nr, FNV1A_64_INIT);
+	hdr->disks = get_disks_sig();
+	hdr->time = time(NULL);
+	memcpy(buf + OBJ_INDEX_HDR_SIZE, s.recs, sizeof(*s.recs) * s.nr);
+	free(s.recs);
+
+	pthread_mutex_lock(&ckpt_lock);
+	pthread_mutex_lock(&idx.lock);
+	if (idx.fd >= 0)
+		close(idx.fd);
+	idx.fd = -1;
+	idx.nr_buf = 0;
+	idx.clean = false;
+	if (atomic_create_and_write(obj_index_path, buf, len) < 0)
+		goto out;
+
+	idx.fd = open(obj_index_path, O_RDWR);
+	if (idx.fd < 0) {
+		sd_eprintf("failed to open %s, %m", obj_index_path);
+		goto out;
+	}
+	idx.nr_recs = hdr->nr_recs;
+	idx.csum = hdr->csum;
+	idx.ckpt_recs = hdr->nr_recs;
+	idx.ckpt_csum = hdr->csum;
+	idx.ckpt_time = hdr->time;
+	sd_iprintf("object index is rebuilt with %"PRIu64" records", idx.nr_recs);
+out:
+	pthread_mutex_unlock(&idx.lock);
+	pthread_mutex_unlock(&ckpt_lock);
+	free(buf);
+	start_checkpoint();
+}
+
+/* Mark the index consistent with the disks, at shutdown */
+void obj_index_seal(void)
+{
+	uint64_t now = time(NULL);
+
+	pthread_mutex_lock(&ckpt_lock);
+	pthread_mutex_lock(&idx.lock);
+	if (idx.fd < 0 || idx.clean)
+		goto out;
+
+	if (flush_index() < 0 || fdatasync(idx.fd) < 0 ||
+	    write_header(idx.fd, true, idx.nr_recs, idx.csum, now) < 0) {
+		drop_index();
+		goto out;
+	}
+	idx.ckpt_recs = idx.nr_recs;
+	idx.ckpt_csum = idx.csum;
+	idx.ckpt_time = now;
+	idx.clean = true;
+	sd_dprintf("sealed %"PRIu64" records", idx.nr_recs);
+out:
+	pthread_mutex_unlock(&idx.lock);
+	pthread_mutex_unlock(&ckpt_lock);
+}
+
+/* Drop the index of the objects which are about to be removed */
+void obj_index_reset(void)
+{
+	pthread_mutex_lock(&ckpt_lock);
+	pthread_mutex_lock(&idx.lock);
+	if (idx.fd >= 0)
+		drop_index();
+	else
+		unlink(obj_index_path);
+	idx.clean = false;
+	pthread_mutex_unlock(&idx.lock);
+	pthread_mutex_unlock(&ckpt_lock);
+}
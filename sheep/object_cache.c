@@ -452,7 +452,7 @@ static int push_cache_object(uint32_t vid, uint32_t idx, uint64_t bmap,
 	if (is_vdi_obj(oid) && (offset + data_length) > SD_INODE_SIZE)
 		data_length = SD_INODE_SIZE - offset;
 
-	buf = xvalloc(data_length);
+	buf = xbuf_get(data_length);
 	ret = read_cache_object_noupdate(vid, idx, buf, data_length, offset);
 	if (ret != SD_RES_SUCCESS)
 		goto out;
@@ -470,7 +470,7 @@ static int push_cache_object(uint32_t vid, uint32_t idx, uint64_t bmap,
 	if (ret != SD_RES_SUCCESS)
 		sd_eprintf("failed to push object %s", sd_strerror(ret));
 out:
-	free(buf);
+	buf_put(buf, data_length);
 	return ret;
 }
 
@@ -785,7 +785,7 @@ static int object_cache_pull(struct object_cache *oc, uint32_t idx)
 	uint32_t data_length = get_objsize(oid);
 	void *buf;
 
-	buf = xvalloc(data_length);
+	buf = xbuf_get(data_length);
 	sd_init_req(&hdr, SD_OP_READ_OBJ);
 	hdr.data_length = data_length;
 	hdr.obj.oid = oid;
@@ -816,13 +816,14 @@ static int object_cache_pull(struct object_cache *oc, uint32_t idx)
 		break;
 	}
 err:
-	free(buf);
+	buf_put(buf, data_length);
 	return ret;
 }
 
 struct push_work {
 	struct work work;
 	struct object_cache_entry *entry;
+	bool client;	/* a client waits for it, e.g. on a guest FLUSH */
 };
 
 static void do_push_object(struct work *work)
@@ -834,6 +835,9 @@ static void do_push_object(struct work *work)
 
 	sd_dprintf("%"PRIx64, oid);
 
+	/* Only the background pushes are throttled, not the client I/O */
+	if (!pw->client)
+		iosched_acquire(IO_CLASS_PUSH);
 	read_lock_entry(entry);
 	if (push_cache_object(oc->vid, entry_idx(entry), entry->bmap,
 			      !!(entry->idx & CACHE_CREATE_BIT))
@@ -863,8 +867,9 @@ static void push_object_done(struct work *work)
  *    It is okay for allow subsequent RW after FLUSH because we only need to
  *    garantee the dirty objects before FLUSH to be pushed.
  * 2. Use threaded AIO to boost push performance, such as fsync(2) from VM.
+ * 3. The pushes for a client, which waits for them, bypass the I/O scheduler.
  */
-static int object_cache_push(struct object_cache *oc)
+static int object_cache_push(struct object_cache *oc, bool client)
 {
 	struct object_cache_entry *entry, *t;
 	eventfd_t value;
@@ -883,6 +888,7 @@ static int object_cache_push(struct object_cache *oc)
 		pw->work.fn = do_push_object;
 		pw->work.done = push_object_done;
 		pw->entry = entry;
+		pw->client = client;
 		queue_work(sys->oc_push_wqueue, &pw->work);
 		list_del_init(&entry->dirty_list);
 	}
@@ -1145,7 +1151,7 @@ int object_cache_read(uint64_t oid, char *data, unsigned int datalen,
 	return ret;
 }
 
-int object_cache_flush_vdi(uint32_t vid)
+int object_cache_flush_vdi(uint32_t vid, bool client)
 {
 	struct object_cache *cache;
 
@@ -1155,7 +1161,7 @@ int object_cache_flush_vdi(uint32_t vid)
 		return SD_RES_SUCCESS;
 	}
 
-	return object_cache_push(cache);
+	return object_cache_push(cache, client);
 }
 
 int object_cache_flush_and_del(const struct request *req)
@@ -104,6 +104,7 @@ void objlist_cache_remove(uint64_t oid)
 	if (!objlist_cache_rb_remove(&obj_list_cache.root, oid)) {
 		obj_list_cache.cache_size--;
 		obj_list_cache.tree_version++;
+		obj_index_del(oid);
 	}
 	pthread_rwlock_unlock(&obj_list_cache.lock);
 }
@@ -124,6 +125,7 @@ int objlist_cache_insert(uint64_t oid)
 		list_add(&entry->list, &obj_list_cache.entry_list);
 		obj_list_cache.cache_size++;
 		obj_list_cache.tree_version++;
+		obj_index_add(oid);
 	}
 	pthread_rwlock_unlock(&obj_list_cache.lock);
 
@@ -167,6 +169,16 @@ out:
 	return SD_RES_SUCCESS;
 }
 
+void objlist_cache_for_each(void (*fn)(uint64_t oid, void *arg), void *arg)
+{
+	struct objlist_cache_entry *entry;
+
+	pthread_rwlock_rdlock(&obj_list_cache.lock);
+	list_for_each_entry(entry, &obj_list_cache.entry_list, list)
+		fn(entry->oid, arg);
+	pthread_rwlock_unlock(&obj_list_cache.lock);
+}
+
 static void objlist_deletion_work(struct work *work)
 {
 	struct objlist_deletion_work *ow =
@@ -195,6 +207,7 @@ static void objlist_deletion_work(struct work *work)
 		sd_dprintf("delete object entry %" PRIx64, entry->oid);
 		list_del(&entry->list);
 		rb_erase(&entry->node, &obj_list_cache.root);
+		obj_index_del(entry->oid);
 		free(entry);
 	}
 	pthread_rwlock_unlock(&obj_list_cache.lock);
@@ -89,15 +89,28 @@ static int cluster_new_vdi(struct request *req)
 		.base_vid = hdr->vdi.base_vdi_id,
 		.create_snapshot = !!hdr->vdi.snapid,
 		.nr_copies = hdr->vdi.copies ? hdr->vdi.copies : sys->nr_copies,
+		.copy_policy = hdr->vdi.copy_policy,
 	};
 
 	if (hdr->data_length != SD_MAX_VDI_LEN)
 		return SD_RES_INVALID_PARMS;
 
+	if (iocb.copy_policy) {
+		int d = ec_policy_data(iocb.copy_policy);
+		int p = ec_policy_parity(iocb.copy_policy);
+
+		if (!ec_policy_is_valid(d, p))
+			return SD_RES_INVALID_PARMS;
+		/* The inode survives as many failures as the data */
+		if (!hdr->vdi.copies)
+			iocb.nr_copies = p + 1;
+	}
+
 	ret = vdi_create(&iocb, &vid);
 
 	rsp->vdi.vdi_id = vid;
 	rsp->vdi.copies = iocb.nr_copies;
+	rsp->vdi.copy_policy = iocb.copy_policy;
 
 	return ret;
 }
@@ -214,6 +227,7 @@ static int cluster_get_vdi_info(struct request *req)
 
 	rsp->vdi.vdi_id = info.vid;
 	rsp->vdi.copies = get_vdi_copy_number(info.vid);
+	rsp->vdi.copy_policy = get_vdi_copy_policy(info.vid);
 
 	return ret;
 }
@@ -243,6 +257,9 @@ static int cluster_make_fs(const struct sd_req *req, struct sd_rsp *rsp,
 	struct store_driver *driver;
 	char *store_name = data;
 
+	if (!get_placement_driver(cluster_placement_id(req->flags)))
+		return SD_RES_INVALID_PARMS;
+
 	driver = find_store_driver(data);
 	if (!driver)
 		return SD_RES_NO_STORE;
@@ -269,6 +286,7 @@ static int cluster_make_fs(const struct sd_req *req, struct sd_rsp *rsp,
 	set_cluster_ctime(created_time);
 	set_cluster_copies(sys->nr_copies);
 	set_cluster_flags(sys->flags);
+	refresh_vnode_info();
 
 	for (i = 1; i <= latest_epoch; i++)
 		remove_epoch(i);
@@ -348,6 +366,56 @@ static int cluster_get_vdi_attr(struct request *req)
 	return ret;
 }
 
+static int cluster_set_vdi_qos(struct request *req)
+{
+	const struct sd_req *hdr = &req->rq;
+	struct sd_rsp *rsp = &req->rp;
+	const char *name = req->data;
+	struct sd_vdi_qos *qos = (struct sd_vdi_qos *)(name + SD_MAX_VDI_LEN);
+	struct sheepdog_vdi_attr *vattr;
+	struct vdi_iocb iocb = {};
+	struct vdi_info info = {};
+	uint32_t vid, attrid = 0;
+	int ret;
+
+	if (hdr->data_length != SD_MAX_VDI_LEN + sizeof(*qos) ||
+	    strnlen(name, SD_MAX_VDI_LEN) == SD_MAX_VDI_LEN)
+		return SD_RES_INVALID_PARMS;
+
+	iocb.name = name;
+	iocb.tag = "";
+	ret = vdi_lookup(&iocb, &info);
+	if (ret != SD_RES_SUCCESS)
+		return ret;
+
+	/* Stored like the other attributes, see cluster_get_vdi_attr() */
+	vattr = xzalloc(sizeof(*vattr));
+	pstrcpy(vattr->name, sizeof(vattr->name), name);
+	pstrcpy(vattr->key, sizeof(vattr->key), SD_VDI_QOS_KEY);
+	vattr->value_len = sizeof(*qos);
+	memcpy(vattr->value, qos, sizeof(*qos));
+
+	vid = fnv_64a_buf(vattr->name, strlen(vattr->name), FNV1A_64_INIT);
+	vid &= SD_NR_VDIS - 1;
+	ret = get_vdi_attr(vattr, SD_ATTR_OBJ_SIZE, vid, &attrid,
+			   info.create_time, true, false, false);
+	free(vattr);
+
+	/* Every node applies the limits to the working VDI */
+	rsp->vdi.vdi_id = info.vid;
+
+	return ret;
+}
+
+static int post_cluster_set_vdi_qos(const struct sd_req *req,
+				    struct sd_rsp *rsp, void *data)
+{
+	qos_set_vdi(rsp->vdi.vdi_id,
+		    (struct sd_vdi_qos *)((char *)data + SD_MAX_VDI_LEN));
+
+	return SD_RES_SUCCESS;
+}
+
 static int local_release_vdi(struct request *req)
 {
 	uint32_t vid = req->rq.vdi.base_vdi_id;
@@ -358,7 +426,8 @@ static int local_release_vdi(struct request *req)
 		return SD_RES_SUCCESS;
 	}
 
-	object_cache_flush_vdi(vid);
+	/* Nobody uses the VDI any more, so push it in the background */
+	object_cache_flush_vdi(vid, false);
 	object_cache_delete(vid);
 
 	return SD_RES_SUCCESS;
@@ -610,12 +679,13 @@ static int cluster_notify_vdi_add(const struct sd_req *req, struct sd_rsp *rsp,
 		/* make the previous working vdi a snapshot */
 		add_vdi_state(req->vdi_state.old_vid,
 			      get_vdi_copy_number(req->vdi_state.old_vid),
-			      true);
+			      true, get_vdi_copy_policy(req->vdi_state.old_vid));
 
 	if (req->vdi_state.set_bitmap)
 		set_bit(req->vdi_state.new_vid, sys->vdi_inuse);
 
-	add_vdi_state(req->vdi_state.new_vid, req->vdi_state.copies, false);
+	add_vdi_state(req->vdi_state.new_vid, req->vdi_state.copies, false,
+		      req->vdi_state.copy_policy);
 
 	return SD_RES_SUCCESS;
 }
@@ -625,6 +695,8 @@ static int cluster_notify_vdi_del(const struct sd_req *req, struct sd_rsp *rsp,
 {
 	uint32_t vid = *(uint32_t *)data;
 
+	qos_del_vdi(vid);
+
 	return objlist_cache_cleanup(vid);
 }
 
@@ -779,6 +851,31 @@ static int local_md_info(struct request *request)
 	return rsp->data_length ? SD_RES_SUCCESS : SD_RES_UNKNOWN;
 }
 
+static int local_stat_buffer(const struct sd_req *req, struct sd_rsp *rsp,
+			     void *data)
+{
+	size_t len = sizeof(struct buf_class_stat) * BUF_NR_CLASSES;
+
+	if (req->data_length < len)
+		return SD_RES_INVALID_PARMS;
+
+	buf_pool_stat(data);
+	rsp->data_length = len;
+
+	return SD_RES_SUCCESS;
+}
+
+static int local_stat_latency(const struct sd_req *req, struct sd_rsp *rsp,
+			      void *data)
+{
+	int nr = req->data_length / sizeof(struct sd_latency_stat);
+
+	nr = get_latency_stat(data, nr);
+	rsp->data_length = nr * sizeof(struct sd_latency_stat);
+
+	return SD_RES_SUCCESS;
+}
+
 static int local_md_plug(const struct sd_req *req, struct sd_rsp *rsp,
 			 void *data)
 {
@@ -814,7 +911,7 @@ static int local_flush_vdi(struct request *req)
 
 	if (sys->enable_object_cache) {
 		uint32_t vid = oid_to_vid(req->rq.obj.oid);
-		ret = object_cache_flush_vdi(vid);
+		ret = object_cache_flush_vdi(vid, true);
 		if (ret != SD_RES_SUCCESS)
 			return ret;
 	}
@@ -905,7 +1002,7 @@ static int read_copy_from_replica(struct request *req, uint32_t epoch,
 	read_req.op = get_sd_op(hdr->opcode);
 	read_req.vinfo = req->vinfo;
 
-	ret = gateway_read_obj(&read_req);
+	ret = gateway_read_obj_sync(&read_req);
 
 	if (ret == SD_RES_SUCCESS)
 		untrim_zero_sectors(buf, rsp->obj.offset, rsp->data_length,
@@ -917,16 +1014,71 @@ static int read_copy_from_replica(struct request *req, uint32_t epoch,
 int peer_remove_obj(struct request *req)
 {
 	uint64_t oid = req->rq.obj.oid;
+	int ret;
 
+	/* The object index must not lose an object which is still there */
+	ret = sd_store->remove_object(oid);
 	objlist_cache_remove(oid);
 
-	return sd_store->remove_object(oid);
+	return ret;
 }
 
-int peer_read_obj(struct request *req)
+/* Fill in the response of a read which has succeeded */
+static void peer_read_end(struct request *req)
 {
 	struct sd_req *hdr = &req->rq;
 	struct sd_rsp *rsp = &req->rp;
+
+	rsp->data_length = hdr->data_length;
+	rsp->obj.offset = 0;
+	trim_zero_sectors(req->data, &rsp->obj.offset, &rsp->data_length);
+
+	if (hdr->obj.copies)
+		rsp->obj.copies = hdr->obj.copies;
+	else
+		rsp->obj.copies = get_obj_copy_number(hdr->obj.oid,
+						      req->vinfo->nr_zones);
+}
+
+static void peer_read_done(void *data, int result)
+{
+	struct request *req = data;
+
+	if (result == SD_RES_SUCCESS)
+		peer_read_end(req);
+	store_io_done(req, result);
+}
+
+static void peer_write_done(void *data, int result)
+{
+	store_io_done(data, result);
+}
+
+/*
+ * Let the store finish the I/O of a request from another node, the worker
+ * goes on with the next request instead of waiting for the disk.  False if
+ * the caller has to do the I/O itself.
+ */
+static bool peer_submit_obj(struct request *req, const struct siocb *iocb,
+			    bool write)
+{
+	void (*done)(void *, int) = write ? peer_write_done : peer_read_done;
+
+	if (req->local)
+		return false;
+
+	req->nr_async_ends = 2;
+	if (cow_submit_obj(req->rq.obj.oid, iocb, write, done, req)
+	    == SD_RES_SUCCESS)
+		return true;
+
+	req->nr_async_ends = 0;
+	return false;
+}
+
+int peer_read_obj(struct request *req)
+{
+	struct sd_req *hdr = &req->rq;
 	int ret;
 	uint32_t epoch = hdr->epoch;
 	struct siocb iocb;
@@ -939,19 +1091,16 @@ int peer_read_obj(struct request *req)
 	iocb.buf = req->data;
 	iocb.length = hdr->data_length;
 	iocb.offset = hdr->obj.offset;
-	ret = sd_store->read(hdr->obj.oid, &iocb);
+
+	if (hdr->opcode == SD_OP_READ_PEER &&
+	    peer_submit_obj(req, &iocb, false))
+		return SD_RES_SUCCESS;
+
+	ret = cow_read_obj(hdr->obj.oid, &iocb, req->vinfo);
 	if (ret != SD_RES_SUCCESS)
 		goto out;
 
-	rsp->data_length = hdr->data_length;
-	rsp->obj.offset = 0;
-	trim_zero_sectors(req->data, &rsp->obj.offset, &rsp->data_length);
-
-	if (hdr->obj.copies)
-		rsp->obj.copies = hdr->obj.copies;
-	else
-		rsp->obj.copies = get_obj_copy_number(hdr->obj.oid,
-						      req->vinfo->nr_zones);
+	peer_read_end(req);
 out:
 	return ret;
 }
@@ -977,7 +1126,11 @@ int peer_write_obj(struct request *req)
 	iocb.length = hdr->data_length;
 	iocb.offset = hdr->obj.offset;
 
-	return sd_store->write(oid, &iocb);
+	if (hdr->opcode == SD_OP_WRITE_PEER &&
+	    peer_submit_obj(req, &iocb, true))
+		return SD_RES_SUCCESS;
+
+	return cow_write_obj(oid, &iocb, req->vinfo);
 }
 
 int peer_create_and_write_obj(struct request *req)
@@ -996,7 +1149,16 @@ int peer_create_and_write_obj(struct request *req)
 	if (hdr->flags & SD_FLAG_CMD_COW) {
 		sd_dprintf("%" PRIx64 ", %" PRIx64, oid, hdr->obj.cow_oid);
 
-		buf = xvalloc(SD_DATA_OBJ_SIZE);
+		iocb.buf = req->data;
+		iocb.length = hdr->data_length;
+		iocb.offset = hdr->obj.offset;
+		ret = cow_create_and_write_obj(oid, hdr->obj.cow_oid, &iocb,
+					       req->vinfo);
+		if (ret != SD_RES_NO_SUPPORT)
+			goto done;
+
+		/* Fall back to copy the whole base object */
+		buf = xbuf_get(SD_DATA_OBJ_SIZE);
 		if (hdr->data_length != SD_DATA_OBJ_SIZE) {
 			ret = read_copy_from_replica(req, hdr->epoch,
 						     hdr->obj.cow_oid, buf);
@@ -1016,15 +1178,94 @@ int peer_create_and_write_obj(struct request *req)
 		ret = do_create_and_write_obj(&iocb, &cow_hdr, epoch, buf);
 	} else
 		ret = do_create_and_write_obj(&iocb, hdr, epoch, req->data);
-
+done:
 	if (SD_RES_SUCCESS == ret)
 		objlist_cache_insert(oid);
 out:
-	if (buf)
-		free(buf);
+	buf_put(buf, SD_DATA_OBJ_SIZE);
 	return ret;
 }
 
+uint64_t objs_data_length(const struct sd_obj_seg *segs, int nr_segs)
+{
+	uint64_t len = 0;
+	int i;
+
+	for (i = 0; i < nr_segs; i++)
+		len += segs[i].length;
+
+	return len;
+}
+
+/*
+ * Read or write the segments from or to the local store.  'buf' holds the data
+ * of the segments in order.
+ */
+int store_rw_segs(const struct sd_obj_seg *segs, int nr_segs, char *buf,
+		  uint32_t epoch, bool write, struct vnode_info *vinfo)
+{
+	int i, ret;
+
+	for (i = 0; i < nr_segs; i++) {
+		struct siocb iocb = { };
+
+		iocb.epoch = epoch;
+		iocb.buf = buf;
+		iocb.length = segs[i].length;
+		iocb.offset = segs[i].offset;
+		if (write)
+			ret = cow_write_obj(segs[i].oid, &iocb, vinfo);
+		else
+			ret = cow_read_obj(segs[i].oid, &iocb, vinfo);
+		if (ret != SD_RES_SUCCESS) {
+			sd_eprintf("failed to %s %"PRIx64", %s",
+				   write ? "write" : "read", segs[i].oid,
+				   sd_strerror(ret));
+			return ret;
+		}
+		buf += segs[i].length;
+	}
+
+	return SD_RES_SUCCESS;
+}
+
+int peer_read_objs(struct request *req)
+{
+	struct sd_req *hdr = &req->rq;
+	uint64_t len = objs_data_length(req->data, hdr->objs.nr_segs);
+	char *buf;
+	int ret;
+
+	if (sys->gateway_only)
+		return SD_RES_NO_OBJ;
+
+	buf = xbuf_get(len);
+	ret = store_rw_segs(req->data, hdr->objs.nr_segs, buf, hdr->epoch,
+			    false, req->vinfo);
+	if (ret != SD_RES_SUCCESS) {
+		buf_put(buf, len);
+		return ret;
+	}
+
+	/* The segment list is replaced with the data we read */
+	buf_put(req->data, req->data_length);
+	req->data = buf;
+	req->data_length = len;
+	req->rp.data_length = len;
+
+	return SD_RES_SUCCESS;
+}
+
+int peer_write_objs(struct request *req)
+{
+	struct sd_req *hdr = &req->rq;
+	struct sd_obj_seg *segs = req->data;
+
+	return store_rw_segs(segs, hdr->objs.nr_segs,
+			     (char *)(segs + hdr->objs.nr_segs), hdr->epoch,
+			     true, req->vinfo);
+}
+
 static struct sd_op_template sd_ops[] = {
 
 	/* cluster operations */
@@ -1062,6 +1303,13 @@ static struct sd_op_template sd_ops[] = {
 		.process_work = cluster_get_vdi_attr,
 	},
 
+	[SD_OP_SET_VDI_QOS] = {
+		.name = "SET_VDI_QOS",
+		.type = SD_OP_TYPE_CLUSTER,
+		.process_work = cluster_set_vdi_qos,
+		.process_main = post_cluster_set_vdi_qos,
+	},
+
 	[SD_OP_FORCE_RECOVER] = {
 		.name = "FORCE_RECOVER",
 		.type = SD_OP_TYPE_CLUSTER,
@@ -1263,6 +1511,18 @@ static struct sd_op_template sd_ops[] = {
 		.process_main = local_md_unplug,
 	},
 
+	[SD_OP_STAT_BUFFER] = {
+		.name = "STAT_BUFFER",
+		.type = SD_OP_TYPE_LOCAL,
+		.process_main = local_stat_buffer,
+	},
+
+	[SD_OP_STAT_LATENCY] = {
+		.name = "STAT_LATENCY",
+		.type = SD_OP_TYPE_LOCAL,
+		.process_main = local_stat_latency,
+	},
+
 	[SD_OP_GET_HASH] = {
 		.name = "GET_HASH",
 		.type = SD_OP_TYPE_LOCAL,
@@ -1294,6 +1554,18 @@ static struct sd_op_template sd_ops[] = {
 		.process_work = gateway_remove_obj,
 	},
 
+	[SD_OP_READ_OBJS] = {
+		.name = "READ_OBJS",
+		.type = SD_OP_TYPE_GATEWAY,
+		.process_work = gateway_read_objs,
+	},
+
+	[SD_OP_WRITE_OBJS] = {
+		.name = "WRITE_OBJS",
+		.type = SD_OP_TYPE_GATEWAY,
+		.process_work = gateway_write_objs,
+	},
+
 	/* peer I/O operations */
 	[SD_OP_CREATE_AND_WRITE_PEER] = {
 		.name = "CREATE_AND_WRITE_PEER",
@@ -1318,6 +1590,30 @@ static struct sd_op_template sd_ops[] = {
 		.type = SD_OP_TYPE_PEER,
 		.process_work = peer_remove_obj,
 	},
+
+	[SD_OP_CHAIN_WRITE_PEER] = {
+		.name = "CHAIN_WRITE_PEER",
+		.type = SD_OP_TYPE_PEER,
+		.process_work = peer_chain_write_obj,
+	},
+
+	[SD_OP_READ_OBJS_PEER] = {
+		.name = "READ_OBJS_PEER",
+		.type = SD_OP_TYPE_PEER,
+		.process_work = peer_read_objs,
+	},
+
+	[SD_OP_WRITE_OBJS_PEER] = {
+		.name = "WRITE_OBJS_PEER",
+		.type = SD_OP_TYPE_PEER,
+		.process_work = peer_write_objs,
+	},
+
+	[SD_OP_EC_WRITE_PEER] = {
+		.name = "EC_WRITE_PEER",
+		.type = SD_OP_TYPE_PEER,
+		.process_work = peer_ec_write_obj,
+	},
 };
 
 const struct sd_op_template *get_sd_op(uint8_t opcode)
@@ -1373,6 +1669,7 @@ void do_process_work(struct work *work)
 	struct request *req = container_of(work, struct request, work);
 	int ret = SD_RES_SUCCESS;
 
+	req_stamp(req, REQ_STAMP_WORK);
 	sd_dprintf("%x, %" PRIx64", %"PRIu32, req->rq.opcode, req->rq.obj.oid,
 		   req->rq.epoch);
 
@@ -1404,6 +1701,8 @@ static int map_table[] = {
 	[SD_OP_READ_OBJ] = SD_OP_READ_PEER,
 	[SD_OP_WRITE_OBJ] = SD_OP_WRITE_PEER,
 	[SD_OP_REMOVE_OBJ] = SD_OP_REMOVE_PEER,
+	[SD_OP_READ_OBJS] = SD_OP_READ_OBJS_PEER,
+	[SD_OP_WRITE_OBJS] = SD_OP_WRITE_OBJS_PEER,
 };
 
 int gateway_to_peer_opcode(int opcode)
@@ -20,6 +20,8 @@
 #include "config.h"
 #include "sha1.h"
 
+#define COWNAME "user.obj.cow"
+
 #define sector_algined(x) ({ ((x) & (SECTOR_SIZE - 1)) == 0; })
 
 static inline bool iocb_is_aligned(const struct siocb *iocb)
@@ -47,14 +49,23 @@ static int prepare_iocb(uint64_t oid, const struct siocb *iocb, bool create)
 
 static int get_obj_path(uint64_t oid, char *path)
 {
-	return snprintf(path, PATH_MAX, "%s/%016" PRIx64,
-			md_get_object_path(oid), oid);
+	return snprintf(path, PATH_MAX, "%s/%02x/%016" PRIx64,
+			md_get_object_path(oid), obj_dir(oid), oid);
 }
 
 static int get_tmp_obj_path(uint64_t oid, char *path)
 {
-	return snprintf(path, PATH_MAX, "%s/%016"PRIx64".tmp",
-			md_get_object_path(oid), oid);
+	return snprintf(path, PATH_MAX, "%s/%02x/%016"PRIx64".tmp",
+			md_get_object_path(oid), obj_dir(oid), oid);
+}
+
+/* Open the file of 'oid' in the working directory for fd_cache_get() */
+int default_open_obj(uint64_t oid, int flags)
+{
+	char path[PATH_MAX];
+
+	get_obj_path(oid, path);
+	return open(path, flags, sd_def_fmode);
 }
 
 static int get_stale_obj_path(uint64_t oid, uint32_t epoch, char *path)
@@ -67,6 +78,15 @@ bool default_exist(uint64_t oid)
 	return md_exist(oid);
 }
 
+/* 'dir' is a subdirectory of the disk, see obj_dir() */
+static int obj_dir_eio(const char *dir)
+{
+	char disk[PATH_MAX];
+
+	pstrcpy(disk, sizeof(disk), dir);
+	return md_handle_eio(dirname(disk));
+}
+
 static int err_to_sderr(char *path, uint64_t oid, int err)
 {
 	struct stat s;
@@ -77,7 +97,7 @@ static int err_to_sderr(char *path, uint64_t oid, int err)
 	case ENOENT:
 		if (stat(dir, &s) < 0) {
 			sd_eprintf("%s corrupted", dir);
-			return md_handle_eio(dir);
+			return obj_dir_eio(dir);
 		}
 		sd_dprintf("object %016" PRIx64 " not found locally", oid);
 		return SD_RES_NO_OBJ;
@@ -94,15 +114,24 @@ static int err_to_sderr(char *path, uint64_t oid, int err)
 		return SD_RES_NETWORK_ERROR;
 	default:
 		sd_eprintf("oid=%"PRIx64", %m", oid);
-		return md_handle_eio(dir);
+		return obj_dir_eio(dir);
 	}
 }
 
+/* Map 'err' of an I/O to the object in the working directory */
+int default_obj_err(uint64_t oid, int err)
+{
+	char path[PATH_MAX];
+
+	get_obj_path(oid, path);
+	return err_to_sderr(path, oid, err);
+}
+
 int default_write(uint64_t oid, const struct siocb *iocb)
 {
-	int flags = prepare_iocb(oid, iocb, false), fd,
-	    ret = SD_RES_SUCCESS;
+	int flags = prepare_iocb(oid, iocb, false), ret = SD_RES_SUCCESS;
 	char path[PATH_MAX];
+	struct fd_cache_entry *e;
 	ssize_t size;
 
 	if (iocb->epoch < sys_epoch()) {
@@ -120,34 +149,31 @@ int default_write(uint64_t oid, const struct siocb *iocb)
 		sync();
 	}
 
-	get_obj_path(oid, path);
-
-	fd = open(path, flags, sd_def_fmode);
-	if (fd < 0)
+	e = fd_cache_get(oid, flags, default_open_obj);
+	if (!e) {
+		get_obj_path(oid, path);
 		return err_to_sderr(path, oid, errno);
+	}
 
-	size = xpwrite(fd, iocb->buf, iocb->length, iocb->offset);
+	size = xpwrite(fd_cache_fd(e), iocb->buf, iocb->length, iocb->offset);
 	if (size != iocb->length) {
+		get_obj_path(oid, path);
 		sd_eprintf("failed to write object %"PRIx64", path=%s, offset=%"
 			   PRId64", size=%"PRId32", result=%zd, %m", oid, path,
 			   iocb->offset, iocb->length, size);
 		ret = err_to_sderr(path, oid, errno);
-		goto out;
+		fd_cache_invalidate(oid);
 	}
-out:
-	close(fd);
+
+	fd_cache_put(e);
 	return ret;
 }
 
-static int make_stale_dir(char *path)
+static int make_obj_dirs(char *path)
 {
-	char p[PATH_MAX];
-
-	snprintf(p, PATH_MAX, "%s/.stale", path);
-	if (xmkdir(p, sd_def_dmode) < 0) {
-		sd_eprintf("%s failed, %m", p);
+	if (md_make_obj_dirs(path) < 0)
 		return SD_RES_EIO;
-	}
+
 	return SD_RES_SUCCESS;
 }
 
@@ -164,7 +190,10 @@ static int purge_stale_dir(char *path)
 	char p[PATH_MAX];
 
 	snprintf(p, PATH_MAX, "%s/.stale", path);
-	return purge_dir(p);
+	if (purge_dir(p) != SD_RES_SUCCESS)
+		return SD_RES_EIO;
+
+	return make_obj_dirs(path);
 }
 
 int default_cleanup(void)
@@ -196,7 +225,7 @@ static int init_vdi_state(uint64_t oid, char *wd, uint32_t epoch)
 	}
 
 	add_vdi_state(oid_to_vid(oid), inode->nr_copies,
-		      vdi_is_snapshot(inode));
+		      vdi_is_snapshot(inode), inode->copy_policy);
 
 	ret = SD_RES_SUCCESS;
 out:
@@ -204,15 +233,19 @@ out:
 	return SD_RES_SUCCESS;
 }
 
+/* The disks are scanned in parallel */
 static int init_objlist_and_vdi_bitmap(uint64_t oid, char *wd, uint32_t epoch,
 				       void *arg)
 {
+	static pthread_mutex_t bitmap_lock = PTHREAD_MUTEX_INITIALIZER;
 	int ret;
 	objlist_cache_insert(oid);
 
 	if (is_vdi_obj(oid)) {
 		sd_dprintf("found the VDI object %" PRIx64, oid);
+		pthread_mutex_lock(&bitmap_lock);
 		set_bit(oid_to_vid(oid), sys->vdi_inuse);
+		pthread_mutex_unlock(&bitmap_lock);
 		ret = init_vdi_state(oid, wd, epoch);
 		if (ret != SD_RES_SUCCESS)
 			return ret;
@@ -225,45 +258,86 @@ int default_init(void)
 	int ret;
 
 	sd_dprintf("use plain store driver");
-	ret = for_each_obj_path(make_stale_dir);
+	ret = for_each_obj_path(make_obj_dirs);
 	if (ret != SD_RES_SUCCESS)
 		return ret;
 
-	for_each_object_in_stale(init_objlist_and_vdi_bitmap, NULL);
+	ret = obj_index_load(init_objlist_and_vdi_bitmap);
+	if (ret != SD_RES_NO_OBJ)
+		return ret;
+
+	ret = for_each_object_parallel(init_objlist_and_vdi_bitmap, true, NULL,
+				       NULL);
+	if (ret != SD_RES_SUCCESS)
+		return ret;
 
-	return for_each_object_in_wd(init_objlist_and_vdi_bitmap, true, NULL);
+	obj_index_rebuild();
+	return SD_RES_SUCCESS;
 }
 
-static int default_read_from_path(uint64_t oid, char *path,
-				  const struct siocb *iocb)
+/* 'path' is NULL for the object in the working directory */
+static int read_from_fd(uint64_t oid, int fd, char *path,
+			const struct siocb *iocb)
 {
-	int flags = prepare_iocb(oid, iocb, false), fd,
-	    ret = SD_RES_SUCCESS;
+	char wd_path[PATH_MAX];
 	ssize_t size;
 
-	fd = open(path, flags);
-
-	if (fd < 0)
-		return err_to_sderr(path, oid, errno);
-
 	size = xpread(fd, iocb->buf, iocb->length, iocb->offset);
 	if (size != iocb->length) {
+		if (!path) {
+			get_obj_path(oid, wd_path);
+			path = wd_path;
+		}
 		sd_eprintf("failed to read object %"PRIx64", path=%s, offset=%"
 			   PRId64", size=%"PRId32", result=%zd, %m", oid, path,
 			   iocb->offset, iocb->length, size);
-		ret = err_to_sderr(path, oid, errno);
+		return err_to_sderr(path, oid, errno);
 	}
+
+	return SD_RES_SUCCESS;
+}
+
+static int default_read_from_path(uint64_t oid, char *path,
+				  const struct siocb *iocb)
+{
+	int flags = prepare_iocb(oid, iocb, false), fd, ret;
+
+	fd = open(path, flags);
+
+	if (fd < 0)
+		return err_to_sderr(path, oid, errno);
+
+	ret = read_from_fd(oid, fd, path, iocb);
 	close(fd);
 	return ret;
 }
 
+/* Read the object in the working directory through the fd cache */
+static int default_read_from_wd(uint64_t oid, const struct siocb *iocb)
+{
+	int flags = prepare_iocb(oid, iocb, false), ret;
+	char path[PATH_MAX];
+	struct fd_cache_entry *e;
+
+	e = fd_cache_get(oid, flags, default_open_obj);
+	if (!e) {
+		get_obj_path(oid, path);
+		return err_to_sderr(path, oid, errno);
+	}
+
+	ret = read_from_fd(oid, fd_cache_fd(e), NULL, iocb);
+	if (ret != SD_RES_SUCCESS)
+		fd_cache_invalidate(oid);
+	fd_cache_put(e);
+	return ret;
+}
+
 int default_read(uint64_t oid, const struct siocb *iocb)
 {
 	int ret;
 	char path[PATH_MAX];
 
-	get_obj_path(oid, path);
-	ret = default_read_from_path(oid, path, iocb);
+	ret = default_read_from_wd(oid, iocb);
 
 	/*
 	 * If the request is againt the older epoch, try to read from
@@ -347,12 +421,22 @@ int default_create_and_write(uint64_t oid, const struct siocb *iocb)
 		goto out;
 	}
 
+	/* The map is set before rename to create the object atomically */
+	if (iocb->cow &&
+	    fsetxattr(fd, COWNAME, iocb->cow, sizeof(*iocb->cow), 0) < 0) {
+		sd_eprintf("failed to set cow map of %s: %m", tmp_path);
+		ret = errno == ENOTSUP ? SD_RES_NO_SUPPORT :
+			err_to_sderr(path, oid, errno);
+		goto out;
+	}
+
 	ret = rename(tmp_path, path);
 	if (ret < 0) {
 		sd_eprintf("failed to rename %s to %s: %m", tmp_path, path);
 		ret = err_to_sderr(path, oid, errno);
 		goto out;
 	}
+	fd_cache_invalidate(oid);
 	sd_dprintf("%"PRIx64, oid);
 	ret = SD_RES_SUCCESS;
 out:
@@ -377,17 +461,18 @@ int default_link(uint64_t oid, uint32_t tgt_epoch)
 			   path);
 		return err_to_sderr(path, oid, errno);
 	}
+	fd_cache_invalidate(oid);
 
 	return SD_RES_SUCCESS;
 }
 
-static bool oid_stale(uint64_t oid)
+/* Return true if this node holds no copy of 'oid' any more */
+bool default_oid_stale(uint64_t oid)
 {
 	int i, nr_copies;
 	struct vnode_info *vinfo;
-	const struct sd_vnode *v;
 	bool ret = true;
-	const struct sd_vnode *obj_vnodes[SD_MAX_COPIES];
+	const struct sd_node *obj_nodes[SD_MAX_COPIES];
 
 	vinfo = get_vnode_info();
 	nr_copies = get_obj_copy_number(oid, vinfo->nr_zones);
@@ -396,11 +481,9 @@ static bool oid_stale(uint64_t oid)
 		goto out;
 	}
 
-	oid_to_vnodes(vinfo->vnodes, vinfo->nr_vnodes, oid,
-		      nr_copies, obj_vnodes);
+	vinfo_oid_to_nodes(vinfo, oid, nr_copies, obj_nodes);
 	for (i = 0; i < nr_copies; i++) {
-		v = obj_vnodes[i];
-		if (vnode_is_local(v)) {
+		if (node_is_local(obj_nodes[i])) {
 			ret = false;
 			break;
 		}
@@ -416,15 +499,16 @@ static int move_object_to_stale_dir(uint64_t oid, char *wd, uint32_t epoch,
 	char path[PATH_MAX], stale_path[PATH_MAX];
 	uint32_t tgt_epoch = *(int *)arg;
 
-	snprintf(path, PATH_MAX, "%s/%016" PRIx64, wd, oid);
-	snprintf(stale_path, PATH_MAX, "%s/.stale/%016"PRIx64".%"PRIu32, wd,
-		 oid, tgt_epoch);
+	snprintf(path, PATH_MAX, "%s/%02x/%016" PRIx64, wd, obj_dir(oid), oid);
+	snprintf(stale_path, PATH_MAX, "%s/.stale/%02x/%016"PRIx64".%"PRIu32,
+		 wd, obj_dir(oid), oid, tgt_epoch);
 
 	if (rename(path, stale_path) < 0) {
 		sd_eprintf("failed to move stale object %"PRIX64" to %s, %m",
 			   oid, path);
 		return SD_RES_EIO;
 	}
+	fd_cache_invalidate(oid);
 
 	sd_dprintf("moved object %"PRIx64, oid);
 	return SD_RES_SUCCESS;
@@ -433,7 +517,7 @@ static int move_object_to_stale_dir(uint64_t oid, char *wd, uint32_t epoch,
 static int check_stale_objects(uint64_t oid, char *wd, uint32_t epoch,
 			       void *arg)
 {
-	if (oid_stale(oid))
+	if (default_oid_stale(oid))
 		return move_object_to_stale_dir(oid, wd, 0, arg);
 
 	return SD_RES_SUCCESS;
@@ -450,7 +534,9 @@ int default_format(void)
 	unsigned ret;
 
 	sd_dprintf("try get a clean store");
+	obj_index_reset();
 	ret = for_each_obj_path(purge_dir);
+	fd_cache_purge();
 	if (ret != SD_RES_SUCCESS)
 		return ret;
 
@@ -476,6 +562,7 @@ int default_remove_object(uint64_t oid)
 		sd_eprintf("failed to remove object %"PRIx64", %m", oid);
 		return SD_RES_EIO;
 	}
+	fd_cache_invalidate(oid);
 
 	return SD_RES_SUCCESS;
 }
@@ -545,7 +632,7 @@ int default_get_hash(uint64_t oid, uint32_t epoch, uint8_t *sha1)
 	}
 
 	length = get_objsize(oid);
-	buf = valloc(length);
+	buf = buf_get(length);
 	if (buf == NULL)
 		return SD_RES_NO_MEM;
 
@@ -555,7 +642,7 @@ int default_get_hash(uint64_t oid, uint32_t epoch, uint8_t *sha1)
 
 	ret = default_read_from_path(oid, path, &iocb);
 	if (ret != SD_RES_SUCCESS) {
-		free(buf);
+		buf_put(buf, iocb.length);
 		return ret;
 	}
 
@@ -566,7 +653,7 @@ int default_get_hash(uint64_t oid, uint32_t epoch, uint8_t *sha1)
 	sha1_update(&c, (uint8_t *)&length, sizeof(length));
 	sha1_update(&c, buf, length);
 	sha1_final(&c, sha1);
-	free(buf);
+	buf_put(buf, iocb.length);
 
 	sd_dprintf("the message digest of %"PRIx64" at epoch %d is %s", oid,
 		   epoch, sha1_to_hex(sha1));
@@ -577,6 +664,55 @@ int default_get_hash(uint64_t oid, uint32_t epoch, uint8_t *sha1)
 	return ret;
 }
 
+int default_get_cow_map(uint64_t oid, uint32_t epoch, struct cow_map *map)
+{
+	char path[PATH_MAX];
+	ssize_t size;
+
+	get_obj_path(oid, path);
+	size = getxattr(path, COWNAME, map, sizeof(*map));
+	if (size < 0 && errno == ENOENT && epoch > 0 && epoch < sys_epoch()) {
+		get_stale_obj_path(oid, epoch, path);
+		size = getxattr(path, COWNAME, map, sizeof(*map));
+	}
+
+	if (size < 0) {
+		if (errno == ENODATA || errno == ENOTSUP) {
+			map->cow_oid = 0;
+			return SD_RES_SUCCESS;
+		}
+		return err_to_sderr(path, oid, errno);
+	}
+	if (size != sizeof(*map)) {
+		sd_eprintf("corrupted cow map of %s", path);
+		return SD_RES_EIO;
+	}
+
+	return SD_RES_SUCCESS;
+}
+
+/* A map with zero 'cow_oid' removes the map of the object */
+int default_set_cow_map(uint64_t oid, const struct cow_map *map)
+{
+	char path[PATH_MAX];
+	int ret;
+
+	get_obj_path(oid, path);
+	if (map->cow_oid)
+		ret = setxattr(path, COWNAME, map, sizeof(*map), 0);
+	else {
+		ret = removexattr(path, COWNAME);
+		if (ret < 0 && errno == ENODATA)
+			ret = 0;
+	}
+	if (ret < 0) {
+		sd_eprintf("failed to update cow map of %s: %m", path);
+		return err_to_sderr(path, oid, errno);
+	}
+
+	return SD_RES_SUCCESS;
+}
+
 int default_purge_obj(void)
 {
 	uint32_t tgt_epoch = get_latest_epoch();
@@ -598,6 +734,8 @@ static struct store_driver plain_store = {
 	.format = default_format,
 	.remove_object = default_remove_object,
 	.get_hash = default_get_hash,
+	.get_cow_map = default_get_cow_map,
+	.set_cow_map = default_set_cow_map,
 	.purge_obj = default_purge_obj,
 };
 
@@ -0,0 +1,536 @@
+/*
+ * Copyright (C) 2013 Taobao Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Per-VDI I/O throttling
+ *
+ * Every VDI with limits has a token bucket for I/Os and one for bytes.  A
+ * gateway request is admitted while both buckets have tokens, and may take
+ * them into debt, so a request larger than the burst still goes through.
+ * Otherwise it is deferred behind the other throttled requests of the VDI,
+ * and the VDI is put on a timer wheel to be dispatched when the buckets are
+ * expected to refill.
+ *
+ * The limits are kept in the SD_VDI_QOS_KEY attribute of the VDI.  They are
+ * loaded by a worker when the VDI is first accessed, and again on the next
+ * access if that failed.  SD_OP_SET_VDI_QOS updates them on every node.
+ * Everything else runs in the main thread.
+ */
+#include <sys/timerfd.h>
+
+#include "sheep_priv.h"
+
+#define QOS_WHEEL_TICK 1000	/* usec */
+#define QOS_WHEEL_SLOTS 256
+#define QOS_SCALE 1000000	/* tokens are counted in millionths */
+#define QOS_MAX_BURST (INT64_MAX / QOS_SCALE / 4)
+
+enum qos_state {
+	QOS_UNLOADED,	/* the limits have to be read by the next request */
+	QOS_LOADING,	/* the limits are being read, don't throttle yet */
+	QOS_READY,
+};
+
+struct qos_bucket {
+	uint64_t rate;	/* tokens per second, 0 means unlimited */
+	int64_t depth;
+	int64_t tokens;
+};
+
+struct qos_vdi {
+	uint32_t vid;
+	enum qos_state state;
+	struct qos_bucket iops;
+	struct qos_bucket bps;
+	uint64_t last_refill;
+
+	struct list_head throttled_reqs;
+
+	/* On the timer wheel */
+	bool scheduled;
+	uint64_t expire;
+	struct list_head wheel_list;
+
+	struct rb_node node;
+};
+
+struct qos_load_work {
+	struct work work;
+	uint32_t vid;
+	struct sd_vdi_qos qos;
+	int ret;
+};
+
+static struct rb_root qos_root = RB_ROOT;
+
+static struct list_head qos_wheel[QOS_WHEEL_SLOTS];
+static uint64_t qos_wheel_tick;	/* the last tick which was run */
+static int qos_nr_scheduled;
+static int qos_timer_fd = -1;
+
+static struct qos_vdi *qos_search(uint32_t vid)
+{
+	struct rb_node *n = qos_root.rb_node;
+	struct qos_vdi *t;
+
+	while (n) {
+		t = rb_entry(n, struct qos_vdi, node);
+
+		if (vid < t->vid)
+			n = n->rb_left;
+		else if (vid > t->vid)
+			n = n->rb_right;
+		else
+			return t;
+	}
+
+	return NULL;
+}
+
+static void qos_insert(struct qos_vdi *new)
+{
+	struct rb_node **p = &qos_root.rb_node;
+	struct rb_node *parent = NULL;
+	struct qos_vdi *entry;
+
+	while (*p) {
+		parent = *p;
+		entry = rb_entry(parent, struct qos_vdi, node);
+
+		if (new->vid < entry->vid)
+			p = &(*p)->rb_left;
+		else
+			p = &(*p)->rb_right;
+	}
+	rb_link_node(&new->node, parent, p);
+	rb_insert_color(&new->node, &qos_root);
+}
+
+static struct qos_vdi *qos_alloc(uint32_t vid)
+{
+	struct qos_vdi *qv;
+
+	qv = xzalloc(sizeof(*qv));
+	qv->vid = vid;
+	INIT_LIST_HEAD(&qv->throttled_reqs);
+	INIT_LIST_HEAD(&qv->wheel_list);
+	qos_insert(qv);
+
+	return qv;
+}
+
+static inline bool qos_limited(const struct qos_vdi *qv)
+{
+	return qv->state == QOS_READY && (qv->iops.rate || qv->bps.rate);
+}
+
+static void bucket_init(struct qos_bucket *b, uint64_t rate, uint64_t burst)
+{
+	b->rate = rate;
+	if (!burst)
+		burst = rate;
+	b->depth = min(burst, (uint64_t)QOS_MAX_BURST) * QOS_SCALE;
+	b->tokens = b->depth;
+}
+
+static void bucket_refill(struct qos_bucket *b, uint64_t elapsed)
+{
+	uint64_t room;
+
+	if (!b->rate || b->tokens >= b->depth)
+		return;
+
+	room = b->depth - b->tokens;
+	if (elapsed >= room / b->rate)
+		b->tokens = b->depth;
+	else
+		b->tokens += elapsed * b->rate;
+}
+
+/* Microseconds until the bucket has tokens again */
+static inline uint64_t bucket_wait(const struct qos_bucket *b)
+{
+	if (!b->rate || b->tokens > 0)
+		return 0;
+
+	return -b->tokens / b->rate + 1;
+}
+
+static void qos_refill(struct qos_vdi *qv, uint64_t now)
+{
+	uint64_t elapsed = now - qv->last_refill;
+
+	bucket_refill(&qv->iops, elapsed);
+	bucket_refill(&qv->bps, elapsed);
+	qv->last_refill = now;
+}
+
+static void req_cost(const struct request *req, uint64_t *nr_ios,
+		     uint64_t *len)
+{
+	const struct sd_req *hdr = &req->rq;
+
+	switch (hdr->opcode) {
+	case SD_OP_READ_OBJS:
+	case SD_OP_WRITE_OBJS:
+		*nr_ios = hdr->objs.nr_segs;
+		*len = objs_data_length(req->data, hdr->objs.nr_segs);
+		break;
+	default:
+		*nr_ios = 1;
+		*len = hdr->data_length;
+		break;
+	}
+}
+
+/* Take the tokens of the request if it can go now */
+static bool qos_admit(struct qos_vdi *qv, const struct request *req)
+{
+	uint64_t nr_ios, len;
+
+	if (bucket_wait(&qv->iops) || bucket_wait(&qv->bps))
+		return false;
+
+	req_cost(req, &nr_ios, &len);
+	if (qv->iops.rate)
+		qv->iops.tokens -= nr_ios * QOS_SCALE;
+	if (qv->bps.rate)
+		qv->bps.tokens -= len * QOS_SCALE;
+
+	return true;
+}
+
+static void qos_timer_set(bool on)
+{
+	struct itimerspec it;
+
+	memset(&it, 0, sizeof(it));
+	if (on) {
+		it.it_value.tv_nsec = QOS_WHEEL_TICK * 1000;
+		it.it_interval.tv_nsec = QOS_WHEEL_TICK * 1000;
+	}
+
+	if (timerfd_settime(qos_timer_fd, 0, &it, NULL) < 0)
+		sd_eprintf("timerfd_settime: %m");
+}
+
+static void qos_schedule(struct qos_vdi *qv, uint64_t now, uint64_t wait)
+{
+	uint64_t tick = (now + wait + QOS_WHEEL_TICK - 1) / QOS_WHEEL_TICK;
+
+	if (qos_nr_scheduled == 0) {
+		qos_wheel_tick = now / QOS_WHEEL_TICK;
+		qos_timer_set(true);
+	}
+
+	/* Farther deadlines are checked again when their slot comes up */
+	tick = max(tick, qos_wheel_tick + 1);
+	tick = min(tick, qos_wheel_tick + QOS_WHEEL_SLOTS - 1);
+
+	qv->scheduled = true;
+	qv->expire = tick;
+	list_add_tail(&qv->wheel_list, &qos_wheel[tick % QOS_WHEEL_SLOTS]);
+	qos_nr_scheduled++;
+}
+
+static void qos_unschedule(struct qos_vdi *qv)
+{
+	if (!qv->scheduled)
+		return;
+
+	list_del_init(&qv->wheel_list);
+	qv->scheduled = false;
+	if (--qos_nr_scheduled == 0)
+		qos_timer_set(false);
+}
+
+/* Let the throttled requests go as long as the buckets allow */
+static void qos_dispatch(struct qos_vdi *qv)
+{
+	struct request *req;
+	uint64_t now = clock_get_usec();
+	LIST_HEAD(ready_list);
+
+	qos_refill(qv, now);
+	while (!list_empty(&qv->throttled_reqs)) {
+		req = list_first_entry(&qv->throttled_reqs, struct request,
+				       request_list);
+		if (qos_limited(qv) && !qos_admit(qv, req))
+			break;
+		list_move_tail(&req->request_list, &ready_list);
+	}
+
+	if (!list_empty(&qv->throttled_reqs))
+		qos_schedule(qv, now, max(bucket_wait(&qv->iops),
+					  bucket_wait(&qv->bps)));
+
+	/* Requeueing may throttle other requests of this VDI again */
+	while (!list_empty(&ready_list)) {
+		req = list_first_entry(&ready_list, struct request,
+				       request_list);
+		list_del(&req->request_list);
+		resume_throttled_request(req);
+	}
+}
+
+static void qos_timer_handler(int fd, int events, void *data)
+{
+	struct qos_vdi *qv, *n;
+	uint64_t now_tick, nr_ticks, expirations;
+	LIST_HEAD(due_list);
+
+	if (read(fd, &expirations, sizeof(expirations)) < 0)
+		return;
+
+	now_tick = clock_get_usec() / QOS_WHEEL_TICK;
+	nr_ticks = min(now_tick - qos_wheel_tick, (uint64_t)QOS_WHEEL_SLOTS);
+	while (nr_ticks--) {
+		struct list_head *slot;
+
+		qos_wheel_tick++;
+		slot = &qos_wheel[qos_wheel_tick % QOS_WHEEL_SLOTS];
+		list_for_each_entry_safe(qv, n, slot, wheel_list) {
+			if (qv->expire > now_tick)
+				continue;
+			list_move_tail(&qv->wheel_list, &due_list);
+		}
+	}
+	qos_wheel_tick = now_tick;
+
+	list_for_each_entry_safe(qv, n, &due_list, wheel_list) {
+		list_del_init(&qv->wheel_list);
+		qv->scheduled = false;
+		qos_nr_scheduled--;
+		qos_dispatch(qv);
+	}
+
+	if (qos_nr_scheduled == 0)
+		qos_timer_set(false);
+}
+
+static void qos_apply(struct qos_vdi *qv, const struct sd_vdi_qos *qos)
+{
+	qv->state = QOS_READY;
+	bucket_init(&qv->iops, qos->iops, qos->iops_burst);
+	bucket_init(&qv->bps, qos->bps, qos->bps_burst);
+	qv->last_refill = clock_get_usec();
+
+	sd_dprintf("%" PRIx32 ", iops %" PRIu64 ", bps %" PRIu64, qv->vid,
+		   qos->iops, qos->bps);
+
+	qos_unschedule(qv);
+	qos_dispatch(qv);
+}
+
+static int read_vdi_qos(uint32_t vid, struct sd_vdi_qos *qos)
+{
+	struct sd_inode *inode = xmalloc(SD_INODE_HEADER_SIZE);
+	struct sheepdog_vdi_attr *vattr = xzalloc(sizeof(*vattr));
+	uint32_t attr_vid, attrid;
+	int ret;
+
+	ret = read_object(vid_to_vdi_oid(vid), (char *)inode,
+			  SD_INODE_HEADER_SIZE, 0);
+	if (ret != SD_RES_SUCCESS)
+		goto out;
+	if (*inode->name == '\0') {
+		ret = SD_RES_NO_VDI;
+		goto out;
+	}
+
+	/* The attributes are stored under the hash of the VDI name */
+	pstrcpy(vattr->name, sizeof(vattr->name), inode->name);
+	pstrcpy(vattr->key, sizeof(vattr->key), SD_VDI_QOS_KEY);
+	attr_vid = fnv_64a_buf(vattr->name, strlen(vattr->name),
+			       FNV1A_64_INIT) & (SD_NR_VDIS - 1);
+	ret = get_vdi_attr(vattr, SD_ATTR_OBJ_SIZE, attr_vid, &attrid,
+			   inode->create_time, false, false, false);
+	if (ret != SD_RES_SUCCESS)
+		goto out;
+
+	ret = read_object(vid_to_attr_oid(attr_vid, attrid), (char *)vattr,
+			  offsetof(struct sheepdog_vdi_attr, value) +
+			  sizeof(*qos), 0);
+	if (ret != SD_RES_SUCCESS)
+		goto out;
+	if (vattr->value_len != sizeof(*qos)) {
+		sd_eprintf("invalid qos attribute of %" PRIx32, vid);
+		ret = SD_RES_INVALID_PARMS;
+		goto out;
+	}
+	memcpy(qos, vattr->value, sizeof(*qos));
+out:
+	free(vattr);
+	free(inode);
+	return ret;
+}
+
+static void qos_load_work(struct work *work)
+{
+	struct qos_load_work *lw = container_of(work, struct qos_load_work,
+						work);
+
+	lw->ret = read_vdi_qos(lw->vid, &lw->qos);
+}
+
+static void qos_load_done(struct work *work)
+{
+	struct qos_load_work *lw = container_of(work, struct qos_load_work,
+						work);
+	struct qos_vdi *qv = qos_search(lw->vid);
+
+	switch (lw->ret) {
+	case SD_RES_SUCCESS:
+	case SD_RES_NO_OBJ:
+	case SD_RES_NO_VDI:
+		break;
+	default:
+		sd_eprintf("failed to load the limits of %" PRIx32 ", %s",
+			   lw->vid, sd_strerror(lw->ret));
+		/* Don't take a transient error for no limits */
+		if (qv && qv->state == QOS_LOADING)
+			qv->state = QOS_UNLOADED;
+		free(lw);
+		return;
+	}
+
+	/* SD_OP_SET_VDI_QOS may have set newer limits in the meantime */
+	if (qv && qv->state == QOS_LOADING)
+		qos_apply(qv, &lw->qos);
+
+	free(lw);
+}
+
+static void qos_load(struct qos_vdi *qv)
+{
+	struct qos_load_work *lw = xzalloc(sizeof(*lw));
+
+	qv->state = QOS_LOADING;
+	lw->vid = qv->vid;
+	lw->work.fn = qos_load_work;
+	lw->work.done = qos_load_done;
+	queue_work(sys->gateway_wqueue, &lw->work);
+}
+
+static uint32_t req_vid(const struct request *req)
+{
+	const struct sd_req *hdr = &req->rq;
+	const struct sd_obj_seg *segs = req->data;
+	uint64_t oid;
+
+	switch (hdr->opcode) {
+	case SD_OP_CREATE_AND_WRITE_OBJ:
+	case SD_OP_READ_OBJ:
+	case SD_OP_WRITE_OBJ:
+		oid = hdr->obj.oid;
+		break;
+	case SD_OP_READ_OBJS:
+	case SD_OP_WRITE_OBJS:
+		oid = segs[0].oid;
+		break;
+	default:
+		return 0;
+	}
+
+	if (!is_data_obj(oid))
+		return 0;
+
+	return oid_to_vid(oid);
+}
+
+/*
+ * Return true if the gateway request has to wait for the limits of its VDI.
+ * It is queued again with resume_throttled_request() when its turn comes.
+ */
+bool qos_throttle_request(struct request *req)
+{
+	struct qos_vdi *qv;
+	uint32_t vid;
+
+	/* Requeued requests have been charged already */
+	if (req->local || req->qos_charged)
+		return false;
+	req->qos_charged = true;
+
+	vid = req_vid(req);
+	if (!vid)
+		return false;
+
+	qv = qos_search(vid);
+	if (!qv)
+		qv = qos_alloc(vid);
+	if (qv->state == QOS_UNLOADED) {
+		qos_load(qv);
+		return false;
+	}
+	if (!qos_limited(qv))
+		return false;
+
+	if (list_empty(&qv->throttled_reqs)) {
+		qos_refill(qv, clock_get_usec());
+		if (qos_admit(qv, req))
+			return false;
+	}
+
+	sd_dprintf("throttle %s of %" PRIx32, op_name(req->op), vid);
+	list_add_tail(&req->request_list, &qv->throttled_reqs);
+	if (!qv->scheduled)
+		qos_schedule(qv, clock_get_usec(),
+			     max(bucket_wait(&qv->iops),
+				 bucket_wait(&qv->bps)));
+
+	return true;
+}
+
+void qos_set_vdi(uint32_t vid, const struct sd_vdi_qos *qos)
+{
+	struct qos_vdi *qv = qos_search(vid);
+
+	if (!qv)
+		qv = qos_alloc(vid);
+	qos_apply(qv, qos);
+}
+
+void qos_del_vdi(uint32_t vid)
+{
+	struct qos_vdi *qv = qos_search(vid);
+	static const struct sd_vdi_qos unlimited;
+
+	if (!qv)
+		return;
+
+	/* Let the throttled requests go, they will fail on their own */
+	qos_apply(qv, &unlimited);
+	rb_erase(&qv->node, &qos_root);
+	free(qv);
+}
+
+int qos_init(void)
+{
+	int i;
+
+	for (i = 0; i < QOS_WHEEL_SLOTS; i++)
+		INIT_LIST_HEAD(&qos_wheel[i]);
+
+	qos_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+	if (qos_timer_fd < 0) {
+		sd_eprintf("timerfd_create: %m");
+		return -1;
+	}
+
+	if (register_event(qos_timer_fd, qos_timer_handler, NULL) < 0) {
+		sd_eprintf("failed to register qos timer");
+		close(qos_timer_fd);
+		return -1;
+	}
+
+	return 0;
+}
@@ -109,9 +109,9 @@ static inline bool node_is_gateway_only(void)
 	return sys->this_node.nr_vnodes == 0;
 }
 
-/* recover object from vnode */
+/* recover object from node */
 static int recover_object_from(struct recovery_obj_work *row,
-			       const struct sd_vnode *vnode, uint32_t tgt_epoch)
+			       const struct sd_node *node, uint32_t tgt_epoch)
 {
 	uint64_t oid = row->oid;
 	uint32_t local_epoch = row->local_epoch;
@@ -124,7 +124,7 @@ static int recover_object_from(struct recovery_obj_work *row,
 	struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
 	struct siocb iocb = { 0 };
 
-	if (vnode_is_local(vnode)) {
+	if (node_is_local(node)) {
 		if (tgt_epoch < sys_epoch())
 			return sd_store->link(oid, tgt_epoch);
 
@@ -136,7 +136,7 @@ static int recover_object_from(struct recovery_obj_work *row,
 		sd_init_req(&hdr, SD_OP_GET_HASH);
 		hdr.obj.oid = oid;
 		hdr.obj.tgt_epoch = tgt_epoch;
-		ret = sheep_exec_req(&vnode->nid, &hdr, NULL);
+		ret = sheep_exec_req(&node->nid, &hdr, NULL);
 		if (ret != SD_RES_SUCCESS)
 			return ret;
 
@@ -151,7 +151,7 @@ static int recover_object_from(struct recovery_obj_work *row,
 	}
 
 	rlen = get_objsize(oid);
-	buf = xvalloc(rlen);
+	buf = xbuf_get(rlen);
 
 	/* recover from remote replica */
 	sd_init_req(&hdr, SD_OP_READ_PEER);
@@ -161,7 +161,7 @@ static int recover_object_from(struct recovery_obj_work *row,
 	hdr.obj.oid = oid;
 	hdr.obj.tgt_epoch = tgt_epoch;
 
-	ret = sheep_exec_req(&vnode->nid, &hdr, buf);
+	ret = sheep_exec_req(&node->nid, &hdr, buf);
 	if (ret == SD_RES_SUCCESS) {
 		iocb.epoch = epoch;
 		iocb.length = rsp->data_length;
@@ -170,7 +170,7 @@ static int recover_object_from(struct recovery_obj_work *row,
 		ret = sd_store->create_and_write(oid, &iocb);
 	}
 
-	free(buf);
+	buf_put(buf, rlen);
 	return ret;
 }
 
@@ -187,11 +187,11 @@ static int recover_object_from_replica(struct recovery_obj_work *row,
 
 	/* find local node first to try to recover from local */
 	for (int i = 0; i < nr_copies; i++) {
-		const struct sd_vnode *vnode;
+		const struct sd_node *node;
 
-		vnode = oid_to_vnode(old->vnodes, old->nr_vnodes, oid, i);
+		node = vinfo_oid_to_node(old, oid, i);
 
-		if (vnode_is_local(vnode)) {
+		if (node_is_local(node)) {
 			start = i;
 			break;
 		}
@@ -199,12 +199,12 @@ static int recover_object_from_replica(struct recovery_obj_work *row,
 
 	/* Let's do a breadth-first search */
 	for (int i = 0; i < nr_copies; i++) {
-		const struct sd_vnode *vnode;
+		const struct sd_node *node;
 		int idx = (i + start) % nr_copies;
 
-		vnode = oid_to_vnode(old->vnodes, old->nr_vnodes, oid, idx);
+		node = vinfo_oid_to_node(old, oid, idx);
 
-		ret = recover_object_from(row, vnode, tgt_epoch);
+		ret = recover_object_from(row, node, tgt_epoch);
 		switch (ret) {
 		case SD_RES_SUCCESS:
 			sd_dprintf("recovered oid %"PRIx64" from %d "
@@ -222,6 +222,17 @@ static int recover_object_from_replica(struct recovery_obj_work *row,
 		}
 	}
 
+	/* A strip without a replica is rebuilt from its siblings */
+	if (is_ec_strip_obj(oid)) {
+		ret = ec_rebuild_strip(oid, old, epoch, tgt_epoch);
+		if (ret == SD_RES_SUCCESS) {
+			sd_dprintf("rebuilt oid %"PRIx64" from epoch %d",
+				   oid, tgt_epoch);
+			objlist_cache_insert(oid);
+		}
+		return ret;
+	}
+
 	/*
 	 * sheep would return a stale object when
 	 *  - all the nodes hold the copies, and
@@ -309,6 +320,8 @@ static void recover_object_work(struct work *work)
 		return;
 	}
 
+	iosched_acquire(IO_CLASS_RECOVERY);
+
 	/* find object in the stale directory */
 	for (epoch = sys_epoch() - 1; epoch > 0; epoch--) {
 		ret = sd_store->get_hash(oid, epoch, row->local_sha1);
@@ -703,45 +716,74 @@ retry:
 	return buf;
 }
 
+static void screen_object(struct recovery_list_work *rlw, uint64_t oid,
+			  int old_count)
+{
+	struct recovery_work *rw = &rlw->base;
+	const struct sd_node *nodes[SD_MAX_COPIES];
+	int nr_objs;
+	int j;
+
+	if (xbsearch(&oid, rlw->oids, old_count, obj_cmp))
+		/* the object is already scheduled to be recovered */
+		return;
+
+	nr_objs = get_obj_copy_number(oid, rw->cur_vinfo->nr_zones);
+	if (!nr_objs) {
+		/* strips can be left without a zone in a degraded cluster */
+		if (!is_ec_strip_obj(oid))
+			sd_eprintf("ERROR: can not find copy number for "
+				   "object %" PRIx64, oid);
+		return;
+	}
+	vinfo_oid_to_nodes(rw->cur_vinfo, oid, nr_objs, nodes);
+	for (j = 0; j < nr_objs; j++) {
+		if (!node_is_local(nodes[j]))
+			continue;
+
+		rlw->oids[rlw->count++] = oid;
+		/* enlarge the list buffer if full */
+		if (rlw->count == list_buffer_size / sizeof(uint64_t)) {
+			list_buffer_size *= 2;
+			rlw->oids = xrealloc(rlw->oids, list_buffer_size);
+		}
+		break;
+	}
+}
+
 /* Screen out objects that don't belong to this node */
 static void screen_object_list(struct recovery_list_work *rlw,
 			       uint64_t *oids, size_t nr_oids)
 {
-	struct recovery_work *rw = &rlw->base;
-	const struct sd_vnode *vnodes[SD_MAX_COPIES];
 	int old_count = rlw->count;
-	int nr_objs;
-	int i, j;
+	int i, j, nr_strips;
 
 	for (i = 0; i < nr_oids; i++) {
-		if (xbsearch(&oids[i], rlw->oids, old_count, obj_cmp))
-			/* the object is already scheduled to be recovered */
+		if (!is_ec_strip_obj(oids[i])) {
+			screen_object(rlw, oids[i], old_count);
 			continue;
-
-		nr_objs = get_obj_copy_number(oids[i], rw->cur_vinfo->nr_zones);
-		if (!nr_objs) {
-			sd_eprintf("ERROR: can not find copy number for object"
-				   " %" PRIx64, oids[i]);
-			continue;
-		}
-		oid_to_vnodes(rw->cur_vinfo->vnodes, rw->cur_vinfo->nr_vnodes,
-			      oids[i], nr_objs, vnodes);
-		for (j = 0; j < nr_objs; j++) {
-			if (!vnode_is_local(vnodes[j]))
-				continue;
-
-			rlw->oids[rlw->count++] = oids[i];
-			/* enlarge the list buffer if full */
-			if (rlw->count == list_buffer_size / sizeof(uint64_t)) {
-				list_buffer_size *= 2;
-				rlw->oids = xrealloc(rlw->oids,
-						     list_buffer_size);
-			}
-			break;
 		}
+
+		/*
+		 * A strip has no copies, so a lost strip is only listed
+		 * through its siblings
+		 */
+		nr_strips = get_ec_nr_strips(oids[i]);
+		for (j = 0; j < nr_strips; j++)
+			screen_object(rlw,
+				ec_strip_oid(ec_strip_base_oid(oids[i]),
+					     ec_strip_nr_data(oids[i]), j),
+				old_count);
 	}
 
 	xqsort(rlw->oids, rlw->count, obj_cmp);
+
+	/* siblings of the strips may have been added more than once */
+	for (i = 1, j = 1; i < rlw->count; i++)
+		if (rlw->oids[i] != rlw->oids[j - 1])
+			rlw->oids[j++] = rlw->oids[i];
+	if (rlw->count)
+		rlw->count = j;
 }
 
 /* Prepare the object list that belongs to this node */
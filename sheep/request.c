@@ -15,7 +15,6 @@
 #include <pthread.h>
 #include <sys/eventfd.h>
 #include <arpa/inet.h>
-#include <netinet/tcp.h>
 #include <sys/epoll.h>
 #include <fcntl.h>
 #include <errno.h>
@@ -33,26 +32,47 @@ static void del_requeue_request(struct request *req)
 
 static bool is_access_local(struct request *req, uint64_t oid)
 {
-	const struct sd_vnode *obj_vnodes[SD_MAX_COPIES];
+	const struct sd_node *obj_nodes[SD_MAX_COPIES];
 	int nr_copies;
 	int i;
 
-	nr_copies = get_req_copy_number(req);
-	oid_to_vnodes(req->vinfo->vnodes, req->vinfo->nr_vnodes, oid,
-		      nr_copies, obj_vnodes);
+	nr_copies = get_req_obj_copy_number(req, oid);
+	vinfo_oid_to_nodes(req->vinfo, oid, nr_copies, obj_nodes);
 
 	for (i = 0; i < nr_copies; i++) {
-		if (vnode_is_local(obj_vnodes[i]))
+		if (node_is_local(obj_nodes[i]))
 			return true;
 	}
 
 	return false;
 }
 
+/*
+ * A request whose I/O was submitted to the store ends when both the worker
+ * and the store are done with it, in either order.  Called in the main thread.
+ */
+static bool store_io_end(struct request *req)
+{
+	if (--req->nr_async_ends)
+		return false;
+
+	req->rp.result = req->async_result;
+	return true;
+}
+
 static void io_op_done(struct work *work)
 {
 	struct request *req = container_of(work, struct request, work);
 
+	if (req->fwd) {
+		/* The next hop of a chain write hasn't acked yet */
+		gateway_wait_forward_request(req);
+		return;
+	}
+
+	if (req->nr_async_ends && !store_io_end(req))
+		return;
+
 	switch (req->rp.result) {
 	case SD_RES_EIO:
 		req->rp.result = SD_RES_NETWORK_ERROR;
@@ -104,6 +124,12 @@ static void gateway_op_done(struct work *work)
 	struct request *req = container_of(work, struct request, work);
 	struct sd_req *hdr = &req->rq;
 
+	if (req->fwd) {
+		/* We will be called again when all the replicas ack */
+		gateway_wait_forward_request(req);
+		return;
+	}
+
 	switch (req->rp.result) {
 	case SD_RES_OLD_NODE_VER:
 		if (req->rp.epoch > sys->epoch) {
@@ -189,6 +215,12 @@ static bool request_in_recovery(struct request *req)
 	if (req->rq.opcode == SD_OP_CREATE_AND_WRITE_PEER ||
 	    req->rq.opcode == SD_OP_CREATE_AND_WRITE_OBJ)
 		return false;
+	if (req->rq.opcode == SD_OP_CHAIN_WRITE_PEER &&
+	    req->rq.chain.opcode == SD_OP_CREATE_AND_WRITE_PEER)
+		return false;
+	/* The strip requests of the write wait for the recovery of strips */
+	if (req->rq.opcode == SD_OP_EC_WRITE_PEER)
+		return false;
 
 	/*
 	 * Request from recovery should go down the Farm even if
@@ -271,8 +303,81 @@ void wakeup_all_requests(void)
 	}
 }
 
+static bool is_vectored_request(const struct request *req)
+{
+	switch (req->rq.opcode) {
+	case SD_OP_READ_OBJS:
+	case SD_OP_WRITE_OBJS:
+	case SD_OP_READ_OBJS_PEER:
+	case SD_OP_WRITE_OBJS_PEER:
+		return true;
+	default:
+		return false;
+	}
+}
+
+/* Sanity check of the segment list of a vectored request */
+static bool vectored_request_is_valid(const struct request *req)
+{
+	const struct sd_req *hdr = &req->rq;
+	const struct sd_obj_seg *segs = req->data;
+	uint64_t len = 0, segs_len = hdr->objs.nr_segs * sizeof(*segs);
+	uint32_t i;
+
+	if (req->local || !(hdr->flags & SD_FLAG_CMD_WRITE) ||
+	    hdr->objs.nr_segs == 0 || hdr->objs.nr_segs > SD_MAX_OBJS_SEGS ||
+	    hdr->data_length < segs_len)
+		return false;
+
+	for (i = 0; i < hdr->objs.nr_segs; i++) {
+		if (!segs[i].oid || !segs[i].length ||
+		    (uint64_t)segs[i].offset + segs[i].length >
+		    get_objsize(segs[i].oid))
+			return false;
+		len += segs[i].length;
+	}
+	if (len > SD_MAX_OBJS_DATA)
+		return false;
+
+	if (hdr->opcode == SD_OP_WRITE_OBJS ||
+	    hdr->opcode == SD_OP_WRITE_OBJS_PEER)
+		return hdr->data_length == segs_len + len;
+	else
+		return hdr->data_length == segs_len;
+}
+
+/*
+ * A vectored request waits for the recovery of all its objects which are
+ * stored locally.  It sleeps on the first object in recovery and is checked
+ * again when woken up.
+ */
+static bool vectored_request_in_recovery(struct request *req, bool gateway)
+{
+	const struct sd_obj_seg *segs = req->data;
+	uint32_t i;
+
+	for (i = 0; i < req->rq.objs.nr_segs; i++) {
+		if (gateway && !is_access_local(req, segs[i].oid))
+			continue;
+		req->local_oid = segs[i].oid;
+		if (request_in_recovery(req))
+			return true;
+	}
+	req->local_oid = 0;
+
+	return false;
+}
+
 static void queue_peer_request(struct request *req)
 {
+	if (is_vectored_request(req)) {
+		if (check_request_epoch(req) < 0)
+			return;
+		if (vectored_request_in_recovery(req, false))
+			return;
+		goto queue_work;
+	}
+
 	req->local_oid = req->rq.obj.oid;
 	if (req->local_oid) {
 		if (check_request_epoch(req) < 0)
@@ -283,7 +388,7 @@ static void queue_peer_request(struct request *req)
 
 	if (req->rq.flags & SD_FLAG_CMD_RECOVERY)
 		req->rq.epoch = req->rq.obj.tgt_epoch;
-
+queue_work:
 	req->work.fn = do_process_work;
 	req->work.done = io_op_done;
 	queue_work(sys->io_wqueue, &req->work);
@@ -293,6 +398,13 @@ static void queue_gateway_request(struct request *req)
 {
 	struct sd_req *hdr = &req->rq;
 
+	if (is_vectored_request(req)) {
+		if (!sys->enable_object_cache &&
+		    vectored_request_in_recovery(req, true))
+			return;
+		goto queue_work;
+	}
+
 	if (is_access_local(req, hdr->obj.oid))
 		req->local_oid = hdr->obj.oid;
 
@@ -326,6 +438,8 @@ static void queue_request(struct request *req)
 	struct sd_req *hdr = &req->rq;
 	struct sd_rsp *rsp = &req->rp;
 
+	req_stamp(req, REQ_STAMP_QUEUE);
+
 	/*
 	 * Check the protocol version for all internal commands, and public
 	 * commands that have it set.  We can't enforce it on all public
@@ -352,6 +466,12 @@ static void queue_request(struct request *req)
 
 	sd_dprintf("%s, %d", op_name(req->op), sys->status);
 
+	if (is_vectored_request(req) && !vectored_request_is_valid(req)) {
+		sd_eprintf("invalid segments of %s", op_name(req->op));
+		rsp->result = SD_RES_INVALID_PARMS;
+		goto done;
+	}
+
 	switch (sys->status) {
 	case SD_STATUS_KILLED:
 		rsp->result = SD_RES_KILLED;
@@ -387,6 +507,8 @@ static void queue_request(struct request *req)
 		queue_peer_request(req);
 	} else if (is_gateway_op(req->op)) {
 		hdr->epoch = sys->epoch;
+		if (qos_throttle_request(req))
+			return;
 		queue_gateway_request(req);
 	} else if (is_local_op(req->op)) {
 		hdr->epoch = sys->epoch;
@@ -414,7 +536,42 @@ static void requeue_request(struct request *req)
 	queue_request(req);
 }
 
+/* The I/O limits of the VDI let the deferred request go */
+void resume_throttled_request(struct request *req)
+{
+	requeue_request(req);
+}
+
 static void clear_client_info(struct client_info *ci);
+static void client_async_close(struct client_info *ci);
+static void client_async_tx(struct client_info *ci);
+static void net_thread_put_request(struct net_thread *nt,
+				   struct request *req);
+
+/*
+ * Hand a request over to the main thread.  The event is written only when the
+ * queue was empty, since the handler takes all the queued requests.
+ */
+static void queue_main_request(struct request *req)
+{
+	eventfd_t value = 1;
+	bool empty;
+
+	pthread_mutex_lock(&sys->local_req_lock);
+	empty = list_empty(&sys->local_req_queue);
+	list_add_tail(&req->request_list, &sys->local_req_queue);
+	pthread_mutex_unlock(&sys->local_req_lock);
+
+	if (empty)
+		eventfd_write(sys->local_req_efd, value);
+}
+
+/* The store has finished the I/O of 'req', see store_driver->submit */
+void store_io_done(struct request *req, int result)
+{
+	req->async_result = result;
+	queue_main_request(req);
+}
 
 static struct request *alloc_local_request(void *data, int data_length)
 {
@@ -429,6 +586,7 @@ static struct request *alloc_local_request(void *data, int data_length)
 	req->local = true;
 
 	INIT_LIST_HEAD(&req->request_list);
+	req_stamp(req, REQ_STAMP_RX);
 
 	return req;
 }
@@ -457,11 +615,7 @@ int exec_local_req(struct sd_req *rq, void *data)
 	req->rq = *rq;
 	req->local_req_efd = eventfd(0, 0);
 
-	pthread_mutex_lock(&sys->local_req_lock);
-	list_add_tail(&req->request_list, &sys->local_req_queue);
-	pthread_mutex_unlock(&sys->local_req_lock);
-
-	eventfd_write(sys->local_req_efd, value);
+	queue_main_request(req);
 
 again:
 	/* In error case (for e.g, EINTR) just retry read */
@@ -496,7 +650,7 @@ static struct request *alloc_request(struct client_info *ci, int data_length)
 	ci->refcnt++;
 	if (data_length) {
 		req->data_length = data_length;
-		req->data = valloc(data_length);
+		req->data = buf_get(data_length);
 		if (!req->data) {
 			free(req);
 			return NULL;
@@ -517,21 +671,22 @@ static void free_request(struct request *req)
 
 	req->ci->refcnt--;
 	put_vnode_info(req->vinfo);
-	free(req->data);
+	buf_put(req->data, req->data_length);
 	free(req);
 }
 
-void put_request(struct request *req)
+/* Queue the response of a done request to its connection */
+static void client_put_request(struct request *req)
 {
 	struct client_info *ci = req->ci;
-	eventfd_t value = 1;
 
-	if (uatomic_sub_return(&req->refcnt, 1) > 0)
-		return;
-
-	if (req->local)
-		eventfd_write(req->local_req_efd, value);
-	else {
+	if (event_async_io()) {
+		list_add(&req->request_list, &ci->done_reqs);
+		if (is_conn_dead(&ci->conn))
+			client_async_close(ci);
+		else
+			client_async_tx(ci);
+	} else {
 		if (conn_tx_on(&ci->conn)) {
 			clear_client_info(ci);
 			free_request(req);
@@ -541,6 +696,25 @@ void put_request(struct request *req)
 	}
 }
 
+void put_request(struct request *req)
+{
+	struct client_info *ci = req->ci;
+	eventfd_t value = 1;
+
+	if (uatomic_sub_return(&req->refcnt, 1) > 0)
+		return;
+
+	req_stamp(req, REQ_STAMP_DONE);
+	if (req->local) {
+		/* The caller frees the request as soon as it is woken up */
+		account_request_latency(req);
+		eventfd_write(req->local_req_efd, value);
+	} else if (ci->net)
+		net_thread_put_request(ci->net, req);
+	else
+		client_put_request(req);
+}
+
 static void init_rx_hdr(struct client_info *ci)
 {
 	ci->conn.c_rx_state = C_IO_HEADER;
@@ -549,40 +723,51 @@ static void init_rx_hdr(struct client_info *ci)
 	ci->conn.rx_buf = &ci->conn.rx_hdr;
 }
 
-static inline int begin_rx(struct client_info *ci)
+/*
+ * Allocate the request of the received header, and set up the receive of its
+ * data.  Return false if there is no data to receive.
+ */
+static bool init_rx_data(struct client_info *ci)
 {
-	int ret;
-	uint64_t data_len;
 	struct connection *conn = &ci->conn;
 	struct sd_req *hdr = &conn->rx_hdr;
+	uint64_t data_len = hdr->data_length;
 	struct request *req;
 
+	req = alloc_request(ci, data_len);
+	if (!req) {
+		conn->c_rx_state = C_IO_CLOSED;
+		return false;
+	}
+	ci->rx_req = req;
+
+	/* use le_to_cpu */
+	memcpy(&req->rq, hdr, sizeof(req->rq));
+
+	if (data_len && hdr->flags & SD_FLAG_CMD_WRITE) {
+		conn->c_rx_state = C_IO_DATA;
+		conn->rx_length = data_len;
+		conn->rx_buf = req->data;
+		return true;
+	}
+
+	conn->c_rx_state = C_IO_END;
+	return false;
+}
+
+static inline int begin_rx(struct client_info *ci)
+{
+	int ret;
+	struct connection *conn = &ci->conn;
+
 	switch (conn->c_rx_state) {
 	case C_IO_HEADER:
 		ret = rx(conn, C_IO_DATA_INIT);
 		if (!ret || conn->c_rx_state != C_IO_DATA_INIT)
 			break;
 	case C_IO_DATA_INIT:
-		data_len = hdr->data_length;
-
-		req = alloc_request(ci, data_len);
-		if (!req) {
-			conn->c_rx_state = C_IO_CLOSED;
+		if (!init_rx_data(ci))
 			break;
-		}
-		ci->rx_req = req;
-
-		/* use le_to_cpu */
-		memcpy(&req->rq, hdr, sizeof(req->rq));
-
-		if (data_len && hdr->flags & SD_FLAG_CMD_WRITE) {
-			conn->c_rx_state = C_IO_DATA;
-			conn->rx_length = data_len;
-			conn->rx_buf = req->data;
-		} else {
-			conn->c_rx_state = C_IO_END;
-			break;
-		}
 	case C_IO_DATA:
 		ret = rx(conn, C_IO_END);
 		break;
@@ -607,10 +792,14 @@ static inline void finish_rx(struct client_info *ci)
 	struct request *req;
 
 	req = ci->rx_req;
+	req_stamp(req, REQ_STAMP_RX);
 	init_rx_hdr(ci);
 
 	sd_dprintf("%d, %s:%d", ci->conn.fd, ci->conn.ipstr, ci->conn.port);
-	queue_request(req);
+	if (ci->net)
+		queue_main_request(req);
+	else
+		queue_request(req);
 }
 
 static void do_client_rx(struct client_info *ci)
@@ -621,68 +810,100 @@ static void do_client_rx(struct client_info *ci)
 	finish_rx(ci);
 }
 
-static void init_tx_hdr(struct client_info *ci)
+/* Move the done requests to the batch, and set up their responses */
+static void init_tx_batch(struct client_info *ci)
 {
-	struct sd_rsp *rsp = (struct sd_rsp *)&ci->conn.tx_hdr;
-	struct request *req;
-
-	assert(!list_empty(&ci->done_reqs));
-
-	memset(rsp, 0, sizeof(*rsp));
+	struct request *req, *t;
+	struct sd_rsp *rsp;
+	struct iovec *iov = ci->tx_iov;
 
-	req = list_first_entry(&ci->done_reqs, struct request, request_list);
-	list_del(&req->request_list);
+	list_for_each_entry_safe(req, t, &ci->done_reqs, request_list) {
+		if (ci->nr_tx_reqs == CLIENT_TX_BATCH)
+			break;
+		list_del(&req->request_list);
+		ci->tx_reqs[ci->nr_tx_reqs++] = req;
 
-	ci->tx_req = req;
-	ci->conn.tx_length = sizeof(*rsp);
-	ci->conn.c_tx_state = C_IO_HEADER;
-	ci->conn.tx_buf = rsp;
+		/* use cpu_to_le */
+		rsp = &req->rp;
+		rsp->epoch = sys->epoch;
+		rsp->opcode = req->rq.opcode;
+		rsp->id = req->rq.id;
 
-	/* use cpu_to_le */
-	memcpy(rsp, &req->rp, sizeof(*rsp));
+		iov->iov_base = rsp;
+		iov->iov_len = sizeof(*rsp);
+		iov++;
+		if (rsp->data_length) {
+			iov->iov_base = req->data;
+			iov->iov_len = rsp->data_length;
+			iov++;
+		}
+	}
 
-	rsp->epoch = sys->epoch;
-	rsp->opcode = req->rq.opcode;
-	rsp->id = req->rq.id;
+	ci->tx_iov_idx = 0;
+	ci->nr_tx_iov = iov - ci->tx_iov;
 }
 
-static inline int begin_tx(struct client_info *ci)
+static void free_tx_batch(struct client_info *ci)
 {
-	int ret, opt;
-	struct sd_rsp *rsp = (struct sd_rsp *)&ci->conn.tx_hdr;
+	bool sent = ci->tx_iov_idx == ci->nr_tx_iov;
+	int i;
 
-	/* If short send happens, we don't need init hdr */
-	if (!ci->tx_req)
-		init_tx_hdr(ci);
+	for (i = 0; i < ci->nr_tx_reqs; i++) {
+		if (sent) {
+			req_stamp(ci->tx_reqs[i], REQ_STAMP_TX);
+			account_request_latency(ci->tx_reqs[i]);
+		}
+		free_request(ci->tx_reqs[i]);
+	}
+	ci->nr_tx_reqs = 0;
+	ci->tx_iov_idx = ci->nr_tx_iov = 0;
+}
 
-	opt = 1;
-	setsockopt(ci->conn.fd, SOL_TCP, TCP_CORK, &opt, sizeof(opt));
+/* Skip the 'len' bytes sent from the head of the batch */
+static void advance_tx_iov(struct client_info *ci, size_t len)
+{
+	struct iovec *iov;
 
-	switch (ci->conn.c_tx_state) {
-	case C_IO_HEADER:
-		ret = tx(&ci->conn, C_IO_DATA_INIT);
-		if (!ret)
+	while (len) {
+		iov = ci->tx_iov + ci->tx_iov_idx;
+		if (len < iov->iov_len) {
+			iov->iov_base = (char *)iov->iov_base + len;
+			iov->iov_len -= len;
 			break;
+		}
+		len -= iov->iov_len;
+		ci->tx_iov_idx++;
+	}
+}
 
-		if (rsp->data_length) {
-			ci->conn.tx_length = rsp->data_length;
-			ci->conn.tx_buf = ci->tx_req->data;
-			ci->conn.c_tx_state = C_IO_DATA;
-		} else {
-			ci->conn.c_tx_state = C_IO_END;
-			break;
+/*
+ * Send all the done responses.  They are gathered into one writev per batch,
+ * so we don't need TCP_CORK to merge the headers and the data.
+ */
+static inline int begin_tx(struct client_info *ci)
+{
+	ssize_t ret;
+
+	for (;;) {
+		if (ci->tx_iov_idx == ci->nr_tx_iov) {
+			free_tx_batch(ci);
+			if (list_empty(&ci->done_reqs))
+				break;
+			init_tx_batch(ci);
 		}
-	case C_IO_DATA:
-		ret = tx(&ci->conn, C_IO_END);
-		if (!ret)
+
+		ret = writev(ci->conn.fd, ci->tx_iov + ci->tx_iov_idx,
+			     ci->nr_tx_iov - ci->tx_iov_idx);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN)
+				ci->conn.c_tx_state = C_IO_CLOSED;
 			break;
-	default:
-		break;
+		}
+		advance_tx_iov(ci, ret);
 	}
 
-	opt = 0;
-	setsockopt(ci->conn.fd, SOL_TCP, TCP_CORK, &opt, sizeof(opt));
-
 	if (is_conn_dead(&ci->conn)) {
 		clear_client_info(ci);
 		return -1;
@@ -693,21 +914,14 @@ static inline int begin_tx(struct client_info *ci)
 /* Return 1 if short send happens or we have more data to send */
 static inline int finish_tx(struct client_info *ci)
 {
-	/* Finish sending one response */
-	if (ci->conn.c_tx_state == C_IO_END) {
-		sd_dprintf("connection from: %d, %s:%d", ci->conn.fd,
-			   ci->conn.ipstr, ci->conn.port);
-		free_request(ci->tx_req);
-		ci->tx_req = NULL;
-	}
-	if (ci->tx_req || !list_empty(&ci->done_reqs))
+	if (ci->nr_tx_reqs || !list_empty(&ci->done_reqs))
 		return 1;
 	return 0;
 }
 
 static void do_client_tx(struct client_info *ci)
 {
-	if (!ci->tx_req && list_empty(&ci->done_reqs)) {
+	if (!ci->nr_tx_reqs && list_empty(&ci->done_reqs)) {
 		if (conn_tx_off(&ci->conn))
 			clear_client_info(ci);
 		return;
@@ -724,6 +938,107 @@ static void do_client_tx(struct client_info *ci)
 		clear_client_info(ci);
 }
 
+/*
+ * With the io_uring event loop, requests are received and responses are sent
+ * with asynchronous operations instead of readiness events.  A dead
+ * connection is shut down to fail the operations in flight, and torn down
+ * when the last of them completes.
+ */
+static void client_async_close(struct client_info *ci)
+{
+	if (ci->rx_busy || ci->tx_busy) {
+		shutdown(ci->conn.fd, SHUT_RDWR);
+		return;
+	}
+
+	clear_client_info(ci);
+}
+
+static void client_rx_done(int res, void *data);
+
+static void client_async_rx(struct client_info *ci)
+{
+	struct connection *conn = &ci->conn;
+
+	if (event_recv(conn->fd, conn->rx_buf, conn->rx_length,
+		       client_rx_done, ci) < 0) {
+		conn->c_rx_state = C_IO_CLOSED;
+		client_async_close(ci);
+		return;
+	}
+	ci->rx_busy = true;
+}
+
+static void client_rx_done(int res, void *data)
+{
+	struct client_info *ci = data;
+	struct connection *conn = &ci->conn;
+
+	ci->rx_busy = false;
+	if (res <= 0 || is_conn_dead(conn)) {
+		conn->c_rx_state = C_IO_CLOSED;
+		client_async_close(ci);
+		return;
+	}
+
+	conn->rx_buf = (char *)conn->rx_buf + res;
+	conn->rx_length -= res;
+	if (!conn->rx_length && conn->c_rx_state == C_IO_HEADER &&
+	    !init_rx_data(ci) && is_conn_dead(conn)) {
+		client_async_close(ci);
+		return;
+	}
+
+	/* Short read, or the data of the request follows */
+	if (conn->rx_length) {
+		client_async_rx(ci);
+		return;
+	}
+
+	finish_rx(ci);
+	client_async_rx(ci);
+}
+
+static void client_tx_done(int res, void *data);
+
+/* Send the next batch of the done responses unless a send is in flight */
+static void client_async_tx(struct client_info *ci)
+{
+	if (ci->tx_busy)
+		return;
+
+	if (ci->tx_iov_idx == ci->nr_tx_iov) {
+		free_tx_batch(ci);
+		if (list_empty(&ci->done_reqs))
+			return;
+		init_tx_batch(ci);
+	}
+
+	if (event_sendmsg(ci->conn.fd, ci->tx_iov + ci->tx_iov_idx,
+			  ci->nr_tx_iov - ci->tx_iov_idx, client_tx_done,
+			  ci) < 0) {
+		ci->conn.c_tx_state = C_IO_CLOSED;
+		client_async_close(ci);
+		return;
+	}
+	ci->tx_busy = true;
+}
+
+static void client_tx_done(int res, void *data)
+{
+	struct client_info *ci = data;
+
+	ci->tx_busy = false;
+	if (res < 0 || is_conn_dead(&ci->conn)) {
+		ci->conn.c_tx_state = C_IO_CLOSED;
+		client_async_close(ci);
+		return;
+	}
+
+	advance_tx_iov(ci, res);
+	client_async_tx(ci);
+}
+
 static void destroy_client(struct client_info *ci)
 {
 	sd_dprintf("connection from: %s:%d", ci->conn.ipstr, ci->conn.port);
@@ -742,10 +1057,7 @@ static void clear_client_info(struct client_info *ci)
 		ci->rx_req = NULL;
 	}
 
-	if (ci->tx_req) {
-		free_request(ci->tx_req);
-		ci->tx_req = NULL;
-	}
+	free_tx_batch(ci);
 
 	list_for_each_entry_safe(req, t, &ci->done_reqs, request_list) {
 		list_del(&req->request_list);
@@ -817,6 +1129,150 @@ static void client_handler(int fd, int events, void *data)
 		do_client_tx(ci);
 }
 
+/* Start serving a connection in the event loop of this thread */
+static int start_client(struct client_info *ci)
+{
+	if (event_async_io()) {
+		client_async_rx(ci);
+		return 0;
+	}
+
+	return register_event(ci->conn.fd, client_handler, ci);
+}
+
+/*
+ * Network threads
+ *
+ * With them, the connections are dealt out round robin, and every thread
+ * receives the requests and sends the responses of its connections in its own
+ * event loop.  The main thread still processes the requests; received ones
+ * are handed over with queue_main_request(), and done ones come back through
+ * the queue of the thread.
+ */
+struct net_thread {
+	pthread_t thread;
+	bool uring;
+	int efd;
+
+	pthread_mutex_t lock;
+	struct list_head new_clients;
+	struct list_head done_reqs;
+};
+
+static struct net_thread *net_threads;
+static int nr_net_threads;
+
+static void net_thread_queue(struct net_thread *nt, struct list_head *entry,
+			     struct list_head *queue)
+{
+	eventfd_t value = 1;
+	bool empty;
+
+	pthread_mutex_lock(&nt->lock);
+	empty = list_empty(&nt->new_clients) && list_empty(&nt->done_reqs);
+	list_add_tail(entry, queue);
+	pthread_mutex_unlock(&nt->lock);
+
+	if (empty)
+		eventfd_write(nt->efd, value);
+}
+
+static void net_thread_add_client(struct client_info *ci)
+{
+	static int next;
+
+	ci->net = net_threads + next++ % nr_net_threads;
+	net_thread_queue(ci->net, &ci->net_list, &ci->net->new_clients);
+}
+
+static void net_thread_put_request(struct net_thread *nt,
+				   struct request *req)
+{
+	net_thread_queue(nt, &req->request_list, &nt->done_reqs);
+}
+
+static void net_thread_handler(int fd, int events, void *data)
+{
+	struct net_thread *nt = data;
+	struct client_info *ci, *tci;
+	struct request *req, *t;
+	LIST_HEAD(new_clients);
+	LIST_HEAD(done_reqs);
+	eventfd_t value;
+
+	if (eventfd_read(fd, &value) < 0)
+		return;
+
+	pthread_mutex_lock(&nt->lock);
+	list_splice_init(&nt->new_clients, &new_clients);
+	list_splice_init(&nt->done_reqs, &done_reqs);
+	pthread_mutex_unlock(&nt->lock);
+
+	list_for_each_entry_safe(ci, tci, &new_clients, net_list) {
+		list_del(&ci->net_list);
+		if (start_client(ci) < 0)
+			destroy_client(ci);
+	}
+
+	list_for_each_entry_safe(req, t, &done_reqs, request_list) {
+		list_del(&req->request_list);
+		client_put_request(req);
+	}
+}
+
+static void *net_thread_main(void *arg)
+{
+	struct net_thread *nt = arg;
+	const struct cpu_placement *p = find_thread_placement("net");
+	int ret;
+
+	if (p)
+		place_thread(pthread_self(), p, nt - net_threads);
+
+	if (nt->uring)
+		ret = init_event_uring(EPOLL_SIZE);
+	else
+		ret = init_event(EPOLL_SIZE);
+	if (ret || register_event(nt->efd, net_thread_handler, nt) < 0)
+		panic("failed to set up a network thread");
+
+	for (;;)
+		event_loop(-1);
+
+	return NULL;
+}
+
+/* Start 'nr' network threads with the same event loop as the main thread */
+int init_net_threads(int nr)
+{
+	struct net_thread *nt;
+	int i, ret;
+
+	net_threads = xcalloc(nr, sizeof(*net_threads));
+	for (i = 0; i < nr; i++) {
+		nt = net_threads + i;
+		nt->uring = event_async_io();
+		nt->efd = eventfd(0, EFD_NONBLOCK);
+		if (nt->efd < 0) {
+			sd_eprintf("failed to create an eventfd, %m");
+			return -1;
+		}
+		pthread_mutex_init(&nt->lock, NULL);
+		INIT_LIST_HEAD(&nt->new_clients);
+		INIT_LIST_HEAD(&nt->done_reqs);
+
+		ret = pthread_create(&nt->thread, NULL, net_thread_main, nt);
+		if (ret) {
+			sd_eprintf("failed to create a network thread, %s",
+				   strerror(ret));
+			return -1;
+		}
+		nr_net_threads++;
+	}
+
+	return 0;
+}
+
 static void listen_handler(int listen_fd, int events, void *data)
 {
 	struct sockaddr_storage from;
@@ -846,7 +1302,8 @@ static void listen_handler(int listen_fd, int events, void *data)
 		}
 	}
 
-	ret = set_nonblocking(fd);
+	/* The asynchronous operations wait in the ring, not in the socket */
+	ret = event_async_io() ? 0 : set_nonblocking(fd);
 	if (ret) {
 		close(fd);
 		return;
@@ -858,8 +1315,9 @@ static void listen_handler(int listen_fd, int events, void *data)
 		return;
 	}
 
-	ret = register_event(fd, client_handler, ci);
-	if (ret) {
+	if (nr_net_threads)
+		net_thread_add_client(ci);
+	else if (start_client(ci) < 0) {
 		destroy_client(ci);
 		return;
 	}
@@ -912,7 +1370,10 @@ static void local_req_handler(int listen_fd, int events, void *data)
 
 	list_for_each_entry_safe(req, t, &pending_list, request_list) {
 		list_del(&req->request_list);
-		queue_request(req);
+		if (!req->nr_async_ends)
+			queue_request(req);
+		else if (store_io_end(req))
+			req->work.done(&req->work);
 	}
 }
 
@@ -33,7 +33,6 @@
 #include "util.h"
 #include "option.h"
 
-#define EPOLL_SIZE 4096
 #define DEFAULT_OBJECT_DIR "/tmp"
 #define LOG_FILE_NAME "sheep.log"
 
@@ -41,26 +40,34 @@ LIST_HEAD(cluster_drivers);
 static const char program_name[] = "sheep";
 
 static struct sd_option sheep_options[] = {
+	{'A', "affinity", true, "place the threads of a work queue on CPUs"},
 	{'b', "bindaddr", true, "specify IP address of interface to listen on"},
 	{'c', "cluster", true, "specify the cluster driver"},
+	{'C', "chain", false, "forward writes to replicas in a chain"},
 	{'d', "debug", false, "include debug messages in the log"},
 	{'D', "directio", false, "use direct IO for backend store"},
+	{'e', "event", true, "specify the event loop (epoll or uring)"},
 	{'f', "foreground", false, "make the program run in the foreground"},
 	{'F', "log-format", true, "specify log format"},
 	{'g', "gateway", false, "make the progam run as a gateway mode"},
 	{'h', "help", false, "display this help and exit"},
+	{'H', "hedge-read", true, "hedge reads slower than the percentile (1-99)"},
 	{'i', "ioaddr", true, "use separate network card to handle IO requests"},
 	{'j', "journal", true, "use jouranl file to log all the write operations"},
 	{'l', "loglevel", true, "specify the level of logging detail"},
 	{'n', "nosync", false, "drop O_SYNC for write of backend"},
+	{'N', "net-threads", true, "specify the number of network I/O threads"},
 	{'o', "stdout", false, "log to stdout instead of shared logger"},
 	{'p', "port", true, "specify the TCP port on which to listen"},
 	{'P', "pidfile", true, "create a pid file"},
+	{'S', "iosched", true, "specify the I/O scheduler class weights and "
+	 "client latency target"},
 	{'u', "upgrade", false, "upgrade to the latest data layout"},
 	{'v', "version", false, "show the version"},
 	{'w', "enable-cache", true, "enable object cache"},
 	{'y', "myaddr", true, "specify the address advertised to other sheep"},
 	{'z', "zone", true, "specify the zone id"},
+	{'Z', "zerocopy", false, "send forwarded write data with MSG_ZEROCOPY"},
 	{ 0, NULL, false, NULL },
 };
 
@@ -330,6 +337,60 @@ static void init_io_arg(char *arg)
 	}
 }
 
+/*
+ * '-A <threads>=<policy>' places the workers of the work queue <threads>, or
+ * the network threads with 'net'.  It can be given for more than one queue.
+ */
+static void init_affinity_arg(char *arg)
+{
+	struct cpu_placement p;
+	char *policy = strchr(arg, '=');
+
+	if (policy) {
+		*policy++ = '\0';
+		if (parse_cpu_placement(policy, &p) == 0 &&
+		    set_thread_placement(arg, &p) == 0)
+			return;
+	}
+
+	fprintf(stderr, "invalid affinity %s%s%s. Use '-A io=nic:eth0', "
+		"'-A gway=pin:0-7,16-23' or '-A io=spread'\n", arg,
+		policy ? "=" : "", policy ? policy : "");
+	exit(1);
+}
+
+static void init_iosched_arg(char *arg)
+{
+	const char *target = "target=";
+	int tl = strlen(target), weight;
+	char *p, *value;
+
+	if (!strncmp(target, arg, tl)) {
+		arg += tl;
+		weight = strtol(arg, &p, 10);
+		if (arg == p || *p != '\0' || weight < 1) {
+			fprintf(stderr, "invalid latency target %s, "
+				"must be a positive number of ms\n", arg);
+			exit(1);
+		}
+		iosched_set_target(weight);
+		return;
+	}
+
+	value = strchr(arg, '=');
+	if (value) {
+		*value++ = '\0';
+		weight = strtol(value, &p, 10);
+		if (value != p && *p == '\0' &&
+		    iosched_set_weight(arg, weight) == 0)
+			return;
+	}
+
+	fprintf(stderr, "invalid paramters %s. Use '-S client=8,recovery=2,"
+		"push=4,deletion=1,target=20'\n", arg);
+	exit(1);
+}
+
 static size_t get_nr_nodes(void)
 {
 	struct vnode_info *vinfo;
@@ -497,6 +558,8 @@ int main(int argc, char **argv)
 	char *dir, *p, *pid_file = NULL, *bindaddr = NULL, path[PATH_MAX],
 	     *argp = NULL;
 	bool is_daemon = true, to_stdout = false, explicit_addr = false;
+	bool use_uring = false;
+	int nr_net_threads = 0;
 	int64_t zone = -1;
 	struct cluster_driver *cdrv;
 	struct option *long_options;
@@ -523,6 +586,12 @@ int main(int argc, char **argv)
 		case 'P':
 			pid_file = optarg;
 			break;
+		case 'S':
+			parse_arg(optarg, ",", init_iosched_arg);
+			break;
+		case 'A':
+			init_affinity_arg(optarg);
+			break;
 		case 'f':
 			is_daemon = false;
 			break;
@@ -539,6 +608,17 @@ int main(int argc, char **argv)
 		case 'n':
 			sys->nosync = true;
 			break;
+		case 'N':
+			nr_net_threads = strtol(optarg, &p, 10);
+			if (optarg == p || nr_net_threads < 0 ||
+			    MAX_NET_THREADS < nr_net_threads || *p != '\0') {
+				fprintf(stderr, "Invalid number of network "
+					"threads '%s': must be an integer "
+					"between 0 and %d\n", optarg,
+					MAX_NET_THREADS);
+				exit(1);
+			}
+			break;
 		case 'y':
 			if (!str_to_addr(optarg, sys->this_node.nid.addr)) {
 				fprintf(stderr, "Invalid address: '%s'\n",
@@ -554,6 +634,21 @@ int main(int argc, char **argv)
 		case 'D':
 			sys->backend_dio = true;
 			break;
+		case 'C':
+			sys->chain_replication = true;
+			break;
+		case 'e':
+			if (!strcmp(optarg, "uring"))
+				use_uring = true;
+			else if (strcmp(optarg, "epoll")) {
+				fprintf(stderr, "Invalid event loop '%s'\n",
+					optarg);
+				exit(1);
+			}
+			break;
+		case 'Z':
+			sys->zerocopy = true;
+			break;
 		case 'g':
 			/* same as '-v 0' */
 			nr_vnodes = 0;
@@ -575,6 +670,16 @@ int main(int argc, char **argv)
 		case 'u':
 			sys->upgrade = true;
 			break;
+		case 'H':
+			sys->hedge_read_pct = strtol(optarg, &p, 10);
+			if (optarg == p || sys->hedge_read_pct < 1 ||
+			    99 < sys->hedge_read_pct || *p != '\0') {
+				fprintf(stderr, "Invalid percentile '%s': "
+					"must be an integer between 1 and 99\n",
+					optarg);
+				exit(1);
+			}
+			break;
 		case 'c':
 			sys->cdrv = find_cdrv(optarg);
 			if (!sys->cdrv) {
@@ -678,7 +783,10 @@ int main(int argc, char **argv)
 	if (ret)
 		exit(1);
 
-	ret = init_event(EPOLL_SIZE);
+	if (use_uring)
+		ret = init_event_uring(EPOLL_SIZE);
+	else
+		ret = init_event(EPOLL_SIZE);
 	if (ret)
 		exit(1);
 
@@ -741,6 +849,18 @@ int main(int argc, char **argv)
 	if (ret)
 		exit(1);
 
+	ret = init_net_threads(nr_net_threads);
+	if (ret)
+		exit(1);
+
+	ret = qos_init();
+	if (ret)
+		exit(1);
+
+	ret = iosched_init();
+	if (ret)
+		exit(1);
+
 	ret = init_store_driver(sys->gateway_only);
 	if (ret)
 		exit(1);
@@ -781,6 +901,7 @@ int main(int argc, char **argv)
 	sd_printf(SDOG_INFO, "shutdown");
 
 	leave_cluster();
+	obj_index_seal();
 
 	if (uatomic_is_true(&sys->use_journal)) {
 		sd_iprintf("cleaning journal file");
@@ -15,6 +15,7 @@
 #include <stdbool.h>
 #include <urcu/uatomic.h>
 #include <time.h>
+#include <sys/uio.h>
 
 #include "sheepdog_proto.h"
 #include "event.h"
@@ -25,19 +26,50 @@
 #include "cluster.h"
 #include "rbtree.h"
 #include "strbuf.h"
+#include "buffer.h"
+#include "numa.h"
+
+/* The max number of responses sent with one writev */
+#define CLIENT_TX_BATCH 64
+
+#define EPOLL_SIZE 4096
+#define MAX_NET_THREADS 256
+
+struct net_thread;
 
 struct client_info {
 	struct connection conn;
 
+	/* The network thread which serves this connection, if any */
+	struct net_thread *net;
+	struct list_head net_list;
+
 	struct request *rx_req;
 
-	struct request *tx_req;
+	/* The responses being sent, a header and the data for each */
+	struct request *tx_reqs[CLIENT_TX_BATCH];
+	int nr_tx_reqs;
+	struct iovec tx_iov[CLIENT_TX_BATCH * 2];
+	int tx_iov_idx, nr_tx_iov;
 
 	struct list_head done_reqs;
 
+	/* The asynchronous receive and send in flight, see event_async_io() */
+	bool rx_busy, tx_busy;
+
 	int refcnt;
 };
 
+/* Timestamps of the stages of a request, see account_request_latency() */
+enum req_stamp {
+	REQ_STAMP_RX,		/* received from the client */
+	REQ_STAMP_QUEUE,	/* queued by queue_request() */
+	REQ_STAMP_WORK,		/* started by a worker */
+	REQ_STAMP_DONE,		/* the last reference is put */
+	REQ_STAMP_TX,		/* the response is sent */
+	REQ_NR_STAMPS,
+};
+
 struct request {
 	struct sd_req rq;
 	struct sd_rsp rp;
@@ -59,7 +91,19 @@ struct request {
 
 	struct vnode_info *vinfo;
 
+	/* replica acks we are waiting for in the main thread */
+	struct forward_info *fwd;
+
 	struct work work;
+
+	/* the I/O limits of the VDI were applied, see qos_throttle_request() */
+	bool qos_charged;
+
+	/* the store and the worker yet to finish, see store_io_done() */
+	int nr_async_ends;
+	int async_result;
+
+	uint64_t stamp[REQ_NR_STAMPS];	/* in microseconds */
 };
 
 struct cluster_info {
@@ -89,6 +133,9 @@ struct cluster_info {
 	bool gateway_only;
 	bool disable_recovery;
 	bool nosync;
+	bool chain_replication;
+	bool zerocopy;
+	int hedge_read_pct; /* 0 means no hedged reads */
 
 	struct work_queue *gateway_wqueue;
 	struct work_queue *io_wqueue;
@@ -112,11 +159,25 @@ struct cluster_info {
 	bool upgrade;
 };
 
+/* Copy-on-write blocks of a data object */
+#define SD_COW_BLOCK_SHIFT 12
+#define SD_COW_NR_BLOCKS (SD_DATA_OBJ_SIZE >> SD_COW_BLOCK_SHIFT)
+
+/*
+ * The object was created from 'cow_oid' and only has the blocks set in 'bmap'
+ * so far.  A zero 'cow_oid' means that the object is complete.
+ */
+struct cow_map {
+	uint64_t cow_oid;
+	DECLARE_BITMAP(bmap, SD_COW_NR_BLOCKS);
+};
+
 struct siocb {
 	uint32_t epoch;
 	void *buf;
 	uint32_t length;
 	uint64_t offset;
+	const struct cow_map *cow;	/* for create_and_write */
 };
 
 struct vdi_iocb {
@@ -128,6 +189,7 @@ struct vdi_iocb {
 	uint32_t snapid;
 	bool create_snapshot;
 	int nr_copies;
+	uint16_t copy_policy;
 };
 
 struct vdi_info {
@@ -140,7 +202,7 @@ struct vdi_state {
 	uint32_t vid;
 	uint8_t nr_copies;
 	uint8_t snapshot;
-	uint16_t _pad;
+	uint16_t copy_policy;
 };
 
 struct store_driver {
@@ -152,9 +214,19 @@ struct store_driver {
 	int (*create_and_write)(uint64_t oid, const struct siocb *);
 	int (*write)(uint64_t oid, const struct siocb *);
 	int (*read)(uint64_t oid, const struct siocb *);
+	/*
+	 * Optional, start a read or a write and return without waiting for it.
+	 * 'done' is called with the result from another thread when the I/O
+	 * ends, maybe before this returns.  Nothing is started on error.
+	 */
+	int (*submit)(uint64_t oid, const struct siocb *, bool write,
+		      void (*done)(void *data, int result), void *data);
 	int (*format)(void);
 	int (*remove_object)(uint64_t oid);
 	int (*get_hash)(uint64_t oid, uint32_t epoch, uint8_t *sha1);
+	/* Optional, block granular copy-on-write */
+	int (*get_cow_map)(uint64_t oid, uint32_t epoch, struct cow_map *map);
+	int (*set_cow_map)(uint64_t oid, const struct cow_map *map);
 	/* Operations in recovery */
 	int (*link)(uint64_t oid, uint32_t tgt_epoch);
 	int (*update_epoch)(uint32_t epoch);
@@ -174,12 +246,21 @@ int default_cleanup(void);
 int default_format(void);
 int default_remove_object(uint64_t oid);
 int default_get_hash(uint64_t oid, uint32_t epoch, uint8_t *sha1);
+int default_get_cow_map(uint64_t oid, uint32_t epoch, struct cow_map *map);
+int default_set_cow_map(uint64_t oid, const struct cow_map *map);
 int default_purge_obj(void);
+int default_open_obj(uint64_t oid, int flags);
+int default_obj_err(uint64_t oid, int err);
+bool default_oid_stale(uint64_t oid);
 int for_each_object_in_wd(int (*func)(uint64_t, char *, uint32_t, void *), bool,
 			  void *);
 int for_each_object_in_stale(int (*func)(uint64_t oid, char *path,
 					 uint32_t epoch, void *arg),
 			     void *arg);
+int for_each_object_parallel(int (*func)(uint64_t oid, char *path,
+					 uint32_t epoch, void *arg),
+			     bool cleanup, const unsigned long *dirs,
+			     void *arg);
 int for_each_obj_path(int (*func)(char *path));
 
 extern struct list_head store_drivers;
@@ -228,10 +309,15 @@ int lock_base_dir(const char *d);
 int fill_vdi_state_list(void *data);
 bool oid_is_readonly(uint64_t oid);
 int get_vdi_copy_number(uint32_t vid);
+uint16_t get_vdi_copy_policy(uint32_t vid);
+bool is_ec_obj(uint64_t oid);
+int get_ec_nr_strips(uint64_t oid);
 int get_obj_copy_number(uint64_t oid, int nr_zones);
 int get_max_copy_number(void);
 int get_req_copy_number(struct request *req);
-int add_vdi_state(uint32_t vid, int nr_copies, bool snapshot);
+int get_req_obj_copy_number(struct request *req, uint64_t oid);
+int add_vdi_state(uint32_t vid, int nr_copies, bool snapshot,
+		  uint16_t copy_policy);
 int vdi_exist(uint32_t vid);
 int vdi_create(struct vdi_iocb *iocb, uint32_t *new_vid);
 int vdi_delete(struct vdi_iocb *iocb, struct request *req);
@@ -313,13 +399,49 @@ int remove_object(uint64_t oid);
 
 int exec_local_req(struct sd_req *rq, void *data);
 void local_req_init(void);
+int init_net_threads(int nr);
 
 int prealloc(int fd, uint32_t size);
 
 int objlist_cache_insert(uint64_t oid);
 void objlist_cache_remove(uint64_t oid);
+void objlist_cache_for_each(void (*fn)(uint64_t oid, void *arg), void *arg);
 
 void put_request(struct request *req);
+void resume_throttled_request(struct request *req);
+void store_io_done(struct request *req, int result);
+
+/* Only the first time of a stage is kept, so requeueing counts as waiting */
+static inline void req_stamp(struct request *req, enum req_stamp stage)
+{
+	if (!req->stamp[stage])
+		req->stamp[stage] = clock_get_usec();
+}
+
+/* Request latency */
+void account_request_latency(struct request *req);
+int get_latency_stat(struct sd_latency_stat *stat, int nr);
+
+/* I/O scheduler */
+enum io_class {
+	IO_CLASS_CLIENT,
+	IO_CLASS_RECOVERY,
+	IO_CLASS_PUSH,		/* object cache pushes */
+	IO_CLASS_DELETION,
+	IO_NR_CLASSES,
+};
+
+int iosched_init(void);
+int iosched_set_weight(const char *name, int weight);
+void iosched_set_target(uint64_t msec);
+void iosched_acquire(enum io_class class);
+void iosched_client_done(uint64_t usec);
+
+/* Per-VDI I/O limits */
+int qos_init(void);
+bool qos_throttle_request(struct request *req);
+void qos_set_vdi(uint32_t vid, const struct sd_vdi_qos *qos);
+void qos_del_vdi(uint32_t vid);
 
 /* Operations */
 
@@ -338,11 +460,6 @@ int do_process_main(const struct sd_op_template *op, const struct sd_req *req,
 int sheep_do_op_work(const struct sd_op_template *op, struct request *req);
 int gateway_to_peer_opcode(int opcode);
 
-static inline bool vnode_is_local(const struct sd_vnode *v)
-{
-	return node_id_cmp(&v->nid, &sys->this_node.nid) == 0;
-}
-
 static inline bool node_is_local(const struct sd_node *n)
 {
 	return node_eq(n, &sys->this_node);
@@ -350,15 +467,43 @@ static inline bool node_is_local(const struct sd_node *n)
 
 /* gateway operations */
 int gateway_read_obj(struct request *req);
+int gateway_read_obj_sync(struct request *req);
 int gateway_write_obj(struct request *req);
 int gateway_create_and_write_obj(struct request *req);
 int gateway_remove_obj(struct request *req);
+int gateway_read_objs(struct request *req);
+int gateway_write_objs(struct request *req);
+void gateway_wait_forward_request(struct request *req);
+
+/* erasure coding */
+int gateway_ec_read_obj(struct request *req);
+int gateway_ec_write_obj(struct request *req);
+int gateway_ec_remove_obj(struct request *req);
+int peer_ec_write_obj(struct request *req);
+int ec_rebuild_strip(uint64_t oid, struct vnode_info *vinfo, uint32_t epoch,
+		     uint32_t tgt_epoch);
 
 /* backend store */
 int peer_read_obj(struct request *req);
 int peer_write_obj(struct request *req);
 int peer_create_and_write_obj(struct request *req);
 int peer_remove_obj(struct request *req);
+int peer_chain_write_obj(struct request *req);
+int peer_read_objs(struct request *req);
+int peer_write_objs(struct request *req);
+uint64_t objs_data_length(const struct sd_obj_seg *segs, int nr_segs);
+int store_rw_segs(const struct sd_obj_seg *segs, int nr_segs, char *buf,
+		  uint32_t epoch, bool write, struct vnode_info *vinfo);
+
+/* copy-on-write */
+int cow_read_obj(uint64_t oid, const struct siocb *iocb,
+		 struct vnode_info *vinfo);
+int cow_write_obj(uint64_t oid, const struct siocb *iocb,
+		  struct vnode_info *vinfo);
+int cow_create_and_write_obj(uint64_t oid, uint64_t cow_oid,
+			     const struct siocb *iocb, struct vnode_info *vinfo);
+int cow_submit_obj(uint64_t oid, const struct siocb *iocb, bool write,
+		   void (*done)(void *data, int result), void *data);
 
 /* object_cache */
 
@@ -372,7 +517,7 @@ int object_cache_write(uint64_t oid, char *data, unsigned int datalen,
 		       uint64_t offset, bool create);
 int object_cache_read(uint64_t oid, char *data, unsigned int datalen,
 		      uint64_t offset);
-int object_cache_flush_vdi(uint32_t vid);
+int object_cache_flush_vdi(uint32_t vid, bool client);
 int object_cache_flush_and_del(const struct request *req);
 void object_cache_delete(uint32_t vid);
 int object_cache_init(const char *p);
@@ -393,6 +538,11 @@ void sockfd_cache_add_group(const struct sd_node *nodes, int nr);
 struct sockfd *sheep_get_sockfd(const struct node_id *);
 void sheep_put_sockfd(const struct node_id *, struct sockfd *);
 void sheep_del_sockfd(const struct node_id *, struct sockfd *);
+void sheep_close_sockfd(const struct node_id *, struct sockfd *);
+void sheep_node_read_start(const struct node_id *nid);
+void sheep_node_read_done(const struct node_id *nid, uint64_t usec);
+uint64_t sheep_node_read_cost(const struct node_id *nid);
+uint64_t sheep_read_latency_percentile(int pct);
 int sheep_exec_req(const struct node_id *nid, struct sd_req *hdr, void *data);
 bool sheep_need_retry(uint32_t epoch);
 
@@ -403,8 +553,44 @@ int
 journal_write_store(uint64_t oid, const char *buf, size_t size, off_t, bool);
 int journal_remove_object(uint64_t oid);
 
+/* fd_cache.c */
+struct fd_cache_entry;
+struct fd_cache_entry *fd_cache_get(uint64_t oid, int flags,
+				    int (*open_fn)(uint64_t oid, int flags));
+void fd_cache_put(struct fd_cache_entry *e);
+int fd_cache_fd(const struct fd_cache_entry *e);
+void fd_cache_invalidate(uint64_t oid);
+void fd_cache_purge(void);
+
+/* obj_index.c */
+void init_obj_index_path(const char *base_path);
+int obj_index_load(int (*scan)(uint64_t oid, char *path, uint32_t epoch,
+				void *arg));
+void obj_index_rebuild(void);
+void obj_index_seal(void);
+void obj_index_reset(void);
+void obj_index_add(uint64_t oid);
+void obj_index_del(uint64_t oid);
+void obj_index_set_vdi(uint32_t vid, int nr_copies, bool snapshot,
+		       uint16_t copy_policy);
+void obj_index_clear_vdi(void);
+
 /* md.c */
+
+/*
+ * The objects of a working or a stale directory are spread over this many
+ * subdirectories, named by the index in two hex digits.
+ */
+#define OBJ_DIR_BITS 8
+#define NR_OBJ_DIRS (1 << OBJ_DIR_BITS)
+
+static inline int obj_dir(uint64_t oid)
+{
+	return hash_64(oid, OBJ_DIR_BITS);
+}
+
 bool md_add_disk(char *path);
+int md_make_obj_dirs(const char *path);
 uint64_t md_init_space(void);
 char *md_get_object_path(uint64_t oid);
 int md_handle_eio(char *);
@@ -415,6 +601,7 @@ int md_plug_disks(char *disks);
 int md_unplug_disks(char *disks);
 uint64_t md_get_size(uint64_t *used);
 void kick_node_recover(void);
+void refresh_vnode_info(void);
 void update_node_size(struct sd_node *node);
 
 #endif
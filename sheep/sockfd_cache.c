@@ -25,6 +25,9 @@
  *    5 the total number of FDs is scalable to massive nodes.
  *    6 total 3 APIs: sheep_{get,put,del}_sockfd().
  *    7 support dual connections to a single node.
+ *
+ * Along with the FDs, we keep the read latency and the number of in-flight
+ * reads of each node, which the gateway uses to pick the replica to read from.
  */
 #include <urcu/uatomic.h>
 #include <pthread.h>
@@ -73,6 +76,8 @@ struct sockfd_cache_entry {
 	struct rb_node rb;
 	struct node_id nid;
 	struct sockfd_cache_fd *fds;
+	uint64_t read_lat; /* EWMA of the read latency in usec */
+	int nr_reads; /* in-flight reads */
 };
 
 static struct sockfd_cache_entry *
@@ -233,7 +238,7 @@ void sockfd_cache_del(const struct node_id *nid)
 
 static void sockfd_cache_add_nolock(const struct node_id *nid)
 {
-	struct sockfd_cache_entry *new = xmalloc(sizeof(*new));
+	struct sockfd_cache_entry *new = xzalloc(sizeof(*new));
 	int i;
 
 	new->fds = xzalloc(sizeof(struct sockfd_cache_fd) * fds_count);
@@ -270,7 +275,7 @@ void sockfd_cache_add(const struct node_id *nid)
 	int n, i;
 
 	pthread_rwlock_wrlock(&sockfd_cache.lock);
-	new = xmalloc(sizeof(*new));
+	new = xzalloc(sizeof(*new));
 	new->fds = xzalloc(sizeof(struct sockfd_cache_fd) * fds_count);
 	for (i = 0; i < fds_count; i++)
 		new->fds[i].fd = -1;
@@ -402,6 +407,8 @@ grab:
 		return NULL;
 	}
 new:
+	if (sys->zerocopy && set_zerocopy(fd) < 0)
+		sd_dprintf("failed to set SO_ZEROCOPY, %m");
 	entry->fds[idx].fd = fd;
 out:
 	sfd = xmalloc(sizeof(*sfd));
@@ -550,6 +557,150 @@ int sheep_exec_req(const struct node_id *nid, struct sd_req *hdr, void *buf)
 	return ret;
 }
 
+/*
+ * Close a sockfd whose connection is out of sync, e.g. the response of an
+ * abandoned request is still on the way.  Unlike sheep_del_sockfd(), the node
+ * is kept in the cache.
+ */
+void sheep_close_sockfd(const struct node_id *nid, struct sockfd *sfd)
+{
+	if (sfd->idx == -1) {
+		sd_dprintf("%d", sfd->fd);
+		close(sfd->fd);
+		free(sfd);
+		return;
+	}
+
+	sockfd_cache_close(nid, sfd->idx);
+	free(sfd);
+}
+
+/*
+ * Read latency histogram of all the nodes, used to calculate the hedged read
+ * timeout.  Bucket n counts the latencies in [2^n, 2^(n+1)) usec.  The counts
+ * are halved when the total exceeds READ_LAT_MAX_SAMPLES, so that old samples
+ * fade away.
+ */
+#define READ_LAT_BUCKETS 32
+#define READ_LAT_MIN_SAMPLES 128
+#define READ_LAT_MAX_SAMPLES (1 << 16)
+
+static struct {
+	pthread_mutex_t lock;
+	uint32_t count[READ_LAT_BUCKETS];
+	uint32_t total;
+} read_lat_hist = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static void read_lat_hist_add(uint64_t usec)
+{
+	int i, b = 0;
+
+	while (usec >>= 1)
+		b++;
+	b = min(b, READ_LAT_BUCKETS - 1);
+
+	pthread_mutex_lock(&read_lat_hist.lock);
+	read_lat_hist.count[b]++;
+	if (++read_lat_hist.total > READ_LAT_MAX_SAMPLES) {
+		read_lat_hist.total = 0;
+		for (i = 0; i < READ_LAT_BUCKETS; i++) {
+			read_lat_hist.count[i] /= 2;
+			read_lat_hist.total += read_lat_hist.count[i];
+		}
+	}
+	pthread_mutex_unlock(&read_lat_hist.lock);
+}
+
+/*
+ * Return the read latency in usec below which 'pct' percent of the recent
+ * reads completed, or 0 if we don't have enough samples yet.
+ */
+uint64_t sheep_read_latency_percentile(int pct)
+{
+	uint64_t ret = 0, target, cum = 0;
+	int i;
+
+	pthread_mutex_lock(&read_lat_hist.lock);
+	if (read_lat_hist.total < READ_LAT_MIN_SAMPLES)
+		goto out;
+
+	target = (uint64_t)read_lat_hist.total * pct / 100;
+	for (i = 0; i < READ_LAT_BUCKETS; i++) {
+		uint32_t n = read_lat_hist.count[i];
+
+		if (cum + n > target) {
+			/* Interpolate linearly within the bucket */
+			ret = (1ULL << i) + ((1ULL << i) * (target - cum)) / n;
+			break;
+		}
+		cum += n;
+	}
+out:
+	pthread_mutex_unlock(&read_lat_hist.lock);
+	return ret;
+}
+
+/* Account a read to the node, which is sent now */
+void sheep_node_read_start(const struct node_id *nid)
+{
+	struct sockfd_cache_entry *entry;
+
+	pthread_rwlock_rdlock(&sockfd_cache.lock);
+	entry = sockfd_cache_search(nid);
+	if (entry)
+		uatomic_inc(&entry->nr_reads);
+	pthread_rwlock_unlock(&sockfd_cache.lock);
+}
+
+/*
+ * Account the completion of a read to the node, which took 'usec'
+ *
+ * The latency is averaged with the weight 1/8 like the TCP smoothed RTT.  A
+ * read which is abandoned before the response arrives should be accounted
+ * with the time we waited for it, so that a slow node doesn't look fast.
+ */
+void sheep_node_read_done(const struct node_id *nid, uint64_t usec)
+{
+	struct sockfd_cache_entry *entry;
+	uint64_t lat;
+
+	pthread_rwlock_rdlock(&sockfd_cache.lock);
+	entry = sockfd_cache_search(nid);
+	if (entry) {
+		uatomic_dec(&entry->nr_reads);
+		lat = uatomic_read(&entry->read_lat);
+		if (lat)
+			lat = lat - lat / 8 + usec / 8;
+		else
+			lat = usec;
+		uatomic_set(&entry->read_lat, lat ? lat : 1);
+	}
+	pthread_rwlock_unlock(&sockfd_cache.lock);
+
+	read_lat_hist_add(usec);
+}
+
+/*
+ * Return the expected cost of reading from the node.  The nodes which we have
+ * never read from cost nothing, so that they are tried soon.
+ */
+uint64_t sheep_node_read_cost(const struct node_id *nid)
+{
+	struct sockfd_cache_entry *entry;
+	uint64_t cost = 0;
+
+	pthread_rwlock_rdlock(&sockfd_cache.lock);
+	entry = sockfd_cache_search(nid);
+	if (entry)
+		cost = uatomic_read(&entry->read_lat) *
+			(uatomic_read(&entry->nr_reads) + 1);
+	pthread_rwlock_unlock(&sockfd_cache.lock);
+
+	return cost;
+}
+
 bool sheep_need_retry(uint32_t epoch)
 {
 	return sys_epoch() == epoch;
@@ -361,6 +361,7 @@ int init_global_pathnames(const char *d, char *argp)
 		return ret;
 
 	init_config_path(d);
+	init_obj_index_path(d);
 
 	return 0;
 }
@@ -0,0 +1,442 @@
+/*
+ * Copyright (C) 2013 Taobao Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Store driver which does the object I/O through io_uring
+ *
+ * The on-disk layout is the one of the plain store, and everything but reads
+ * and writes is done by the plain store.  Every md disk has a ring and a
+ * thread which owns it.  The I/O is queued to the disk of the object and the
+ * thread submits all the queued I/O with a single io_uring_enter(), which
+ * also reaps the completions.
+ *
+ * Reads and writes from other nodes are started with ->submit() and the io
+ * worker goes on with the next request, the completion ends the request (see
+ * store_io_done()).  So the disk sees all the outstanding I/O of the node at
+ * once, however many workers there are.  The other callers sleep until their
+ * I/O is done.
+ *
+ * The files are taken from the fd cache and opened with O_DIRECT when the
+ * buffer and the range are aligned.  A short transfer is continued with the
+ * buffered descriptor, as the rest is not aligned any more.  Writes are made
+ * durable per request with RWF_DSYNC instead of O_DSYNC, so a buffered and a
+ * synchronous write share the same descriptor.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sys/eventfd.h>
+
+#include "sheep_priv.h"
+#include "uring.h"
+
+#define URING_STORE_DEPTH 256
+
+struct uring_io {
+	struct list_head list;
+	int op;
+	int fd;
+	void *buf;
+	uint32_t len;
+	uint64_t offset;
+	bool dsync;
+	int flags;			/* the open flags of fd */
+
+	uint64_t oid;
+	struct fd_cache_entry *entry;
+	void (*done)(void *data, int result);
+	void *data;
+};
+
+struct uring_wait {
+	sem_t done;
+	int result;
+};
+
+struct uring_disk {
+	char path[PATH_MAX];
+	struct uring ring;
+	pthread_t thread;
+
+	int efd;
+	eventfd_t efd_value;
+
+	int nr_inflight;		/* owned by the thread of the disk */
+
+	pthread_mutex_t lock;
+	struct list_head pending;	/* protected by lock */
+	bool kicked;			/* protected by lock */
+};
+
+static struct uring_disk *disks[MD_MAX_DISK];
+static int nr_disks;
+static pthread_mutex_t disks_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Read the event fd in the ring, so that queueing an I/O wakes us up.  The
+ * submission queue is empty when this is called, so it has room for it.
+ */
+static void prep_kick_read(struct uring_disk *d)
+{
+	struct io_uring_sqe *sqe = uring_get_sqe(&d->ring);
+
+	uring_prep_rw(sqe, IORING_OP_READ, d->efd, &d->efd_value,
+		      sizeof(d->efd_value), 0, NULL);
+}
+
+static void prep_io(struct uring_io *io, struct io_uring_sqe *sqe)
+{
+	uring_prep_rw(sqe, io->op, io->fd, io->buf, io->len, io->offset, io);
+	if (io->dsync)
+		sqe->rw_flags = RWF_DSYNC;
+}
+
+/* Switch 'io' to the buffered descriptor of the object */
+static int uring_io_buffered(struct uring_io *io)
+{
+	struct fd_cache_entry *e;
+
+	e = fd_cache_get(io->oid, io->flags & ~O_DIRECT, default_open_obj);
+	if (!e)
+		return -errno;
+
+	fd_cache_put(io->entry);
+	io->entry = e;
+	io->fd = fd_cache_fd(e);
+	io->flags &= ~O_DIRECT;
+	return 0;
+}
+
+/*
+ * Called in the thread of the disk when the ring completed 'io' with 'res'.
+ * An I/O which has to go on is put back to 'queued'.
+ */
+static void uring_io_end(struct uring_io *io, int res,
+			 struct list_head *queued)
+{
+	int ret = SD_RES_SUCCESS;
+
+	if (res == -EINTR || res == -EAGAIN) {
+		list_add_tail(&io->list, queued);
+		return;
+	}
+	if (res <= 0) {
+		sd_eprintf("failed to %s object %"PRIx64", offset=%"PRIu64
+			   ", size=%"PRIu32", %s",
+			   io->op == IORING_OP_WRITE ? "write" : "read",
+			   io->oid, io->offset, io->len,
+			   res ? strerror(-res) : "EOF");
+		ret = default_obj_err(io->oid, res ? -res : EIO);
+		fd_cache_invalidate(io->oid);
+		goto out;
+	}
+	if (res < io->len) {
+		/*
+		 * Go on with the rest.  Like pread(), a read which hits the
+		 * end of the file then fails with EOF.
+		 */
+		io->buf = (char *)io->buf + res;
+		io->len -= res;
+		io->offset += res;
+		if (io->flags & O_DIRECT) {
+			res = uring_io_buffered(io);
+			if (res < 0) {
+				sd_eprintf("failed to open %"PRIx64", %s",
+					   io->oid, strerror(-res));
+				ret = default_obj_err(io->oid, -res);
+				goto out;
+			}
+		}
+		list_add_tail(&io->list, queued);
+		return;
+	}
+out:
+	fd_cache_put(io->entry);
+	io->done(io->data, ret);
+	free(io);
+}
+
+static void *uring_disk_main(void *arg)
+{
+	struct uring_disk *d = arg;
+	struct io_uring_cqe *cqe;
+	struct io_uring_sqe *sqe;
+	struct uring_io *io;
+	LIST_HEAD(queued);
+	int ret;
+
+	prep_kick_read(d);
+	for (;;) {
+		pthread_mutex_lock(&d->lock);
+		list_splice_tail_init(&d->pending, &queued);
+		d->kicked = false;
+		pthread_mutex_unlock(&d->lock);
+
+		/* The read of the event fd takes one of the slots */
+		while (!list_empty(&queued) &&
+		       d->nr_inflight < URING_STORE_DEPTH - 1 &&
+		       (sqe = uring_get_sqe(&d->ring))) {
+			io = list_first_entry(&queued, struct uring_io, list);
+			list_del(&io->list);
+			prep_io(io, sqe);
+			d->nr_inflight++;
+		}
+
+		ret = uring_submit(&d->ring, 1, -1);
+		if (ret < 0 && ret != -EINTR && ret != -EAGAIN &&
+		    ret != -EBUSY)
+			panic("failed to submit I/O to %s, %s", d->path,
+			      strerror(-ret));
+
+		while ((cqe = uring_peek_cqe(&d->ring))) {
+			io = (struct uring_io *)(unsigned long)cqe->user_data;
+			ret = cqe->res;
+			uring_cqe_seen(&d->ring);
+			if (io) {
+				d->nr_inflight--;
+				uring_io_end(io, ret, &queued);
+			} else
+				prep_kick_read(d);
+		}
+	}
+
+	return NULL;
+}
+
+static struct uring_disk *create_disk(const char *path)
+{
+	struct uring_disk *d = xzalloc(sizeof(*d));
+	int ret;
+
+	pstrcpy(d->path, sizeof(d->path), path);
+	INIT_LIST_HEAD(&d->pending);
+	pthread_mutex_init(&d->lock, NULL);
+
+	d->efd = eventfd(0, EFD_CLOEXEC);
+	if (d->efd < 0) {
+		sd_eprintf("failed to create an event fd, %m");
+		goto err;
+	}
+	if (uring_init(&d->ring, URING_STORE_DEPTH) < 0)
+		goto close_efd;
+
+	ret = pthread_create(&d->thread, NULL, uring_disk_main, d);
+	if (ret) {
+		sd_eprintf("failed to create a thread, %s", strerror(ret));
+		goto exit_ring;
+	}
+
+	sd_dprintf("%s", path);
+	return d;
+exit_ring:
+	uring_exit(&d->ring);
+close_efd:
+	close(d->efd);
+err:
+	free(d);
+	return NULL;
+}
+
+/*
+ * The disk of 'oid'.  Rings are created on the first I/O to a disk and kept
+ * even if it is unplugged.
+ */
+static struct uring_disk *oid_to_disk(uint64_t oid)
+{
+	char path[PATH_MAX];
+	struct uring_disk *d = NULL;
+	int i, nr;
+
+	pstrcpy(path, sizeof(path), md_get_object_path(oid));
+
+	nr = uatomic_read(&nr_disks);
+	for (i = 0; i < nr; i++)
+		if (!strcmp(disks[i]->path, path))
+			return disks[i];
+
+	pthread_mutex_lock(&disks_lock);
+	for (i = 0; i < nr_disks; i++) {
+		if (!strcmp(disks[i]->path, path)) {
+			d = disks[i];
+			goto out;
+		}
+	}
+	if (nr_disks == MD_MAX_DISK)
+		goto out;
+	d = create_disk(path);
+	if (d) {
+		disks[nr_disks] = d;
+		uatomic_inc(&nr_disks);
+	}
+out:
+	pthread_mutex_unlock(&disks_lock);
+	return d;
+}
+
+static int uring_prep_write(uint64_t oid, const struct siocb *iocb,
+			    bool *dsync)
+{
+	*dsync = !uatomic_is_true(&sys->use_journal) && !sys->nosync;
+
+	if (iocb->epoch < sys_epoch()) {
+		sd_dprintf("%"PRIu32" sys %"PRIu32, iocb->epoch, sys_epoch());
+		return SD_RES_OLD_NODE_VER;
+	}
+
+	if (uatomic_is_true(&sys->use_journal) &&
+	    journal_write_store(oid, iocb->buf, iocb->length, iocb->offset,
+				false)
+	    != SD_RES_SUCCESS) {
+		sd_eprintf("turn off journaling");
+		uatomic_set_false(&sys->use_journal);
+		*dsync = true;
+		sync();
+	}
+
+	return SD_RES_SUCCESS;
+}
+
+static int uring_submit_obj(uint64_t oid, const struct siocb *iocb,
+			    bool write, void (*done)(void *data, int result),
+			    void *data)
+{
+	int flags = O_RDWR, ret;
+	struct fd_cache_entry *e;
+	struct uring_disk *d;
+	struct uring_io *io;
+	eventfd_t value = 1;
+	bool dsync = false, kick;
+
+	if (write) {
+		ret = uring_prep_write(oid, iocb, &dsync);
+		if (ret != SD_RES_SUCCESS)
+			return ret;
+	}
+
+	d = oid_to_disk(oid);
+	if (!d)
+		return SD_RES_EIO;
+
+	if (is_aligned_to_pagesize(iocb->buf) &&
+	    (iocb->offset & (SECTOR_SIZE - 1)) == 0 &&
+	    (iocb->length & (SECTOR_SIZE - 1)) == 0)
+		flags |= O_DIRECT;
+
+	e = fd_cache_get(oid, flags, default_open_obj);
+	if (!e)
+		return default_obj_err(oid, errno);
+
+	if (!iocb->length) {
+		fd_cache_put(e);
+		done(data, SD_RES_SUCCESS);
+		return SD_RES_SUCCESS;
+	}
+
+	io = xzalloc(sizeof(*io));
+	io->op = write ? IORING_OP_WRITE : IORING_OP_READ;
+	io->fd = fd_cache_fd(e);
+	io->buf = iocb->buf;
+	io->len = iocb->length;
+	io->offset = iocb->offset;
+	io->dsync = dsync;
+	io->flags = flags;
+	io->oid = oid;
+	io->entry = e;
+	io->done = done;
+	io->data = data;
+
+	pthread_mutex_lock(&d->lock);
+	list_add_tail(&io->list, &d->pending);
+	kick = !d->kicked;
+	d->kicked = true;
+	pthread_mutex_unlock(&d->lock);
+
+	if (kick)
+		eventfd_write(d->efd, value);
+
+	return SD_RES_SUCCESS;
+}
+
+static void uring_wake(void *data, int result)
+{
+	struct uring_wait *w = data;
+
+	w->result = result;
+	sem_post(&w->done);
+}
+
+static int uring_rw(uint64_t oid, const struct siocb *iocb, bool write)
+{
+	struct uring_wait w;
+	int ret;
+
+	sem_init(&w.done, 0, 0);
+	ret = uring_submit_obj(oid, iocb, write, uring_wake, &w);
+	if (ret == SD_RES_SUCCESS) {
+		while (sem_wait(&w.done) < 0)
+			;
+		ret = w.result;
+	}
+	sem_destroy(&w.done);
+
+	return ret;
+}
+
+static int uring_read(uint64_t oid, const struct siocb *iocb)
+{
+	int ret;
+
+	ret = uring_rw(oid, iocb, false);
+
+	/* An object of an older epoch may be in the stale directory */
+	if (ret == SD_RES_NO_OBJ && iocb->epoch > 0 &&
+	    iocb->epoch < sys_epoch())
+		ret = default_read(oid, iocb);
+
+	return ret;
+}
+
+static int uring_write(uint64_t oid, const struct siocb *iocb)
+{
+	return uring_rw(oid, iocb, true);
+}
+
+static int uring_init_store(void)
+{
+	if (!uring_supported()) {
+		sd_eprintf("io_uring is not available");
+		return SD_RES_NO_SUPPORT;
+	}
+
+	return default_init();
+}
+
+static struct store_driver uring_store = {
+	.name = "uring",
+	.init = uring_init_store,
+	.exist = default_exist,
+	.create_and_write = default_create_and_write,
+	.write = uring_write,
+	.read = uring_read,
+	.submit = uring_submit_obj,
+	.link = default_link,
+	.update_epoch = default_update_epoch,
+	.cleanup = default_cleanup,
+	.format = default_format,
+	.remove_object = default_remove_object,
+	.get_hash = default_get_hash,
+	.get_cow_map = default_get_cow_map,
+	.set_cow_map = default_set_cow_map,
+	.purge_obj = default_purge_obj,
+};
+
+add_store_driver(uring_store);
@@ -20,6 +20,7 @@ struct vdi_state_entry {
 	uint32_t vid;
 	unsigned int nr_copies;
 	bool snapshot;
+	uint16_t copy_policy;
 	struct rb_node node;
 };
 
@@ -112,23 +113,66 @@ int get_vdi_copy_number(uint32_t vid)
 	return entry->nr_copies;
 }
 
+/* Return the erasure coding policy of the vdi, or zero if it is replicated */
+uint16_t get_vdi_copy_policy(uint32_t vid)
+{
+	struct vdi_state_entry *entry;
+
+	pthread_rwlock_rdlock(&vdi_state_lock);
+	entry = vdi_state_search(&vdi_state_root, vid);
+	pthread_rwlock_unlock(&vdi_state_lock);
+
+	if (!entry)
+		return 0;
+
+	return entry->copy_policy;
+}
+
+/* True if 'oid' is a data object stored as erasure coded strips */
+bool is_ec_obj(uint64_t oid)
+{
+	return is_data_obj(oid) && !is_ec_strip_obj(oid) &&
+		get_vdi_copy_policy(oid_to_vid(oid));
+}
+
+/* Return the number of strips of the erasure coded object, or zero */
+int get_ec_nr_strips(uint64_t oid)
+{
+	uint16_t policy = get_vdi_copy_policy(oid_to_vid(oid));
+
+	return ec_policy_data(policy) + ec_policy_parity(policy);
+}
+
 int get_obj_copy_number(uint64_t oid, int nr_zones)
 {
+	/* A strip has no copies, and can't be placed without its own zone */
+	if (is_ec_strip_obj(oid))
+		return ec_strip_index(oid) < nr_zones ? 1 : 0;
+
 	return min(get_vdi_copy_number(oid_to_vid(oid)), nr_zones);
 }
 
-int get_req_copy_number(struct request *req)
+/* Return the copy number of 'oid', which is accessed by the request */
+int get_req_obj_copy_number(struct request *req, uint64_t oid)
 {
 	int nr_copies;
 
+	/* The copy number of the request is the one of the whole object */
+	if (is_ec_strip_obj(oid))
+		return get_obj_copy_number(oid, req->vinfo->nr_zones);
+
 	nr_copies = min((int)req->rq.obj.copies, req->vinfo->nr_zones);
 	if (!nr_copies)
-		nr_copies = get_obj_copy_number(req->rq.obj.oid,
-						req->vinfo->nr_zones);
+		nr_copies = get_obj_copy_number(oid, req->vinfo->nr_zones);
 
 	return nr_copies;
 }
 
+int get_req_copy_number(struct request *req)
+{
+	return get_req_obj_copy_number(req, req->rq.obj.oid);
+}
+
 int get_max_copy_number(void)
 {
 	int nr_copies = uatomic_read(&max_copies);
@@ -139,29 +183,44 @@ int get_max_copy_number(void)
 	return nr_copies;
 }
 
-int add_vdi_state(uint32_t vid, int nr_copies, bool snapshot)
+int add_vdi_state(uint32_t vid, int nr_copies, bool snapshot,
+		  uint16_t copy_policy)
 {
 	struct vdi_state_entry *entry, *old;
+	int nr_zones = nr_copies;
+	bool changed = true;
 
 	entry = xzalloc(sizeof(*entry));
 	entry->vid = vid;
 	entry->nr_copies = nr_copies;
 	entry->snapshot = snapshot;
+	entry->copy_policy = copy_policy;
+
+	sd_dprintf("%" PRIx32 ", %d, %x", vid, nr_copies, copy_policy);
 
-	sd_dprintf("%" PRIx32 ", %d", vid, nr_copies);
+	/* All the strips have to be placed on different zones */
+	if (copy_policy)
+		nr_zones = ec_policy_data(copy_policy) +
+			ec_policy_parity(copy_policy);
 
 	pthread_rwlock_wrlock(&vdi_state_lock);
 	old = vdi_state_insert(&vdi_state_root, entry);
 	if (old) {
 		free(entry);
 		entry = old;
+		changed = entry->nr_copies != nr_copies ||
+			entry->snapshot != snapshot ||
+			entry->copy_policy != copy_policy;
 		entry->nr_copies = nr_copies;
 		entry->snapshot = snapshot;
+		entry->copy_policy = copy_policy;
 	}
+	if (changed)
+		obj_index_set_vdi(vid, nr_copies, snapshot, copy_policy);
 
 	if (uatomic_read(&max_copies) == 0 ||
-	    nr_copies > uatomic_read(&max_copies))
-		uatomic_set(&max_copies, nr_copies);
+	    nr_zones > uatomic_read(&max_copies))
+		uatomic_set(&max_copies, nr_zones);
 	pthread_rwlock_unlock(&vdi_state_lock);
 
 	return SD_RES_SUCCESS;
@@ -181,6 +240,7 @@ int fill_vdi_state_list(void *data)
 		vs->vid = entry->vid;
 		vs->nr_copies = entry->nr_copies;
 		vs->snapshot = entry->snapshot;
+		vs->copy_policy = entry->copy_policy;
 		vs++;
 		nr++;
 	}
@@ -269,7 +329,7 @@ static int create_vdi_obj(struct vdi_iocb *iocb, uint32_t new_vid,
 	new->vdi_id = new_vid;
 	new->create_time = (uint64_t) tv.tv_sec << 32 | tv.tv_usec * 1000;
 	new->vdi_size = iocb->size;
-	new->copy_policy = 0;
+	new->copy_policy = iocb->copy_policy;
 	new->nr_copies = iocb->nr_copies;
 	new->block_size_shift = find_next_bit(&block_size, BITS_PER_LONG, 0);
 	new->snap_id = iocb->snapid;
@@ -473,7 +533,8 @@ int vdi_lookup(struct vdi_iocb *iocb, struct vdi_info *info)
 	return fill_vdi_info(left, right, iocb, info);
 }
 
-static int notify_vdi_add(uint32_t vdi_id, uint32_t nr_copies, uint32_t old_vid)
+static int notify_vdi_add(uint32_t vdi_id, uint32_t nr_copies, uint32_t old_vid,
+			  uint16_t copy_policy)
 {
 	int ret = SD_RES_SUCCESS;
 	struct sd_req hdr;
@@ -483,6 +544,7 @@ static int notify_vdi_add(uint32_t vdi_id, uint32_t nr_copies, uint32_t old_vid)
 	hdr.vdi_state.new_vid = vdi_id;
 	hdr.vdi_state.copies = nr_copies;
 	hdr.vdi_state.set_bitmap = false;
+	hdr.vdi_state.copy_policy = copy_policy;
 
 	ret = exec_local_req(&hdr, NULL);
 	if (ret != SD_RES_SUCCESS)
@@ -539,8 +601,11 @@ int vdi_create(struct vdi_iocb *iocb, uint32_t *new_vid)
 	}
 	if (!iocb->snapid)
 		iocb->snapid = 1;
+	/* Snapshots and clones share the COW objects with their base */
+	if (iocb->base_vid)
+		iocb->copy_policy = get_vdi_copy_policy(iocb->base_vid);
 	*new_vid = info.free_bit;
-	notify_vdi_add(*new_vid, iocb->nr_copies, info.vid);
+	notify_vdi_add(*new_vid, iocb->nr_copies, info.vid, iocb->copy_policy);
 
 	sd_dprintf("%s %s: size %" PRIu64 ", vid %" PRIx32 ", base %" PRIx32
 		   ", cur %" PRIx32 ", copies %d, snapid %"PRIu32,
@@ -677,6 +742,7 @@ static void delete_one(struct work *work)
 			continue;
 		}
 
+		iosched_acquire(IO_CLASS_DELETION);
 		ret = remove_object(oid);
 		if (ret != SD_RES_SUCCESS)
 			sd_eprintf("remove object %" PRIx64 " fail, %d", oid,
@@ -965,5 +1031,6 @@ void clean_vdi_state(void)
 		current_node = rb_first(&vdi_state_root);
 	}
 	INIT_RB_ROOT(&vdi_state_root);
+	obj_index_clear_vdi();
 	pthread_rwlock_unlock(&vdi_state_lock);
 }
@@ -0,0 +1,141 @@
+/*
+ * Copyright (C) 2013 Taobao Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Compare the lookups of the placement drivers with the search of the vnode
+ * ring
+ *
+ * usage: placement_bench [nodes [vnodes per node [copies [lookups]]]]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "sheepdog_proto.h"
+#include "sheep.h"
+
+static struct sd_node nodes[SD_MAX_NODES];
+
+static uint64_t now_nsec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int arg(int argc, char **argv, int i, int def)
+{
+	return argc > i ? atoi(argv[i]) : def;
+}
+
+static uint64_t time_lookups(const struct vnode_info *vinfo,
+			     const uint64_t *oids, int nr_lookups,
+			     int nr_copies, uint64_t *sum)
+{
+	const struct sd_node *n[SD_MAX_COPIES];
+	uint64_t start = now_nsec();
+	int i;
+
+	for (i = 0; i < nr_lookups; i++) {
+		vinfo_oid_to_nodes(vinfo, oids[i], nr_copies, n);
+		*sum += n[nr_copies - 1]->zone;
+	}
+
+	return now_nsec() - start;
+}
+
+int main(int argc, char **argv)
+{
+	int nr_nodes = arg(argc, argv, 1, 1024);
+	int nr_per_node = arg(argc, argv, 2, 64);
+	int nr_copies = arg(argc, argv, 3, 3);
+	int nr_lookups = arg(argc, argv, 4, 1000000);
+	const struct sd_vnode *a[SD_MAX_COPIES];
+	const struct sd_node *b[SD_MAX_COPIES];
+	struct vnode_info ring = { .pdrv = NULL }, straw2 = { .pdrv = NULL };
+	struct sd_vnode *vnodes;
+	uint64_t *oids, start, search_ns, ring_ns, straw2_ns, build_ns;
+	uint64_t sum = 0;
+	int i, j, nr_vnodes;
+
+	if (nr_nodes < 1 || nr_nodes > SD_MAX_NODES || nr_per_node < 1 ||
+	    nr_nodes * nr_per_node > SD_MAX_VNODES || nr_copies < 1 ||
+	    nr_copies > SD_MAX_COPIES || nr_copies > nr_nodes ||
+	    nr_lookups < 1) {
+		fprintf(stderr, "invalid parameters\n");
+		return 1;
+	}
+
+	for (i = 0; i < nr_nodes; i++) {
+		nodes[i].nid.addr[12] = 10;
+		nodes[i].nid.addr[14] = i >> 8;
+		nodes[i].nid.addr[15] = i & 0xff;
+		nodes[i].nid.port = 7000;
+		nodes[i].nr_vnodes = nr_per_node;
+		nodes[i].zone = i;
+	}
+
+	nr_vnodes = nodes_to_vnodes(nodes, nr_nodes, NULL);
+	vnodes = xmalloc(sizeof(*vnodes) * nr_vnodes);
+	nodes_to_vnodes(nodes, nr_nodes, vnodes);
+
+	ring.nodes = straw2.nodes = nodes;
+	ring.nr_nodes = straw2.nr_nodes = nr_nodes;
+	start = now_nsec();
+	placement_init(&ring, find_placement_driver("ring"));
+	build_ns = now_nsec() - start;
+	placement_init(&straw2, find_placement_driver("straw2"));
+
+	oids = xmalloc(sizeof(*oids) * nr_lookups);
+	srandom(1);
+	for (i = 0; i < nr_lookups; i++)
+		oids[i] = vid_to_data_oid(random() & 0xffffff,
+					  random() % MAX_DATA_OBJS);
+
+	for (i = 0; i < nr_lookups; i++) {
+		oid_to_vnodes(vnodes, nr_vnodes, oids[i], nr_copies, a);
+		vinfo_oid_to_nodes(&ring, oids[i], nr_copies, b);
+		for (j = 0; j < nr_copies; j++)
+			if (&nodes[a[j]->node_idx] != b[j]) {
+				fprintf(stderr, "mismatch at %" PRIx64 "\n",
+					oids[i]);
+				return 1;
+			}
+	}
+
+	start = now_nsec();
+	for (i = 0; i < nr_lookups; i++) {
+		oid_to_vnodes(vnodes, nr_vnodes, oids[i], nr_copies, a);
+		sum += a[nr_copies - 1]->zone;
+	}
+	search_ns = now_nsec() - start;
+
+	ring_ns = time_lookups(&ring, oids, nr_lookups, nr_copies, &sum);
+	straw2_ns = time_lookups(&straw2, oids, nr_lookups, nr_copies, &sum);
+
+	printf("%d nodes x %d vnodes, %d copies, %d lookups\n", nr_nodes,
+	       nr_per_node, nr_copies, nr_lookups);
+	printf("table build   %10.3f ms\n", build_ns / 1e6);
+	printf("ring search   %10.1f ns/lookup\n",
+	       (double)search_ns / nr_lookups);
+	printf("ring table    %10.1f ns/lookup\n",
+	       (double)ring_ns / nr_lookups);
+	printf("straw2        %10.1f ns/lookup\n",
+	       (double)straw2_ns / nr_lookups);
+
+	placement_exit(&ring);
+	placement_exit(&straw2);
+	free(vnodes);
+	free(oids);
+
+	return sum == 0;
+}
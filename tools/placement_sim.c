@@ -0,0 +1,292 @@
+/*
+ * Copyright (C) 2013 Taobao Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Simulate the data movement of an epoch transition
+ *
+ * usage: placement_sim [-d driver] [-c copies] [-o objects] old new
+ *        placement_sim [-d driver] [-c copies] [-o objects] -g nodes[:vnodes]
+ *
+ * 'old' and 'new' are epoch logs of a sheep (e.g. /store/epoch/00000003).
+ * With -g, the transitions of adding, removing and doubling the weight of a
+ * node are simulated on a generated cluster.  The moved copies are compared
+ * with the minimum which keeps the copies proportional to the weights, and
+ * the load of the most loaded node is shown relative to its weight.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "sheepdog_proto.h"
+#include "sheep.h"
+
+static const struct placement_driver *pdrv;
+static int nr_copies = 3;
+static int nr_objs = 1000000;
+
+static int read_epoch_log(const char *path, struct sd_node *nodes)
+{
+	struct stat st;
+	int fd, ret;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		fprintf(stderr, "failed to open %s, %m\n", path);
+		exit(1);
+	}
+
+	/* The nodes are followed by the creation time of the epoch */
+	ret = xread(fd, nodes, st.st_size - sizeof(time_t));
+	close(fd);
+	if (ret < 0 || ret % sizeof(struct sd_node) ||
+	    ret > sizeof(struct sd_node) * SD_MAX_NODES) {
+		fprintf(stderr, "invalid epoch log %s\n", path);
+		exit(1);
+	}
+
+	return ret / sizeof(struct sd_node);
+}
+
+static void gen_nodes(struct sd_node *nodes, int nr_nodes, int nr_vnodes)
+{
+	int i;
+
+	for (i = 0; i < nr_nodes; i++) {
+		memset(nodes + i, 0, sizeof(nodes[i]));
+		nodes[i].nid.addr[12] = 10;
+		nodes[i].nid.addr[14] = i >> 8;
+		nodes[i].nid.addr[15] = i & 0xff;
+		nodes[i].nid.port = 7000;
+		nodes[i].nr_vnodes = nr_vnodes;
+		nodes[i].zone = i;
+	}
+}
+
+static int get_zones_nr(const struct sd_node *nodes, int nr_nodes)
+{
+	uint32_t zones[SD_MAX_COPIES];
+	int nr_zones = 0, i, j;
+
+	for (i = 0; i < nr_nodes && nr_zones < SD_MAX_COPIES; i++) {
+		if (!nodes[i].nr_vnodes)
+			continue;
+		for (j = 0; j < nr_zones; j++)
+			if (zones[j] == nodes[i].zone)
+				break;
+		if (j == nr_zones)
+			zones[nr_zones++] = nodes[i].zone;
+	}
+
+	return nr_zones;
+}
+
+static uint64_t get_total_weight(const struct sd_node *nodes, int nr_nodes)
+{
+	uint64_t total = 0;
+	int i;
+
+	for (i = 0; i < nr_nodes; i++)
+		total += nodes[i].nr_vnodes;
+
+	return total;
+}
+
+/* The fraction of the copies which have to move to follow the weights */
+static double min_movement(const struct vnode_info *old,
+			   const struct vnode_info *new)
+{
+	uint64_t w_old = get_total_weight(old->nodes, old->nr_nodes);
+	uint64_t w_new = get_total_weight(new->nodes, new->nr_nodes);
+	double moved = 0, share;
+	int i, j;
+
+	for (i = 0; i < new->nr_nodes; i++) {
+		share = (double)new->nodes[i].nr_vnodes / w_new;
+		for (j = 0; j < old->nr_nodes; j++)
+			if (node_eq(new->nodes + i, old->nodes + j)) {
+				share -= (double)old->nodes[j].nr_vnodes /
+					w_old;
+				break;
+			}
+		if (share > 0)
+			moved += share;
+	}
+
+	return moved;
+}
+
+static void simulate(const char *name, struct sd_node *old_nodes,
+		     int nr_old, struct sd_node *new_nodes, int nr_new)
+{
+	struct vnode_info old = { .pdrv = NULL }, new = { .pdrv = NULL };
+	const struct sd_node *o[SD_MAX_COPIES], *n[SD_MAX_COPIES];
+	uint64_t moved = 0, nr_moved_objs = 0, before, oid;
+	uint64_t *load = xzalloc(sizeof(*load) * nr_new);
+	double fair, max_load = 0;
+	int i, j, k, copies;
+
+	xqsort(old_nodes, nr_old, node_cmp);
+	xqsort(new_nodes, nr_new, node_cmp);
+	old.nodes = old_nodes;
+	old.nr_nodes = nr_old;
+	new.nodes = new_nodes;
+	new.nr_nodes = nr_new;
+	copies = min(get_zones_nr(old_nodes, nr_old),
+		     get_zones_nr(new_nodes, nr_new));
+	copies = min(copies, nr_copies);
+	if (!copies) {
+		fprintf(stderr, "no node has vnodes\n");
+		exit(1);
+	}
+	placement_init(&old, pdrv);
+	placement_init(&new, pdrv);
+
+	srandom(1);
+	for (i = 0; i < nr_objs; i++) {
+		oid = vid_to_data_oid(random() & 0xffffff,
+				      random() % MAX_DATA_OBJS);
+		vinfo_oid_to_nodes(&old, oid, copies, o);
+		vinfo_oid_to_nodes(&new, oid, copies, n);
+
+		before = moved;
+		for (j = 0; j < copies; j++) {
+			load[n[j] - new_nodes]++;
+			for (k = 0; k < copies; k++)
+				if (node_eq(n[j], o[k]))
+					break;
+			if (k == copies)
+				moved++;
+		}
+		if (moved != before)
+			nr_moved_objs++;
+	}
+
+	/* The most loaded node relative to its weight */
+	for (i = 0; i < nr_new; i++) {
+		if (!new_nodes[i].nr_vnodes)
+			continue;
+		fair = (double)nr_objs * copies * new_nodes[i].nr_vnodes /
+			get_total_weight(new_nodes, nr_new);
+		max_load = max(max_load, load[i] / fair);
+	}
+
+	printf("%-8s %-16s %5.2f%% of copies moved (minimum %5.2f%%), "
+	       "%5.2f%% of objects, max load %.2fx\n", pdrv->name, name,
+	       100.0 * moved / ((uint64_t)nr_objs * copies),
+	       100.0 * min_movement(&old, &new),
+	       100.0 * nr_moved_objs / nr_objs, max_load);
+
+	placement_exit(&old);
+	placement_exit(&new);
+	free(load);
+}
+
+static struct sd_node old_nodes[SD_MAX_NODES], new_nodes[SD_MAX_NODES];
+
+static void simulate_generated(int nr_nodes, int nr_vnodes)
+{
+	gen_nodes(old_nodes, nr_nodes, nr_vnodes);
+	gen_nodes(new_nodes, nr_nodes + 1, nr_vnodes);
+	simulate("add a node", old_nodes, nr_nodes, new_nodes, nr_nodes + 1);
+
+	gen_nodes(old_nodes, nr_nodes, nr_vnodes);
+	gen_nodes(new_nodes, nr_nodes, nr_vnodes);
+	simulate("remove a node", old_nodes, nr_nodes, new_nodes,
+		 nr_nodes - 1);
+
+	gen_nodes(old_nodes, nr_nodes, nr_vnodes);
+	gen_nodes(new_nodes, nr_nodes, nr_vnodes);
+	new_nodes[0].nr_vnodes *= 2;
+	simulate("double a weight", old_nodes, nr_nodes, new_nodes, nr_nodes);
+}
+
+static void run(const struct placement_driver *d, const char *gen,
+		char **epochs, int nr_nodes, int nr_vnodes)
+{
+	const struct placement_driver *saved = pdrv;
+	int nr_old, nr_new;
+
+	pdrv = d;
+	if (gen)
+		simulate_generated(nr_nodes, nr_vnodes);
+	else {
+		nr_old = read_epoch_log(epochs[0], old_nodes);
+		nr_new = read_epoch_log(epochs[1], new_nodes);
+		simulate("epoch transition", old_nodes, nr_old, new_nodes,
+			 nr_new);
+	}
+	pdrv = saved;
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: placement_sim [-d driver] [-c copies] "
+		"[-o objects] old new\n"
+		"       placement_sim [-d driver] [-c copies] "
+		"[-o objects] -g nodes[:vnodes]\n");
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	const char *drivers[] = { "ring", "straw2" }, *gen = NULL;
+	int ch, i, nr_nodes = 0, nr_vnodes = SD_DEFAULT_VNODES;
+
+	while ((ch = getopt(argc, argv, "d:c:o:g:")) != -1) {
+		switch (ch) {
+		case 'd':
+			pdrv = find_placement_driver(optarg);
+			if (!pdrv) {
+				fprintf(stderr, "unknown driver %s\n", optarg);
+				exit(1);
+			}
+			break;
+		case 'c':
+			nr_copies = atoi(optarg);
+			if (nr_copies < 1 || nr_copies > SD_MAX_COPIES)
+				usage();
+			break;
+		case 'o':
+			nr_objs = atoi(optarg);
+			if (nr_objs < 1)
+				usage();
+			break;
+		case 'g':
+			gen = optarg;
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if (gen) {
+		if (optind != argc ||
+		    sscanf(gen, "%d:%d", &nr_nodes, &nr_vnodes) < 1 ||
+		    nr_nodes < 2 || nr_nodes >= SD_MAX_NODES ||
+		    nr_vnodes < 1 || nr_vnodes * 2 > UINT16_MAX)
+			usage();
+	} else if (argc - optind != 2)
+		usage();
+
+	for (i = 0; i < ARRAY_SIZE(drivers); i++) {
+		const struct placement_driver *d;
+
+		d = find_placement_driver(drivers[i]);
+		if (pdrv && pdrv != d)
+			continue;
+
+		run(d, gen, argv + optind, nr_nodes, nr_vnodes);
+	}
+
+	return 0;
+}
@@ -0,0 +1,139 @@
+/*
+ * Copyright (C) 2013 Taobao Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Measure the throughput of the work queues
+ *
+ * The main thread keeps 'window' work items in flight and queues a new one
+ * whenever one is done, so a dynamic work queue grows to about 'window'
+ * threads.  Every item spins for 'work usec' in its worker.  The ordered
+ * work queue must complete the items in the order they were queued.
+ * 'idle queues' work queues are created and left idle on the side.
+ *
+ * usage: work_bench [items [max window [work usec [idle queues]]]]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "list.h"
+#include "util.h"
+#include "event.h"
+#include "work.h"
+
+static int nr_queued, nr_done, nr_items, window, work_usec;
+static struct work *works;
+static struct work_queue *wq;
+static bool check_order;
+
+static uint64_t now_nsec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int arg(int argc, char **argv, int i, int def)
+{
+	return argc > i ? atoi(argv[i]) : def;
+}
+
+static void bench_work(struct work *work)
+{
+	uint64_t end;
+
+	if (!work_usec)
+		return;
+
+	end = now_nsec() + work_usec * 1000;
+	while (now_nsec() < end)
+		;
+}
+
+static void bench_done(struct work *work)
+{
+	if (check_order && work != works + nr_done) {
+		fprintf(stderr, "item %td is done before %d\n", work - works,
+			nr_done);
+		exit(1);
+	}
+
+	nr_done++;
+	if (nr_queued < nr_items)
+		queue_work(wq, &works[nr_queued++]);
+}
+
+static double run(struct work_queue *q, int nr_window, bool ordered)
+{
+	uint64_t start;
+
+	wq = q;
+	check_order = ordered;
+	nr_queued = nr_done = 0;
+
+	start = now_nsec();
+	while (nr_queued < nr_window && nr_queued < nr_items)
+		queue_work(wq, &works[nr_queued++]);
+	while (nr_done < nr_items)
+		event_loop(-1);
+
+	return nr_items * 1e9 / (now_nsec() - start);
+}
+
+int main(int argc, char **argv)
+{
+	struct work_queue *dynamic, *ordered;
+	int i, nr_idle;
+
+	nr_items = arg(argc, argv, 1, 1000000);
+	window = arg(argc, argv, 2, 128);
+	work_usec = arg(argc, argv, 3, 0);
+	nr_idle = arg(argc, argv, 4, 0);
+	if (nr_items < 1 || window < 1 || work_usec < 0 || nr_idle < 0) {
+		fprintf(stderr, "invalid parameters\n");
+		return 1;
+	}
+
+	works = xzalloc(sizeof(*works) * nr_items);
+	for (i = 0; i < nr_items; i++) {
+		works[i].fn = bench_work;
+		works[i].done = bench_done;
+	}
+
+	if (init_event(4096) < 0 || init_work_queue(NULL, NULL, NULL)) {
+		fprintf(stderr, "failed to initialize\n");
+		return 1;
+	}
+
+	ordered = create_ordered_work_queue("ordered");
+	dynamic = create_work_queue("unlimited", WQ_UNLIMITED);
+	if (!ordered || !dynamic) {
+		fprintf(stderr, "failed to create work queues\n");
+		return 1;
+	}
+
+	for (i = 0; i < nr_idle; i++) {
+		if (!create_work_queue("idle", WQ_DYNAMIC)) {
+			fprintf(stderr, "failed to create work queues\n");
+			return 1;
+		}
+	}
+
+	printf("%d items, %d usec of work each, %d idle queues\n", nr_items,
+	       work_usec, nr_idle);
+	printf("ordered        %12.0f items/s\n", run(ordered, window, true));
+	for (i = 1; i <= window; i *= 2)
+		printf("window %4d    %12.0f items/s\n", i, run(dynamic, i, false));
+
+	return 0;
+}